@@ -0,0 +1,533 @@
+/**
+        libvile
+        Copyright (C) 2022 Cat (Ivan Epifanov)
+
+        This program is free software: you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        This program is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <psp2kern/kernel/cpu.h>
+#include <psp2kern/kernel/debug.h>
+#include <psp2kern/kernel/processmgr.h>
+#include <psp2kern/kernel/threadmgr.h>
+#include <psp2kern/kernel/sysmem/data_transfers.h>
+#include <string.h>
+#include "nxt.h"
+
+/*
+ * Bus ownership by priority class, and between processes by weighted
+ * fair queueing. Whoever releases the bus hands it to the most urgent
+ * class with waiters; within that class the session that has had the
+ * least bus time for its weight goes first. Every process that called
+ * vileStart is a session, the driver's own threads share session 0.
+ */
+
+#define ARB_SESSIONS VILE_SESSIONS_MAX
+#define ARB_WEIGHT_DEFAULT 10
+#define ARB_WEIGHT_MAX 100
+
+typedef struct {
+  SceUID pid; // 0 is a free slot, except for the kernel's slot 0
+  uint32_t refs; // vileStart calls not yet matched by vileStop
+  uint32_t weight;
+  uint8_t claims; // VILE_MOTOR() mask of motors only this session may drive
+  uint64_t vtime; // bus time used, scaled by weight
+  uint32_t waiting[VILE_PRIORITY_CLASSES];
+  uint32_t acquired;
+  uint64_t bus_us;
+  uint64_t wait_sum;
+  uint32_t wait_max;
+} session_t;
+
+static SceUID arb_mtx;
+static SceUID arb_cond[VILE_PRIORITY_CLASSES];
+
+static uint8_t busy = 0;
+static uint8_t owner = 0; // class index of the current holder
+static uint8_t owner_session = 0;
+static SceInt64 owner_since = 0;
+static uint32_t waiting[VILE_PRIORITY_CLASSES];
+
+static session_t sessions[ARB_SESSIONS];
+static uint64_t vclock = 0; // vtime of the last session served
+static uint64_t bus_total = 0;
+
+static vile_priority_stats_t stats;
+static uint64_t wait_sum[VILE_PRIORITY_CLASSES];
+
+static int class_index(vile_priority_t priority)
+{
+  if (priority == VILE_PRIORITY_DEFAULT || priority > VILE_PRIORITY_BULK)
+    priority = VILE_PRIORITY_CONTROL;
+  return priority - 1;
+}
+
+// arb_mtx held; the caller's session, kernel threads and strangers get 0
+static int session_of(SceUID pid)
+{
+  for (int i = 1; i < ARB_SESSIONS; i++)
+    if (sessions[i].pid == pid && sessions[i].refs)
+      return i;
+  return 0;
+}
+
+static int session_index()
+{
+  return session_of(ksceKernelGetProcessId());
+}
+
+// arb_mtx held; sessions of processes that exited without vileStop
+static void session_reap()
+{
+  for (int i = 1; i < ARB_SESSIONS; i++)
+  {
+    SceKernelProcessInfo info;
+    info.size = sizeof(info);
+    if (sessions[i].refs && ksceKernelGetProcessInfo(sessions[i].pid, &info) < 0)
+    {
+      sessions[i].refs = 0;
+      sessions[i].pid = 0;
+      sessions[i].claims = 0;
+    }
+  }
+}
+
+static int more_urgent_waiting(int c)
+{
+  for (int i = 0; i < c; i++)
+    if (waiting[i])
+      return 1;
+  return 0;
+}
+
+// the session with waiters in class c that is furthest behind
+static int next_session(int c)
+{
+  int best = -1;
+  for (int i = 0; i < ARB_SESSIONS; i++)
+  {
+    if (!sessions[i].waiting[c])
+      continue;
+    if (best < 0 || sessions[i].vtime < sessions[best].vtime)
+      best = i;
+  }
+  return best;
+}
+
+static void wake_next()
+{
+  for (int i = 0; i < VILE_PRIORITY_CLASSES; i++)
+  {
+    if (waiting[i])
+    {
+      // everybody in the class checks whether it is their session's turn
+      ksceKernelSignalCondAll(arb_cond[i]);
+      return;
+    }
+  }
+}
+
+// arb_mtx held, charge the holder for the time it had the bus
+static void charge(SceInt64 now)
+{
+  session_t *s = &sessions[owner_session];
+  uint64_t held = (uint64_t)(now - owner_since);
+  s->bus_us += held;
+  s->vtime += held * ARB_WEIGHT_MAX / s->weight;
+  bus_total += held;
+  owner_since = now;
+}
+
+// arb_mtx held
+static void acquire(int c, int s, SceInt64 begin)
+{
+  session_t *ses = &sessions[s];
+
+  // a session coming back from idle doesn't get to spend saved-up time
+  if (ses->vtime < vclock)
+    ses->vtime = vclock;
+
+  waiting[c]++;
+  ses->waiting[c]++;
+  while (busy || more_urgent_waiting(c) || next_session(c) != s)
+    ksceKernelWaitCond(arb_cond[c], NULL);
+  waiting[c]--;
+  ses->waiting[c]--;
+
+  busy = 1;
+  owner = c;
+  owner_session = s;
+  vclock = ses->vtime;
+
+  SceInt64 now = ksceKernelGetSystemTimeWide();
+  owner_since = now;
+
+  uint32_t wait = (uint32_t)(now - begin);
+  stats.acquired[c]++;
+  wait_sum[c] += wait;
+  if (wait > stats.wait_max[c])
+    stats.wait_max[c] = wait;
+
+  ses->acquired++;
+  ses->wait_sum += wait;
+  if (wait > ses->wait_max)
+    ses->wait_max = wait;
+}
+
+vile_priority_t nxt_command_priority(const unsigned char *request, unsigned int length)
+{
+  if (length < 2)
+    return VILE_PRIORITY_CONTROL;
+
+  // file transfers and other system commands
+  if ((request[0] & 0x7F) == NXT_SYSTEM_COMMAND_DOREPLY)
+    return VILE_PRIORITY_BULK;
+
+  switch (request[1])
+  {
+    case NXT_OPCODE_STOPPROGRAM:
+      return VILE_PRIORITY_SAFETY;
+    case NXT_OPCODE_SET_OUTPUTSTATE:
+      // power 0 is a stop, whether braking or coasting
+      return (length > 3 && request[3] == 0) ? VILE_PRIORITY_SAFETY : VILE_PRIORITY_CONTROL;
+    case NXT_OPCODE_GET_OUTPUTSTATE:
+    case NXT_OPCODE_GET_INPUTVALUES:
+    case NXT_OPCODE_BATTERYLEVEL:
+    case NXT_OPCODE_KEEPALIVE:
+    case NXT_OPCODE_LS_GET_STATUS:
+    case NXT_OPCODE_LS_READ:
+    case NXT_OPCODE_MESSAGE_READ:
+    case NXT_OPCODE_GET_CURRENTPROGRAM_NAME:
+      return VILE_PRIORITY_TELEMETRY;
+    default:
+      return VILE_PRIORITY_CONTROL;
+  }
+}
+
+void nxt_lock_priority(vile_priority_t priority)
+{
+  SceInt64 begin = ksceKernelGetSystemTimeWide();
+
+  ksceKernelLockMutex(arb_mtx, 1, NULL);
+  acquire(class_index(priority), session_index(), begin);
+  ksceKernelUnlockMutex(arb_mtx, 1);
+}
+
+void nxt_lock()
+{
+  nxt_lock_priority(VILE_PRIORITY_CONTROL);
+}
+
+void nxt_unlock()
+{
+  ksceKernelLockMutex(arb_mtx, 1, NULL);
+  charge(ksceKernelGetSystemTimeWide());
+  busy = 0;
+  wake_next();
+  ksceKernelUnlockMutex(arb_mtx, 1);
+}
+
+// called by a holder between packets of a longer job; steps aside for a
+// more urgent class, or for another session that is owed bus time
+int nxt_yield()
+{
+  int yielded = 0;
+
+  ksceKernelLockMutex(arb_mtx, 1, NULL);
+  int c = owner;
+  int s = owner_session;
+  SceInt64 begin = ksceKernelGetSystemTimeWide();
+  charge(begin);
+  int next = next_session(c);
+  if (more_urgent_waiting(c) || (next >= 0 && sessions[next].vtime < sessions[s].vtime))
+  {
+    busy = 0;
+    wake_next();
+    acquire(c, s, begin);
+    stats.yields++;
+    yielded = 1;
+  }
+  ksceKernelUnlockMutex(arb_mtx, 1);
+
+  return yielded;
+}
+
+void arbiter_reset_stats()
+{
+  ksceKernelLockMutex(arb_mtx, 1, NULL);
+  memset(&stats, 0, sizeof(stats));
+  memset(wait_sum, 0, sizeof(wait_sum));
+  for (int i = 0; i < ARB_SESSIONS; i++)
+  {
+    sessions[i].acquired = 0;
+    sessions[i].bus_us = 0;
+    sessions[i].wait_sum = 0;
+    sessions[i].wait_max = 0;
+  }
+  bus_total = 0;
+  ksceKernelUnlockMutex(arb_mtx, 1);
+}
+
+// vileStart from the calling process; returns 1 when it is the first
+// session, so the driver has to start, 0 if not, -1 if the table is full
+int session_open()
+{
+  SceUID pid = ksceKernelGetProcessId();
+  int ret = -1;
+
+  ksceKernelLockMutex(arb_mtx, 1, NULL);
+  session_reap();
+  int s = session_index();
+  if (s == 0)
+  {
+    for (int i = 1; i < ARB_SESSIONS; i++)
+    {
+      if (!sessions[i].refs)
+      {
+        s = i;
+        memset(&sessions[s], 0, sizeof(sessions[s]));
+        sessions[s].pid = pid;
+        sessions[s].weight = ARB_WEIGHT_DEFAULT;
+        sessions[s].vtime = vclock;
+        break;
+      }
+    }
+  }
+
+  if (s)
+  {
+    int open = 0;
+    for (int i = 1; i < ARB_SESSIONS; i++)
+      if (sessions[i].refs)
+        open++;
+    sessions[s].refs++;
+    ret = open ? 0 : 1;
+  }
+  ksceKernelUnlockMutex(arb_mtx, 1);
+
+  return ret;
+}
+
+// vileStop from the calling process; returns 1 when no session is left
+int session_close()
+{
+  int ret = 0;
+
+  ksceKernelLockMutex(arb_mtx, 1, NULL);
+  int s = session_index();
+  if (s && !--sessions[s].refs)
+  {
+    sessions[s].pid = 0;
+    sessions[s].claims = 0;
+  }
+  // a leaked session mustn't keep the driver running after the last one
+  session_reap();
+
+  ret = 1;
+  for (int i = 1; i < ARB_SESSIONS; i++)
+    if (sessions[i].refs)
+      ret = 0;
+  ksceKernelUnlockMutex(arb_mtx, 1);
+
+  return ret;
+}
+
+void session_reset()
+{
+  ksceKernelLockMutex(arb_mtx, 1, NULL);
+  for (int i = 1; i < ARB_SESSIONS; i++)
+  {
+    sessions[i].refs = 0;
+    sessions[i].pid = 0;
+    sessions[i].claims = 0;
+  }
+  ksceKernelUnlockMutex(arb_mtx, 1);
+}
+
+// 0 if the caller may send this command, -1 if it drives a motor
+// another session has claimed; the driver's own threads always may
+int session_check(const unsigned char *request, unsigned int length)
+{
+  return session_check_for(ksceKernelGetProcessId(), request, length);
+}
+
+// the same for process pid, for commands the driver sends on its behalf
+int session_check_for(SceUID pid, const unsigned char *request, unsigned int length)
+{
+  if (length < 3 || (request[0] & 0x7F) != NXT_DIRECT_COMMAND_DOREPLY)
+    return 0;
+  if (request[1] != NXT_OPCODE_SET_OUTPUTSTATE && request[1] != NXT_OPCODE_RESET_MOTOR_POSITION)
+    return 0;
+
+  uint8_t ports = (request[2] == NXT_OUT_ALL) ? 0x07 : (1 << (request[2] & 0x07));
+  int ret = 0;
+
+  ksceKernelLockMutex(arb_mtx, 1, NULL);
+  int s = session_of(pid);
+  if (s)
+  {
+    for (int i = 1; i < ARB_SESSIONS; i++)
+      if (i != s && (sessions[i].claims & ports))
+        ret = -1;
+  }
+  ksceKernelUnlockMutex(arb_mtx, 1);
+
+  return ret;
+}
+
+// for jobs that drive a motor later from the driver's own threads
+int session_check_motor(uint8_t port)
+{
+  const unsigned char probe[3] = {NXT_DIRECT_COMMAND_DOREPLY, NXT_OPCODE_SET_OUTPUTSTATE, port};
+  return session_check(probe, sizeof(probe));
+}
+
+int arbiter_init()
+{
+  static const char *names[VILE_PRIORITY_CLASSES] = {
+    "vile_arb_safety", "vile_arb_control", "vile_arb_telemetry", "vile_arb_bulk"
+  };
+
+  arb_mtx = ksceKernelCreateMutex("vile_arbiter", 0, 0, NULL);
+  if (arb_mtx < 0)
+    return -1;
+
+  sessions[0].weight = ARB_WEIGHT_DEFAULT;
+
+  for (int i = 0; i < VILE_PRIORITY_CLASSES; i++)
+  {
+    arb_cond[i] = ksceKernelCreateCond(names[i], 0, arb_mtx, NULL);
+    if (arb_cond[i] < 0)
+      return -1;
+  }
+  return 0;
+}
+
+/*
+ *  PUBLIC COMMANDS
+ */
+
+int vileGetPriorityStats(vile_priority_stats_t *out)
+{
+  uint32_t state;
+  ENTER_SYSCALL(state);
+
+  ksceKernelLockMutex(arb_mtx, 1, NULL);
+  vile_priority_stats_t kstats = stats;
+  for (int i = 0; i < VILE_PRIORITY_CLASSES; i++)
+    kstats.wait_avg[i] = kstats.acquired[i] ? (uint32_t)(wait_sum[i] / kstats.acquired[i]) : 0;
+  ksceKernelUnlockMutex(arb_mtx, 1);
+
+  ksceKernelMemcpyKernelToUser(out, &kstats, sizeof(kstats));
+
+  EXIT_SYSCALL(state);
+  return 0;
+}
+
+int vileSetSessionWeight(const uint32_t weight)
+{
+  uint32_t state;
+  ENTER_SYSCALL(state);
+
+  if (!weight || weight > ARB_WEIGHT_MAX)
+  {
+    EXIT_SYSCALL(state);
+    return -1;
+  }
+
+  ksceKernelLockMutex(arb_mtx, 1, NULL);
+  int s = session_index();
+  if (s)
+    sessions[s].weight = weight;
+  ksceKernelUnlockMutex(arb_mtx, 1);
+
+  EXIT_SYSCALL(state);
+  return s ? 0 : -1;
+}
+
+int vileClaimMotors(const uint8_t ports)
+{
+  uint32_t state;
+  ENTER_SYSCALL(state);
+
+  int ret = -1;
+
+  ksceKernelLockMutex(arb_mtx, 1, NULL);
+  // claims of a process that is gone aren't in the way
+  session_reap();
+  int s = session_index();
+  if (s)
+  {
+    ret = 0;
+    for (int i = 1; i < ARB_SESSIONS; i++)
+      if (i != s && (sessions[i].claims & ports))
+        ret = -1;
+    if (ret == 0)
+      sessions[s].claims |= ports;
+  }
+  ksceKernelUnlockMutex(arb_mtx, 1);
+
+  EXIT_SYSCALL(state);
+  return ret;
+}
+
+int vileReleaseMotors(const uint8_t ports)
+{
+  uint32_t state;
+  ENTER_SYSCALL(state);
+
+  ksceKernelLockMutex(arb_mtx, 1, NULL);
+  int s = session_index();
+  if (s)
+    sessions[s].claims &= ~ports;
+  ksceKernelUnlockMutex(arb_mtx, 1);
+
+  EXIT_SYSCALL(state);
+  return s ? 0 : -1;
+}
+
+int vileGetSessionStats(vile_session_stats_t *out, const unsigned int max)
+{
+  uint32_t state;
+  ENTER_SYSCALL(state);
+
+  int n = 0;
+
+  for (int i = 0; i < ARB_SESSIONS && n < max; i++)
+  {
+    vile_session_stats_t kstats;
+
+    ksceKernelLockMutex(arb_mtx, 1, NULL);
+    session_t *s = &sessions[i];
+    if (i && !s->refs)
+    {
+      ksceKernelUnlockMutex(arb_mtx, 1);
+      continue;
+    }
+    kstats.pid = i ? s->pid : 0;
+    kstats.weight = s->weight;
+    kstats.claims = s->claims;
+    kstats.acquired = s->acquired;
+    kstats.bus_us = s->bus_us;
+    kstats.share = bus_total ? (uint32_t)(s->bus_us * 1000 / bus_total) : 0;
+    kstats.wait_avg = s->acquired ? (uint32_t)(s->wait_sum / s->acquired) : 0;
+    kstats.wait_max = s->wait_max;
+    ksceKernelUnlockMutex(arb_mtx, 1);
+
+    ksceKernelMemcpyKernelToUser(&out[n], &kstats, sizeof(kstats));
+    n++;
+  }
+
+  EXIT_SYSCALL(state);
+  return n;
+}
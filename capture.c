@@ -0,0 +1,226 @@
+/**
+        libvile
+        Copyright (C) 2022 Cat (Ivan Epifanov)
+
+        This program is free software: you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        This program is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <psp2kern/kernel/cpu.h>
+#include <psp2kern/kernel/debug.h>
+#include <psp2kern/kernel/threadmgr.h>
+#include <psp2kern/kernel/sysmem.h>
+#include <psp2kern/kernel/iofilemgr.h>
+#include <string.h>
+#include "nxt.h"
+#include "capture.h"
+
+#define CAPTURE_DEFAULT 4096
+#define CAPTURE_MAX 65536
+
+static SceUID cap_mtx;
+static SceUID cap_uid = -1;
+
+static cap_entry_t *entries = NULL;
+static uint32_t capacity = 0;
+static uint32_t total = 0; // entries ever captured, ring index is total % capacity
+static uint32_t missed = 0;
+
+static volatile uint8_t active = 0;
+static uint8_t saving = 0;
+static SceInt64 epoch;
+
+SceInt64 capture_begin()
+{
+  return active ? ksceKernelGetSystemTimeWide() : 0;
+}
+
+void capture_packet(const uint8_t dir, const unsigned char *data, const unsigned int length, const int result, const SceInt64 begin)
+{
+  if (!begin)
+    return;
+
+  SceInt64 now = ksceKernelGetSystemTimeWide();
+
+  ksceKernelLockMutex(cap_mtx, 1, NULL);
+
+  if (!active)
+  {
+    if (saving)
+      missed++;
+    ksceKernelUnlockMutex(cap_mtx, 1);
+    return;
+  }
+
+  cap_entry_t *e = &entries[total % capacity];
+  total++;
+
+  unsigned int bytes = (dir == CAP_SEND) ? length : (result > 0 ? result : 0);
+  if (bytes > CAP_PACKET_SIZE)
+    bytes = CAP_PACKET_SIZE;
+
+  e->time = begin - epoch;
+  e->duration = (uint32_t)(now - begin);
+  e->result = result;
+  e->dir = dir;
+  e->length = length > 0xFF ? 0xFF : length;
+  e->reserved[0] = e->reserved[1] = 0;
+  memcpy(e->data, data, bytes);
+  memset(e->data + bytes, 0, CAP_PACKET_SIZE - bytes);
+
+  ksceKernelUnlockMutex(cap_mtx, 1);
+}
+
+static int capture_stop()
+{
+  ksceKernelLockMutex(cap_mtx, 1, NULL);
+  if (saving)
+  {
+    ksceKernelUnlockMutex(cap_mtx, 1);
+    return -1;
+  }
+  active = 0;
+  if (cap_uid >= 0)
+    ksceKernelFreeMemBlock(cap_uid);
+  cap_uid = -1;
+  entries = NULL;
+  capacity = 0;
+  ksceKernelUnlockMutex(cap_mtx, 1);
+  return 0;
+}
+
+int capture_init()
+{
+  cap_mtx = ksceKernelCreateMutex("vile_capture", 0, 0, NULL);
+  return (cap_mtx < 0) ? -1 : 0;
+}
+
+void capture_shutdown()
+{
+  capture_stop();
+}
+
+/*
+ *  PUBLIC COMMANDS
+ */
+
+int vileStartCapture(const unsigned int count)
+{
+  uint32_t state;
+  ENTER_SYSCALL(state);
+
+  if (cap_uid >= 0)
+  {
+    EXIT_SYSCALL(state);
+    return -1;
+  }
+
+  uint32_t kcapacity = count ? count : CAPTURE_DEFAULT;
+  if (kcapacity > CAPTURE_MAX)
+    kcapacity = CAPTURE_MAX;
+
+  SceSize size = (kcapacity * sizeof(cap_entry_t) + 0xFFF) & ~0xFFF;
+
+  SceUID uid = ksceKernelAllocMemBlock("vile_capture", SCE_KERNEL_MEMBLOCK_TYPE_KERNEL_RW, size, NULL);
+  if (uid < 0)
+  {
+    EXIT_SYSCALL(state);
+    return -1;
+  }
+
+  ksceKernelLockMutex(cap_mtx, 1, NULL);
+  cap_uid = uid;
+  ksceKernelGetMemBlockBase(cap_uid, (void **)&entries);
+  capacity = kcapacity;
+  total = 0;
+  missed = 0;
+  epoch = ksceKernelGetSystemTimeWide();
+  active = 1;
+  ksceKernelUnlockMutex(cap_mtx, 1);
+
+  EXIT_SYSCALL(state);
+  return kcapacity;
+}
+
+int vileStopCapture()
+{
+  uint32_t state;
+  ENTER_SYSCALL(state);
+
+  int ret = capture_stop();
+
+  EXIT_SYSCALL(state);
+  return ret;
+}
+
+int vileSaveCapture(const char *path)
+{
+  uint32_t state;
+  ENTER_SYSCALL(state);
+
+  char kpath[256];
+  ksceKernelStrncpyUserToKernel(kpath, path, sizeof(kpath));
+  kpath[sizeof(kpath) - 1] = 0;
+
+  ksceKernelLockMutex(cap_mtx, 1, NULL);
+
+  if (cap_uid < 0)
+  {
+    ksceKernelUnlockMutex(cap_mtx, 1);
+    EXIT_SYSCALL(state);
+    return -1;
+  }
+
+  // pause instead of holding the lock, transfers must not wait on storage
+  uint8_t was_active = active;
+  active = 0;
+  saving = 1;
+  ksceKernelUnlockMutex(cap_mtx, 1);
+
+  uint32_t count = total < capacity ? total : capacity;
+  uint32_t first = total < capacity ? 0 : total % capacity;
+
+  int ret = -1;
+  SceUID fd = ksceIoOpen(kpath, SCE_O_WRONLY | SCE_O_CREAT | SCE_O_TRUNC, 0666);
+  if (fd >= 0)
+  {
+    cap_header_t hdr = {
+      .magic = CAP_MAGIC,
+      .version = CAP_VERSION,
+      .entry_size = sizeof(cap_entry_t),
+      .count = count,
+      .dropped = (total - count) + missed,
+      .start = epoch
+    };
+
+    ksceIoWrite(fd, &hdr, sizeof(hdr));
+    // oldest first: tail of the ring, then its head
+    ksceIoWrite(fd, &entries[first], (count - first) * sizeof(cap_entry_t));
+    if (first)
+      ksceIoWrite(fd, entries, first * sizeof(cap_entry_t));
+    ksceIoClose(fd);
+    ret = count;
+  }
+  else
+  {
+    ksceDebugPrintf("capture open %s: 0x%08x\n", kpath, fd);
+  }
+
+  ksceKernelLockMutex(cap_mtx, 1, NULL);
+  saving = 0;
+  active = was_active;
+  ksceKernelUnlockMutex(cap_mtx, 1);
+
+  EXIT_SYSCALL(state);
+  return ret;
+}
@@ -0,0 +1,62 @@
+/**
+        libvile
+        Copyright (C) 2022 Cat (Ivan Epifanov)
+
+        This program is free software: you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        This program is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+ * USB capture file format, written by vileSaveCapture and read by the
+ * host replay backend: cap_header_t followed by count cap_entry_t,
+ * oldest first.
+ */
+
+#ifndef __CAPTURE_H__
+#define __CAPTURE_H__
+
+#include <stdint.h>
+
+#define CAP_MAGIC 0x50414356 // "VCAP"
+#define CAP_VERSION 1
+#define CAP_PACKET_SIZE 64
+
+enum {
+  CAP_SEND = 0x01,
+  CAP_RECV = 0x02
+};
+
+#pragma pack(push,1)
+
+typedef struct {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t entry_size;
+  uint32_t count;
+  uint32_t dropped; // entries overwritten or missed before saving
+  uint64_t start; // system time at capture start, usec
+} cap_header_t;
+
+typedef struct {
+  uint64_t time; // submit time, usec since capture start
+  uint32_t duration; // usec until the transfer completed
+  int32_t result; // bytes transferred or error code
+  uint8_t dir;
+  uint8_t length; // bytes requested
+  uint8_t reserved[2];
+  uint8_t data[CAP_PACKET_SIZE];
+} cap_entry_t;
+
+#pragma pack(pop)
+
+#endif // __CAPTURE_H__
@@ -0,0 +1,225 @@
+/**
+        libvile
+        Copyright (C) 2022 Cat (Ivan Epifanov)
+
+        This program is free software: you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        This program is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <psp2kern/kernel/cpu.h>
+#include <psp2kern/kernel/debug.h>
+#include <psp2kern/kernel/threadmgr.h>
+#include <psp2kern/kernel/sysmem/data_transfers.h>
+#include <string.h>
+#include "nxt.h"
+
+/*
+ * Read combining. A GET_INPUTVALUES or GET_OUTPUTSTATE for a port that
+ * already has one in flight waits for that one's reply instead of sending
+ * its own, as long as the one in flight is at least as urgent; otherwise
+ * an urgent read would sit behind a telemetry one. The bus then sees one
+ * read per port however many threads want it.
+ *
+ * With a freshness window, reads from user space (default priority) also
+ * take a good reply that came back within the window. The driver's own
+ * threads pick their priorities and always get a read that was in flight
+ * when they asked. Any command that changes a port drops its reply and
+ * starts a new epoch; only reads issued in the current epoch can be
+ * joined, so nobody asking after a write gets a reply from before it.
+ */
+
+#define COMBINE_INPUTS 4
+#define COMBINE_OUTPUTS 3
+#define COMBINE_SLOTS (COMBINE_INPUTS + COMBINE_OUTPUTS)
+
+typedef struct {
+  uint8_t inflight; // reads
+  vile_priority_t priority; // of the newest read in flight
+  uint32_t sent; // reads issued, the newest one's reply wins
+  uint32_t stored; // which read the reply is from
+  uint32_t epoch; // bumped by every command that changes the port
+  uint32_t issued_epoch; // of the newest read in flight
+  int ret;
+  SceInt64 done; // when the last good reply came back, 0 is none or dropped
+  unsigned char reply[64];
+} slot_t;
+
+static SceUID cmb_mtx;
+static SceUID cmb_cond;
+
+// under cmb_mtx
+static slot_t slots[COMBINE_SLOTS];
+static uint32_t freshness = 0;
+static vile_combine_stats_t stats;
+
+static slot_t *slot_of(uint8_t opcode, uint8_t port)
+{
+  if (opcode == NXT_OPCODE_GET_INPUTVALUES && port < COMBINE_INPUTS)
+    return &slots[port];
+  if (opcode == NXT_OPCODE_GET_OUTPUTSTATE && port < COMBINE_OUTPUTS)
+    return &slots[COMBINE_INPUTS + port];
+  return NULL;
+}
+
+// the reply as the transfer returned it
+static int take(const slot_t *s, unsigned char *result, unsigned int size)
+{
+  if (s->ret > 0)
+    memcpy(result, s->reply, (unsigned int)s->ret < size ? (unsigned int)s->ret : size);
+  return s->ret;
+}
+
+int nxt_read_combined(unsigned char *request, unsigned int length, unsigned char *result, unsigned int size, vile_priority_t priority)
+{
+  uint8_t fresh_ok = priority == VILE_PRIORITY_DEFAULT;
+  if (priority == VILE_PRIORITY_DEFAULT)
+    priority = nxt_command_priority(request, length);
+
+  slot_t *s = length >= 3 ? slot_of(request[1], request[2]) : NULL;
+  if (!s)
+    return nxt_transfer_priority(request, length, result, priority);
+
+  ksceKernelLockMutex(cmb_mtx, 1, NULL);
+  stats.reads++;
+
+  if (fresh_ok && freshness && s->done && ksceKernelGetSystemTimeWide() - s->done <= freshness)
+  {
+    int ret = take(s, result, size);
+    stats.fresh++;
+    ksceKernelUnlockMutex(cmb_mtx, 1);
+    return ret;
+  }
+
+  // smaller is more urgent
+  if (s->inflight && s->priority <= priority && s->issued_epoch == s->epoch)
+  {
+    // an older read coming back first may predate the write
+    uint32_t ticket = s->sent;
+    while (s->stored < ticket)
+      ksceKernelWaitCond(cmb_cond, NULL);
+    int ret = take(s, result, size);
+    stats.joined++;
+    ksceKernelUnlockMutex(cmb_mtx, 1);
+    return ret;
+  }
+
+  // whoever waits on a less urgent read in flight gets this reply if it
+  // comes back first, it's newer anyway
+  uint32_t ticket = ++s->sent;
+  uint32_t epoch = s->epoch;
+  s->inflight++;
+  s->priority = priority;
+  s->issued_epoch = epoch;
+  stats.issued++;
+  ksceKernelUnlockMutex(cmb_mtx, 1);
+
+  int ret = nxt_transfer_priority(request, length, result, priority);
+
+  ksceKernelLockMutex(cmb_mtx, 1, NULL);
+  if (ticket > s->stored)
+  {
+    s->stored = ticket;
+    s->ret = ret;
+    if (ret > 0)
+      memcpy(s->reply, result, (unsigned int)ret < size ? (unsigned int)ret : size);
+    // a write since may have made it stale, it's not handed out again
+    s->done = (ret > 0 && result[2] == NXT_STATUS_OK && epoch == s->epoch) ? ksceKernelGetSystemTimeWide() : 0;
+  }
+  // which one is left isn't known, only bulk reads may still join it
+  if (--s->inflight)
+    s->priority = VILE_PRIORITY_BULK;
+  ksceKernelSignalCondAll(cmb_cond);
+  ksceKernelUnlockMutex(cmb_mtx, 1);
+
+  return ret;
+}
+
+// every command that went out; drops replies it makes stale
+void combine_command(const unsigned char *request, unsigned int length)
+{
+  if (length < 3)
+    return;
+
+  int first;
+  int count;
+  switch (request[1])
+  {
+    case NXT_OPCODE_SET_INPUTMODE:
+    case NXT_OPCODE_RESET_INPUT_SCALEDVALUES:
+      first = request[2];
+      count = first < COMBINE_INPUTS ? 1 : 0;
+      break;
+    case NXT_OPCODE_SET_OUTPUTSTATE:
+    case NXT_OPCODE_RESET_MOTOR_POSITION:
+      first = COMBINE_INPUTS + request[2];
+      count = request[2] < COMBINE_OUTPUTS ? 1 : 0;
+      if (request[2] == NXT_OUT_ALL)
+      {
+        first = COMBINE_INPUTS;
+        count = COMBINE_OUTPUTS;
+      }
+      break;
+    default:
+      return;
+  }
+
+  ksceKernelLockMutex(cmb_mtx, 1, NULL);
+  for (int i = first; i < first + count; i++)
+  {
+    slots[i].done = 0;
+    slots[i].epoch++;
+  }
+  ksceKernelUnlockMutex(cmb_mtx, 1);
+}
+
+int combine_init()
+{
+  cmb_mtx = ksceKernelCreateMutex("vile_combine", 0, 0, NULL);
+  cmb_cond = ksceKernelCreateCond("vile_combine", 0, cmb_mtx, NULL);
+  return (cmb_mtx < 0 || cmb_cond < 0) ? -1 : 0;
+}
+
+/*
+ *  PUBLIC COMMANDS
+ */
+
+// usec a reply may be handed out again to vileGetInputValues and
+// vileGetOutputState, 0 only shares reads in flight
+int vileSetReadFreshness(const uint32_t usec)
+{
+  uint32_t state;
+  ENTER_SYSCALL(state);
+
+  ksceKernelLockMutex(cmb_mtx, 1, NULL);
+  freshness = usec;
+  ksceKernelUnlockMutex(cmb_mtx, 1);
+
+  EXIT_SYSCALL(state);
+  return 0;
+}
+
+int vileGetCombineStats(vile_combine_stats_t *ustats)
+{
+  uint32_t state;
+  ENTER_SYSCALL(state);
+
+  ksceKernelLockMutex(cmb_mtx, 1, NULL);
+  vile_combine_stats_t kstats = stats;
+  kstats.freshness = freshness;
+  ksceKernelUnlockMutex(cmb_mtx, 1);
+
+  ksceKernelMemcpyKernelToUser(ustats, &kstats, sizeof(kstats));
+
+  EXIT_SYSCALL(state);
+  return 0;
+}
@@ -0,0 +1,339 @@
+/**
+        libvile
+        Copyright (C) 2022 Cat (Ivan Epifanov)
+
+        This program is free software: you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        This program is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <psp2kern/kernel/cpu.h>
+#include <psp2kern/kernel/debug.h>
+#include <psp2kern/kernel/threadmgr.h>
+#include <psp2kern/kernel/sysmem/data_transfers.h>
+#include <string.h>
+#include "nxt.h"
+
+// anything faster is below a single usb round trip anyway
+#define CONTROLLER_MIN_PERIOD 1000
+#define CONTROLLER_INTEGRAL_LIMIT 1000000
+
+#define CONTROLLER_EV_WAKE 1
+
+static vile_controller_t config;
+
+static SceUID ctl_mtx;
+static SceUID ctl_ev;
+static SceUID ctl_thid = -1;
+
+static volatile uint8_t running = 0;
+
+static vile_controller_stats_t stats;
+static uint64_t jitter_sum = 0;
+
+static int32_t controller_input(const vile_inputstate_t *in, vile_source_t source)
+{
+  switch (source)
+  {
+    case VILE_SOURCE_RAW:
+      return in->raw_value;
+    case VILE_SOURCE_NORMALIZED:
+      return in->normalized_value;
+    case VILE_SOURCE_SCALED:
+    default:
+      return in->scaled_value;
+  }
+}
+
+static int controller_thread(SceSize args, void *argp)
+{
+  ksceDebugPrintf("controller thread started\n");
+
+  SceInt64 next = ksceKernelGetSystemTimeWide();
+  SceInt64 window = next;
+  uint32_t window_count = 0;
+
+  int32_t integral = 0;
+  int32_t prev_input = 0;
+  uint8_t have_prev = 0;
+
+  while (running)
+  {
+    SceInt64 now = ksceKernelGetSystemTimeWide();
+
+    if (now < next)
+    {
+      SceUInt timeout = (SceUInt)(next - now);
+      ksceKernelWaitEventFlag(ctl_ev, CONTROLLER_EV_WAKE, SCE_EVENT_WAITCLEAR_PAT | SCE_EVENT_WAITOR, NULL, &timeout);
+      continue;
+    }
+
+    ksceKernelLockMutex(ctl_mtx, 1, NULL);
+    vile_controller_t c = config;
+    ksceKernelUnlockMutex(ctl_mtx, 1);
+
+    uint32_t jitter = (uint32_t)(now - next);
+    uint32_t skipped = 0;
+
+    next += c.period;
+    if (next <= now)
+    {
+      // fell behind, keep the original phase instead of bursting to catch up
+      skipped = (uint32_t)((now - next) / c.period) + 1;
+      next += (SceInt64)skipped * c.period;
+    }
+
+    if (now - window >= 1000000)
+    {
+      ksceKernelLockMutex(ctl_mtx, 1, NULL);
+      stats.rate = window_count;
+      ksceKernelUnlockMutex(ctl_mtx, 1);
+      window = now;
+      window_count = 0;
+    }
+    window_count++;
+
+    vile_inputstate_t in;
+    if (nxt_get_input_values(c.in_port, &in, VILE_PRIORITY_CONTROL) < 0 || !in.valid)
+    {
+      ksceKernelLockMutex(ctl_mtx, 1, NULL);
+      stats.failed++;
+      stats.overruns += skipped;
+      ksceKernelUnlockMutex(ctl_mtx, 1);
+      continue;
+    }
+
+    int32_t input = controller_input(&in, c.source);
+    int32_t error = c.setpoint - input;
+    // derivative on measurement, so setpoint changes don't kick the output
+    int32_t dinput = have_prev ? input - prev_input : 0;
+    prev_input = input;
+    have_prev = 1;
+
+    int32_t next_integral = integral + error;
+    if (next_integral > CONTROLLER_INTEGRAL_LIMIT)
+      next_integral = CONTROLLER_INTEGRAL_LIMIT;
+    else if (next_integral < -CONTROLLER_INTEGRAL_LIMIT)
+      next_integral = -CONTROLLER_INTEGRAL_LIMIT;
+
+    int64_t acc = (int64_t)c.kp * error + (int64_t)c.ki * next_integral - (int64_t)c.kd * dinput;
+
+    int32_t min_power = c.min_power;
+    int32_t max_power = c.max_power;
+    if (min_power == 0 && max_power == 0)
+    {
+      min_power = -100;
+      max_power = 100;
+    }
+
+    // a big ki times the integral doesn't fit 32 bits, so it's clamped
+    // first; one past the limit still counts as saturated below
+    int64_t wide = c.bias + (acc >> 16);
+    if (wide > max_power)
+      wide = max_power + 1;
+    else if (wide < min_power)
+      wide = min_power - 1;
+    int32_t output = (int32_t)wide;
+
+    // conditional integration: don't wind up while saturated in the same direction
+    if (output > max_power)
+    {
+      output = max_power;
+      if (error < 0)
+        integral = next_integral;
+    }
+    else if (output < min_power)
+    {
+      output = min_power;
+      if (error > 0)
+        integral = next_integral;
+    }
+    else
+    {
+      integral = next_integral;
+    }
+
+    vile_setoutputstate_t out = {
+      .port = c.out_port,
+      .power = (int8_t)output,
+      .mode = c.mode,
+      .regulation = c.regulation,
+      .turn_ratio = c.turn_ratio,
+      .run_state = NXT_MOTOR_RUNSTATE_RUNNING,
+      .tacho_limit = 0
+    };
+
+    int ret = nxt_set_output_state(&out, 0);
+
+    ksceKernelLockMutex(ctl_mtx, 1, NULL);
+    stats.overruns += skipped;
+    if (ret < 0)
+    {
+      stats.failed++;
+    }
+    else
+    {
+      stats.iterations++;
+      if (jitter > stats.jitter_max)
+        stats.jitter_max = jitter;
+      jitter_sum += jitter;
+      stats.last_input = input;
+      stats.last_error = error;
+      stats.last_output = output;
+    }
+    ksceKernelUnlockMutex(ctl_mtx, 1);
+  }
+
+  ksceDebugPrintf("controller thread stopped\n");
+  return 0;
+}
+
+static void controller_stop()
+{
+  if (ctl_thid < 0)
+    return;
+
+  running = 0;
+  ksceKernelSetEventFlag(ctl_ev, CONTROLLER_EV_WAKE);
+  ksceKernelWaitThreadEnd(ctl_thid, NULL, NULL);
+  ksceKernelDeleteThread(ctl_thid);
+  ctl_thid = -1;
+
+  // don't leave the motor running at whatever the last iteration computed;
+  // the firmware only brakes a motor that is on
+  vile_setoutputstate_t brake = {
+    .port = config.out_port,
+    .power = 0,
+    .mode = NXT_MOTOR_MODE_ON | NXT_MOTOR_MODE_BRAKE,
+    .regulation = NXT_MOTOR_REGULATION_IDLE,
+    .turn_ratio = 0,
+    .run_state = NXT_MOTOR_RUNSTATE_RUNNING,
+    .tacho_limit = 0
+  };
+  nxt_set_output_state(&brake, 1);
+}
+
+int controller_init()
+{
+  ctl_mtx = ksceKernelCreateMutex("vile_controller", 0, 0, NULL);
+  ctl_ev = ksceKernelCreateEventFlag("vile_controller", 0, 0, NULL);
+  return (ctl_mtx < 0 || ctl_ev < 0) ? -1 : 0;
+}
+
+void controller_shutdown()
+{
+  controller_stop();
+}
+
+/*
+ *  PUBLIC COMMANDS
+ */
+
+int vileStartController(const vile_controller_t *controller)
+{
+  uint32_t state;
+  ENTER_SYSCALL(state);
+
+  if (ctl_thid >= 0)
+  {
+    EXIT_SYSCALL(state);
+    return -1;
+  }
+
+  vile_controller_t kcontroller;
+  ksceKernelMemcpyUserToKernel(&kcontroller, controller, sizeof(vile_controller_t));
+
+  if (kcontroller.period < CONTROLLER_MIN_PERIOD || session_check_motor(kcontroller.out_port) < 0)
+  {
+    EXIT_SYSCALL(state);
+    return -1;
+  }
+
+  ksceKernelLockMutex(ctl_mtx, 1, NULL);
+  config = kcontroller;
+  memset(&stats, 0, sizeof(stats));
+  jitter_sum = 0;
+  ksceKernelUnlockMutex(ctl_mtx, 1);
+
+  ctl_thid = ksceKernelCreateThread("vile_controller", controller_thread, 0x3C, 0x1000, 0, 0x10000, NULL);
+  if (ctl_thid < 0)
+  {
+    EXIT_SYSCALL(state);
+    return -1;
+  }
+
+  ksceKernelClearEventFlag(ctl_ev, ~CONTROLLER_EV_WAKE);
+  running = 1;
+  ksceKernelStartThread(ctl_thid, 0, NULL);
+
+  EXIT_SYSCALL(state);
+  return 0;
+}
+
+int vileStopController()
+{
+  uint32_t state;
+  ENTER_SYSCALL(state);
+
+  controller_stop();
+
+  EXIT_SYSCALL(state);
+  return 0;
+}
+
+int vileSetControllerGains(const int32_t kp, const int32_t ki, const int32_t kd)
+{
+  uint32_t state;
+  ENTER_SYSCALL(state);
+
+  ksceKernelLockMutex(ctl_mtx, 1, NULL);
+  config.kp = kp;
+  config.ki = ki;
+  config.kd = kd;
+  ksceKernelUnlockMutex(ctl_mtx, 1);
+
+  EXIT_SYSCALL(state);
+  return 0;
+}
+
+int vileSetControllerSetpoint(const int32_t setpoint)
+{
+  uint32_t state;
+  ENTER_SYSCALL(state);
+
+  ksceKernelLockMutex(ctl_mtx, 1, NULL);
+  config.setpoint = setpoint;
+  ksceKernelUnlockMutex(ctl_mtx, 1);
+
+  EXIT_SYSCALL(state);
+  return 0;
+}
+
+int vileGetControllerStats(vile_controller_stats_t *ustats)
+{
+  uint32_t state;
+  ENTER_SYSCALL(state);
+
+  vile_controller_stats_t kstats;
+
+  ksceKernelLockMutex(ctl_mtx, 1, NULL);
+  kstats = stats;
+  kstats.running = running;
+  if (kstats.iterations)
+    kstats.jitter_avg = (uint32_t)(jitter_sum / kstats.iterations);
+  ksceKernelUnlockMutex(ctl_mtx, 1);
+
+  ksceKernelMemcpyKernelToUser(ustats, &kstats, sizeof(vile_controller_stats_t));
+
+  EXIT_SYSCALL(state);
+  return 0;
+}
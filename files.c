@@ -0,0 +1,658 @@
+/**
+        libvile
+        Copyright (C) 2022 Cat (Ivan Epifanov)
+
+        This program is free software: you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        This program is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <psp2kern/kernel/cpu.h>
+#include <psp2kern/kernel/debug.h>
+#include <psp2kern/kernel/threadmgr.h>
+#include <psp2kern/kernel/sysmem.h>
+#include <psp2kern/kernel/sysmem/data_transfers.h>
+#include <psp2kern/kernel/iofilemgr.h>
+#include <string.h>
+#include "nxt.h"
+
+/*
+ * Files on the brick. An upload is DELETE, OPENWRITE, a run of WRITEs
+ * and CLOSE, all at bulk priority. Writes go out without a reply except
+ * every FILES_WINDOW-th and the last one; replies come in order, so that
+ * one covers the writes before it. A window never holds more than the
+ * brick queues, and nobody else sends in the middle of one; between
+ * windows the bus is offered to anybody more urgent. If the brick still
+ * refuses a packet the upload starts over with a reply to every write.
+ *
+ * A deploy hashes every file first (FNV-1a), then holds the bus for a
+ * GET_DEVICEINFO and a FINDFIRST/FINDNEXT listing, and uploads only the
+ * files whose manifest entry or listed size doesn't match. For a brick
+ * that already has everything that is the whole deploy.
+ */
+
+// commands the firmware queues before dropping them
+#define FILES_WINDOW 4
+#define FILES_BUSY -2
+
+#define DEPLOY_BRICKS 32
+#define DEPLOY_ENTRIES 64 // per brick
+#define DEPLOY_LISTING 64
+#define DEPLOY_HASH_CHUNK 512
+#define DEPLOY_MAGIC 0x4D504456 // "VDPM"
+
+#define FNV_OFFSET 0xCBF29CE484222325ULL
+#define FNV_PRIME 0x100000001B3ULL
+
+typedef struct {
+  char name[20];
+  uint32_t size;
+  uint64_t hash;
+} manifest_entry_t;
+
+typedef struct {
+  uint8_t address[6];
+  uint8_t used;
+  uint8_t reserved;
+  uint32_t stamp; // deploy it was last used in, the oldest one goes first
+  manifest_entry_t entry[DEPLOY_ENTRIES];
+} manifest_t;
+
+typedef struct {
+  char name[20];
+  uint32_t size;
+} listed_t;
+
+static SceUID files_mtx; // one upload at a time, the brick has few handles
+static SceUID stats_mtx;
+static vile_upload_stats_t stats;
+static vile_deploy_stats_t deploy_stats;
+
+// under files_mtx
+static SceUID manifests_uid = -1;
+static manifest_t *manifests = NULL;
+static uint32_t deploy_stamp = 0;
+static vile_deploy_file_t deploy_files[VILE_DEPLOY_MAX];
+static uint64_t deploy_hash[VILE_DEPLOY_MAX];
+static listed_t listing[DEPLOY_LISTING];
+static uint8_t hash_buf[DEPLOY_HASH_CHUNK];
+
+// status of a system command reply, -1 if it is not one
+static int sys_status(int ret, const unsigned char *reply, uint8_t opcode)
+{
+  if (ret < 3 || reply[0] != NXT_COMMAND_REPLY || reply[1] != opcode)
+    return -1;
+  return reply[2];
+}
+
+static int busy(int status)
+{
+  return status == NXT_STATUS_NO_BUFFER || status == NXT_STATUS_COMMUNICATION_ERROR;
+}
+
+// bus held
+static int sys_delete(const char *filename)
+{
+  cmd_file_t cmd = {NXT_SYSTEM_COMMAND_DOREPLY, NXT_OPCODE_SYS_DELETE, ""};
+  memcpy(cmd.filename, filename, sizeof(cmd.filename));
+
+  ret_status_t st;
+  SceInt64 begin = ksceKernelGetSystemTimeWide();
+  int ret = nxt_exchange((unsigned char*) &cmd, sizeof(cmd), (unsigned char*) &st, VILE_PRIORITY_BULK, begin, 0);
+  return sys_status(ret, (unsigned char*) &st, NXT_OPCODE_SYS_DELETE);
+}
+
+// bus held
+static int sys_close(uint8_t handle)
+{
+  cmd_handle_t cmd = {NXT_SYSTEM_COMMAND_DOREPLY, NXT_OPCODE_SYS_CLOSE, handle};
+
+  ret_handle_t st;
+  SceInt64 begin = ksceKernelGetSystemTimeWide();
+  int ret = nxt_exchange((unsigned char*) &cmd, sizeof(cmd), (unsigned char*) &st, VILE_PRIORITY_BULK, begin, 0);
+  return sys_status(ret, (unsigned char*) &st, NXT_OPCODE_SYS_CLOSE);
+}
+
+// bus held; data is a user pointer, run collects the counters;
+// FILES_BUSY when the brick dropped a packet
+static int upload(const char *filename, const uint8_t *data, uint32_t size, uint8_t linear, unsigned int window, SceInt64 wait, vile_upload_stats_t *run)
+{
+  int status = sys_delete(filename);
+  if (busy(status))
+    return FILES_BUSY;
+  if (status != NXT_STATUS_OK && status != NXT_STATUS_SYS_FILE_NOT_FOUND)
+    return -1;
+
+  uint8_t opcode = linear ? NXT_OPCODE_SYS_OPENLINEARWRITE : NXT_OPCODE_SYS_OPENWRITE;
+  cmd_openwrite_t open = {NXT_SYSTEM_COMMAND_DOREPLY, opcode, "", size};
+  memcpy(open.filename, filename, sizeof(open.filename));
+
+  ret_handle_t oh;
+  SceInt64 begin = ksceKernelGetSystemTimeWide();
+  int ret = nxt_exchange((unsigned char*) &open, sizeof(open), (unsigned char*) &oh, VILE_PRIORITY_BULK, begin, wait);
+  status = sys_status(ret, (unsigned char*) &oh, opcode);
+  if (status != NXT_STATUS_OK)
+    return busy(status) ? FILES_BUSY : -1;
+
+  cmd_write_t cmd = {NXT_SYSTEM_COMMAND_NOREPLY, NXT_OPCODE_SYS_WRITE, oh.handle};
+  ret_write_t wr;
+  uint32_t done = 0;
+  unsigned int writes = 0;
+  status = NXT_STATUS_OK;
+
+  while (done < size)
+  {
+    uint32_t chunk = size - done;
+    if (chunk > NXT_WRITE_CHUNK)
+      chunk = NXT_WRITE_CHUNK;
+    ksceKernelMemcpyUserToKernel(cmd.data, data + done, chunk);
+
+    uint8_t reply = (++writes % window) == 0 || done + chunk == size;
+    cmd.type = reply ? NXT_SYSTEM_COMMAND_DOREPLY : NXT_SYSTEM_COMMAND_NOREPLY;
+
+    begin = ksceKernelGetSystemTimeWide();
+    ret = nxt_exchange((unsigned char*) &cmd, 3 + chunk, reply ? (unsigned char*) &wr : NULL, VILE_PRIORITY_BULK, begin, 0);
+    if (ret < 0)
+      break;
+    if (reply)
+    {
+      status = sys_status(ret, (unsigned char*) &wr, NXT_OPCODE_SYS_WRITE);
+      if (status != NXT_STATUS_OK || wr.size != chunk)
+        break;
+    }
+
+    done += chunk;
+    run->writes++;
+
+    if (reply && done < size)
+    {
+      run->windows++;
+      if (nxt_yield())
+        run->yields++;
+    }
+  }
+
+  if (sys_close(oh.handle) != NXT_STATUS_OK || done < size)
+  {
+    // don't leave half a file behind
+    sys_delete(filename);
+    return busy(status) ? FILES_BUSY : -1;
+  }
+
+  run->windows++;
+  return (int)done;
+}
+
+// bus held; upload with a retry at one reply per write, see above
+static int upload_file(const char *filename, const uint8_t *data, uint32_t size, uint8_t linear, SceInt64 wait, vile_upload_stats_t *run)
+{
+  int ret = upload(filename, data, size, linear, FILES_WINDOW, wait, run);
+  if (ret == FILES_BUSY)
+  {
+    run->retries++;
+    ret = upload(filename, data, size, linear, 1, 0, run);
+  }
+  return ret;
+}
+
+static void upload_account(const vile_upload_stats_t *run, int ret, uint32_t took)
+{
+  ksceKernelLockMutex(stats_mtx, 1, NULL);
+  stats.writes += run->writes;
+  stats.windows += run->windows;
+  stats.yields += run->yields;
+  stats.retries += run->retries;
+  if (ret < 0)
+  {
+    stats.failures++;
+  }
+  else
+  {
+    stats.uploads++;
+    stats.bytes += ret;
+    stats.last_us = took;
+    stats.last_rate = took ? (uint32_t)((uint64_t)ret * 1000000 / took) : 0;
+  }
+  ksceKernelUnlockMutex(stats_mtx, 1);
+}
+
+// the VM runs programs in place and the display draws images in place,
+// those have to be in one piece in flash
+static uint8_t needs_linear(const char *filename)
+{
+  const char *dot = strrchr(filename, '.');
+  if (!dot)
+    return 0;
+  return !strcmp(dot, ".rxe") || !strcmp(dot, ".ric") || !strcmp(dot, ".rtm") || !strcmp(dot, ".sys");
+}
+
+// user data
+static uint64_t content_hash(const uint8_t *data, uint32_t size)
+{
+  uint64_t h = FNV_OFFSET;
+  for (uint32_t done = 0; done < size; )
+  {
+    uint32_t chunk = size - done < DEPLOY_HASH_CHUNK ? size - done : DEPLOY_HASH_CHUNK;
+    ksceKernelMemcpyUserToKernel(hash_buf, data + done, chunk);
+    for (uint32_t i = 0; i < chunk; i++)
+      h = (h ^ hash_buf[i]) * FNV_PRIME;
+    done += chunk;
+  }
+  return h;
+}
+
+// bus held
+static int device_address(uint8_t *address)
+{
+  cmd_simple_t cmd = {NXT_SYSTEM_COMMAND_DOREPLY, NXT_OPCODE_SYS_GET_DEVICEINFO};
+  ret_deviceinfo_t r;
+
+  SceInt64 begin = ksceKernelGetSystemTimeWide();
+  int ret = nxt_exchange((unsigned char*) &cmd, sizeof(cmd), (unsigned char*) &r, VILE_PRIORITY_BULK, begin, 0);
+  if (ret < 33 || sys_status(ret, (unsigned char*) &r, NXT_OPCODE_SYS_GET_DEVICEINFO) != NXT_STATUS_OK)
+    return -1;
+
+  memcpy(address, r.address, 6);
+  return 0;
+}
+
+// bus held; every file on the brick into listing, returns how many
+static int list_files()
+{
+  cmd_file_t first = {NXT_SYSTEM_COMMAND_DOREPLY, NXT_OPCODE_SYS_FINDFIRST, "*.*"};
+  ret_find_t r;
+  int n = 0;
+
+  SceInt64 begin = ksceKernelGetSystemTimeWide();
+  int ret = nxt_exchange((unsigned char*) &first, sizeof(first), (unsigned char*) &r, VILE_PRIORITY_BULK, begin, 0);
+  int status = sys_status(ret, (unsigned char*) &r, NXT_OPCODE_SYS_FINDFIRST);
+  if (status == NXT_STATUS_SYS_FILE_NOT_FOUND)
+    return 0;
+  if (status != NXT_STATUS_OK || ret < 28)
+    return -1;
+
+  uint8_t handle = r.handle;
+  while (n < DEPLOY_LISTING)
+  {
+    memcpy(listing[n].name, r.filename, sizeof(listing[n].name));
+    listing[n].name[sizeof(listing[n].name) - 1] = 0;
+    listing[n].size = r.size;
+    n++;
+
+    cmd_handle_t next = {NXT_SYSTEM_COMMAND_DOREPLY, NXT_OPCODE_SYS_FINDNEXT, handle};
+    begin = ksceKernelGetSystemTimeWide();
+    ret = nxt_exchange((unsigned char*) &next, sizeof(next), (unsigned char*) &r, VILE_PRIORITY_BULK, begin, 0);
+    status = sys_status(ret, (unsigned char*) &r, NXT_OPCODE_SYS_FINDNEXT);
+    if (status != NXT_STATUS_OK || ret < 28)
+      break;
+  }
+
+  // the firmware may have let go of it already, either way is fine
+  sys_close(handle);
+  return (status == NXT_STATUS_OK || status == NXT_STATUS_SYS_FILE_NOT_FOUND) ? n : -1;
+}
+
+static const listed_t *listed(const char *name, int count)
+{
+  for (int i = 0; i < count; i++)
+    if (!strncmp(listing[i].name, name, sizeof(listing[i].name)))
+      return &listing[i];
+  return NULL;
+}
+
+static int manifests_alloc()
+{
+  if (manifests)
+    return 0;
+
+  SceSize size = (sizeof(manifest_t) * DEPLOY_BRICKS + 0xFFF) & ~0xFFF;
+  manifests_uid = ksceKernelAllocMemBlock("vile_deploy", SCE_KERNEL_MEMBLOCK_TYPE_KERNEL_RW, size, NULL);
+  if (manifests_uid < 0)
+    return -1;
+  ksceKernelGetMemBlockBase(manifests_uid, (void **)&manifests);
+  memset(manifests, 0, size);
+  return 0;
+}
+
+static manifest_t *manifest_for(const uint8_t *address)
+{
+  manifest_t *oldest = &manifests[0];
+
+  for (int i = 0; i < DEPLOY_BRICKS; i++)
+  {
+    manifest_t *m = &manifests[i];
+    if (m->used && !memcmp(m->address, address, 6))
+      return m;
+    if (!m->used || (oldest->used && m->stamp < oldest->stamp))
+      oldest = m;
+  }
+
+  memset(oldest, 0, sizeof(*oldest));
+  memcpy(oldest->address, address, 6);
+  oldest->used = 1;
+  return oldest;
+}
+
+static int deploying(const char *name, unsigned int files)
+{
+  for (unsigned int i = 0; i < files; i++)
+    if (!strncmp(deploy_files[i].name, name, sizeof(deploy_files[i].name)))
+      return 1;
+  return 0;
+}
+
+// with create, a free slot or one for a file that is neither on the brick
+// nor in this deploy; NULL if there is none
+static manifest_entry_t *manifest_entry(manifest_t *m, const char *name, int count, unsigned int files, uint8_t create)
+{
+  manifest_entry_t *empty = NULL;
+  manifest_entry_t *stale = NULL;
+
+  for (int i = 0; i < DEPLOY_ENTRIES; i++)
+  {
+    manifest_entry_t *e = &m->entry[i];
+    if (!e->name[0])
+    {
+      if (!empty)
+        empty = e;
+    }
+    else if (!strncmp(e->name, name, sizeof(e->name)))
+      return e;
+    else if (!stale && create && !listed(e->name, count) && !deploying(e->name, files))
+      stale = e;
+  }
+
+  if (!create)
+    return NULL;
+  return empty ? empty : stale;
+}
+
+static int start_program(const char *filename)
+{
+  cmd_startprogram_t cmd = {NXT_DIRECT_COMMAND_DOREPLY, NXT_OPCODE_STARTPROGRAM, ""};
+  memcpy(cmd.filename, filename, sizeof(cmd.filename));
+
+  ret_status_t st;
+  SceInt64 begin = ksceKernelGetSystemTimeWide();
+  int ret = nxt_exchange((unsigned char*) &cmd, sizeof(cmd), (unsigned char*) &st, VILE_PRIORITY_BULK, begin, 0);
+  if (ret < 3 || st.type != NXT_COMMAND_REPLY || st.opcode != NXT_OPCODE_STARTPROGRAM)
+    return -1;
+  return st.status == NXT_STATUS_OK ? 0 : -1;
+}
+
+int files_init()
+{
+  files_mtx = ksceKernelCreateMutex("vile_files", 0, 0, NULL);
+  stats_mtx = ksceKernelCreateMutex("vile_files_stats", 0, 0, NULL);
+  return (files_mtx < 0 || stats_mtx < 0) ? -1 : 0;
+}
+
+/*
+ *  PUBLIC COMMANDS
+ */
+
+// replaces the file if it is there; returns bytes written
+int vileUploadFile(const char *filename, const void *data, const uint32_t size)
+{
+  uint32_t state;
+  ENTER_SYSCALL(state);
+
+  char name[20] = "";
+  ksceKernelStrncpyUserToKernel(name, filename, sizeof(name) - 1);
+  name[sizeof(name) - 1] = 0;
+
+  if (!name[0] || !size)
+  {
+    EXIT_SYSCALL(state);
+    return -1;
+  }
+
+  vile_upload_stats_t run;
+  memset(&run, 0, sizeof(run));
+
+  ksceKernelLockMutex(files_mtx, 1, NULL);
+  SceInt64 begin = ksceKernelGetSystemTimeWide();
+  nxt_lock_priority(VILE_PRIORITY_BULK);
+  int ret = upload_file(name, data, size, needs_linear(name), ksceKernelGetSystemTimeWide() - begin, &run);
+  nxt_unlock();
+  ksceKernelUnlockMutex(files_mtx, 1);
+
+  upload_account(&run, ret, (uint32_t)(ksceKernelGetSystemTimeWide() - begin));
+
+  EXIT_SYSCALL(state);
+  return ret < 0 ? -1 : ret;
+}
+
+int vileGetUploadStats(vile_upload_stats_t *out)
+{
+  uint32_t state;
+  ENTER_SYSCALL(state);
+
+  ksceKernelLockMutex(stats_mtx, 1, NULL);
+  vile_upload_stats_t kstats = stats;
+  ksceKernelUnlockMutex(stats_mtx, 1);
+
+  ksceKernelMemcpyKernelToUser(out, &kstats, sizeof(kstats));
+
+  EXIT_SYSCALL(state);
+  return 0;
+}
+
+int vileDeploy(const vile_deploy_file_t *files, const unsigned int count, const char *program)
+{
+  uint32_t state;
+  ENTER_SYSCALL(state);
+
+  char kprogram[20] = "";
+  if (program)
+  {
+    ksceKernelStrncpyUserToKernel(kprogram, program, sizeof(kprogram));
+    kprogram[sizeof(kprogram) - 1] = 0;
+  }
+
+  if (!count || count > VILE_DEPLOY_MAX)
+  {
+    EXIT_SYSCALL(state);
+    return -1;
+  }
+
+  ksceKernelLockMutex(files_mtx, 1, NULL);
+
+  SceInt64 begin = ksceKernelGetSystemTimeWide();
+  ksceKernelMemcpyUserToKernel(deploy_files, files, count * sizeof(vile_deploy_file_t));
+
+  int ret = manifests_alloc();
+  for (unsigned int i = 0; i < count && ret == 0; i++)
+  {
+    deploy_files[i].name[sizeof(deploy_files[i].name) - 1] = 0;
+    if (!deploy_files[i].name[0] || !deploy_files[i].size)
+      ret = -1;
+    else
+      deploy_hash[i] = content_hash(deploy_files[i].data, deploy_files[i].size);
+  }
+
+  SceInt64 hashed = ksceKernelGetSystemTimeWide();
+  uint8_t address[6];
+  int listed_count = 0;
+  SceInt64 list_done = hashed;
+  unsigned int uploaded = 0;
+  unsigned int skipped = 0;
+  uint64_t bytes_uploaded = 0;
+  uint64_t bytes_skipped = 0;
+
+  if (ret == 0)
+  {
+    nxt_lock_priority(VILE_PRIORITY_BULK);
+
+    if (device_address(address) < 0 || (listed_count = list_files()) < 0)
+      ret = -1;
+    list_done = ksceKernelGetSystemTimeWide();
+
+    manifest_t *m = ret == 0 ? manifest_for(address) : NULL;
+    if (m)
+      m->stamp = ++deploy_stamp;
+
+    for (unsigned int i = 0; i < count && ret == 0; i++)
+    {
+      vile_deploy_file_t *f = &deploy_files[i];
+      manifest_entry_t *e = manifest_entry(m, f->name, listed_count, count, 0);
+      const listed_t *l = listed(f->name, listed_count);
+
+      if (e && l && e->hash == deploy_hash[i] && e->size == f->size && l->size == f->size)
+      {
+        skipped++;
+        bytes_skipped += f->size;
+        continue;
+      }
+
+      if (uploaded)
+        nxt_yield();
+
+      vile_upload_stats_t run;
+      memset(&run, 0, sizeof(run));
+      SceInt64 start = ksceKernelGetSystemTimeWide();
+      int up = upload_file(f->name, f->data, f->size, needs_linear(f->name), 0, &run);
+      upload_account(&run, up, (uint32_t)(ksceKernelGetSystemTimeWide() - start));
+
+      if (up < 0)
+      {
+        // whatever is on the brick now, it isn't what the entry says
+        if (e)
+          e->name[0] = 0;
+        ret = -1;
+        break;
+      }
+
+      if (!e)
+        e = manifest_entry(m, f->name, listed_count, count, 1);
+      if (e)
+      {
+        memcpy(e->name, f->name, sizeof(e->name));
+        e->size = f->size;
+        e->hash = deploy_hash[i];
+      }
+      uploaded++;
+      bytes_uploaded += f->size;
+    }
+
+    if (ret == 0 && kprogram[0] && start_program(kprogram) < 0)
+      ret = -1;
+
+    nxt_unlock();
+  }
+
+  uint32_t bricks = 0;
+  for (int i = 0; manifests && i < DEPLOY_BRICKS; i++)
+    bricks += manifests[i].used;
+
+  ksceKernelUnlockMutex(files_mtx, 1);
+
+  SceInt64 end = ksceKernelGetSystemTimeWide();
+
+  ksceKernelLockMutex(stats_mtx, 1, NULL);
+  deploy_stats.deploys++;
+  if (ret < 0)
+    deploy_stats.failures++;
+  deploy_stats.uploaded += uploaded;
+  deploy_stats.skipped += skipped;
+  deploy_stats.bytes_uploaded += bytes_uploaded;
+  deploy_stats.bytes_skipped += bytes_skipped;
+  deploy_stats.bricks = bricks;
+  deploy_stats.last_listed = listed_count;
+  deploy_stats.last_hash_us = (uint32_t)(hashed - begin);
+  deploy_stats.last_list_us = (uint32_t)(list_done - hashed);
+  deploy_stats.last_us = (uint32_t)(end - begin);
+  ksceKernelUnlockMutex(stats_mtx, 1);
+
+  EXIT_SYSCALL(state);
+  return ret < 0 ? -1 : (int)uploaded;
+}
+
+int vileGetDeployStats(vile_deploy_stats_t *out)
+{
+  uint32_t state;
+  ENTER_SYSCALL(state);
+
+  ksceKernelLockMutex(stats_mtx, 1, NULL);
+  vile_deploy_stats_t kstats = deploy_stats;
+  ksceKernelUnlockMutex(stats_mtx, 1);
+
+  ksceKernelMemcpyKernelToUser(out, &kstats, sizeof(kstats));
+
+  EXIT_SYSCALL(state);
+  return 0;
+}
+
+// magic, then DEPLOY_BRICKS manifests as they are in memory
+int vileSaveDeployManifests(const char *path)
+{
+  uint32_t state;
+  ENTER_SYSCALL(state);
+
+  char kpath[256];
+  ksceKernelStrncpyUserToKernel(kpath, path, sizeof(kpath));
+  kpath[sizeof(kpath) - 1] = 0;
+
+  ksceKernelLockMutex(files_mtx, 1, NULL);
+
+  int ret = -1;
+  SceUID fd = manifests ? ksceIoOpen(kpath, SCE_O_WRONLY | SCE_O_CREAT | SCE_O_TRUNC, 0666) : -1;
+  if (fd >= 0)
+  {
+    uint32_t magic = DEPLOY_MAGIC;
+    SceSize size = sizeof(manifest_t) * DEPLOY_BRICKS;
+    if (ksceIoWrite(fd, &magic, sizeof(magic)) == sizeof(magic) && ksceIoWrite(fd, manifests, size) == (int)size)
+      ret = 0;
+    ksceIoClose(fd);
+  }
+
+  ksceKernelUnlockMutex(files_mtx, 1);
+
+  EXIT_SYSCALL(state);
+  return ret;
+}
+
+int vileLoadDeployManifests(const char *path)
+{
+  uint32_t state;
+  ENTER_SYSCALL(state);
+
+  char kpath[256];
+  ksceKernelStrncpyUserToKernel(kpath, path, sizeof(kpath));
+  kpath[sizeof(kpath) - 1] = 0;
+
+  ksceKernelLockMutex(files_mtx, 1, NULL);
+
+  int ret = -1;
+  SceUID fd = manifests_alloc() == 0 ? ksceIoOpen(kpath, SCE_O_RDONLY, 0) : -1;
+  if (fd >= 0)
+  {
+    uint32_t magic = 0;
+    SceSize size = sizeof(manifest_t) * DEPLOY_BRICKS;
+    if (ksceIoRead(fd, &magic, sizeof(magic)) == sizeof(magic) && magic == DEPLOY_MAGIC)
+    {
+      ret = ksceIoRead(fd, manifests, size) == (int)size ? 0 : -1;
+      if (ret < 0)
+        memset(manifests, 0, size);
+    }
+    ksceIoClose(fd);
+  }
+
+  for (int i = 0; ret == 0 && i < DEPLOY_BRICKS; i++)
+    if (manifests[i].stamp > deploy_stamp)
+      deploy_stamp = manifests[i].stamp;
+
+  ksceKernelUnlockMutex(files_mtx, 1);
+
+  EXIT_SYSCALL(state);
+  return ret;
+}
@@ -0,0 +1,468 @@
+/**
+        libvile
+        Copyright (C) 2022 Cat (Ivan Epifanov)
+
+        This program is free software: you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        This program is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <psp2kern/kernel/cpu.h>
+#include <psp2kern/kernel/debug.h>
+#include <psp2kern/kernel/threadmgr.h>
+#include <psp2kern/kernel/sysmem.h>
+#include <psp2kern/kernel/sysmem/data_transfers.h>
+#include <string.h>
+#include "nxt.h"
+
+/*
+ * Firmware flashing through the AT91SAM7's SAM-BA monitor. After SYS_BOOT
+ * the brick comes back as 03eb:6124 and takes text commands ("W addr,val#",
+ * "S addr,len#" and the bytes, "R addr,len#", "G addr#"); in the N#
+ * (non-interactive) mode only reads answer. A page goes through the flash
+ * controller's latch, which wants word writes, so a small routine is
+ * loaded into RAM and run for every page, the way libnxt does it.
+ *
+ * The routine waits for the flash to be ready before returning and the
+ * monitor takes commands one after the other, so pages are sent back to
+ * back; the status register is read once every FLASH_WINDOW pages, to
+ * notice a brick that stopped listening. Verification reads back
+ * VERIFY_CHUNK bytes at a time and writes the pages that differ again.
+ */
+
+#define FLASH_BASE 0x00100000
+#define FLASH_PAGES (VILE_FLASH_SIZE / VILE_FLASH_PAGE)
+#define FLASH_REGIONS 16 // lock regions, 64 pages each
+#define FLASH_WINDOW 32 // pages sent between status reads
+#define FLASH_PASSES 3 // writes a page gets before giving up
+#define VERIFY_CHUNK 4096
+
+#define RAM_WRITER 0x00202000
+#define RAM_PAGE 0x00202100
+#define RAM_PAGE_NUMBER 0x00202300
+
+#define PMC_MCKR 0xFFFFFC30
+#define MC_FCR 0xFFFFFF64
+#define MC_FSR 0xFFFFFF68
+#define MC_FSR_FRDY 0x1
+#define MC_KEY 0x5A000000
+#define MC_UNLOCK 0x4
+
+#define FLASH_ATTACH_TIMEOUT 10000000 // usec for the brick to re-enumerate
+#define FLASH_ATTACH_POLL 50000
+
+// copies the 64 words at RAM_PAGE to page [RAM_PAGE_NUMBER] of flash,
+// starts the write and waits for it; ARM, uses r0-r3 and r12 only
+static const uint32_t page_writer[] = {
+  0xE59F0040, //        ldr   r0, =RAM_PAGE_NUMBER
+  0xE5901000, //        ldr   r1, [r0]
+  0xE2402C02, //        sub   r2, r0, #0x200          @ RAM_PAGE
+  0xE3A03601, //        mov   r3, #0x100000           @ FLASH_BASE
+  0xE0833401, //        add   r3, r3, r1, lsl #8
+  0xE2820C01, //        add   r0, r2, #0x100
+  0xE492C004, // copy:  ldr   r12, [r2], #4
+  0xE483C004, //        str   r12, [r3], #4
+  0xE1520000, //        cmp   r2, r0
+  0x1AFFFFFB, //        bne   copy
+  0xE59F201C, //        ldr   r2, =MC_KEY | 1         @ write page
+  0xE1822401, //        orr   r2, r2, r1, lsl #8
+  0xE3E000FF, //        mvn   r0, #0xFF               @ MC base
+  0xE5802064, //        str   r2, [r0, #0x64]         @ MC_FCR
+  0xE5902068, // wait:  ldr   r2, [r0, #0x68]         @ MC_FSR
+  0xE3120001, //        tst   r2, #1
+  0x0AFFFFFC, //        beq   wait
+  0xE12FFF1E, //        bx    lr
+  RAM_PAGE_NUMBER,
+  MC_KEY | 1
+};
+
+static SceUID fl_mtx;
+static SceUID fl_thid = -1;
+static SceUID image_uid = -1;
+
+static volatile uint8_t running = 0;
+static volatile uint8_t aborting = 0;
+
+static uint8_t *image = NULL; // VILE_FLASH_SIZE, pages past the image are padded
+static uint32_t image_size = 0;
+
+static vile_flash_stats_t stats;
+static SceInt64 begin;
+
+// flash thread only
+static uint8_t readback[VERIFY_CHUNK];
+static uint8_t bad[FLASH_PAGES];
+
+static void set_state(vile_flash_state_t state)
+{
+  ksceKernelLockMutex(fl_mtx, 1, NULL);
+  stats.state = state;
+  ksceKernelUnlockMutex(fl_mtx, 1);
+}
+
+static void count(uint32_t *counter, uint32_t n)
+{
+  ksceKernelLockMutex(fl_mtx, 1, NULL);
+  *counter += n;
+  ksceKernelUnlockMutex(fl_mtx, 1);
+}
+
+// "<c><addr>[,<arg>]#"
+static int command(char c, uint32_t addr, int with_arg, uint32_t arg)
+{
+  static const char hex[] = "0123456789ABCDEF";
+  char buf[20];
+  int n = 0;
+
+  buf[n++] = c;
+  for (int i = 28; i >= 0; i -= 4)
+    buf[n++] = hex[(addr >> i) & 0xF];
+  if (with_arg)
+  {
+    buf[n++] = ',';
+    for (int i = 28; i >= 0; i -= 4)
+      buf[n++] = hex[(arg >> i) & 0xF];
+  }
+  buf[n++] = '#';
+
+  return nxt_boot_send((unsigned char *)buf, n) == n ? 0 : -1;
+}
+
+static int write_word(uint32_t addr, uint32_t value)
+{
+  return command('W', addr, 1, value);
+}
+
+static int read_word(uint32_t addr, uint32_t *value)
+{
+  uint8_t buf[4];
+  count(&stats.round_trips, 1);
+  if (command('w', addr, 1, 4) < 0 || nxt_boot_recv(buf, 4) != 4)
+    return -1;
+  *value = buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((uint32_t)buf[3] << 24);
+  return 0;
+}
+
+static int send_bytes(uint32_t addr, const uint8_t *data, uint32_t size)
+{
+  if (command('S', addr, 1, size) < 0)
+    return -1;
+  return nxt_boot_send(data, size) == (int)size ? 0 : -1;
+}
+
+static int recv_bytes(uint32_t addr, uint8_t *data, uint32_t size)
+{
+  count(&stats.round_trips, 1);
+  if (command('R', addr, 1, size) < 0)
+    return -1;
+
+  uint32_t done = 0;
+  while (done < size)
+  {
+    int ret = nxt_boot_recv(data + done, size - done);
+    if (ret <= 0)
+      return -1;
+    done += ret;
+  }
+  return 0;
+}
+
+static int wait_ready()
+{
+  uint32_t fsr = 0;
+  for (int i = 0; i < 1000; i++)
+  {
+    if (read_word(MC_FSR, &fsr) < 0)
+      return -1;
+    if (fsr & MC_FSR_FRDY)
+      return 0;
+  }
+  return -1;
+}
+
+static int wait_attach(int (*attached)())
+{
+  SceInt64 deadline = ksceKernelGetSystemTimeWide() + FLASH_ATTACH_TIMEOUT;
+  while (!attached())
+  {
+    if (aborting || ksceKernelGetSystemTimeWide() >= deadline)
+      return -1;
+    ksceKernelDelayThread(FLASH_ATTACH_POLL);
+  }
+  return 0;
+}
+
+static int reboot_to_samba()
+{
+  if (nxt_bootloader())
+    return 0;
+  if (!nxt_connected())
+    return -1;
+
+  cmd_file_t cmd = {NXT_SYSTEM_COMMAND_DOREPLY, NXT_OPCODE_SYS_BOOT, NXT_BOOT_MAGIC};
+  ret_status_t st;
+  // the brick may be gone before it answers
+  nxt_transfer_priority((unsigned char*) &cmd, 2 + sizeof(NXT_BOOT_MAGIC), (unsigned char*) &st, VILE_PRIORITY_BULK);
+
+  return wait_attach(nxt_bootloader);
+}
+
+// bus held
+static int prepare()
+{
+  uint8_t reply[2];
+  count(&stats.round_trips, 1);
+  if (nxt_boot_send((const unsigned char *)"N#", 2) != 2 || nxt_boot_recv(reply, sizeof(reply)) <= 0)
+    return -1;
+
+  // PLL / 2, what the flash timings assume
+  if (write_word(PMC_MCKR, 0x7) < 0)
+    return -1;
+
+  for (int i = 0; i < FLASH_REGIONS; i++)
+  {
+    if (wait_ready() < 0 || write_word(MC_FCR, MC_KEY | MC_UNLOCK | ((i * 64) << 8)) < 0)
+      return -1;
+  }
+
+  return send_bytes(RAM_WRITER, (const uint8_t *)page_writer, sizeof(page_writer));
+}
+
+// bus held; writes pages marked in bad, or all of them
+static int write_pages(uint32_t pages, int all)
+{
+  unsigned int sent = 0;
+
+  for (uint32_t p = 0; p < pages; p++)
+  {
+    if (aborting)
+      return -1;
+    if (!all && !bad[p])
+      continue;
+
+    if (write_word(RAM_PAGE_NUMBER, p) < 0 ||
+        send_bytes(RAM_PAGE, image + p * VILE_FLASH_PAGE, VILE_FLASH_PAGE) < 0 ||
+        command('G', RAM_WRITER, 0, 0) < 0)
+      return -1;
+    count(&stats.written, 1);
+
+    if (++sent % FLASH_WINDOW == 0 && wait_ready() < 0)
+      return -1;
+  }
+
+  return wait_ready();
+}
+
+// bus held; n pages from first against the image, marks the ones that differ
+static int compare(uint32_t first, uint32_t n)
+{
+  int wrong = 0;
+
+  if (recv_bytes(FLASH_BASE + first * VILE_FLASH_PAGE, readback, n * VILE_FLASH_PAGE) < 0)
+    return -1;
+
+  for (uint32_t i = 0; i < n; i++)
+  {
+    uint32_t p = first + i;
+    bad[p] = memcmp(readback + i * VILE_FLASH_PAGE, image + p * VILE_FLASH_PAGE, VILE_FLASH_PAGE) != 0;
+    wrong += bad[p];
+  }
+  count(&stats.verified, n);
+  return wrong;
+}
+
+// bus held; reads back every page, or only those marked in bad;
+// returns how many differ
+static int verify_pages(uint32_t pages, int all)
+{
+  uint32_t step = all ? VERIFY_CHUNK / VILE_FLASH_PAGE : 1;
+  int wrong = 0;
+
+  for (uint32_t p = 0; p < pages; p += step)
+  {
+    if (aborting)
+      return -1;
+    if (!all && !bad[p])
+      continue;
+
+    int ret = compare(p, pages - p < step ? pages - p : step);
+    if (ret < 0)
+      return -1;
+    wrong += ret;
+  }
+
+  return wrong;
+}
+
+static int flash_thread(SceSize args, void *argp)
+{
+  uint32_t pages = (image_size + VILE_FLASH_PAGE - 1) / VILE_FLASH_PAGE;
+  int ok = 0;
+
+  ksceDebugPrintf("flashing %d pages\n", pages);
+
+  set_state(VILE_FLASH_REBOOTING);
+  if (reboot_to_samba() < 0)
+    goto out;
+
+  nxt_lock_priority(VILE_PRIORITY_BULK);
+
+  set_state(VILE_FLASH_PREPARING);
+  if (prepare() < 0)
+    goto unlock;
+
+  set_state(VILE_FLASH_WRITING);
+  SceInt64 t0 = ksceKernelGetSystemTimeWide();
+  if (write_pages(pages, 1) < 0)
+    goto unlock;
+  SceInt64 t1 = ksceKernelGetSystemTimeWide();
+
+  ksceKernelLockMutex(fl_mtx, 1, NULL);
+  stats.write_us = (uint32_t)(t1 - t0);
+  stats.write_rate = stats.write_us ? (uint32_t)((uint64_t)pages * VILE_FLASH_PAGE * 1000000 / stats.write_us) : 0;
+  stats.state = VILE_FLASH_VERIFYING;
+  ksceKernelUnlockMutex(fl_mtx, 1);
+
+  int wrong = verify_pages(pages, 1);
+  for (int pass = 1; wrong > 0 && pass < FLASH_PASSES; pass++)
+  {
+    count(&stats.rewritten, wrong);
+    if (write_pages(pages, 0) < 0)
+      goto unlock;
+    wrong = verify_pages(pages, 0);
+  }
+
+  ksceKernelLockMutex(fl_mtx, 1, NULL);
+  stats.verify_us = (uint32_t)(ksceKernelGetSystemTimeWide() - t1);
+  ksceKernelUnlockMutex(fl_mtx, 1);
+
+  if (wrong != 0)
+    goto unlock;
+
+  set_state(VILE_FLASH_BOOTING);
+  command('G', FLASH_BASE, 0, 0);
+  nxt_unlock();
+
+  ok = wait_attach(nxt_connected) == 0;
+  goto out;
+
+unlock:
+  nxt_unlock();
+out:
+  ksceKernelLockMutex(fl_mtx, 1, NULL);
+  stats.state = ok ? VILE_FLASH_DONE : VILE_FLASH_FAILED;
+  stats.total_us = (uint32_t)(ksceKernelGetSystemTimeWide() - begin);
+  if (ok)
+    stats.flashed++;
+  ksceKernelUnlockMutex(fl_mtx, 1);
+
+  ksceDebugPrintf("flashing %s\n", ok ? "done" : "failed");
+  running = 0;
+  return 0;
+}
+
+static void flash_join()
+{
+  if (fl_thid < 0)
+    return;
+  ksceKernelWaitThreadEnd(fl_thid, NULL, NULL);
+  ksceKernelDeleteThread(fl_thid);
+  fl_thid = -1;
+}
+
+void flash_shutdown()
+{
+  aborting = 1;
+  flash_join();
+  aborting = 0;
+}
+
+int flash_init()
+{
+  fl_mtx = ksceKernelCreateMutex("vile_flash", 0, 0, NULL);
+  return (fl_mtx < 0) ? -1 : 0;
+}
+
+/*
+ *  PUBLIC COMMANDS
+ */
+
+int vileFlashFirmware(const void *uimage, const uint32_t size)
+{
+  uint32_t state;
+  ENTER_SYSCALL(state);
+
+  if (running || (uimage && (!size || size > VILE_FLASH_SIZE)) || (!uimage && !image_size))
+  {
+    EXIT_SYSCALL(state);
+    return -1;
+  }
+
+  flash_join();
+
+  if (uimage)
+  {
+    if (image_uid < 0)
+    {
+      image_uid = ksceKernelAllocMemBlock("vile_flash", SCE_KERNEL_MEMBLOCK_TYPE_KERNEL_RW, VILE_FLASH_SIZE, NULL);
+      if (image_uid < 0)
+      {
+        EXIT_SYSCALL(state);
+        return -1;
+      }
+      ksceKernelGetMemBlockBase(image_uid, (void **)&image);
+    }
+    memset(image, 0xFF, VILE_FLASH_SIZE);
+    ksceKernelMemcpyUserToKernel(image, uimage, size);
+    image_size = size;
+
+    ksceKernelLockMutex(fl_mtx, 1, NULL);
+    stats.flashed = 0;
+    ksceKernelUnlockMutex(fl_mtx, 1);
+  }
+
+  ksceKernelLockMutex(fl_mtx, 1, NULL);
+  uint32_t flashed = stats.flashed;
+  memset(&stats, 0, sizeof(stats));
+  stats.flashed = flashed;
+  stats.pages = (image_size + VILE_FLASH_PAGE - 1) / VILE_FLASH_PAGE;
+  begin = ksceKernelGetSystemTimeWide();
+  ksceKernelUnlockMutex(fl_mtx, 1);
+
+  fl_thid = ksceKernelCreateThread("vile_flash", flash_thread, 0x3C, 0x1000, 0, 0x10000, NULL);
+  if (fl_thid < 0)
+  {
+    EXIT_SYSCALL(state);
+    return -1;
+  }
+
+  running = 1;
+  ksceKernelStartThread(fl_thid, 0, NULL);
+
+  EXIT_SYSCALL(state);
+  return 0;
+}
+
+int vileGetFlashStats(vile_flash_stats_t *out)
+{
+  uint32_t state;
+  ENTER_SYSCALL(state);
+
+  ksceKernelLockMutex(fl_mtx, 1, NULL);
+  vile_flash_stats_t kstats = stats;
+  ksceKernelUnlockMutex(fl_mtx, 1);
+
+  ksceKernelMemcpyKernelToUser(out, &kstats, sizeof(kstats));
+
+  EXIT_SYSCALL(state);
+  return 0;
+}
@@ -0,0 +1,657 @@
+/**
+        libvile
+        Copyright (C) 2022 Cat (Ivan Epifanov)
+
+        This program is free software: you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        This program is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Kernel services used by the module, implemented on pthreads and POSIX
+ * so the driver sources build and run unchanged on a Linux host.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include <psp2kern/kernel/modulemgr.h>
+#include <psp2kern/kernel/debug.h>
+#include <psp2kern/kernel/suspend.h>
+#include <psp2kern/kernel/threadmgr.h>
+#include <psp2kern/kernel/sysmem.h>
+#include <psp2kern/kernel/iofilemgr.h>
+#include <psp2kern/kernel/processmgr.h>
+#include <psp2kern/usbserv.h>
+
+#define COMPAT_OBJECTS 1024
+#define COMPAT_UID_BASE 0x10000
+
+#define COMPAT_ERROR_ILLEGAL_UID ((int)0x80020001)
+
+enum {
+  OBJ_NONE = 0,
+  OBJ_THREAD,
+  OBJ_MUTEX,
+  OBJ_COND,
+  OBJ_SEMA,
+  OBJ_EVENTFLAG,
+  OBJ_MEMBLOCK
+};
+
+typedef struct {
+  int type;
+  pthread_mutex_t mtx;
+  pthread_cond_t cond;
+  union {
+    struct {
+      pthread_t thread;
+      SceKernelThreadEntry entry;
+      void *args;
+      SceSize arglen;
+      int started;
+      int status;
+    } th;
+    struct {
+      SceUID mutex;
+    } cv;
+    struct {
+      int count;
+      int max;
+    } sema;
+    struct {
+      unsigned int bits;
+    } ev;
+    struct {
+      void *base;
+    } mem;
+  };
+} compat_obj_t;
+
+static pthread_mutex_t objects_mtx = PTHREAD_MUTEX_INITIALIZER;
+static compat_obj_t *objects[COMPAT_OBJECTS];
+
+extern int module_start(SceSize args, void *argp);
+
+static void __attribute__ ((constructor)) compat_module_start()
+{
+  module_start(0, NULL);
+}
+
+static SceUID obj_create(int type, compat_obj_t **out)
+{
+  compat_obj_t *o = calloc(1, sizeof(compat_obj_t));
+  if (!o)
+    return -1;
+
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&o->cond, &attr);
+  pthread_condattr_destroy(&attr);
+  pthread_mutex_init(&o->mtx, NULL);
+  o->type = type;
+
+  pthread_mutex_lock(&objects_mtx);
+  for (int i = 0; i < COMPAT_OBJECTS; i++)
+  {
+    if (!objects[i])
+    {
+      objects[i] = o;
+      pthread_mutex_unlock(&objects_mtx);
+      *out = o;
+      return COMPAT_UID_BASE + i;
+    }
+  }
+  pthread_mutex_unlock(&objects_mtx);
+
+  free(o);
+  return -1;
+}
+
+static compat_obj_t *obj_get(SceUID uid, int type)
+{
+  int i = uid - COMPAT_UID_BASE;
+  if (i < 0 || i >= COMPAT_OBJECTS)
+    return NULL;
+  compat_obj_t *o = objects[i];
+  return (o && o->type == type) ? o : NULL;
+}
+
+static int obj_delete(SceUID uid, int type)
+{
+  compat_obj_t *o = obj_get(uid, type);
+  if (!o)
+    return COMPAT_ERROR_ILLEGAL_UID;
+
+  pthread_mutex_lock(&objects_mtx);
+  objects[uid - COMPAT_UID_BASE] = NULL;
+  pthread_mutex_unlock(&objects_mtx);
+
+  pthread_cond_destroy(&o->cond);
+  pthread_mutex_destroy(&o->mtx);
+  free(o);
+  return 0;
+}
+
+// absolute CLOCK_MONOTONIC deadline for a usec timeout
+static void deadline(struct timespec *ts, SceUInt usec)
+{
+  clock_gettime(CLOCK_MONOTONIC, ts);
+  ts->tv_sec += usec / 1000000;
+  ts->tv_nsec += (usec % 1000000) * 1000;
+  if (ts->tv_nsec >= 1000000000)
+  {
+    ts->tv_sec++;
+    ts->tv_nsec -= 1000000000;
+  }
+}
+
+/*
+ *  DEBUG / MISC
+ */
+
+int ksceDebugPrintf(const char *fmt, ...)
+{
+  static int enabled = -1;
+  if (enabled < 0)
+    enabled = getenv("VILE_DEBUG") ? 1 : 0;
+  if (!enabled)
+    return 0;
+
+  va_list ap;
+  va_start(ap, fmt);
+  int ret = vfprintf(stderr, fmt, ap);
+  va_end(ap);
+  return ret;
+}
+
+SceUID ksceKernelRegisterSysEventHandler(const char *name, SceSysEventHandler handler, void *args)
+{
+  // no suspend/resume on the host
+  return 1;
+}
+
+int ksceUsbServMacSelect(unsigned int port, unsigned int mode)
+{
+  return 0;
+}
+
+SceUID ksceKernelGetProcessId(void)
+{
+  return getpid();
+}
+
+// alive or not is all libvile asks
+int ksceKernelGetProcessInfo(SceUID pid, SceKernelProcessInfo *info)
+{
+  if (kill(pid, 0) < 0 && errno == ESRCH)
+    return -1;
+  info->pid = pid;
+  return 0;
+}
+
+/*
+ *  THREADS
+ */
+
+static void *thread_main(void *arg)
+{
+  compat_obj_t *o = arg;
+  o->th.status = o->th.entry(o->th.arglen, o->th.args);
+  return NULL;
+}
+
+SceUID ksceKernelCreateThread(const char *name, SceKernelThreadEntry entry, int initPriority, SceSize stackSize, SceUInt attr, int cpuAffinityMask, const void *option)
+{
+  compat_obj_t *o;
+  SceUID uid = obj_create(OBJ_THREAD, &o);
+  if (uid < 0)
+    return uid;
+  o->th.entry = entry;
+  return uid;
+}
+
+int ksceKernelStartThread(SceUID thid, SceSize arglen, void *argp)
+{
+  compat_obj_t *o = obj_get(thid, OBJ_THREAD);
+  if (!o)
+    return COMPAT_ERROR_ILLEGAL_UID;
+
+  // like the real thing, arguments are copied to the new thread
+  if (arglen && argp)
+  {
+    o->th.args = malloc(arglen);
+    memcpy(o->th.args, argp, arglen);
+    o->th.arglen = arglen;
+  }
+
+  if (pthread_create(&o->th.thread, NULL, thread_main, o) != 0)
+    return -1;
+  o->th.started = 1;
+  return 0;
+}
+
+int ksceKernelWaitThreadEnd(SceUID thid, int *stat, SceUInt *timeout)
+{
+  compat_obj_t *o = obj_get(thid, OBJ_THREAD);
+  if (!o)
+    return COMPAT_ERROR_ILLEGAL_UID;
+
+  if (o->th.started)
+  {
+    pthread_join(o->th.thread, NULL);
+    o->th.started = 0;
+  }
+  if (stat)
+    *stat = o->th.status;
+  return 0;
+}
+
+int ksceKernelDeleteThread(SceUID thid)
+{
+  compat_obj_t *o = obj_get(thid, OBJ_THREAD);
+  if (!o)
+    return COMPAT_ERROR_ILLEGAL_UID;
+
+  if (o->th.started)
+    pthread_detach(o->th.thread);
+  free(o->th.args);
+  return obj_delete(thid, OBJ_THREAD);
+}
+
+int ksceKernelDelayThread(SceUInt delay)
+{
+  struct timespec ts = { delay / 1000000, (delay % 1000000) * 1000 };
+  while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+    ;
+  return 0;
+}
+
+SceUID ksceKernelGetThreadId(void)
+{
+  return (SceUID)syscall(SYS_gettid);
+}
+
+SceInt64 ksceKernelGetSystemTimeWide(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (SceInt64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ *  MUTEX / COND / SEMA
+ */
+
+SceUID ksceKernelCreateMutex(const char *name, SceUInt attr, int initCount, void *option)
+{
+  compat_obj_t *o;
+  SceUID uid = obj_create(OBJ_MUTEX, &o);
+  if (uid >= 0 && initCount > 0)
+    pthread_mutex_lock(&o->mtx);
+  return uid;
+}
+
+int ksceKernelDeleteMutex(SceUID mutexid)
+{
+  return obj_delete(mutexid, OBJ_MUTEX);
+}
+
+int ksceKernelLockMutex(SceUID mutexid, int lockCount, unsigned int *timeout)
+{
+  compat_obj_t *o = obj_get(mutexid, OBJ_MUTEX);
+  if (!o)
+    return COMPAT_ERROR_ILLEGAL_UID;
+
+  if (!timeout)
+    return pthread_mutex_lock(&o->mtx) ? -1 : 0;
+
+  struct timespec ts;
+  struct timespec now;
+  deadline(&ts, *timeout);
+  // pthread_mutex_timedlock only knows CLOCK_REALTIME
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  while (pthread_mutex_trylock(&o->mtx) != 0)
+  {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (now.tv_sec > ts.tv_sec || (now.tv_sec == ts.tv_sec && now.tv_nsec >= ts.tv_nsec))
+      return SCE_KERNEL_ERROR_WAIT_TIMEOUT;
+    ksceKernelDelayThread(100);
+  }
+  return 0;
+}
+
+int ksceKernelUnlockMutex(SceUID mutexid, int unlockCount)
+{
+  compat_obj_t *o = obj_get(mutexid, OBJ_MUTEX);
+  if (!o)
+    return COMPAT_ERROR_ILLEGAL_UID;
+  return pthread_mutex_unlock(&o->mtx) ? -1 : 0;
+}
+
+SceUID ksceKernelCreateCond(const char *name, SceUInt attr, SceUID mutexId, const void *option)
+{
+  compat_obj_t *o;
+  SceUID uid = obj_create(OBJ_COND, &o);
+  if (uid >= 0)
+    o->cv.mutex = mutexId;
+  return uid;
+}
+
+int ksceKernelDeleteCond(SceUID cid)
+{
+  return obj_delete(cid, OBJ_COND);
+}
+
+int ksceKernelWaitCond(SceUID condId, unsigned int *timeout)
+{
+  compat_obj_t *o = obj_get(condId, OBJ_COND);
+  compat_obj_t *m = o ? obj_get(o->cv.mutex, OBJ_MUTEX) : NULL;
+  if (!o || !m)
+    return COMPAT_ERROR_ILLEGAL_UID;
+
+  if (!timeout)
+    return pthread_cond_wait(&o->cond, &m->mtx) ? -1 : 0;
+
+  struct timespec ts;
+  deadline(&ts, *timeout);
+  int ret = pthread_cond_timedwait(&o->cond, &m->mtx, &ts);
+  return (ret == ETIMEDOUT) ? SCE_KERNEL_ERROR_WAIT_TIMEOUT : (ret ? -1 : 0);
+}
+
+int ksceKernelSignalCond(SceUID condId)
+{
+  compat_obj_t *o = obj_get(condId, OBJ_COND);
+  if (!o)
+    return COMPAT_ERROR_ILLEGAL_UID;
+  return pthread_cond_signal(&o->cond) ? -1 : 0;
+}
+
+int ksceKernelSignalCondAll(SceUID condId)
+{
+  compat_obj_t *o = obj_get(condId, OBJ_COND);
+  if (!o)
+    return COMPAT_ERROR_ILLEGAL_UID;
+  return pthread_cond_broadcast(&o->cond) ? -1 : 0;
+}
+
+SceUID ksceKernelCreateSema(const char *name, SceUInt attr, int initVal, int maxVal, void *option)
+{
+  compat_obj_t *o;
+  SceUID uid = obj_create(OBJ_SEMA, &o);
+  if (uid >= 0)
+  {
+    o->sema.count = initVal;
+    o->sema.max = maxVal;
+  }
+  return uid;
+}
+
+int ksceKernelDeleteSema(SceUID semaid)
+{
+  return obj_delete(semaid, OBJ_SEMA);
+}
+
+int ksceKernelWaitSema(SceUID semaid, int signal, SceUInt *timeout)
+{
+  compat_obj_t *o = obj_get(semaid, OBJ_SEMA);
+  if (!o)
+    return COMPAT_ERROR_ILLEGAL_UID;
+
+  struct timespec ts;
+  if (timeout)
+    deadline(&ts, *timeout);
+
+  int ret = 0;
+  pthread_mutex_lock(&o->mtx);
+  while (o->sema.count < signal && ret == 0)
+    ret = timeout ? pthread_cond_timedwait(&o->cond, &o->mtx, &ts) : pthread_cond_wait(&o->cond, &o->mtx);
+  if (o->sema.count >= signal)
+  {
+    o->sema.count -= signal;
+    ret = 0;
+  }
+  pthread_mutex_unlock(&o->mtx);
+
+  return (ret == ETIMEDOUT) ? SCE_KERNEL_ERROR_WAIT_TIMEOUT : (ret ? -1 : 0);
+}
+
+int ksceKernelSignalSema(SceUID semaid, int signal)
+{
+  compat_obj_t *o = obj_get(semaid, OBJ_SEMA);
+  if (!o)
+    return COMPAT_ERROR_ILLEGAL_UID;
+
+  pthread_mutex_lock(&o->mtx);
+  o->sema.count += signal;
+  if (o->sema.max > 0 && o->sema.count > o->sema.max)
+    o->sema.count = o->sema.max;
+  pthread_cond_broadcast(&o->cond);
+  pthread_mutex_unlock(&o->mtx);
+  return 0;
+}
+
+/*
+ *  EVENT FLAGS
+ */
+
+SceUID ksceKernelCreateEventFlag(const char *name, int attr, int bits, void *opt)
+{
+  compat_obj_t *o;
+  SceUID uid = obj_create(OBJ_EVENTFLAG, &o);
+  if (uid >= 0)
+    o->ev.bits = bits;
+  return uid;
+}
+
+int ksceKernelDeleteEventFlag(SceUID evfid)
+{
+  return obj_delete(evfid, OBJ_EVENTFLAG);
+}
+
+int ksceKernelSetEventFlag(SceUID evfid, unsigned int bits)
+{
+  compat_obj_t *o = obj_get(evfid, OBJ_EVENTFLAG);
+  if (!o)
+    return COMPAT_ERROR_ILLEGAL_UID;
+
+  pthread_mutex_lock(&o->mtx);
+  o->ev.bits |= bits;
+  pthread_cond_broadcast(&o->cond);
+  pthread_mutex_unlock(&o->mtx);
+  return 0;
+}
+
+int ksceKernelClearEventFlag(SceUID evfid, unsigned int bits)
+{
+  compat_obj_t *o = obj_get(evfid, OBJ_EVENTFLAG);
+  if (!o)
+    return COMPAT_ERROR_ILLEGAL_UID;
+
+  // bits set in the argument are kept, as on the real kernel
+  pthread_mutex_lock(&o->mtx);
+  o->ev.bits &= bits;
+  pthread_mutex_unlock(&o->mtx);
+  return 0;
+}
+
+static int ev_match(unsigned int flags, unsigned int bits, unsigned int wait)
+{
+  if (wait & SCE_EVENT_WAITOR)
+    return (flags & bits) != 0;
+  return (flags & bits) == bits;
+}
+
+static void ev_consume(compat_obj_t *o, unsigned int bits, unsigned int wait, unsigned int *outBits)
+{
+  if (outBits)
+    *outBits = o->ev.bits;
+  if (wait & SCE_EVENT_WAITCLEAR)
+    o->ev.bits = 0;
+  else if (wait & SCE_EVENT_WAITCLEAR_PAT)
+    o->ev.bits &= ~bits;
+}
+
+int ksceKernelWaitEventFlag(SceUID evfid, unsigned int bits, unsigned int wait, unsigned int *outBits, SceUInt *timeout)
+{
+  compat_obj_t *o = obj_get(evfid, OBJ_EVENTFLAG);
+  if (!o)
+    return COMPAT_ERROR_ILLEGAL_UID;
+
+  struct timespec ts;
+  if (timeout)
+    deadline(&ts, *timeout);
+
+  int ret = 0;
+  pthread_mutex_lock(&o->mtx);
+  while (!ev_match(o->ev.bits, bits, wait) && ret == 0)
+    ret = timeout ? pthread_cond_timedwait(&o->cond, &o->mtx, &ts) : pthread_cond_wait(&o->cond, &o->mtx);
+  if (ev_match(o->ev.bits, bits, wait))
+  {
+    ev_consume(o, bits, wait, outBits);
+    ret = 0;
+  }
+  pthread_mutex_unlock(&o->mtx);
+
+  return (ret == ETIMEDOUT) ? SCE_KERNEL_ERROR_WAIT_TIMEOUT : (ret ? -1 : 0);
+}
+
+int ksceKernelPollEventFlag(SceUID evfid, unsigned int bits, unsigned int wait, unsigned int *outBits)
+{
+  compat_obj_t *o = obj_get(evfid, OBJ_EVENTFLAG);
+  if (!o)
+    return COMPAT_ERROR_ILLEGAL_UID;
+
+  int ret = -1;
+  pthread_mutex_lock(&o->mtx);
+  if (ev_match(o->ev.bits, bits, wait))
+  {
+    ev_consume(o, bits, wait, outBits);
+    ret = 0;
+  }
+  pthread_mutex_unlock(&o->mtx);
+  return ret;
+}
+
+/*
+ *  MEMORY
+ */
+
+int ksceKernelMemcpyUserToKernel(void *dst, const void *src, SceSize len)
+{
+  memcpy(dst, src, len);
+  return 0;
+}
+
+int ksceKernelMemcpyKernelToUser(void *dst, const void *src, SceSize len)
+{
+  memcpy(dst, src, len);
+  return 0;
+}
+
+int ksceKernelStrncpyUserToKernel(void *dst, const void *src, SceSize len)
+{
+  strncpy(dst, src, len);
+  return strnlen(dst, len);
+}
+
+SceUID ksceKernelAllocMemBlock(const char *name, int type, SceSize size, void *opt)
+{
+  compat_obj_t *o;
+  SceUID uid = obj_create(OBJ_MEMBLOCK, &o);
+  if (uid < 0)
+    return uid;
+
+  if (posix_memalign(&o->mem.base, 0x1000, size) != 0)
+  {
+    obj_delete(uid, OBJ_MEMBLOCK);
+    return -1;
+  }
+  return uid;
+}
+
+int ksceKernelGetMemBlockBase(SceUID uid, void **base)
+{
+  compat_obj_t *o = obj_get(uid, OBJ_MEMBLOCK);
+  if (!o)
+    return COMPAT_ERROR_ILLEGAL_UID;
+  *base = o->mem.base;
+  return 0;
+}
+
+int ksceKernelFreeMemBlock(SceUID uid)
+{
+  compat_obj_t *o = obj_get(uid, OBJ_MEMBLOCK);
+  if (!o)
+    return COMPAT_ERROR_ILLEGAL_UID;
+  free(o->mem.base);
+  return obj_delete(uid, OBJ_MEMBLOCK);
+}
+
+/*
+ *  FILES
+ */
+
+SceUID ksceIoOpen(const char *file, int flags, SceMode mode)
+{
+  int oflags = 0;
+
+  if ((flags & SCE_O_RDWR) == SCE_O_RDWR)
+    oflags = O_RDWR;
+  else if (flags & SCE_O_WRONLY)
+    oflags = O_WRONLY;
+  else
+    oflags = O_RDONLY;
+
+  if (flags & SCE_O_APPEND)
+    oflags |= O_APPEND;
+  if (flags & SCE_O_CREAT)
+    oflags |= O_CREAT;
+  if (flags & SCE_O_TRUNC)
+    oflags |= O_TRUNC;
+
+  int fd = open(file, oflags, mode);
+  return fd < 0 ? -errno : fd;
+}
+
+int ksceIoClose(SceUID fd)
+{
+  return close(fd) < 0 ? -errno : 0;
+}
+
+int ksceIoRead(SceUID fd, void *data, SceSize size)
+{
+  ssize_t ret = read(fd, data, size);
+  return ret < 0 ? -errno : (int)ret;
+}
+
+int ksceIoWrite(SceUID fd, const void *data, SceSize size)
+{
+  ssize_t ret = write(fd, data, size);
+  return ret < 0 ? -errno : (int)ret;
+}
+
+SceOff ksceIoLseek(SceUID fd, SceOff offset, int whence)
+{
+  off_t ret = lseek(fd, offset, whence);
+  return ret < 0 ? -errno : ret;
+}
@@ -0,0 +1,38 @@
+/**
+        libvile
+        Copyright (C) 2022 Cat (Ivan Epifanov)
+
+        This program is free software: you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        This program is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+// host stand-in for the vitasdk header of the same name, only what libvile uses
+
+#ifndef __HOST_PSP2_TYPES_H__
+#define __HOST_PSP2_TYPES_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef int SceUID;
+typedef unsigned int SceSize;
+typedef int SceInt;
+typedef unsigned int SceUInt;
+typedef int32_t SceInt32;
+typedef uint32_t SceUInt32;
+typedef int64_t SceInt64;
+typedef uint64_t SceUInt64;
+typedef int SceMode;
+typedef int64_t SceOff;
+
+#endif // __HOST_PSP2_TYPES_H__
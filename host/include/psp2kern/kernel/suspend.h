@@ -0,0 +1,30 @@
+/**
+        libvile
+        Copyright (C) 2022 Cat (Ivan Epifanov)
+
+        This program is free software: you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        This program is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+// host stand-in for the vitasdk header of the same name, only what libvile uses
+
+#ifndef __HOST_PSP2KERN_SUSPEND_H__
+#define __HOST_PSP2KERN_SUSPEND_H__
+
+#include <psp2/types.h>
+
+typedef int (*SceSysEventHandler)(int resume, int eventid, void *args, void *opt);
+
+SceUID ksceKernelRegisterSysEventHandler(const char *name, SceSysEventHandler handler, void *args);
+
+#endif // __HOST_PSP2KERN_SUSPEND_H__
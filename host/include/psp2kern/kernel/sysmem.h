@@ -0,0 +1,33 @@
+/**
+        libvile
+        Copyright (C) 2022 Cat (Ivan Epifanov)
+
+        This program is free software: you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        This program is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+// host stand-in for the vitasdk header of the same name, only what libvile uses
+
+#ifndef __HOST_PSP2KERN_SYSMEM_H__
+#define __HOST_PSP2KERN_SYSMEM_H__
+
+#include <psp2/types.h>
+#include <psp2kern/kernel/sysmem/data_transfers.h>
+
+#define SCE_KERNEL_MEMBLOCK_TYPE_KERNEL_RW 0x1020D006
+
+SceUID ksceKernelAllocMemBlock(const char *name, int type, SceSize size, void *opt);
+int ksceKernelGetMemBlockBase(SceUID uid, void **base);
+int ksceKernelFreeMemBlock(SceUID uid);
+
+#endif // __HOST_PSP2KERN_SYSMEM_H__
@@ -0,0 +1,55 @@
+/**
+        libvile
+        Copyright (C) 2022 Cat (Ivan Epifanov)
+
+        This program is free software: you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        This program is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+// host stand-in for the vitasdk header of the same name, only what libvile uses
+
+#ifndef __HOST_PSP2KERN_THREADMGR_H__
+#define __HOST_PSP2KERN_THREADMGR_H__
+
+#include <psp2/types.h>
+#include <psp2kern/kernel/threadmgr/event_flags.h>
+
+#define SCE_KERNEL_ERROR_WAIT_TIMEOUT 0x80028005
+
+typedef int (*SceKernelThreadEntry)(SceSize args, void *argp);
+
+SceUID ksceKernelCreateThread(const char *name, SceKernelThreadEntry entry, int initPriority, SceSize stackSize, SceUInt attr, int cpuAffinityMask, const void *option);
+int ksceKernelStartThread(SceUID thid, SceSize arglen, void *argp);
+int ksceKernelWaitThreadEnd(SceUID thid, int *stat, SceUInt *timeout);
+int ksceKernelDeleteThread(SceUID thid);
+int ksceKernelDelayThread(SceUInt delay);
+SceUID ksceKernelGetThreadId(void);
+SceInt64 ksceKernelGetSystemTimeWide(void);
+
+SceUID ksceKernelCreateMutex(const char *name, SceUInt attr, int initCount, void *option);
+int ksceKernelDeleteMutex(SceUID mutexid);
+int ksceKernelLockMutex(SceUID mutexid, int lockCount, unsigned int *timeout);
+int ksceKernelUnlockMutex(SceUID mutexid, int unlockCount);
+
+SceUID ksceKernelCreateCond(const char *name, SceUInt attr, SceUID mutexId, const void *option);
+int ksceKernelDeleteCond(SceUID cid);
+int ksceKernelWaitCond(SceUID condId, unsigned int *timeout);
+int ksceKernelSignalCond(SceUID condId);
+int ksceKernelSignalCondAll(SceUID condId);
+
+SceUID ksceKernelCreateSema(const char *name, SceUInt attr, int initVal, int maxVal, void *option);
+int ksceKernelDeleteSema(SceUID semaid);
+int ksceKernelWaitSema(SceUID semaid, int signal, SceUInt *timeout);
+int ksceKernelSignalSema(SceUID semaid, int signal);
+
+#endif // __HOST_PSP2KERN_THREADMGR_H__
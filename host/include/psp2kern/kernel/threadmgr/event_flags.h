@@ -0,0 +1,38 @@
+/**
+        libvile
+        Copyright (C) 2022 Cat (Ivan Epifanov)
+
+        This program is free software: you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        This program is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+// host stand-in for the vitasdk header of the same name, only what libvile uses
+
+#ifndef __HOST_PSP2KERN_EVENT_FLAGS_H__
+#define __HOST_PSP2KERN_EVENT_FLAGS_H__
+
+#include <psp2/types.h>
+
+#define SCE_EVENT_WAITAND 0x00
+#define SCE_EVENT_WAITOR 0x01
+#define SCE_EVENT_WAITCLEAR 0x02
+#define SCE_EVENT_WAITCLEAR_PAT 0x04
+
+SceUID ksceKernelCreateEventFlag(const char *name, int attr, int bits, void *opt);
+int ksceKernelDeleteEventFlag(SceUID evfid);
+int ksceKernelSetEventFlag(SceUID evfid, unsigned int bits);
+int ksceKernelClearEventFlag(SceUID evfid, unsigned int bits);
+int ksceKernelWaitEventFlag(SceUID evfid, unsigned int bits, unsigned int wait, unsigned int *outBits, SceUInt *timeout);
+int ksceKernelPollEventFlag(SceUID evfid, unsigned int bits, unsigned int wait, unsigned int *outBits);
+
+#endif // __HOST_PSP2KERN_EVENT_FLAGS_H__
@@ -0,0 +1,96 @@
+/**
+        libvile
+        Copyright (C) 2022 Cat (Ivan Epifanov)
+
+        This program is free software: you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        This program is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+// host stand-in for the vitasdk header of the same name, only what libvile uses
+
+#ifndef __HOST_PSP2KERN_USBD_H__
+#define __HOST_PSP2KERN_USBD_H__
+
+#include <psp2/types.h>
+
+#define SCE_USBD_ATTACH_SUCCEEDED 0
+#define SCE_USBD_ATTACH_FAILED (-1)
+#define SCE_USBD_PROBE_SUCCEEDED 0
+#define SCE_USBD_PROBE_FAILED (-1)
+#define SCE_USBD_DETACH_SUCCEEDED 0
+#define SCE_USBD_DETACH_FAILED (-1)
+
+typedef enum {
+  SCE_USBD_DESCRIPTOR_DEVICE = 0x01,
+  SCE_USBD_DESCRIPTOR_CONFIGURATION = 0x02,
+  SCE_USBD_DESCRIPTOR_STRING = 0x03,
+  SCE_USBD_DESCRIPTOR_INTERFACE = 0x04,
+  SCE_USBD_DESCRIPTOR_ENDPOINT = 0x05
+} SceUsbdDescriptorType;
+
+typedef struct {
+  unsigned char bLength;
+  unsigned char bDescriptorType;
+  unsigned short bcdUSB;
+  unsigned char bDeviceClass;
+  unsigned char bDeviceSubClass;
+  unsigned char bDeviceProtocol;
+  unsigned char bMaxPacketSize0;
+  unsigned short idVendor;
+  unsigned short idProduct;
+  unsigned short bcdDevice;
+  unsigned char iManufacturer;
+  unsigned char iProduct;
+  unsigned char iSerialNumber;
+  unsigned char bNumConfigurations;
+} SceUsbdDeviceDescriptor;
+
+typedef struct {
+  unsigned char bLength;
+  unsigned char bDescriptorType;
+  unsigned short wTotalLength;
+  unsigned char bNumInterfaces;
+  unsigned char bConfigurationValue;
+  unsigned char iConfiguration;
+  unsigned char bmAttributes;
+  unsigned char MaxPower;
+} SceUsbdConfigurationDescriptor;
+
+typedef struct {
+  unsigned char bLength;
+  unsigned char bDescriptorType;
+  unsigned char bEndpointAddress;
+  unsigned char bmAttributes;
+  unsigned short wMaxPacketSize;
+  unsigned char bInterval;
+} SceUsbdEndpointDescriptor;
+
+typedef struct SceUsbdDriver {
+  const char *name;
+  int (*probe)(int device_id);
+  int (*attach)(int device_id);
+  int (*detach)(int device_id);
+  struct SceUsbdDriver *next;
+} SceUsbdDriver;
+
+typedef void (*ksceUsbdDoneCallback)(int32_t result, int32_t count, void *arg);
+
+int ksceUsbdRegisterDriver(const SceUsbdDriver *driver);
+int ksceUsbdUnregisterDriver(const SceUsbdDriver *driver);
+void *ksceUsbdScanStaticDescriptor(SceUID device_id, void *start, SceUsbdDescriptorType type);
+SceUID ksceUsbdOpenPipe(int device_id, SceUsbdEndpointDescriptor *endpoint);
+int ksceUsbdClosePipe(SceUID pipe_id);
+int ksceUsbdBulkTransfer(SceUID pipe_id, unsigned char *buffer, unsigned int length, ksceUsbdDoneCallback cb, void *user_data);
+int ksceUsbdSetConfiguration(SceUID pipe_id, int config_num, ksceUsbdDoneCallback cb, void *user_data);
+
+#endif // __HOST_PSP2KERN_USBD_H__
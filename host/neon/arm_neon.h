@@ -0,0 +1,102 @@
+/**
+        libvile
+        Copyright (C) 2022 Cat (Ivan Epifanov)
+
+        This program is free software: you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        This program is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Plain C stand-ins for the ARMv7 NEON intrinsics libvilesig uses, lane
+ * by lane as the ARM reference describes them, so its NEON path builds
+ * and runs on any host (-DVILE_SIG_NEON_EMU=ON) and its results can be
+ * checked against the other backends. Says nothing about NEON speed.
+ * vmlaq_f32 multiplies and adds with two roundings, as ARMv7 does.
+ */
+
+#ifndef __VILE_ARM_NEON_H__
+#define __VILE_ARM_NEON_H__
+
+#include <stdint.h>
+#include <string.h>
+
+typedef int16_t int16x4_t __attribute__((vector_size(8)));
+typedef int16_t int16x8_t __attribute__((vector_size(16)));
+typedef uint16_t uint16x8_t __attribute__((vector_size(16)));
+typedef uint8_t uint8x8_t __attribute__((vector_size(8)));
+typedef int32_t int32x2_t __attribute__((vector_size(8)));
+typedef int32_t int32x4_t __attribute__((vector_size(16)));
+typedef float float32x4_t __attribute__((vector_size(16)));
+typedef uint64_t uint64x1_t __attribute__((vector_size(8)));
+
+static inline int16x8_t vld1q_s16(const int16_t *p) { int16x8_t v; memcpy(&v, p, sizeof(v)); return v; }
+static inline int16x4_t vld1_s16(const int16_t *p) { int16x4_t v; memcpy(&v, p, sizeof(v)); return v; }
+static inline void vst1q_s16(int16_t *p, int16x8_t v) { memcpy(p, &v, sizeof(v)); }
+static inline void vst1q_f32(float *p, float32x4_t v) { memcpy(p, &v, sizeof(v)); }
+
+static inline float32x4_t vdupq_n_f32(float x) { return (float32x4_t){x, x, x, x}; }
+static inline int16x8_t vdupq_n_s16(int16_t x) { return (int16x8_t){x, x, x, x, x, x, x, x}; }
+static inline int32x4_t vdupq_n_s32(int32_t x) { return (int32x4_t){x, x, x, x}; }
+#define vdupq_lane_s32(v, lane) vdupq_n_s32((v)[lane])
+#define vgetq_lane_s32(v, lane) ((int32_t)(v)[lane])
+#define vget_lane_u64(v, lane) ((uint64_t)(v)[lane])
+
+static inline int16x4_t vget_low_s16(int16x8_t v) { return (int16x4_t){v[0], v[1], v[2], v[3]}; }
+static inline int16x4_t vget_high_s16(int16x8_t v) { return (int16x4_t){v[4], v[5], v[6], v[7]}; }
+static inline int32x2_t vget_high_s32(int32x4_t v) { return (int32x2_t){v[2], v[3]}; }
+
+static inline int32x4_t vmovl_s16(int16x4_t v) { return __builtin_convertvector(v, int32x4_t); }
+static inline int32x4_t vsubl_s16(int16x4_t a, int16x4_t b) { return vmovl_s16(a) - vmovl_s16(b); }
+static inline uint8x8_t vmovn_u16(uint16x8_t v) { return __builtin_convertvector(v, uint8x8_t); }
+static inline float32x4_t vcvtq_f32_s32(int32x4_t v) { return __builtin_convertvector(v, float32x4_t); }
+static inline uint64x1_t vreinterpret_u64_u8(uint8x8_t v) { uint64x1_t r; memcpy(&r, &v, sizeof(r)); return r; }
+
+static inline int32x4_t vaddq_s32(int32x4_t a, int32x4_t b) { return a + b; }
+static inline float32x4_t vmulq_f32(float32x4_t a, float32x4_t b) { return a * b; }
+static inline uint16x8_t veorq_u16(uint16x8_t a, uint16x8_t b) { return a ^ b; }
+
+// built with -ffp-contract=off, so never fused
+static inline float32x4_t vmlaq_f32(float32x4_t a, float32x4_t b, float32x4_t c) { return a + b * c; }
+
+static inline int16x8_t vminq_s16(int16x8_t a, int16x8_t b)
+{
+  for (int i = 0; i < 8; i++)
+    a[i] = a[i] < b[i] ? a[i] : b[i];
+  return a;
+}
+
+static inline int16x8_t vmaxq_s16(int16x8_t a, int16x8_t b)
+{
+  for (int i = 0; i < 8; i++)
+    a[i] = a[i] > b[i] ? a[i] : b[i];
+  return a;
+}
+
+static inline uint16x8_t vcgtq_s16(int16x8_t a, int16x8_t b)
+{
+  return (uint16x8_t)(a > b);
+}
+
+// lanes n.. of a followed by b
+static inline int32x4_t vext_s32_emu(int32x4_t a, int32x4_t b, int n)
+{
+  int32_t both[8];
+  memcpy(both, &a, sizeof(a));
+  memcpy(both + 4, &b, sizeof(b));
+  int32x4_t r;
+  memcpy(&r, both + n, sizeof(r));
+  return r;
+}
+#define vextq_s32(a, b, n) vext_s32_emu(a, b, n)
+
+#endif
@@ -0,0 +1,1129 @@
+/**
+        libvile
+        Copyright (C) 2022 Cat (Ivan Epifanov)
+
+        This program is free software: you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        This program is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Minimal NXT simulator for the socket transport. Answers the direct
+ * commands libvile issues; motors turn at 10 deg/s per unit of power
+ * and stop at their tacho limit, two synced motors follow their turn
+ * ratio, sensors read a fixed raw value or, with -t, sweep 0..1023 and
+ * back.
+ * With -s the brick works through commands at a fixed rate and drops
+ * them once -q are queued, the way the firmware does under load.
+ * Files written to the brick are kept in memory and can be listed with
+ * FINDFIRST/FINDNEXT; -a sets the bluetooth address GET_DEVICEINFO
+ * reports, so restarting with another one looks like a different brick.
+ * The display module's
+ * IOMap holds the frame buffer; with -d a dot walks across it.
+ * Starting vilestrm.rxe runs a stand-in for the stream helper, which
+ * fills the usb poll buffer with a frame every 4 msec.
+ * SYS_BOOT (or -b) turns it into the SAM-BA bootloader, with 256K of
+ * flash that takes 4 msec a page; booting the flash makes it a brick again.
+ * Every connection starts with the vendor and product id, the way a
+ * reconnected usb device tells what it is.
+ * With -g the sim carries a two-wheeled base on A (left) and B (right)
+ * and integrates its true pose from the motors' millidegrees, an exact
+ * arc per step; module SIM_TRUTH_MODULE's IOMap holds it as x and y in
+ * mm and the heading in radians, doubles, and writing zeros resets it.
+ */
+
+#include <math.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "nxt.h"
+
+#define SIM_OUTPUTS 3
+#define SIM_INPUTS 4
+#define SIM_DEG_PER_POWER 10 // deg/s per unit of power
+#define SIM_RAW_VALUE 512
+#define SIM_FILES 16
+#define SIM_HANDLES 4
+#define SIM_DISPLAY_MODULE 0x000A0001
+#define SIM_DISPLAY_SIZE 919 // up to the end of Normal[8][100]
+#define SIM_DISPLAY_NORMAL 119
+#define SIM_INPUT_MODULE 0x00030001
+#define SIM_OUTPUT_MODULE 0x00020001
+#define SIM_TRUTH_MODULE 0x7F000001 // no such module on a brick
+#define SIM_POLL_SIZE 64 // usb poll buffer, one byte stays free
+#define SIM_STREAM_PERIOD 4000 // usec, as nxc/vilestrm.nxc samples
+#define SIM_STREAM_FRAME 24
+#define SIM_FLASH_BASE 0x00100000
+#define SIM_FLASH_REGION 0x4000 // 16 lock regions
+#define SIM_PAGE_WRITE 4000 // usec a page takes to program
+#define SIM_RAM_BASE 0x00200000
+#define SIM_RAM_SIZE 0x10000
+#define SIM_MC_FCR 0xFFFFFF64
+#define SIM_MC_FSR 0xFFFFFF68
+
+typedef struct {
+  int8_t power;
+  uint8_t mode;
+  uint8_t regulation;
+  int8_t turn_ratio;
+  uint8_t run_state;
+  uint32_t tacho_limit;
+  int64_t tacho; // millidegrees, so slow motors still move
+  int64_t block_tacho;
+  int64_t rotation;
+} sim_output_t;
+
+typedef struct {
+  uint8_t type;
+  uint8_t mode;
+} sim_input_t;
+
+typedef struct {
+  char name[20];
+  uint8_t *data;
+  uint32_t size;
+  uint32_t written;
+  uint8_t used;
+} sim_file_t;
+
+static sim_output_t outputs[SIM_OUTPUTS];
+static sim_input_t inputs[SIM_INPUTS];
+static sim_file_t files[SIM_FILES];
+static int handles[SIM_HANDLES]; // file index + 1, 0 is free, -(next file index + 1) for a search
+static char patterns[SIM_HANDLES][20]; // of each search
+static uint8_t address[7] = { 0x00, 0x16, 0x53, 0x0A, 0x0B, 0x0C, 0x00 };
+static uint8_t display[SIM_DISPLAY_SIZE];
+static unsigned int redraw = 0; // usec per step of the walking dot
+static char program[20];
+static uint8_t poll_buf[SIM_POLL_SIZE];
+static unsigned int poll_in = 0;
+static unsigned int poll_out = 0;
+static uint64_t stream_next = 0; // when the helper samples next, 0 while it isn't running
+static uint8_t stream_seq = 0;
+static int samba = 0; // in the bootloader
+static int reboot = 0; // SYS_BOOT answered, hang up
+static unsigned int corrupt = 0; // every corrupt-th page write comes out wrong
+static unsigned int page_writes = 0;
+static uint16_t flash_locked = 0xFFFF;
+static uint8_t flash[VILE_FLASH_SIZE];
+static uint8_t sram[SIM_RAM_SIZE];
+static uint64_t last_update;
+static unsigned int latency = 0;
+static unsigned int sweep = 0; // usec per 0..1023..0 cycle of the sensors
+static unsigned int service = 0; // usec per command, 0 is instant
+static unsigned int depth = 4;
+static uint64_t busy_until;
+static int verbose = 0;
+static double wheel = 0; // mm, 0 is no ground truth
+static double track = 0; // mm between the wheels
+static double truth[3]; // x, y, heading
+
+static uint64_t now_us()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int running(const sim_output_t *o)
+{
+  return (o->mode & NXT_MOTOR_MODE_ON) && o->run_state != NXT_MOTOR_RUNSTATE_IDLE && o->power;
+}
+
+// power after sync regulation: of two synced motors a positive turn ratio
+// slows the higher numbered one, 50 stops it and 100 reverses it
+static int64_t synced_power(int i)
+{
+  const sim_output_t *o = &outputs[i];
+  if (o->regulation != NXT_MOTOR_REGULATION_SYNC)
+    return o->power;
+
+  int partner = -1;
+  for (int j = 0; j < SIM_OUTPUTS; j++)
+    if (j != i && running(&outputs[j]) && outputs[j].regulation == NXT_MOTOR_REGULATION_SYNC)
+      partner = j;
+  if (partner < 0)
+    return o->power;
+
+  int turn = o->turn_ratio;
+  if ((i > partner && turn > 0) || (i < partner && turn < 0))
+    return (int64_t)o->power * (100 - 2 * (turn < 0 ? -turn : turn)) / 100;
+  return o->power;
+}
+
+static void update_motors()
+{
+  uint64_t now = now_us();
+  int64_t dt = now - last_update;
+  last_update = now;
+  int64_t moved[SIM_OUTPUTS] = {0};
+
+  for (int i = 0; i < SIM_OUTPUTS; i++)
+  {
+    sim_output_t *o = &outputs[i];
+    if (!running(o))
+      continue;
+
+    // deg/s * usec / 1000 = millidegrees
+    int64_t delta = synced_power(i) * SIM_DEG_PER_POWER * dt / 1000;
+    moved[i] = delta;
+    o->tacho += delta;
+    o->block_tacho += delta;
+    o->rotation += delta;
+
+    int64_t moved = o->block_tacho < 0 ? -o->block_tacho : o->block_tacho;
+    if (o->tacho_limit && moved >= (int64_t)o->tacho_limit * 1000)
+    {
+      o->run_state = NXT_MOTOR_RUNSTATE_IDLE;
+      o->power = 0;
+    }
+  }
+
+  if (!wheel || (!moved[0] && !moved[1]))
+    return;
+
+  // speeds only change between steps, so each one is an arc
+  double left = moved[0] * M_PI * wheel / 360000;
+  double right = moved[1] * M_PI * wheel / 360000;
+  double turn = (right - left) / track;
+  double chord = (left + right) / 2;
+  if (turn != 0)
+    chord *= sin(turn / 2) / (turn / 2);
+  truth[0] += chord * cos(truth[2] + turn / 2);
+  truth[1] += chord * sin(truth[2] + turn / 2);
+  truth[2] += turn;
+}
+
+static uint16_t sensor_raw()
+{
+  if (!sweep)
+    return SIM_RAW_VALUE;
+  uint64_t t = now_us() % sweep;
+  uint64_t half = sweep / 2;
+  return (uint16_t)((t < half ? t : sweep - t) * 1023 / half);
+}
+
+static int reply_status(uint8_t opcode, uint8_t status, unsigned char *reply)
+{
+  ret_status_t *r = (ret_status_t *)reply;
+  r->type = NXT_COMMAND_REPLY;
+  r->opcode = opcode;
+  r->status = status;
+  return sizeof(ret_status_t);
+}
+
+static int reply_handle(uint8_t opcode, uint8_t status, uint8_t handle, unsigned char *reply)
+{
+  ret_handle_t *r = (ret_handle_t *)reply;
+  reply_status(opcode, status, reply);
+  r->handle = handle;
+  return sizeof(ret_handle_t);
+}
+
+static sim_file_t *find_file(const char *name)
+{
+  for (int i = 0; i < SIM_FILES; i++)
+    if (files[i].used && !strncmp(files[i].name, name, sizeof(files[i].name)))
+      return &files[i];
+  return NULL;
+}
+
+static sim_file_t *open_handle(uint8_t handle)
+{
+  if (handle >= SIM_HANDLES || handles[handle] <= 0)
+    return NULL;
+  return &files[handles[handle] - 1];
+}
+
+// the firmware's wildcards: "*.*", "*.ext", "name.*" or the whole name
+static int matches(const char *pattern, const char *name)
+{
+  const char *pdot = strchr(pattern, '.');
+  const char *ndot = strrchr(name, '.');
+  if (!pdot || !ndot)
+    return !strcmp(pattern, name);
+  int base = (pdot - pattern == 1 && pattern[0] == '*')
+             || (pdot - pattern == ndot - name && !strncmp(pattern, name, ndot - name));
+  return base && (!strcmp(pdot + 1, "*") || !strcmp(pdot + 1, ndot + 1));
+}
+
+// the next file from index on that matches the search on handle
+static int reply_find(uint8_t opcode, uint8_t handle, int index, unsigned char *reply)
+{
+  ret_find_t *r = (ret_find_t *)reply;
+  while (index < SIM_FILES && !(files[index].used && matches(patterns[handle], files[index].name)))
+    index++;
+  if (index == SIM_FILES)
+  {
+    handles[handle] = 0;
+    reply_handle(opcode, NXT_STATUS_SYS_FILE_NOT_FOUND, handle, reply);
+    memset(r->filename, 0, sizeof(r->filename));
+    r->size = 0;
+    return sizeof(ret_find_t);
+  }
+  handles[handle] = -(index + 2);
+  reply_handle(opcode, NXT_STATUS_OK, handle, reply);
+  memcpy(r->filename, files[index].name, sizeof(r->filename));
+  r->size = files[index].size;
+  return sizeof(ret_find_t);
+}
+
+// the walking dot, one pixel per redraw period
+static void update_display()
+{
+  if (!redraw)
+    return;
+  static int last = -1;
+  int step = (int)((now_us() / redraw) % (VILE_SCREEN_WIDTH * VILE_SCREEN_HEIGHT));
+  if (step == last)
+    return;
+  uint8_t *normal = display + SIM_DISPLAY_NORMAL;
+  if (last >= 0)
+    normal[(last / VILE_SCREEN_WIDTH / 8) * VILE_SCREEN_WIDTH + last % VILE_SCREEN_WIDTH] &= ~(1 << (last / VILE_SCREEN_WIDTH % 8));
+  normal[(step / VILE_SCREEN_WIDTH / 8) * VILE_SCREEN_WIDTH + step % VILE_SCREEN_WIDTH] |= 1 << (step / VILE_SCREEN_WIDTH % 8);
+  last = step;
+}
+
+static int16_t sensor_scaled(uint8_t mode, uint16_t raw)
+{
+  switch (mode & NXT_SENSOR_MASK_MODE)
+  {
+    case NXT_SENSOR_MODE_BOOLEAN:
+      return raw < 512;
+    case NXT_SENSOR_MODE_PCT_FULLSCALE:
+      return (1023 - raw) * 100 / 1023;
+    default:
+      return raw;
+  }
+}
+
+static unsigned int poll_used()
+{
+  return (poll_in + SIM_POLL_SIZE - poll_out) % SIM_POLL_SIZE;
+}
+
+// what vilestrm.nxc would have left in the poll buffer by now; frames
+// that don't fit are dropped and only show as a sequence gap
+static void update_stream()
+{
+  if (strcmp(program, VILE_STREAM_PROGRAM))
+  {
+    stream_next = 0;
+    return;
+  }
+
+  uint64_t now = now_us();
+  if (!stream_next)
+  {
+    stream_next = now;
+    stream_seq = 0;
+    poll_in = poll_out = 0;
+  }
+  if (now > stream_next + 64 * SIM_STREAM_PERIOD)
+  {
+    uint64_t skip = (now - stream_next) / SIM_STREAM_PERIOD;
+    stream_seq += skip;
+    stream_next += skip * SIM_STREAM_PERIOD;
+  }
+
+  update_motors();
+  for (; stream_next <= now; stream_next += SIM_STREAM_PERIOD, stream_seq++)
+  {
+    if (poll_used() + SIM_STREAM_FRAME >= SIM_POLL_SIZE)
+      continue;
+
+    uint8_t frame[SIM_STREAM_FRAME];
+    uint16_t tick = (uint16_t)(stream_next / 1000);
+    frame[0] = 0x56;
+    frame[1] = stream_seq;
+    memcpy(frame + 2, &tick, 2);
+    for (int i = 0; i < SIM_INPUTS; i++)
+    {
+      int16_t scaled = sensor_scaled(inputs[i].mode, inputs[i].type == NXT_SENSOR_NONE ? 1023 : sensor_raw());
+      memcpy(frame + 4 + 2 * i, &scaled, 2);
+    }
+    for (int i = 0; i < SIM_OUTPUTS; i++)
+    {
+      int32_t rotation = (int32_t)(outputs[i].rotation / 1000);
+      memcpy(frame + 12 + 4 * i, &rotation, 4);
+    }
+
+    for (int i = 0; i < SIM_STREAM_FRAME; i++)
+      poll_buf[(poll_in + i) % SIM_POLL_SIZE] = frame[i];
+    poll_in = (poll_in + SIM_STREAM_FRAME) % SIM_POLL_SIZE;
+  }
+}
+
+// Inputs[4] as the firmware lays them out, 20 bytes each
+static void input_iomap(uint8_t *map)
+{
+  for (int i = 0; i < SIM_INPUTS; i++)
+  {
+    uint8_t *p = map + i * 20;
+    uint16_t raw = inputs[i].type == NXT_SENSOR_NONE ? 1023 : sensor_raw();
+    int16_t scaled = sensor_scaled(inputs[i].mode, raw);
+    memset(p, 0, 20);
+    memcpy(p + 2, &raw, 2); // ADRaw
+    memcpy(p + 4, &raw, 2); // SensorRaw
+    memcpy(p + 6, &scaled, 2); // SensorValue
+    p[8] = inputs[i].type;
+    p[9] = inputs[i].mode;
+  }
+}
+
+// Outputs[3], 32 bytes each
+static void output_iomap(uint8_t *map)
+{
+  update_motors();
+  for (int i = 0; i < SIM_OUTPUTS; i++)
+  {
+    const sim_output_t *o = &outputs[i];
+    uint8_t *p = map + i * 32;
+    int32_t tacho = (int32_t)(o->tacho / 1000), block = (int32_t)(o->block_tacho / 1000), rotation = (int32_t)(o->rotation / 1000);
+    memset(p, 0, 32);
+    memcpy(p, &tacho, 4);
+    memcpy(p + 4, &block, 4);
+    memcpy(p + 8, &rotation, 4);
+    memcpy(p + 12, &o->tacho_limit, 4);
+    p[19] = o->mode;
+    p[20] = o->power;
+    p[21] = o->power;
+    p[25] = o->run_state;
+    p[26] = o->regulation;
+    p[28] = o->turn_ratio;
+  }
+}
+
+// module memory, NULL when there is no such module
+static uint8_t *iomap(uint32_t module, uint32_t *size)
+{
+  static uint8_t map[SIM_OUTPUTS * 32];
+
+  if (module == SIM_INPUT_MODULE)
+  {
+    input_iomap(map);
+    *size = SIM_INPUTS * 20;
+    return map;
+  }
+  if (module == SIM_OUTPUT_MODULE)
+  {
+    output_iomap(map);
+    *size = SIM_OUTPUTS * 32;
+    return map;
+  }
+  if (module == SIM_DISPLAY_MODULE)
+  {
+    update_display();
+    *size = sizeof(display);
+    return display;
+  }
+  if (module == SIM_TRUTH_MODULE && wheel)
+  {
+    update_motors();
+    *size = sizeof(truth);
+    return (uint8_t *)truth;
+  }
+  return NULL;
+}
+
+static int reply_iomap(uint8_t opcode, uint8_t status, uint32_t module, uint16_t size, unsigned char *reply)
+{
+  ret_iomap_t *r = (ret_iomap_t *)reply;
+  reply_status(opcode, status, reply);
+  r->module = module;
+  r->size = size;
+  return 9 + (opcode == NXT_OPCODE_SYS_READ_IOMAP ? size : 0);
+}
+
+static int handle_system(const unsigned char *req, int length, unsigned char *reply)
+{
+  uint8_t opcode = req[1];
+
+  switch (opcode)
+  {
+    case NXT_OPCODE_SYS_READ_IOMAP:
+    case NXT_OPCODE_SYS_WRITE_IOMAP:
+    {
+      const cmd_iomap_t *c = (const cmd_iomap_t *)req;
+      uint32_t size;
+      uint8_t *mem = iomap(c->module, &size);
+      if (!mem)
+        return reply_iomap(opcode, NXT_STATUS_SYS_MODULE_NOT_FOUND, c->module, 0, reply);
+      uint16_t limit = opcode == NXT_OPCODE_SYS_READ_IOMAP ? NXT_IOMAP_READ_CHUNK : length - 10;
+      if (c->size > limit || c->offset + c->size > size)
+        return reply_iomap(opcode, NXT_STATUS_SYS_OUT_OF_BOUNDARY, c->module, 0, reply);
+      if (opcode == NXT_OPCODE_SYS_READ_IOMAP)
+        memcpy(((ret_iomap_t *)reply)->data, mem + c->offset, c->size);
+      else
+        memcpy(mem + c->offset, c->data, c->size);
+      return reply_iomap(opcode, NXT_STATUS_OK, c->module, c->size, reply);
+    }
+
+    case NXT_OPCODE_SYS_POLLCOMMAND_LENGTH:
+    case NXT_OPCODE_SYS_POLLCOMMAND:
+    {
+      const cmd_poll_t *c = (const cmd_poll_t *)req;
+      ret_poll_t *r = (ret_poll_t *)reply;
+      update_stream();
+      // nobody writes the high speed buffer
+      unsigned int n = c->buffer == NXT_POLL_USB ? poll_used() : 0;
+      reply_status(opcode, NXT_STATUS_OK, reply);
+      r->buffer = c->buffer;
+      if (opcode == NXT_OPCODE_SYS_POLLCOMMAND_LENGTH)
+      {
+        r->length = n;
+        return 5;
+      }
+      if (n > c->length)
+        n = c->length;
+      if (n > NXT_POLL_CHUNK)
+        n = NXT_POLL_CHUNK;
+      for (unsigned int i = 0; i < n; i++)
+        r->data[i] = poll_buf[(poll_out + i) % SIM_POLL_SIZE];
+      poll_out = (poll_out + n) % SIM_POLL_SIZE;
+      r->length = n;
+      return 5 + n;
+    }
+
+    case NXT_OPCODE_SYS_BOOT:
+    {
+      const cmd_file_t *c = (const cmd_file_t *)req;
+      if (strncmp(c->filename, NXT_BOOT_MAGIC, sizeof(c->filename)))
+        return reply_status(opcode, NXT_STATUS_BAD_ARGS, reply);
+      reboot = 1;
+      reply_status(opcode, NXT_STATUS_OK, reply);
+      memcpy(reply + 3, "Yes", 4);
+      return 7;
+    }
+
+    case NXT_OPCODE_SYS_OPENWRITE:
+    case NXT_OPCODE_SYS_OPENLINEARWRITE:
+    {
+      const cmd_openwrite_t *c = (const cmd_openwrite_t *)req;
+      if (find_file(c->filename))
+        return reply_handle(opcode, NXT_STATUS_SYS_FILE_EXISTS, 0, reply);
+      int h = 0;
+      while (h < SIM_HANDLES && handles[h])
+        h++;
+      int f = 0;
+      while (f < SIM_FILES && files[f].used)
+        f++;
+      if (h == SIM_HANDLES)
+        return reply_handle(opcode, NXT_STATUS_SYS_NO_MORE_HANDLES, 0, reply);
+      if (f == SIM_FILES)
+        return reply_handle(opcode, NXT_STATUS_SYS_NO_SPACE, 0, reply);
+      sim_file_t *file = &files[f];
+      memcpy(file->name, c->filename, sizeof(file->name));
+      file->name[sizeof(file->name) - 1] = 0;
+      file->data = malloc(c->size ? c->size : 1);
+      file->size = c->size;
+      file->written = 0;
+      file->used = 1;
+      handles[h] = f + 1;
+      return reply_handle(opcode, NXT_STATUS_OK, h, reply);
+    }
+
+    case NXT_OPCODE_SYS_WRITE:
+    {
+      const cmd_write_t *c = (const cmd_write_t *)req;
+      sim_file_t *file = open_handle(c->handle);
+      ret_write_t *r = (ret_write_t *)reply;
+      if (!file)
+        return reply_handle(opcode, NXT_STATUS_SYS_ILLEGAL_HANDLE, c->handle, reply);
+      uint32_t n = length - 3;
+      if (file->written + n > file->size)
+        return reply_handle(opcode, NXT_STATUS_SYS_FILE_IS_FULL, c->handle, reply);
+      memcpy(file->data + file->written, c->data, n);
+      file->written += n;
+      reply_handle(opcode, NXT_STATUS_OK, c->handle, reply);
+      r->size = n;
+      return sizeof(ret_write_t);
+    }
+
+    case NXT_OPCODE_SYS_FINDFIRST:
+    {
+      const cmd_file_t *c = (const cmd_file_t *)req;
+      int h = 0;
+      while (h < SIM_HANDLES && handles[h])
+        h++;
+      if (h == SIM_HANDLES)
+        return reply_handle(opcode, NXT_STATUS_SYS_NO_MORE_HANDLES, 0, reply);
+      memcpy(patterns[h], c->filename, sizeof(patterns[h]));
+      patterns[h][sizeof(patterns[h]) - 1] = 0;
+      return reply_find(opcode, h, 0, reply);
+    }
+
+    case NXT_OPCODE_SYS_FINDNEXT:
+    {
+      const cmd_handle_t *c = (const cmd_handle_t *)req;
+      if (c->handle >= SIM_HANDLES || handles[c->handle] >= 0)
+        return reply_handle(opcode, NXT_STATUS_SYS_ILLEGAL_HANDLE, c->handle, reply);
+      return reply_find(opcode, c->handle, -handles[c->handle] - 1, reply);
+    }
+
+    case NXT_OPCODE_SYS_GET_DEVICEINFO:
+    {
+      ret_deviceinfo_t *r = (ret_deviceinfo_t *)reply;
+      reply_status(opcode, NXT_STATUS_OK, reply);
+      memset(r->name, 0, sizeof(r->name));
+      strcpy(r->name, "nxtsim");
+      memcpy(r->address, address, sizeof(r->address));
+      r->signal = 0;
+      r->free_flash = 0;
+      for (int i = 0; i < SIM_FILES; i++)
+        r->free_flash += files[i].used ? 0 : 1;
+      r->free_flash *= 4096;
+      return sizeof(ret_deviceinfo_t);
+    }
+
+    case NXT_OPCODE_SYS_CLOSE:
+    {
+      const cmd_handle_t *c = (const cmd_handle_t *)req;
+      if (c->handle < SIM_HANDLES && handles[c->handle] < 0)
+      {
+        handles[c->handle] = 0;
+        return reply_handle(opcode, NXT_STATUS_OK, c->handle, reply);
+      }
+      sim_file_t *file = open_handle(c->handle);
+      if (!file)
+        return reply_handle(opcode, NXT_STATUS_SYS_HANDLE_ALREADY_CLOSED, c->handle, reply);
+      if (verbose)
+        fprintf(stderr, "nxtsim: %s, %u of %u bytes\n", file->name, file->written, file->size);
+      handles[c->handle] = 0;
+      return reply_handle(opcode, NXT_STATUS_OK, c->handle, reply);
+    }
+
+    case NXT_OPCODE_SYS_DELETE:
+    {
+      const cmd_file_t *c = (const cmd_file_t *)req;
+      sim_file_t *file = find_file(c->filename);
+      ret_currentprogram_t *r = (ret_currentprogram_t *)reply;
+      reply_status(opcode, file ? NXT_STATUS_OK : NXT_STATUS_SYS_FILE_NOT_FOUND, reply);
+      memcpy(r->filename, c->filename, sizeof(r->filename));
+      if (file)
+      {
+        for (int h = 0; h < SIM_HANDLES; h++)
+          if (handles[h] == file - files + 1)
+            handles[h] = 0;
+        free(file->data);
+        memset(file, 0, sizeof(*file));
+      }
+      return sizeof(ret_currentprogram_t);
+    }
+
+    default:
+      return reply_status(opcode, NXT_STATUS_UNKNOWN_OPCODE, reply);
+  }
+}
+
+static void set_output(sim_output_t *o, const cmd_setoutput_t *c)
+{
+  o->power = c->power;
+  o->mode = c->mode;
+  o->regulation = c->regulation;
+  o->turn_ratio = c->turn_ratio;
+  o->run_state = c->run_state;
+  o->tacho_limit = c->tacho_limit;
+  o->block_tacho = 0;
+  // the firmware resets the limit counter on every new command
+  o->tacho = 0;
+}
+
+static int handle(const unsigned char *req, int length, unsigned char *reply)
+{
+  uint8_t opcode = req[1];
+
+  if ((req[0] & 0x7F) == NXT_SYSTEM_COMMAND_DOREPLY)
+    return handle_system(req, length, reply);
+
+  update_motors();
+
+  switch (opcode)
+  {
+    case NXT_OPCODE_STARTPROGRAM:
+    {
+      const cmd_startprogram_t *c = (const cmd_startprogram_t *)req;
+      memcpy(program, c->filename, sizeof(program));
+      program[sizeof(program) - 1] = 0;
+      return reply_status(opcode, NXT_STATUS_OK, reply);
+    }
+
+    case NXT_OPCODE_STOPPROGRAM:
+      if (!program[0])
+        return reply_status(opcode, NXT_STATUS_NO_ACTIVE_PROGRAM, reply);
+      program[0] = 0;
+      return reply_status(opcode, NXT_STATUS_OK, reply);
+
+    case NXT_OPCODE_GET_CURRENTPROGRAM_NAME:
+    {
+      if (!program[0])
+        return reply_status(opcode, NXT_STATUS_NO_ACTIVE_PROGRAM, reply);
+      ret_currentprogram_t *r = (ret_currentprogram_t *)reply;
+      reply_status(opcode, NXT_STATUS_OK, reply);
+      memcpy(r->filename, program, sizeof(r->filename));
+      return sizeof(ret_currentprogram_t);
+    }
+
+    case NXT_OPCODE_PLAYSOUND:
+    {
+      const cmd_playsound_t *c = (const cmd_playsound_t *)req;
+      if (!find_file(c->filename))
+        return reply_status(opcode, NXT_STATUS_SYS_FILE_NOT_FOUND, reply);
+      return reply_status(opcode, NXT_STATUS_OK, reply);
+    }
+
+    case NXT_OPCODE_PLAYTONE:
+    case NXT_OPCODE_STOP_SOUND:
+      return reply_status(opcode, NXT_STATUS_OK, reply);
+
+    case NXT_OPCODE_SET_OUTPUTSTATE:
+    {
+      const cmd_setoutput_t *c = (const cmd_setoutput_t *)req;
+      if (c->port == NXT_OUT_ALL)
+      {
+        for (int i = 0; i < SIM_OUTPUTS; i++)
+          set_output(&outputs[i], c);
+      }
+      else if (c->port < SIM_OUTPUTS)
+        set_output(&outputs[c->port], c);
+      else
+        return reply_status(opcode, NXT_STATUS_DATA_OUT_OF_RANGE, reply);
+      return reply_status(opcode, NXT_STATUS_OK, reply);
+    }
+
+    case NXT_OPCODE_GET_OUTPUTSTATE:
+    {
+      const cmd_port_t *c = (const cmd_port_t *)req;
+      if (c->port >= SIM_OUTPUTS)
+        return reply_status(opcode, NXT_STATUS_DATA_OUT_OF_RANGE, reply);
+
+      const sim_output_t *o = &outputs[c->port];
+      vile_outputstate_t *r = (vile_outputstate_t *)reply;
+      reply_status(opcode, NXT_STATUS_OK, reply);
+      r->port = c->port;
+      r->power = o->power;
+      r->mode = o->mode;
+      r->regulation = o->regulation;
+      r->turn_ratio = o->turn_ratio;
+      r->run_state = o->run_state;
+      r->tacho_limit = o->tacho_limit;
+      r->tacho_count = (int32_t)(o->tacho / 1000);
+      r->block_tacho_count = (int32_t)(o->block_tacho / 1000);
+      r->rotation_count = (int32_t)(o->rotation / 1000);
+      return sizeof(vile_outputstate_t);
+    }
+
+    case NXT_OPCODE_RESET_MOTOR_POSITION:
+    {
+      const cmd_resetport_t *c = (const cmd_resetport_t *)req;
+      if (c->port >= SIM_OUTPUTS)
+        return reply_status(opcode, NXT_STATUS_DATA_OUT_OF_RANGE, reply);
+      if (c->relative)
+        outputs[c->port].block_tacho = 0;
+      else
+        outputs[c->port].rotation = 0;
+      return reply_status(opcode, NXT_STATUS_OK, reply);
+    }
+
+    case NXT_OPCODE_SET_INPUTMODE:
+    {
+      const cmd_setinput_t *c = (const cmd_setinput_t *)req;
+      if (c->port >= SIM_INPUTS)
+        return reply_status(opcode, NXT_STATUS_DATA_OUT_OF_RANGE, reply);
+      inputs[c->port].type = c->stype;
+      inputs[c->port].mode = c->smode;
+      return reply_status(opcode, NXT_STATUS_OK, reply);
+    }
+
+    case NXT_OPCODE_GET_INPUTVALUES:
+    {
+      const cmd_port_t *c = (const cmd_port_t *)req;
+      if (c->port >= SIM_INPUTS)
+        return reply_status(opcode, NXT_STATUS_DATA_OUT_OF_RANGE, reply);
+
+      const sim_input_t *in = &inputs[c->port];
+      vile_inputstate_t *r = (vile_inputstate_t *)reply;
+      reply_status(opcode, NXT_STATUS_OK, reply);
+      r->port = c->port;
+      r->valid = 1;
+      r->calibrated = 0;
+      r->sensor_type = in->type;
+      r->sensor_mode = in->mode;
+      r->raw_value = (in->type == NXT_SENSOR_NONE) ? 1023 : sensor_raw();
+      r->normalized_value = r->raw_value;
+      r->scaled_value = sensor_scaled(in->mode, r->raw_value);
+      r->calibrated_value = r->scaled_value;
+      return sizeof(vile_inputstate_t);
+    }
+
+    case NXT_OPCODE_RESET_INPUT_SCALEDVALUES:
+    {
+      const cmd_port_t *c = (const cmd_port_t *)req;
+      if (c->port >= SIM_INPUTS)
+        return reply_status(opcode, NXT_STATUS_DATA_OUT_OF_RANGE, reply);
+      return reply_status(opcode, NXT_STATUS_OK, reply);
+    }
+
+    case NXT_OPCODE_BATTERYLEVEL:
+    {
+      ret_battery_t *r = (ret_battery_t *)reply;
+      reply_status(opcode, NXT_STATUS_OK, reply);
+      r->mv = 8000;
+      return sizeof(ret_battery_t);
+    }
+
+    case NXT_OPCODE_KEEPALIVE:
+    {
+      ret_keepalive_t *r = (ret_keepalive_t *)reply;
+      reply_status(opcode, NXT_STATUS_OK, reply);
+      r->msec = 600000;
+      return sizeof(ret_keepalive_t);
+    }
+
+    default:
+      return reply_status(opcode, NXT_STATUS_UNKNOWN_OPCODE, reply);
+  }
+}
+
+// queue the command behind the ones still being worked through,
+// returns 0 when the queue is full
+static int admit()
+{
+  if (!service)
+    return 1;
+
+  uint64_t now = now_us();
+  if (busy_until < now)
+    busy_until = now;
+  if ((busy_until - now + service - 1) / service >= depth)
+    return 0;
+  busy_until += service;
+  return 1;
+}
+
+static void serve(int client)
+{
+  unsigned char req[64];
+  unsigned char reply[64];
+  ssize_t n;
+  unsigned int commands = 0, dropped = 0;
+
+  while ((n = recv(client, req, sizeof(req), 0)) > 0)
+  {
+    if (n < 2)
+      continue;
+
+    memset(reply, 0, sizeof(reply));
+    int len;
+    commands++;
+    if (admit())
+    {
+      len = handle(req, n, reply);
+      // a reply comes once everything queued before it is done
+      uint64_t now = now_us();
+      if (!(req[0] & 0x80) && busy_until > now)
+        usleep(busy_until - now);
+    }
+    else
+    {
+      dropped++;
+      len = reply_status(req[1], NXT_STATUS_NO_BUFFER, reply);
+    }
+
+    if (verbose)
+      fprintf(stderr, "nxtsim: type 0x%02x opcode 0x%02x -> status 0x%02x\n", req[0], req[1], reply[2]);
+
+    // bit 7 of the type is "no reply"
+    if (req[0] & 0x80)
+      continue;
+
+    if (latency)
+      usleep(latency);
+
+    if (send(client, reply, len, MSG_NOSIGNAL) < 0)
+      break;
+
+    if (reboot)
+    {
+      fprintf(stderr, "nxtsim: rebooting into SAM-BA\n");
+      reboot = 0;
+      samba = 1;
+      break;
+    }
+  }
+
+  if (service)
+    fprintf(stderr, "nxtsim: %u commands, %u dropped\n", commands, dropped);
+}
+
+// flash or RAM behind addr, NULL past either
+static uint8_t *samba_mem(uint32_t addr, uint32_t len)
+{
+  if (addr >= SIM_FLASH_BASE && addr + len <= SIM_FLASH_BASE + VILE_FLASH_SIZE)
+    return flash + addr - SIM_FLASH_BASE;
+  if (addr >= SIM_RAM_BASE && addr + len <= SIM_RAM_BASE + SIM_RAM_SIZE)
+    return sram + addr - SIM_RAM_BASE;
+  return NULL;
+}
+
+static uint32_t samba_word(uint32_t addr)
+{
+  uint32_t v = 0;
+  uint8_t *mem = samba_mem(addr, 4);
+  if (addr == SIM_MC_FSR)
+    v = 1; // FRDY, writes are done by the time anyone asks
+  else if (mem)
+    memcpy(&v, mem, 4);
+  return v;
+}
+
+// what the page writer libvile loads does: copy RAM_PAGE into flash
+// page [RAM_PAGE_NUMBER], unless its region is locked
+static void samba_run(uint32_t addr)
+{
+  uint32_t page = samba_word(addr + 0x300);
+  if (page >= VILE_FLASH_SIZE / VILE_FLASH_PAGE)
+    return;
+
+  uint32_t offset = page * VILE_FLASH_PAGE;
+  if (!(flash_locked & (1 << (offset / SIM_FLASH_REGION))))
+  {
+    memcpy(flash + offset, sram + addr + 0x100 - SIM_RAM_BASE, VILE_FLASH_PAGE);
+    if (corrupt && ++page_writes % corrupt == 0)
+      flash[offset + page_writes % VILE_FLASH_PAGE] ^= 0x10;
+  }
+  usleep(SIM_PAGE_WRITE);
+}
+
+// SAM-BA in non-interactive mode: only N, w, R and V answer
+static void serve_samba(int client)
+{
+  unsigned char buf[8192];
+  char cmd[32];
+  unsigned int cmd_len = 0;
+  uint8_t *sink = NULL; // S data goes here
+  uint32_t sink_left = 0;
+  ssize_t n;
+
+  while ((n = recv(client, buf, sizeof(buf), 0)) > 0)
+  {
+    for (ssize_t i = 0; i < n; i++)
+    {
+      if (sink_left)
+      {
+        uint32_t take = (uint32_t)(n - i) < sink_left ? (uint32_t)(n - i) : sink_left;
+        if (sink)
+          memcpy(sink, buf + i, take);
+        sink += sink ? take : 0;
+        sink_left -= take;
+        i += take - 1;
+        continue;
+      }
+
+      if (buf[i] != '#')
+      {
+        if (cmd_len < sizeof(cmd) - 1)
+          cmd[cmd_len++] = buf[i];
+        continue;
+      }
+
+      cmd[cmd_len] = 0;
+      cmd_len = 0;
+      char c = cmd[0];
+      uint32_t addr = strtoul(cmd + 1, NULL, 16);
+      char *comma = strchr(cmd, ',');
+      uint32_t arg = comma ? strtoul(comma + 1, NULL, 16) : 0;
+      unsigned char reply[4096];
+      int len = -1;
+
+      if (verbose)
+        fprintf(stderr, "nxtsim: samba %s#\n", cmd);
+
+      switch (c)
+      {
+        case 'N':
+          memcpy(reply, "\n\r", 2);
+          len = 2;
+          break;
+        case 'V':
+          len = sprintf((char *)reply, "v1.4 Nov 10 2004 14:24:53\n\r");
+          break;
+        case 'W':
+          if (addr == SIM_MC_FCR && (arg & 0xFF00000F) == 0x5A000004)
+            flash_locked &= ~(1 << (((arg >> 8) & 0x3FF) * VILE_FLASH_PAGE / SIM_FLASH_REGION));
+          else if (samba_mem(addr, 4))
+            memcpy(samba_mem(addr, 4), &arg, 4);
+          break;
+        case 'w':
+        {
+          uint32_t v = samba_word(addr);
+          memcpy(reply, &v, 4);
+          len = 4;
+          break;
+        }
+        case 'S':
+          // flash isn't written this way, the bytes go nowhere
+          sink = addr < SIM_FLASH_BASE + VILE_FLASH_SIZE ? NULL : samba_mem(addr, arg);
+          sink_left = arg;
+          break;
+        case 'R':
+        {
+          uint8_t *mem = arg <= sizeof(reply) ? samba_mem(addr, arg) : NULL;
+          if (mem)
+            memcpy(reply, mem, arg);
+          else
+            memset(reply, 0, sizeof(reply));
+          len = arg <= sizeof(reply) ? (int)arg : (int)sizeof(reply);
+          break;
+        }
+        case 'G':
+          if (addr == SIM_FLASH_BASE)
+          {
+            fprintf(stderr, "nxtsim: booting the new firmware, %u page writes\n", page_writes);
+            samba = 0;
+            flash_locked = 0xFFFF;
+            return;
+          }
+          if (addr >= SIM_RAM_BASE && addr + 0x300 + 4 <= SIM_RAM_BASE + SIM_RAM_SIZE)
+            samba_run(addr);
+          break;
+      }
+
+      if (len >= 0)
+      {
+        if (latency)
+          usleep(latency);
+        if (send(client, reply, len, MSG_NOSIGNAL) < 0)
+          return;
+      }
+    }
+  }
+}
+
+static void usage(const char *name)
+{
+  fprintf(stderr, "usage: %s [-l latency_us] [-s service_us] [-q depth] [-t sweep_ms] [-d redraw_ms] [-b] [-c pages] [-a address] [-g wheel_mm:track_mm] [-v] socket\n", name);
+  fprintf(stderr, "  -l  delay before each reply, usec\n");
+  fprintf(stderr, "  -s  time the brick spends on each command, usec\n");
+  fprintf(stderr, "  -q  commands queued before the brick drops them (4)\n");
+  fprintf(stderr, "  -t  sensors sweep their raw value up and down once per sweep_ms\n");
+  fprintf(stderr, "  -d  a dot walks across the display, one pixel every redraw_ms\n");
+  fprintf(stderr, "  -b  start in the SAM-BA bootloader\n");
+  fprintf(stderr, "  -c  every pages-th flash page write comes out wrong\n");
+  fprintf(stderr, "  -a  bluetooth address, 00:16:53:0a:0b:0c\n");
+  fprintf(stderr, "  -g  ground truth pose of a base on A and B, e.g. 56:112\n");
+  fprintf(stderr, "  -v  log every command\n");
+}
+
+int main(int argc, char *argv[])
+{
+  int opt;
+
+  while ((opt = getopt(argc, argv, "l:s:q:t:d:bc:a:g:v")) != -1)
+  {
+    switch (opt)
+    {
+      case 'l':
+        latency = strtoul(optarg, NULL, 10);
+        break;
+      case 's':
+        service = strtoul(optarg, NULL, 10);
+        break;
+      case 'q':
+        depth = strtoul(optarg, NULL, 10);
+        break;
+      case 't':
+        sweep = strtoul(optarg, NULL, 10) * 1000;
+        break;
+      case 'd':
+        redraw = strtoul(optarg, NULL, 10) * 1000;
+        break;
+      case 'b':
+        samba = 1;
+        break;
+      case 'c':
+        corrupt = strtoul(optarg, NULL, 10);
+        break;
+      case 'a':
+        if (sscanf(optarg, "%hhx:%hhx:%hhx:%hhx:%hhx:%hhx", &address[0], &address[1], &address[2],
+                   &address[3], &address[4], &address[5]) != 6)
+        {
+          usage(argv[0]);
+          return 1;
+        }
+        break;
+      case 'g':
+        if (sscanf(optarg, "%lf:%lf", &wheel, &track) != 2 || wheel <= 0 || track <= 0)
+        {
+          usage(argv[0]);
+          return 1;
+        }
+        break;
+      case 'v':
+        verbose = 1;
+        break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+
+  if (optind >= argc)
+  {
+    usage(argv[0]);
+    return 1;
+  }
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(argv[optind]) >= sizeof(addr.sun_path))
+  {
+    fprintf(stderr, "%s: socket path too long\n", argv[optind]);
+    return 1;
+  }
+  strcpy(addr.sun_path, argv[optind]);
+
+  int s = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+  unlink(addr.sun_path);
+  if (s < 0 || bind(s, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(s, 1) < 0)
+  {
+    perror(argv[optind]);
+    return 1;
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+  last_update = now_us();
+
+  // one client at a time, state survives reconnects like a real brick
+  while (1)
+  {
+    int client = accept(s, NULL, NULL);
+    if (client < 0)
+      continue;
+    uint16_t id[2] = { samba ? 0x03EB : 0x0694, samba ? 0x6124 : 0x0002 };
+    send(client, id, sizeof(id), MSG_NOSIGNAL);
+    if (samba)
+      serve_samba(client);
+    else
+      serve(client);
+    close(client);
+  }
+
+  return 0;
+}
@@ -0,0 +1,183 @@
+/**
+        libvile
+        Copyright (C) 2022 Cat (Ivan Epifanov)
+
+        This program is free software: you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        This program is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Odometry against ground truth: nxtsim -g carries a base on A (left)
+ * and B (right) and keeps its true pose. For every period given the base
+ * drives an arc at fixed powers with odometry running, then the pose the
+ * kernel integrated is compared with the sim's, along with the update
+ * rate and read times from vileGetOdometryStats.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "vile.h"
+#include "vile_transport.h"
+
+#define TRUTH_MODULE 0x7F000001 // nxtsim's
+
+static void usage(const char *name)
+{
+  fprintf(stderr, "usage: %s [-p period_us,...] [-t ms] [-l power] [-r power] [-w wheel_mm] [-k track_mm] socket\n", name);
+  fprintf(stderr, "  -p  odometry periods to run, one after the other (2000,5000,10000,50000)\n");
+  fprintf(stderr, "  -t  how long the base drives each time (4000)\n");
+  fprintf(stderr, "  -l  left motor power (40)\n");
+  fprintf(stderr, "  -r  right motor power (60)\n");
+  fprintf(stderr, "  -w  wheel diameter, as given to nxtsim -g (56)\n");
+  fprintf(stderr, "  -k  track width, as given to nxtsim -g (112)\n");
+}
+
+static int set_power(vile_out_t port, int8_t power)
+{
+  // unregulated, so the sim turns the motor at exactly its power
+  vile_setoutputstate_t s = {
+    .port = port,
+    .power = power,
+    .mode = NXT_MOTOR_MODE_ON | NXT_MOTOR_MODE_BRAKE,
+    .regulation = NXT_MOTOR_REGULATION_IDLE,
+    .turn_ratio = 0,
+    .run_state = NXT_MOTOR_RUNSTATE_RUNNING,
+    .tacho_limit = 0
+  };
+  return vileSetOutputState(&s);
+}
+
+static int run(uint32_t period, uint32_t ms, int8_t left, int8_t right, double wheel, double track)
+{
+  double truth[3] = {0};
+  if (vileWriteIOMap(TRUTH_MODULE, 0, sizeof(truth), truth) != sizeof(truth))
+  {
+    fprintf(stderr, "no ground truth, start nxtsim with -g\n");
+    return -1;
+  }
+
+  vile_odometry_t odo = {
+    .left = NXT_OUT_A,
+    .right = NXT_OUT_B,
+    .reversed = 0,
+    .wheel_diameter = (uint32_t)(wheel * 1000),
+    .track_width = (uint32_t)(track * 1000),
+    .period = period
+  };
+  if (vileStartOdometry(&odo) < 0)
+  {
+    fprintf(stderr, "vileStartOdometry failed\n");
+    return -1;
+  }
+
+  set_power(NXT_OUT_A, left);
+  set_power(NXT_OUT_B, right);
+  usleep(ms * 1000);
+  set_power(NXT_OUT_A, 0);
+  set_power(NXT_OUT_B, 0);
+  // a few more updates see the final counts
+  usleep(period * 4 + 20000);
+
+  vile_pose_t pose;
+  vile_odometry_stats_t stats;
+  vileGetPose(&pose);
+  vileGetOdometryStats(&stats);
+  vileStopOdometry();
+
+  if (vileReadIOMap(TRUTH_MODULE, 0, sizeof(truth), truth) != sizeof(truth))
+    return -1;
+
+  double x = pose.x / 1000.0;
+  double y = pose.y / 1000.0;
+  double heading = (int32_t)pose.heading * (M_PI / 2147483648.0);
+  double error = hypot(x - truth[0], y - truth[1]);
+  // both wrapped into one turn
+  double turned = remainder(heading - truth[2], 2 * M_PI);
+
+  printf("period %6u us  %5u updates/s  read %5u us avg %6u max  skew %5u us  "
+         "pose %8.1f %8.1f mm %7.2f deg  truth %8.1f %8.1f mm %7.2f deg  err %6.2f mm %6.3f deg\n",
+         period, stats.rate, stats.read_avg, stats.read_max, stats.skew_avg,
+         x, y, heading * 180 / M_PI, truth[0], truth[1], remainder(truth[2], 2 * M_PI) * 180 / M_PI,
+         error, turned * 180 / M_PI);
+  return 0;
+}
+
+int main(int argc, char *argv[])
+{
+  const char *periods = "2000,5000,10000,50000";
+  uint32_t ms = 4000;
+  int left = 40;
+  int right = 60;
+  double wheel = 56;
+  double track = 112;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "p:t:l:r:w:k:")) != -1)
+  {
+    switch (opt)
+    {
+      case 'p':
+        periods = optarg;
+        break;
+      case 't':
+        ms = strtoul(optarg, NULL, 10);
+        break;
+      case 'l':
+        left = atoi(optarg);
+        break;
+      case 'r':
+        right = atoi(optarg);
+        break;
+      case 'w':
+        wheel = atof(optarg);
+        break;
+      case 'k':
+        track = atof(optarg);
+        break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+
+  if (optind >= argc || left < -100 || left > 100 || right < -100 || right > 100 || wheel <= 0 || track <= 0)
+  {
+    usage(argv[0]);
+    return 1;
+  }
+
+  if (vileUseSocketTransport(argv[optind]) < 0 || vileStart() < 0 || vileWaitReady(2000000) < 0)
+  {
+    fprintf(stderr, "%s: no brick\n", argv[optind]);
+    return 1;
+  }
+
+  printf("%.0f mm wheels, %.0f mm track, powers %d/%d for %u ms\n", wheel, track, left, right, ms);
+
+  int ret = 0;
+  for (const char *p = periods; *p && !ret; )
+  {
+    char *end;
+    uint32_t period = strtoul(p, &end, 10);
+    if (end == p)
+      break;
+    ret = run(period, ms, (int8_t)left, (int8_t)right, wheel, track);
+    p = *end == ',' ? end + 1 : end;
+  }
+
+  vileStop();
+  return ret ? 1 : 0;
+}
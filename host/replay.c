@@ -0,0 +1,276 @@
+/**
+        libvile
+        Copyright (C) 2022 Cat (Ivan Epifanov)
+
+        This program is free software: you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        This program is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+ * usbd for the host build: a single NXT whose bulk pipes are served from
+ * a capture file. Sends are checked against the recorded bytes, receives
+ * return the recorded reply.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <psp2kern/kernel/threadmgr.h>
+#include <psp2kern/usbd.h>
+
+#include "capture.h"
+#include "transport.h"
+#include "vile_replay.h"
+#include "vile_transport.h"
+
+#define REPLAY_DEVICE 1
+
+enum {
+  PIPE_CONTROL = 1,
+  PIPE_OUT,
+  PIPE_IN
+};
+
+static const SceUsbdDeviceDescriptor device_desc = {
+  .bLength = 18,
+  .bDescriptorType = SCE_USBD_DESCRIPTOR_DEVICE,
+  .bcdUSB = 0x0200,
+  .bMaxPacketSize0 = 8,
+  .idVendor = 0x0694,
+  .idProduct = 0x0002,
+  .bNumConfigurations = 1
+};
+
+static const SceUsbdConfigurationDescriptor config_desc = {
+  .bLength = 9,
+  .bDescriptorType = SCE_USBD_DESCRIPTOR_CONFIGURATION,
+  .wTotalLength = 32,
+  .bNumInterfaces = 1,
+  .bConfigurationValue = 1,
+  .bmAttributes = 0xC0
+};
+
+static const SceUsbdEndpointDescriptor endpoint_desc[2] = {
+  { .bLength = 7, .bDescriptorType = SCE_USBD_DESCRIPTOR_ENDPOINT, .bEndpointAddress = 0x82, .bmAttributes = 2, .wMaxPacketSize = 64 },
+  { .bLength = 7, .bDescriptorType = SCE_USBD_DESCRIPTOR_ENDPOINT, .bEndpointAddress = 0x01, .bmAttributes = 2, .wMaxPacketSize = 64 }
+};
+
+// scan order, as the descriptors would follow each other in memory
+static const void *descriptors[] = { &device_desc, &config_desc, &endpoint_desc[0], &endpoint_desc[1] };
+
+static pthread_mutex_t replay_mtx = PTHREAD_MUTEX_INITIALIZER;
+static const SceUsbdDriver *driver = NULL;
+static int attached = 0;
+
+static cap_entry_t *entries = NULL;
+static uint32_t count = 0;
+static uint32_t cursor = 0;
+static unsigned int speed = 1;
+static vile_replay_stats_t stats;
+
+static void replay_attach()
+{
+  if (!driver || !entries || attached)
+    return;
+  if (driver->probe(REPLAY_DEVICE) != SCE_USBD_PROBE_SUCCEEDED)
+    return;
+  attached = (driver->attach(REPLAY_DEVICE) == SCE_USBD_ATTACH_SUCCEEDED);
+}
+
+static void replay_detach()
+{
+  if (driver && attached)
+    driver->detach(REPLAY_DEVICE);
+  attached = 0;
+}
+
+int vileReplayOpen(const char *path, unsigned int speedup)
+{
+  FILE *f = fopen(path, "rb");
+  if (!f)
+    return -1;
+
+  cap_header_t hdr;
+  if (fread(&hdr, sizeof(hdr), 1, f) != 1 || hdr.magic != CAP_MAGIC || hdr.version != CAP_VERSION
+      || hdr.entry_size != sizeof(cap_entry_t))
+  {
+    fclose(f);
+    return -1;
+  }
+
+  cap_entry_t *e = malloc((size_t)hdr.count * sizeof(cap_entry_t));
+  if (!e)
+  {
+    fclose(f);
+    return -1;
+  }
+
+  // a truncated file replays what it has
+  size_t got = fread(e, sizeof(cap_entry_t), hdr.count, f);
+  fclose(f);
+
+  vileReplayClose();
+
+  pthread_mutex_lock(&replay_mtx);
+  entries = e;
+  count = got;
+  cursor = 0;
+  speed = speedup;
+  memset(&stats, 0, sizeof(stats));
+  pthread_mutex_unlock(&replay_mtx);
+
+  replay_attach();
+  return count;
+}
+
+void vileReplayClose(void)
+{
+  replay_detach();
+
+  pthread_mutex_lock(&replay_mtx);
+  free(entries);
+  entries = NULL;
+  count = 0;
+  cursor = 0;
+  pthread_mutex_unlock(&replay_mtx);
+}
+
+int vileGetReplayStats(vile_replay_stats_t *out)
+{
+  pthread_mutex_lock(&replay_mtx);
+  *out = stats;
+  pthread_mutex_unlock(&replay_mtx);
+  return 0;
+}
+
+int vileUseUsbdTransport(void)
+{
+  return nxt_set_transport(&transport_usbd);
+}
+
+/*
+ *  USBD
+ */
+
+int ksceUsbdRegisterDriver(const SceUsbdDriver *drv)
+{
+  driver = drv;
+  replay_attach();
+  return 0;
+}
+
+int ksceUsbdUnregisterDriver(const SceUsbdDriver *drv)
+{
+  if (driver != drv)
+    return -1;
+  replay_detach();
+  driver = NULL;
+  return 0;
+}
+
+void *ksceUsbdScanStaticDescriptor(SceUID device_id, void *start, SceUsbdDescriptorType type)
+{
+  int n = sizeof(descriptors) / sizeof(descriptors[0]);
+  int i = 0;
+
+  if (device_id != REPLAY_DEVICE)
+    return NULL;
+
+  if (start)
+  {
+    while (i < n && descriptors[i] != start)
+      i++;
+    i++;
+  }
+
+  for (; i < n; i++)
+    if (((const unsigned char *)descriptors[i])[1] == type)
+      return (void *)descriptors[i];
+
+  return NULL;
+}
+
+SceUID ksceUsbdOpenPipe(int device_id, SceUsbdEndpointDescriptor *endpoint)
+{
+  if (device_id != REPLAY_DEVICE)
+    return -1;
+  if (!endpoint)
+    return PIPE_CONTROL;
+  return (endpoint->bEndpointAddress & 0x80) ? PIPE_IN : PIPE_OUT;
+}
+
+int ksceUsbdClosePipe(SceUID pipe_id)
+{
+  return 0;
+}
+
+int ksceUsbdSetConfiguration(SceUID pipe_id, int config_num, ksceUsbdDoneCallback cb, void *user_data)
+{
+  cb(0, 0, user_data);
+  return 0;
+}
+
+int ksceUsbdBulkTransfer(SceUID pipe_id, unsigned char *buffer, unsigned int length, ksceUsbdDoneCallback cb, void *user_data)
+{
+  uint8_t dir = (pipe_id == PIPE_IN) ? CAP_RECV : CAP_SEND;
+
+  pthread_mutex_lock(&replay_mtx);
+
+  while (cursor < count && entries[cursor].dir != dir)
+  {
+    cursor++;
+    stats.skipped++;
+  }
+
+  if (cursor >= count)
+  {
+    stats.exhausted++;
+    pthread_mutex_unlock(&replay_mtx);
+    return -1;
+  }
+
+  cap_entry_t *e = &entries[cursor++];
+  stats.replayed++;
+
+  if (dir == CAP_SEND)
+  {
+    unsigned int n = length < CAP_PACKET_SIZE ? length : CAP_PACKET_SIZE;
+    if (length != e->length || memcmp(buffer, e->data, n) != 0)
+      stats.mismatched++;
+  }
+  else if (e->result > 0)
+  {
+    unsigned int n = (unsigned int)e->result;
+    if (n > length)
+      n = length;
+    if (n > CAP_PACKET_SIZE)
+      n = CAP_PACKET_SIZE;
+    memcpy(buffer, e->data, n);
+  }
+
+  int32_t result = e->result;
+  uint32_t delay = speed ? e->duration / speed : 0;
+
+  pthread_mutex_unlock(&replay_mtx);
+
+  // the original submit failed, fail the same way
+  if (result < 0)
+    return result;
+
+  if (delay)
+    ksceKernelDelayThread(delay);
+  cb(0, result, user_data);
+  return 0;
+}
@@ -0,0 +1,249 @@
+/**
+        libvile
+        Copyright (C) 2022 Cat (Ivan Epifanov)
+
+        This program is free software: you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        This program is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Converts 16-bit PCM .wav files to .rso and times the conversion, so a
+ * corpus of files doubles as a benchmark. With -u the result goes to a
+ * brick (or nxtsim) and plays.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <libgen.h>
+#include "vile.h"
+#include "vilerso.h"
+#include "vile_transport.h"
+
+typedef struct {
+  int16_t *pcm;
+  uint32_t frames;
+  uint32_t channels;
+  uint32_t rate;
+} wav_t;
+
+static uint64_t now_us()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint32_t le32(const uint8_t *p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint16_t le16(const uint8_t *p)
+{
+  return p[0] | (p[1] << 8);
+}
+
+// 16-bit PCM only
+static int load_wav(const char *path, wav_t *wav)
+{
+  FILE *f = fopen(path, "rb");
+  if (!f)
+    return -1;
+
+  uint8_t hdr[12];
+  if (fread(hdr, 1, 12, f) != 12 || memcmp(hdr, "RIFF", 4) || memcmp(hdr + 8, "WAVE", 4))
+  {
+    fclose(f);
+    return -1;
+  }
+
+  int have_fmt = 0;
+  uint8_t chunk[8];
+  while (fread(chunk, 1, 8, f) == 8)
+  {
+    uint32_t size = le32(chunk + 4);
+    if (!memcmp(chunk, "fmt ", 4) && size >= 16)
+    {
+      uint8_t fmt[16];
+      if (fread(fmt, 1, 16, f) != 16)
+        break;
+      fseek(f, size - 16 + (size & 1), SEEK_CUR);
+      if (le16(fmt) != 1 || le16(fmt + 14) != 16)
+        break;
+      wav->channels = le16(fmt + 2);
+      wav->rate = le32(fmt + 4);
+      have_fmt = wav->channels > 0;
+    }
+    else if (!memcmp(chunk, "data", 4) && have_fmt)
+    {
+      wav->frames = size / (2 * wav->channels);
+      wav->pcm = malloc((size_t)wav->frames * wav->channels * 2);
+      if (!wav->pcm || fread(wav->pcm, 2 * wav->channels, wav->frames, f) != wav->frames)
+        break;
+      fclose(f);
+      return 0;
+    }
+    else
+    {
+      fseek(f, size + (size & 1), SEEK_CUR);
+    }
+  }
+
+  free(wav->pcm);
+  wav->pcm = NULL;
+  fclose(f);
+  return -1;
+}
+
+static void usage(const char *name)
+{
+  fprintf(stderr, "usage: %s [-r rate] [-n runs] [-o dir] [-u socket] file.wav...\n", name);
+  fprintf(stderr, "  -r  output rate, %d..%d Hz (8000)\n", VILE_RSO_MIN_RATE, VILE_RSO_MAX_RATE);
+  fprintf(stderr, "  -n  convert every file this many times for timing (1)\n");
+  fprintf(stderr, "  -o  write the .rso files to dir\n");
+  fprintf(stderr, "  -u  upload each file through the socket transport and play it\n");
+}
+
+int main(int argc, char *argv[])
+{
+  uint32_t rate = 8000;
+  int runs = 1;
+  const char *outdir = NULL;
+  const char *sock = NULL;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "r:n:o:u:")) != -1)
+  {
+    switch (opt)
+    {
+      case 'r':
+        rate = strtoul(optarg, NULL, 10);
+        break;
+      case 'n':
+        runs = atoi(optarg);
+        break;
+      case 'o':
+        outdir = optarg;
+        break;
+      case 'u':
+        sock = optarg;
+        break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+
+  if (optind >= argc || runs < 1 || rate < VILE_RSO_MIN_RATE || rate > VILE_RSO_MAX_RATE)
+  {
+    usage(argv[0]);
+    return 1;
+  }
+
+  if (sock && (vileUseSocketTransport(sock) < 0 || vileStart() < 0 || vileWaitReady(2000000) < 0))
+  {
+    fprintf(stderr, "%s: no brick\n", sock);
+    return 1;
+  }
+
+  uint64_t total_frames = 0, total_us = 0;
+  double total_seconds = 0;
+  int failed = 0;
+
+  for (int i = optind; i < argc; i++)
+  {
+    wav_t wav = {0};
+    if (load_wav(argv[i], &wav) < 0)
+    {
+      fprintf(stderr, "%s: not a 16-bit PCM wav\n", argv[i]);
+      failed++;
+      continue;
+    }
+
+    uint32_t size = vileRsoSize(wav.frames, wav.rate, rate);
+    uint8_t *rso = malloc(size ? size : 1);
+    int ret = -1;
+
+    uint64_t t0 = now_us();
+    for (int r = 0; r < runs; r++)
+      ret = vileRsoConvert(wav.pcm, wav.frames, wav.channels, wav.rate, rate, rso, size);
+    uint64_t took = (now_us() - t0) / runs;
+
+    // the input actually converted, long files are cut
+    uint32_t used = size ? (uint32_t)((uint64_t)(size - VILE_RSO_HEADER) * wav.rate / rate) : 0;
+    double seconds = (double)used / wav.rate;
+    printf("%s: %u Hz x%u, %.2f s -> %d bytes, %.2f ms, %.0fx realtime\n",
+           argv[i], wav.rate, wav.channels, seconds, ret, took / 1000.0, took ? seconds * 1000000 / took : 0);
+
+    if (ret > 0)
+    {
+      total_frames += used;
+      total_us += took;
+      total_seconds += seconds;
+    }
+    else
+    {
+      failed++;
+    }
+
+    // brick names are 15.3
+    char name[20];
+    char *base = basename(argv[i]);
+    snprintf(name, sizeof(name), "%.15s", base);
+    char *dot = strrchr(name, '.');
+    if (dot)
+      *dot = 0;
+    strcat(name, ".rso");
+
+    if (ret > 0 && outdir)
+    {
+      char path[4096];
+      snprintf(path, sizeof(path), "%s/%s", outdir, name);
+      FILE *f = fopen(path, "wb");
+      if (!f || fwrite(rso, 1, ret, f) != (size_t)ret)
+      {
+        perror(path);
+        failed++;
+      }
+      if (f)
+        fclose(f);
+    }
+
+    if (ret > 0 && sock)
+    {
+      vile_upload_stats_t st;
+      if (vileUploadFile(name, rso, ret) != ret || vilePlaySoundfile(name, 0) < 0)
+      {
+        fprintf(stderr, "%s: upload failed\n", name);
+        failed++;
+      }
+      vileGetUploadStats(&st);
+      printf("  uploaded as %s in %.1f ms, %u bytes/s\n", name, st.last_us / 1000.0, st.last_rate);
+    }
+
+    free(rso);
+    free(wav.pcm);
+  }
+
+  if (total_us)
+    printf("total: %.2f s of audio in %.2f ms, %.1f Mframes/s, %.0fx realtime\n",
+           total_seconds, total_us / 1000.0, (double)total_frames / total_us, total_seconds * 1000000 / total_us);
+
+  if (sock)
+    vileStop();
+
+  return failed ? 1 : 0;
+}
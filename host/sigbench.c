@@ -0,0 +1,168 @@
+/**
+        libvile
+        Copyright (C) 2022 Cat (Ivan Epifanov)
+
+        This program is free software: you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        This program is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+ * libvilesig throughput: a synthetic recording (a noisy sine with spikes,
+ * in vile_sample_t records) goes through every kernel, best of a few
+ * runs, in samples per second. The check column is a sum of each result,
+ * so builds with different backends (-DVILE_SIG_SCALAR=ON) can be
+ * compared for the same output.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "vile.h"
+#include "vilesig.h"
+
+static uint64_t now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static double sum_f(const float *v, uint32_t n)
+{
+  double s = 0;
+  for (uint32_t i = 0; i < n; i++)
+    s += v[i];
+  return s;
+}
+
+static double sum_i(const int16_t *v, uint32_t n)
+{
+  double s = 0;
+  for (uint32_t i = 0; i < n; i++)
+    s += v[i];
+  return s;
+}
+
+static void report(const char *name, uint64_t best, uint32_t n, double check)
+{
+  printf("%-16s %8.1f Msamples/s %10.3f ms   check %.6g\n", name, n * 1000.0 / best, best / 1e6, check);
+}
+
+static void usage(const char *name)
+{
+  fprintf(stderr, "usage: %s [-n samples] [-r runs] [-w median_window] [-a average_window]\n", name);
+  fprintf(stderr, "  -n  samples in the recording (1000000)\n");
+  fprintf(stderr, "  -r  runs of each kernel, the best one counts (20)\n");
+  fprintf(stderr, "  -w  median window, odd, up to %d (5)\n", VILE_SIG_MEDIAN_MAX);
+  fprintf(stderr, "  -a  moving average window (16)\n");
+}
+
+#define BENCH(name, check, call) \
+  do { \
+    uint64_t best = UINT64_MAX; \
+    for (int r = 0; r < runs; r++) \
+    { \
+      uint64_t t = now_ns(); \
+      call; \
+      t = now_ns() - t; \
+      if (t < best) \
+        best = t; \
+    } \
+    report(name, best, n, check); \
+  } while (0)
+
+int main(int argc, char *argv[])
+{
+  uint32_t n = 1000000;
+  int runs = 20;
+  uint32_t median = 5;
+  uint32_t average = 16;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "n:r:w:a:")) != -1)
+  {
+    switch (opt)
+    {
+      case 'n':
+        n = strtoul(optarg, NULL, 10);
+        break;
+      case 'r':
+        runs = atoi(optarg);
+        break;
+      case 'w':
+        median = strtoul(optarg, NULL, 10);
+        break;
+      case 'a':
+        average = strtoul(optarg, NULL, 10);
+        break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+
+  if (!n || runs < 1 || !(median & 1) || median > VILE_SIG_MEDIAN_MAX || !average)
+  {
+    usage(argv[0]);
+    return 1;
+  }
+
+  vile_sample_t *rec = calloc(n, sizeof(vile_sample_t));
+  float *f = malloc(n * sizeof(float));
+  int16_t *m = malloc(n * sizeof(int16_t));
+  vile_sig_crossing_t *x = malloc(n * sizeof(vile_sig_crossing_t));
+  vile_sig_batch_t b;
+  if (!rec || !f || !m || !x || vileSigBatchInit(&b, n) < 0)
+  {
+    fprintf(stderr, "out of memory\n");
+    return 1;
+  }
+
+  srand(1);
+  for (uint32_t i = 0; i < n; i++)
+  {
+    int v = 512 + (int)(300 * sin(i * 0.001)) + rand() % 21 - 10;
+    if (rand() % 100 == 0)
+      v += rand() % 2 ? 200 : -200;
+    v = v < 0 ? 0 : v > 1023 ? 1023 : v;
+    rec[i].input.raw_value = v;
+    rec[i].input.normalized_value = v;
+    rec[i].input.scaled_value = v * 100 / 1023;
+  }
+
+  printf("%s, %u samples, best of %d\n", vileSigBackend(), n, runs);
+
+  BENCH("gather", sum_i(b.raw, n), vileSigGather(&b, &rec[0].input, sizeof(vile_sample_t), n));
+  BENCH("scale", sum_f(f, n), vileSigScale(b.raw, n, 0.0048828125f, -0.5f, f));
+
+  char name[32];
+  snprintf(name, sizeof(name), "average %u", average);
+  BENCH(name, sum_f(f, n), vileSigMovingAverage(b.raw, n, average, f));
+  snprintf(name, sizeof(name), "median %u", median);
+  BENCH(name, sum_i(m, n), vileSigMedian(b.raw, n, median, m));
+  BENCH("derivative 2", sum_f(f, n), vileSigDerivative(b.raw, n, 2, 250.0f, f));
+
+  // crossings of the filtered signal, the raw one chatters
+  uint32_t found = 0;
+  BENCH("crossings", found, found = vileSigCrossings(m, n, 512, x, n));
+
+  vileSigBatchFree(&b);
+  free(x);
+  free(m);
+  free(f);
+  free(rec);
+  return 0;
+}
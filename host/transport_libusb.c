@@ -0,0 +1,316 @@
+/**
+        libvile
+        Copyright (C) 2022 Cat (Ivan Epifanov)
+
+        This program is free software: you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        This program is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Transport to a real brick on a Linux host. Transfers are libusb async
+ * transfers completed by an event thread, so cancel works the same way
+ * it does on the Vita. A brick that went away, or came back as its
+ * SAM-BA bootloader, is opened again the next time anyone asks.
+ */
+
+#include "transport.h"
+#include "vile_transport.h"
+
+#ifdef VILE_HAVE_LIBUSB
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <libusb.h>
+
+#define NXT_USB_ID_VENDOR_LEGO 0x0694
+#define NXT_USB_ID_PRODUCT_NXT 0x0002
+#define NXT_USB_ENDPOINT_OUT 0x01
+#define NXT_USB_ENDPOINT_IN 0x82
+#define NXT_USB_TIMEOUT 1000 // msec
+#define NXT_USB_INTERFACE 0
+#define NXT_USB_ID_VENDOR_ATMEL 0x03EB
+#define NXT_USB_ID_PRODUCT_SAMBA 0x6124
+#define SAMBA_USB_INTERFACE 1 // CDC data, same endpoints as the brick
+
+typedef struct {
+  nxt_transport_done_t done;
+  void *arg;
+  int slot;
+} pending_t;
+
+typedef struct {
+  pthread_mutex_t mtx;
+  pthread_cond_t cond;
+  int finished;
+  int32_t result;
+  int32_t count;
+} waiter_t;
+
+static libusb_context *ctx = NULL;
+static libusb_device_handle *handle = NULL;
+static pthread_t events_thread;
+static volatile int running = 0;
+static int interface = NXT_USB_INTERFACE;
+static volatile int samba = 0;
+static volatile int lost = 0; // gone from the bus, closed on the next look
+
+// one transfer per direction can be in flight, the bus lock sees to that;
+// also guards handle
+static pthread_mutex_t inflight_mtx = PTHREAD_MUTEX_INITIALIZER;
+static struct libusb_transfer *inflight[2];
+
+static void *events_main(void *arg)
+{
+  struct timeval tv = { 0, 100000 };
+  while (running)
+    libusb_handle_events_timeout_completed(ctx, &tv, NULL);
+  return NULL;
+}
+
+// inflight_mtx held
+static int lusb_open()
+{
+  int boot = 0;
+  libusb_device_handle *h = libusb_open_device_with_vid_pid(ctx, NXT_USB_ID_VENDOR_LEGO, NXT_USB_ID_PRODUCT_NXT);
+  if (!h)
+  {
+    h = libusb_open_device_with_vid_pid(ctx, NXT_USB_ID_VENDOR_ATMEL, NXT_USB_ID_PRODUCT_SAMBA);
+    boot = h != NULL;
+  }
+  if (!h)
+    return -1;
+
+  int iface = boot ? SAMBA_USB_INTERFACE : NXT_USB_INTERFACE;
+  libusb_set_auto_detach_kernel_driver(h, 1);
+  if (libusb_claim_interface(h, iface) < 0)
+  {
+    libusb_close(h);
+    return -1;
+  }
+
+  handle = h;
+  interface = iface;
+  samba = boot;
+  lost = 0;
+  if (!boot)
+    restore_attached();
+  return 0;
+}
+
+// inflight_mtx held
+static void lusb_close()
+{
+  if (!handle)
+    return;
+  libusb_release_interface(handle, interface);
+  libusb_close(handle);
+  handle = NULL;
+  if (!samba)
+    restore_detached();
+  samba = 0;
+}
+
+static int lusb_start()
+{
+  if (libusb_init(&ctx) < 0)
+    return -1;
+
+  pthread_mutex_lock(&inflight_mtx);
+  int ret = lusb_open();
+  pthread_mutex_unlock(&inflight_mtx);
+  if (ret < 0)
+  {
+    fprintf(stderr, "vile: no NXT found\n");
+    libusb_exit(ctx);
+    ctx = NULL;
+    return -1;
+  }
+
+  running = 1;
+  pthread_create(&events_thread, NULL, events_main, NULL);
+  return 0;
+}
+
+static void lusb_stop()
+{
+  if (!ctx)
+    return;
+
+  running = 0;
+  pthread_join(events_thread, NULL);
+
+  pthread_mutex_lock(&inflight_mtx);
+  if (handle)
+  {
+    libusb_release_interface(handle, interface);
+    libusb_close(handle);
+  }
+  handle = NULL;
+  samba = 0;
+  pthread_mutex_unlock(&inflight_mtx);
+  libusb_exit(ctx);
+  ctx = NULL;
+}
+
+// 1 for a brick, 2 for SAM-BA, 0 for nothing
+static int lusb_device()
+{
+  pthread_mutex_lock(&inflight_mtx);
+  if (lost && !inflight[0] && !inflight[1])
+    lusb_close();
+  if (!handle && ctx)
+    lusb_open();
+  int ret = handle ? (samba ? 2 : 1) : 0;
+  pthread_mutex_unlock(&inflight_mtx);
+  return ret;
+}
+
+static int lusb_connected()
+{
+  return lusb_device() == 1;
+}
+
+static int lusb_bootloader()
+{
+  return lusb_device() == 2;
+}
+
+static void LIBUSB_CALL transfer_done(struct libusb_transfer *xfer)
+{
+  pending_t *p = xfer->user_data;
+
+  pthread_mutex_lock(&inflight_mtx);
+  inflight[p->slot] = NULL;
+  if (xfer->status == LIBUSB_TRANSFER_NO_DEVICE)
+    lost = 1;
+  pthread_mutex_unlock(&inflight_mtx);
+
+  int32_t result = (xfer->status == LIBUSB_TRANSFER_COMPLETED) ? 0 : -1;
+  p->done(result, xfer->actual_length, p->arg);
+
+  free(p);
+  libusb_free_transfer(xfer);
+}
+
+static int lusb_submit(uint8_t dir, unsigned char *data, unsigned int length, nxt_transport_done_t done, void *arg)
+{
+  struct libusb_transfer *xfer = libusb_alloc_transfer(0);
+  pending_t *p = malloc(sizeof(pending_t));
+  if (!xfer || !p)
+  {
+    libusb_free_transfer(xfer);
+    free(p);
+    return -1;
+  }
+
+  p->done = done;
+  p->arg = arg;
+  p->slot = (dir == NXT_TRANSPORT_IN);
+
+  pthread_mutex_lock(&inflight_mtx);
+  int ret = -1;
+  if (handle && !lost)
+  {
+    libusb_fill_bulk_transfer(xfer, handle, (dir == NXT_TRANSPORT_IN) ? NXT_USB_ENDPOINT_IN : NXT_USB_ENDPOINT_OUT,
+                              data, length, transfer_done, p, NXT_USB_TIMEOUT);
+    inflight[p->slot] = xfer;
+    ret = libusb_submit_transfer(xfer);
+    if (ret < 0)
+    {
+      inflight[p->slot] = NULL;
+      if (ret == LIBUSB_ERROR_NO_DEVICE)
+        lost = 1;
+    }
+  }
+  pthread_mutex_unlock(&inflight_mtx);
+
+  if (ret < 0)
+  {
+    libusb_free_transfer(xfer);
+    free(p);
+    return -1;
+  }
+  return 0;
+}
+
+static void wake(int32_t result, int32_t count, void *arg)
+{
+  waiter_t *w = arg;
+  pthread_mutex_lock(&w->mtx);
+  w->result = result;
+  w->count = count;
+  w->finished = 1;
+  pthread_cond_signal(&w->cond);
+  pthread_mutex_unlock(&w->mtx);
+}
+
+static int lusb_wait(uint8_t dir, unsigned char *data, unsigned int length)
+{
+  waiter_t w = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0, 0 };
+
+  if (lusb_submit(dir, data, length, wake, &w) < 0)
+    return -1;
+
+  pthread_mutex_lock(&w.mtx);
+  while (!w.finished)
+    pthread_cond_wait(&w.cond, &w.mtx);
+  pthread_mutex_unlock(&w.mtx);
+
+  return w.result < 0 ? -1 : w.count;
+}
+
+static int lusb_send(const unsigned char *data, unsigned int length)
+{
+  return lusb_wait(NXT_TRANSPORT_OUT, (unsigned char *)data, length);
+}
+
+static int lusb_recv(unsigned char *data, unsigned int length)
+{
+  return lusb_wait(NXT_TRANSPORT_IN, data, length);
+}
+
+static void lusb_cancel()
+{
+  pthread_mutex_lock(&inflight_mtx);
+  for (int i = 0; i < 2; i++)
+    if (inflight[i])
+      libusb_cancel_transfer(inflight[i]);
+  pthread_mutex_unlock(&inflight_mtx);
+}
+
+static const nxt_transport_t transport_libusb = {
+  .name = "libusb",
+  .start = lusb_start,
+  .stop = lusb_stop,
+  .connected = lusb_connected,
+  .send = lusb_send,
+  .recv = lusb_recv,
+  .submit = lusb_submit,
+  .cancel = lusb_cancel,
+  .bootloader = lusb_bootloader
+};
+
+int vileUseLibusbTransport(void)
+{
+  return nxt_set_transport(&transport_libusb);
+}
+
+#else
+
+int vileUseLibusbTransport(void)
+{
+  return -1;
+}
+
+#endif // VILE_HAVE_LIBUSB
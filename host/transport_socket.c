@@ -0,0 +1,189 @@
+/**
+        libvile
+        Copyright (C) 2022 Cat (Ivan Epifanov)
+
+        This program is free software: you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        This program is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Transport over a SOCK_SEQPACKET unix socket, one datagram per USB packet,
+ * so a simulator (nxtsim) can stand in for the brick. The first datagram
+ * is the device's vendor and product id, the way a descriptor tells a
+ * brick from its SAM-BA bootloader.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "transport.h"
+#include "vile_transport.h"
+
+static char sock_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+static volatile int fd = -1;
+static volatile int started = 0;
+static volatile int samba = 0;
+
+static int socket_open()
+{
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  memcpy(addr.sun_path, sock_path, sizeof(addr.sun_path));
+
+  int s = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+  if (s < 0)
+    return -1;
+
+  if (connect(s, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+  {
+    close(s);
+    return -1;
+  }
+
+  uint16_t id[2];
+  struct timeval tv = { 1, 0 }, none = { 0, 0 };
+  setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  if (recv(s, id, sizeof(id), 0) != sizeof(id))
+  {
+    close(s);
+    return -1;
+  }
+  setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &none, sizeof(none));
+
+  fd = s;
+  samba = id[0] == 0x03EB && id[1] == 0x6124;
+  if (!samba)
+    restore_attached();
+  return 0;
+}
+
+static int socket_start()
+{
+  started = 1;
+  if (socket_open() < 0)
+  {
+    fprintf(stderr, "vile: can't connect to %s\n", sock_path);
+    return -1;
+  }
+  return 0;
+}
+
+static void socket_stop()
+{
+  started = 0;
+  if (fd >= 0)
+    close(fd);
+  fd = -1;
+  samba = 0;
+}
+
+// the simulator went away, like a brick being unplugged
+static void socket_lost()
+{
+  int s = fd;
+  fd = -1;
+  if (s >= 0)
+  {
+    close(s);
+    if (!samba)
+      restore_detached();
+  }
+  samba = 0;
+}
+
+// 1 for a brick, 2 for SAM-BA, 0 for nothing
+static int socket_device()
+{
+  // a device that rebooted hangs up without anybody noticing
+  struct pollfd p = { fd, 0, 0 };
+  if (fd >= 0 && poll(&p, 1, 0) > 0 && (p.revents & POLLHUP))
+    socket_lost();
+
+  // a restarted simulator is picked up the next time anyone asks
+  if (fd < 0 && started)
+    socket_open();
+  return fd < 0 ? 0 : samba ? 2 : 1;
+}
+
+static int socket_connected()
+{
+  return socket_device() == 1;
+}
+
+static int socket_bootloader()
+{
+  return socket_device() == 2;
+}
+
+static int socket_send(const unsigned char *data, unsigned int length)
+{
+  if (fd < 0)
+    return -1;
+  ssize_t n = send(fd, data, length, MSG_NOSIGNAL);
+  if (n < 0)
+    socket_lost();
+  return n < 0 ? -1 : (int)n;
+}
+
+static int socket_recv(unsigned char *data, unsigned int length)
+{
+  if (fd < 0)
+    return -1;
+  // 0 is the simulator hanging up, not an empty packet
+  ssize_t n = recv(fd, data, length, 0);
+  if (n <= 0)
+    socket_lost();
+  return n <= 0 ? -1 : (int)n;
+}
+
+static int socket_submit(uint8_t dir, unsigned char *data, unsigned int length, nxt_transport_done_t done, void *arg)
+{
+  if (fd < 0)
+    return -1;
+  int n = (dir == NXT_TRANSPORT_IN) ? socket_recv(data, length) : socket_send(data, length);
+  done(n < 0 ? -1 : 0, n < 0 ? 0 : n, arg);
+  return 0;
+}
+
+static void socket_cancel()
+{
+  // wakes a blocked recv with an error, the socket stays open for stop
+  if (fd >= 0)
+    shutdown(fd, SHUT_RDWR);
+}
+
+static const nxt_transport_t transport_socket = {
+  .name = "socket",
+  .start = socket_start,
+  .stop = socket_stop,
+  .connected = socket_connected,
+  .send = socket_send,
+  .recv = socket_recv,
+  .submit = socket_submit,
+  .cancel = socket_cancel,
+  .bootloader = socket_bootloader
+};
+
+int vileUseSocketTransport(const char *path)
+{
+  if (strlen(path) >= sizeof(sock_path))
+    return -1;
+  strcpy(sock_path, path);
+  return nxt_set_transport(&transport_socket);
+}
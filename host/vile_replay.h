@@ -0,0 +1,49 @@
+/**
+        libvile
+        Copyright (C) 2022 Cat (Ivan Epifanov)
+
+        This program is free software: you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        This program is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef __VILE_REPLAY_H__
+#define __VILE_REPLAY_H__
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+  uint32_t replayed; // transfers served from the capture
+  uint32_t mismatched; // sends whose bytes differ from the recorded ones
+  uint32_t skipped; // recorded entries passed over to find the next one of the right direction
+  uint32_t exhausted; // transfers issued after the capture ran out
+} vile_replay_stats_t;
+
+/*
+ * Load a capture saved by vileSaveCapture and present it as an attached NXT.
+ * speedup 0 - complete transfers immediately, 1 - recorded device latency,
+ * N - recorded latency divided by N.
+ */
+int vileReplayOpen(const char *path, unsigned int speedup);
+// detach the replayed brick and free the capture
+void vileReplayClose(void);
+int vileGetReplayStats(vile_replay_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __VILE_REPLAY_H__
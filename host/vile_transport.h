@@ -0,0 +1,40 @@
+/**
+        libvile
+        Copyright (C) 2022 Cat (Ivan Epifanov)
+
+        This program is free software: you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        This program is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef __VILE_TRANSPORT_H__
+#define __VILE_TRANSPORT_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Pick the link used by the host build, call before vileStart.
+ * Default is usbd, which on the host is the capture replay (vile_replay.h).
+ */
+int vileUseUsbdTransport(void);
+// SOCK_SEQPACKET unix socket, e.g. the one nxtsim listens on
+int vileUseSocketTransport(const char *path);
+// first NXT found by libusb, -1 when built without libusb
+int vileUseLibusbTransport(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __VILE_TRANSPORT_H__
@@ -0,0 +1,296 @@
+/**
+        libvile
+        Copyright (C) 2022 Cat (Ivan Epifanov)
+
+        This program is free software: you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        This program is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "vilelog.h"
+
+struct vilelog {
+  FILE *f;
+  tlm_header_t hdr;
+  uint32_t blocks;
+  int nfields;
+
+  uint8_t *block;
+  uint32_t next_block;
+  const uint8_t *p;
+  const uint8_t *end;
+
+  uint8_t keyed;
+  int32_t fields[TLM_MAX_FIELDS];
+  uint64_t last_time;
+  uint64_t skip_until;
+};
+
+static int read_block_header(vilelog_t *log, uint32_t idx, tlm_block_t *blk)
+{
+  if (fseek(log->f, log->hdr.header_size + (long)idx * log->hdr.block_size, SEEK_SET) < 0)
+    return -1;
+  if (fread(blk, sizeof(tlm_block_t), 1, log->f) != 1)
+    return -1;
+  return (blk->magic == TLM_BLOCK_MAGIC) ? 0 : -1;
+}
+
+static int load_block(vilelog_t *log, uint32_t idx)
+{
+  if (idx >= log->blocks)
+    return 0;
+
+  if (fseek(log->f, log->hdr.header_size + (long)idx * log->hdr.block_size, SEEK_SET) < 0)
+    return -1;
+
+  size_t got = fread(log->block, 1, log->hdr.block_size, log->f);
+  tlm_block_t *blk = (tlm_block_t *)log->block;
+
+  if (got < sizeof(tlm_block_t) || blk->magic != TLM_BLOCK_MAGIC)
+    return -1;
+
+  size_t used = blk->used;
+  if (used > got - sizeof(tlm_block_t))
+    used = got - sizeof(tlm_block_t);
+
+  log->p = (const uint8_t *)(blk + 1);
+  log->end = log->p + used;
+  log->next_block = idx + 1;
+  log->keyed = 0;
+  log->last_time = blk->time;
+  return 1;
+}
+
+static void unpack_fields(const vilelog_t *log, vilelog_record_t *rec)
+{
+  const int32_t *f = log->fields;
+
+  memset(rec->in, 0, sizeof(rec->in));
+  memset(rec->out, 0, sizeof(rec->out));
+
+  for (int i = 0; i < TLM_INPUTS; i++)
+  {
+    if (!(log->hdr.inputs & (1 << i)))
+      continue;
+
+    vilelog_input_t *in = &rec->in[i];
+    in->raw_value = f[TLM_IN_RAW];
+    in->normalized_value = f[TLM_IN_NORMALIZED];
+    in->scaled_value = f[TLM_IN_SCALED];
+    in->valid = f[TLM_IN_STATE] & 1;
+    in->calibrated = (f[TLM_IN_STATE] >> 1) & 1;
+    in->sensor_type = (f[TLM_IN_STATE] >> 8) & 0xFF;
+    in->sensor_mode = (f[TLM_IN_STATE] >> 16) & 0xFF;
+    f += TLM_IN_FIELDS;
+  }
+
+  for (int i = 0; i < TLM_OUTPUTS; i++)
+  {
+    if (!(log->hdr.outputs & (1 << i)))
+      continue;
+
+    vilelog_output_t *out = &rec->out[i];
+    out->power = f[TLM_OUT_POWER];
+    out->mode = f[TLM_OUT_STATE] & 0xFF;
+    out->regulation = (f[TLM_OUT_STATE] >> 8) & 0xFF;
+    out->run_state = (f[TLM_OUT_STATE] >> 16) & 0xFF;
+    out->turn_ratio = f[TLM_OUT_TURN_RATIO];
+    out->tacho_limit = (uint32_t)f[TLM_OUT_TACHO_LIMIT];
+    out->tacho_count = f[TLM_OUT_TACHO_COUNT];
+    out->block_tacho_count = f[TLM_OUT_BLOCK_TACHO_COUNT];
+    out->rotation_count = f[TLM_OUT_ROTATION_COUNT];
+    f += TLM_OUT_FIELDS;
+  }
+}
+
+static int decode_record(vilelog_t *log, vilelog_record_t *rec)
+{
+  const uint8_t *p = log->p;
+  const uint8_t *end = log->end;
+  uint64_t v;
+
+  uint8_t tag = *p++;
+
+  switch (tag)
+  {
+    case TLM_REC_KEYFRAME:
+      if (!(p = tlm_get_varint(p, end, &v)))
+        return -1;
+      log->last_time = v;
+      for (int i = 0; i < log->nfields; i++)
+      {
+        if (!(p = tlm_get_varint(p, end, &v)))
+          return -1;
+        log->fields[i] = tlm_unzigzag((uint32_t)v);
+      }
+      log->keyed = 1;
+
+      rec->kind = VILELOG_SAMPLE;
+      rec->keyframe = 1;
+      rec->time = log->last_time;
+      unpack_fields(log, rec);
+      break;
+
+    case TLM_REC_SAMPLE:
+    {
+      uint64_t mask;
+
+      if (!log->keyed)
+        return -1;
+      if (!(p = tlm_get_varint(p, end, &v)))
+        return -1;
+      log->last_time += (int64_t)tlm_unzigzag((uint32_t)v) + log->hdr.period;
+      if (!(p = tlm_get_varint(p, end, &mask)))
+        return -1;
+      for (int i = 0; i < log->nfields; i++)
+      {
+        if (!(mask & (1ULL << i)))
+          continue;
+        if (!(p = tlm_get_varint(p, end, &v)))
+          return -1;
+        log->fields[i] = (int32_t)((uint32_t)log->fields[i] + (uint32_t)tlm_unzigzag((uint32_t)v));
+      }
+
+      rec->kind = VILELOG_SAMPLE;
+      rec->keyframe = 0;
+      rec->time = log->last_time;
+      unpack_fields(log, rec);
+      break;
+    }
+
+    case TLM_REC_COMMAND:
+      if (!(p = tlm_get_varint(p, end, &v)))
+        return -1;
+      if (end - p < 2)
+        return -1;
+
+      rec->kind = VILELOG_COMMAND;
+      rec->time = log->last_time + tlm_unzigzag((uint32_t)v);
+      rec->opcode = *p++;
+      rec->length = *p++;
+      if (end - p < rec->length)
+        return -1;
+      memcpy(rec->payload, p, rec->length);
+      p += rec->length;
+      break;
+
+    default:
+      return -1;
+  }
+
+  log->p = p;
+  return 1;
+}
+
+vilelog_t *vilelog_open(const char *path)
+{
+  vilelog_t *log = calloc(1, sizeof(vilelog_t));
+  if (!log)
+    return NULL;
+
+  log->f = fopen(path, "rb");
+  if (!log->f)
+    goto fail;
+
+  if (fread(&log->hdr, sizeof(tlm_header_t), 1, log->f) != 1)
+    goto fail;
+
+  if (log->hdr.magic != TLM_MAGIC || log->hdr.version != TLM_VERSION)
+    goto fail;
+
+  if (log->hdr.block_size < sizeof(tlm_block_t) + TLM_RECORD_MAX)
+    goto fail;
+
+  fseek(log->f, 0, SEEK_END);
+  long size = ftell(log->f);
+  // a short trailing block still counts, it is what a crash leaves behind
+  log->blocks = (size - log->hdr.header_size + log->hdr.block_size - 1) / log->hdr.block_size;
+  log->nfields = tlm_field_count(log->hdr.inputs, log->hdr.outputs);
+
+  log->block = malloc(log->hdr.block_size);
+  if (!log->block)
+    goto fail;
+
+  log->p = log->end = NULL;
+  log->next_block = 0;
+  return log;
+
+fail:
+  vilelog_close(log);
+  return NULL;
+}
+
+void vilelog_close(vilelog_t *log)
+{
+  if (!log)
+    return;
+  if (log->f)
+    fclose(log->f);
+  free(log->block);
+  free(log);
+}
+
+const tlm_header_t *vilelog_header(const vilelog_t *log)
+{
+  return &log->hdr;
+}
+
+uint32_t vilelog_blocks(const vilelog_t *log)
+{
+  return log->blocks;
+}
+
+int vilelog_seek(vilelog_t *log, uint64_t time)
+{
+  // last block opened at or before time
+  uint32_t lo = 0;
+  uint32_t hi = log->blocks;
+  tlm_block_t blk;
+
+  while (hi - lo > 1)
+  {
+    uint32_t mid = lo + (hi - lo) / 2;
+    if (read_block_header(log, mid, &blk) < 0)
+      return -1;
+    if (blk.time <= time)
+      lo = mid;
+    else
+      hi = mid;
+  }
+
+  log->p = log->end = NULL;
+  log->next_block = lo;
+  log->skip_until = time;
+  return 0;
+}
+
+int vilelog_next(vilelog_t *log, vilelog_record_t *rec)
+{
+  while (1)
+  {
+    while (log->p >= log->end)
+    {
+      int ret = load_block(log, log->next_block);
+      if (ret <= 0)
+        return ret;
+    }
+
+    if (decode_record(log, rec) < 0)
+      return -1;
+
+    if (rec->time >= log->skip_until)
+      return 1;
+  }
+}
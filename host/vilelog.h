@@ -0,0 +1,87 @@
+/**
+        libvile
+        Copyright (C) 2022 Cat (Ivan Epifanov)
+
+        This program is free software: you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        This program is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef __VILELOG_H__
+#define __VILELOG_H__
+
+#include <stdint.h>
+#include "telemetry.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+  VILELOG_SAMPLE = 0,
+  VILELOG_COMMAND
+} vilelog_kind_t;
+
+typedef struct {
+  uint16_t raw_value;
+  uint16_t normalized_value;
+  int16_t scaled_value;
+  uint8_t valid;
+  uint8_t calibrated;
+  uint8_t sensor_type;
+  uint8_t sensor_mode;
+} vilelog_input_t;
+
+typedef struct {
+  int8_t power;
+  uint8_t mode;
+  uint8_t regulation;
+  int8_t turn_ratio;
+  uint8_t run_state;
+  uint32_t tacho_limit;
+  int32_t tacho_count;
+  int32_t block_tacho_count;
+  int32_t rotation_count;
+} vilelog_output_t;
+
+typedef struct {
+  vilelog_kind_t kind;
+  uint64_t time; // usec since recording start
+  // samples, only ports enabled in the header are filled
+  uint8_t keyframe;
+  vilelog_input_t in[TLM_INPUTS];
+  vilelog_output_t out[TLM_OUTPUTS];
+  // commands
+  uint8_t opcode;
+  uint8_t length;
+  uint8_t payload[TLM_RECORD_MAX];
+} vilelog_record_t;
+
+typedef struct vilelog vilelog_t;
+
+vilelog_t *vilelog_open(const char *path);
+void vilelog_close(vilelog_t *log);
+
+const tlm_header_t *vilelog_header(const vilelog_t *log);
+uint32_t vilelog_blocks(const vilelog_t *log);
+
+// position at the first record at or after time (usec since start)
+int vilelog_seek(vilelog_t *log, uint64_t time);
+
+// 1 on record, 0 at end of log, -1 on corrupt data
+int vilelog_next(vilelog_t *log, vilelog_record_t *rec);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __VILELOG_H__
@@ -0,0 +1,191 @@
+/**
+        libvile
+        Copyright (C) 2022 Cat (Ivan Epifanov)
+
+        This program is free software: you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        This program is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include "vilelog.h"
+
+static void usage(const char *name)
+{
+  fprintf(stderr, "usage: %s [-i] [-c] [-s start_ms] [-e end_ms] file\n", name);
+  fprintf(stderr, "  -i  print log info and exit\n");
+  fprintf(stderr, "  -c  export commands instead of samples\n");
+  fprintf(stderr, "  -s  first record time, msec since recording start\n");
+  fprintf(stderr, "  -e  last record time, msec since recording start\n");
+}
+
+static void print_info(vilelog_t *log)
+{
+  const tlm_header_t *hdr = vilelog_header(log);
+  vilelog_record_t rec;
+  uint64_t samples = 0, commands = 0, keyframes = 0, last = 0;
+  int ret;
+
+  while ((ret = vilelog_next(log, &rec)) > 0)
+  {
+    if (rec.kind == VILELOG_COMMAND)
+      commands++;
+    else
+      samples++;
+    if (rec.keyframe)
+      keyframes++;
+    last = rec.time;
+  }
+
+  printf("period: %u usec\n", hdr->period);
+  printf("keyframe: every %u samples\n", hdr->keyframe);
+  printf("inputs: 0x%x, outputs: 0x%x\n", hdr->inputs, hdr->outputs);
+  printf("blocks: %u x %u bytes\n", vilelog_blocks(log), hdr->block_size);
+  printf("samples: %" PRIu64 " (%" PRIu64 " keyframes)\n", samples, keyframes);
+  printf("commands: %" PRIu64 "\n", commands);
+  printf("duration: %.3f s\n", last / 1000000.0);
+  if (ret < 0)
+    printf("log is corrupt after %.3f s\n", last / 1000000.0);
+}
+
+static void print_sample_header(const tlm_header_t *hdr)
+{
+  printf("time_us");
+  for (int i = 0; i < TLM_INPUTS; i++)
+    if (hdr->inputs & (1 << i))
+      printf(",in%d_raw,in%d_normalized,in%d_scaled,in%d_valid,in%d_type,in%d_mode", i + 1, i + 1, i + 1, i + 1, i + 1, i + 1);
+  for (int i = 0; i < TLM_OUTPUTS; i++)
+    if (hdr->outputs & (1 << i))
+      printf(",out%c_power,out%c_mode,out%c_regulation,out%c_turn_ratio,out%c_run_state,out%c_tacho_limit,out%c_tacho_count,out%c_block_tacho_count,out%c_rotation_count",
+             'A' + i, 'A' + i, 'A' + i, 'A' + i, 'A' + i, 'A' + i, 'A' + i, 'A' + i, 'A' + i);
+  printf("\n");
+}
+
+static void print_sample(const tlm_header_t *hdr, const vilelog_record_t *rec)
+{
+  printf("%" PRIu64, rec->time);
+  for (int i = 0; i < TLM_INPUTS; i++)
+  {
+    if (!(hdr->inputs & (1 << i)))
+      continue;
+    const vilelog_input_t *in = &rec->in[i];
+    printf(",%u,%u,%d,%u,%u,%u", in->raw_value, in->normalized_value, in->scaled_value, in->valid, in->sensor_type, in->sensor_mode);
+  }
+  for (int i = 0; i < TLM_OUTPUTS; i++)
+  {
+    if (!(hdr->outputs & (1 << i)))
+      continue;
+    const vilelog_output_t *out = &rec->out[i];
+    printf(",%d,%u,%u,%d,%u,%u,%d,%d,%d", out->power, out->mode, out->regulation, out->turn_ratio, out->run_state,
+           out->tacho_limit, out->tacho_count, out->block_tacho_count, out->rotation_count);
+  }
+  printf("\n");
+}
+
+static void print_command(const vilelog_record_t *rec)
+{
+  printf("%" PRIu64 ",0x%02x,", rec->time, rec->opcode);
+  for (int i = 0; i < rec->length; i++)
+    printf("%02x", rec->payload[i]);
+  printf("\n");
+}
+
+int main(int argc, char *argv[])
+{
+  int info = 0;
+  int commands = 0;
+  uint64_t start = 0;
+  uint64_t end = UINT64_MAX;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "ics:e:")) != -1)
+  {
+    switch (opt)
+    {
+      case 'i':
+        info = 1;
+        break;
+      case 'c':
+        commands = 1;
+        break;
+      case 's':
+        start = strtoull(optarg, NULL, 10) * 1000;
+        break;
+      case 'e':
+        end = strtoull(optarg, NULL, 10) * 1000;
+        break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+
+  if (optind >= argc)
+  {
+    usage(argv[0]);
+    return 1;
+  }
+
+  vilelog_t *log = vilelog_open(argv[optind]);
+  if (!log)
+  {
+    fprintf(stderr, "%s: not a telemetry log\n", argv[optind]);
+    return 1;
+  }
+
+  if (info)
+  {
+    print_info(log);
+    vilelog_close(log);
+    return 0;
+  }
+
+  const tlm_header_t *hdr = vilelog_header(log);
+
+  if (start && vilelog_seek(log, start) < 0)
+  {
+    fprintf(stderr, "%s: seek failed\n", argv[optind]);
+    vilelog_close(log);
+    return 1;
+  }
+
+  if (commands)
+    printf("time_us,opcode,payload\n");
+  else
+    print_sample_header(hdr);
+
+  vilelog_record_t rec;
+  int ret;
+
+  while ((ret = vilelog_next(log, &rec)) > 0)
+  {
+    if (rec.time > end)
+      break;
+    if (commands && rec.kind == VILELOG_COMMAND)
+      print_command(&rec);
+    else if (!commands && rec.kind == VILELOG_SAMPLE)
+      print_sample(hdr, &rec);
+  }
+
+  vilelog_close(log);
+
+  if (ret < 0)
+  {
+    fprintf(stderr, "%s: corrupt record, stopping\n", argv[optind]);
+    return 1;
+  }
+
+  return 0;
+}
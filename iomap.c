@@ -0,0 +1,594 @@
+/**
+        libvile
+        Copyright (C) 2022 Cat (Ivan Epifanov)
+
+        This program is free software: you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        This program is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <psp2kern/kernel/cpu.h>
+#include <psp2kern/kernel/debug.h>
+#include <psp2kern/kernel/threadmgr.h>
+#include <psp2kern/kernel/sysmem/data_transfers.h>
+#include <string.h>
+#include "nxt.h"
+
+/*
+ * Firmware module IOMaps, split into packet sized READ/WRITE IOMAP
+ * commands at bulk priority. Every read needs its reply, so reads go one
+ * chunk per exchange; writes only ask for a reply every IOMAP_WINDOW
+ * chunks, as file uploads do. The screen mirror reads the display
+ * module's frame buffer over and over and publishes frames that differ
+ * from the last one.
+ *
+ * The Input and Output modules keep every port's state in one array, so
+ * only the span between the first and last port wanted is read and
+ * decoded into the GET_INPUTVALUES/GET_OUTPUTSTATE reply layouts.
+ * Writes there change ports like SET_INPUTMODE/SET_OUTPUTSTATE would, so
+ * they are held to the same motor claims and drop the same cached state.
+ */
+
+// commands the firmware queues before dropping them
+#define IOMAP_WINDOW 4
+#define IOMAP_HEADER 10 // of a command
+#define IOMAP_REPLY_HEADER 9
+
+#define SCREEN_MODULE 0x000A0001
+#define SCREEN_OFFSET 119 // Normal[8][100]
+#define SCREEN_CHUNKS ((VILE_SCREEN_BYTES + NXT_IOMAP_READ_CHUNK - 1) / NXT_IOMAP_READ_CHUNK)
+#define SCREEN_WIRE_BYTES (VILE_SCREEN_BYTES + SCREEN_CHUNKS * (IOMAP_HEADER + IOMAP_REPLY_HEADER))
+#define SCREEN_RETRY 100000 // no brick, or no display module
+
+// firmware c_input.iom / c_output.iom
+#define INPUT_MODULE 0x00030001
+#define INPUT_SIZE 20 // per port
+#define INPUT_USED 17 // up to InvalidData
+#define OUTPUT_MODULE 0x00020001
+#define OUTPUT_SIZE 32
+#define OUTPUT_USED 29 // up to SyncTurnParameter
+
+#define IOMAP_EV_WAKE 1
+
+static SceUID io_mtx;
+static SceUID io_cond; // new frame
+static SceUID io_ev;
+static SceUID io_thid = -1;
+
+static volatile uint8_t running = 0;
+static uint32_t interval = 0;
+static SceInt64 started = 0;
+
+static vile_screen_t frame; // last published
+static uint8_t scratch[VILE_SCREEN_BYTES]; // mirror thread only
+
+static vile_screen_stats_t stats;
+static uint64_t read_sum = 0;
+
+// vileGetState's copy, too big for a syscall stack
+static SceUID state_mtx;
+static vile_state_t kstate;
+
+#pragma pack(push,1)
+
+typedef struct {
+  uint16_t custom_zero_offset;
+  uint16_t ad_raw;
+  uint16_t sensor_raw;
+  int16_t sensor_value;
+  uint8_t sensor_type;
+  uint8_t sensor_mode;
+  uint8_t sensor_boolean;
+  uint8_t digi_pins_dir;
+  uint8_t digi_pins_in;
+  uint8_t digi_pins_out;
+  uint8_t custom_pct_full_scale;
+  uint8_t custom_active_status;
+  uint8_t invalid_data;
+  uint8_t spare[3];
+} iom_input_t;
+
+typedef struct {
+  int32_t tacho_cnt;
+  int32_t block_tacho_cnt;
+  int32_t rotation_cnt;
+  uint32_t tacho_limit;
+  int16_t motor_rpm;
+  uint8_t flags;
+  uint8_t mode;
+  int8_t speed;
+  int8_t actual_speed;
+  uint8_t reg_p;
+  uint8_t reg_i;
+  uint8_t reg_d;
+  uint8_t run_state;
+  uint8_t reg_mode;
+  uint8_t overloaded;
+  int8_t sync_turn;
+  uint8_t spare[3];
+} iom_output_t;
+
+#pragma pack(pop)
+
+// bus held; out is a user pointer when to_user is set
+static int read_iomap(uint32_t module, uint16_t offset, uint32_t size, uint8_t *out, uint8_t to_user, vile_priority_t priority, SceInt64 wait)
+{
+  cmd_iomap_t cmd = {NXT_SYSTEM_COMMAND_DOREPLY, NXT_OPCODE_SYS_READ_IOMAP, module};
+  ret_iomap_t r;
+  uint32_t done = 0;
+
+  while (done < size)
+  {
+    uint16_t chunk = size - done > NXT_IOMAP_READ_CHUNK ? NXT_IOMAP_READ_CHUNK : size - done;
+    cmd.offset = offset + done;
+    cmd.size = chunk;
+
+    SceInt64 begin = ksceKernelGetSystemTimeWide();
+    int ret = nxt_exchange((unsigned char*) &cmd, IOMAP_HEADER, (unsigned char*) &r, priority, begin, wait);
+    wait = 0;
+
+    if (ret < IOMAP_REPLY_HEADER || r.type != NXT_COMMAND_REPLY || r.opcode != NXT_OPCODE_SYS_READ_IOMAP ||
+        r.status != NXT_STATUS_OK || r.module != module || r.size != chunk)
+      return -1;
+
+    if (to_user)
+      ksceKernelMemcpyKernelToUser(out + done, r.data, chunk);
+    else
+      memcpy(out + done, r.data, chunk);
+    done += chunk;
+
+    if (done < size)
+      nxt_yield();
+  }
+
+  return (int)done;
+}
+
+// bus held; data is a user pointer
+static int write_iomap(uint32_t module, uint16_t offset, uint32_t size, const uint8_t *data, unsigned int window)
+{
+  cmd_iomap_t cmd = {NXT_SYSTEM_COMMAND_NOREPLY, NXT_OPCODE_SYS_WRITE_IOMAP, module};
+  ret_iomap_t r;
+  uint32_t done = 0;
+  unsigned int writes = 0;
+
+  while (done < size)
+  {
+    uint16_t chunk = size - done > NXT_IOMAP_WRITE_CHUNK ? NXT_IOMAP_WRITE_CHUNK : size - done;
+    cmd.offset = offset + done;
+    cmd.size = chunk;
+    ksceKernelMemcpyUserToKernel(cmd.data, data + done, chunk);
+
+    uint8_t reply = (++writes % window) == 0 || done + chunk == size;
+    cmd.type = reply ? NXT_SYSTEM_COMMAND_DOREPLY : NXT_SYSTEM_COMMAND_NOREPLY;
+
+    SceInt64 begin = ksceKernelGetSystemTimeWide();
+    int ret = nxt_exchange((unsigned char*) &cmd, IOMAP_HEADER + chunk, reply ? (unsigned char*) &r : NULL, VILE_PRIORITY_BULK, begin, 0);
+    if (ret < 0)
+      return -1;
+    if (reply && (ret < IOMAP_REPLY_HEADER || r.type != NXT_COMMAND_REPLY || r.opcode != NXT_OPCODE_SYS_WRITE_IOMAP ||
+                  r.status != NXT_STATUS_OK || r.module != module || r.size != chunk))
+      return -1;
+
+    done += chunk;
+
+    if (reply && done < size)
+      nxt_yield();
+  }
+
+  return (int)done;
+}
+
+// first and last port set in mask, -1 if none
+static int port_span(uint8_t mask, int ports, int *first)
+{
+  int last = -1;
+  *first = -1;
+  for (int i = 0; i < ports; i++)
+  {
+    if (!(mask & (1 << i)))
+      continue;
+    if (*first < 0)
+      *first = i;
+    last = i;
+  }
+  return last;
+}
+
+// reads = exchanges it took, or -1
+int nxt_read_state(vile_state_t *state, vile_priority_t priority)
+{
+  // both spans together, the bigger one is 3 * 32 + 29 bytes
+  uint8_t buf[OUTPUT_SIZE * 2 + OUTPUT_USED];
+  int first, last;
+  int reads = 0;
+  int ret = 0;
+
+  SceInt64 begin = ksceKernelGetSystemTimeWide();
+  nxt_lock_priority(priority);
+  SceInt64 wait = ksceKernelGetSystemTimeWide() - begin;
+
+  last = port_span(state->inputs, 4, &first);
+  if (last >= 0)
+  {
+    uint32_t size = (last - first) * INPUT_SIZE + INPUT_USED;
+    ret = read_iomap(INPUT_MODULE, first * INPUT_SIZE, size, buf, 0, priority, wait);
+    wait = 0;
+    reads += (size + NXT_IOMAP_READ_CHUNK - 1) / NXT_IOMAP_READ_CHUNK;
+
+    for (int i = first; ret >= 0 && i <= last; i++)
+    {
+      if (!(state->inputs & (1 << i)))
+        continue;
+      const iom_input_t *m = (const iom_input_t *)(buf + (i - first) * INPUT_SIZE);
+      vile_inputstate_t *in = &state->input[i].state;
+      in->type = NXT_COMMAND_REPLY;
+      in->opcode = NXT_OPCODE_GET_INPUTVALUES;
+      in->status = NXT_STATUS_OK;
+      in->port = i;
+      in->valid = !m->invalid_data;
+      in->calibrated = 0;
+      in->sensor_type = m->sensor_type;
+      in->sensor_mode = m->sensor_mode;
+      in->raw_value = m->ad_raw;
+      in->normalized_value = m->sensor_raw;
+      in->scaled_value = m->sensor_value;
+      in->calibrated_value = m->sensor_value;
+    }
+  }
+
+  last = port_span(state->outputs, 3, &first);
+  if (ret >= 0 && last >= 0)
+  {
+    if (reads)
+      nxt_yield();
+
+    uint32_t size = (last - first) * OUTPUT_SIZE + OUTPUT_USED;
+    ret = read_iomap(OUTPUT_MODULE, first * OUTPUT_SIZE, size, buf, 0, priority, wait);
+    reads += (size + NXT_IOMAP_READ_CHUNK - 1) / NXT_IOMAP_READ_CHUNK;
+
+    for (int i = first; ret >= 0 && i <= last; i++)
+    {
+      if (!(state->outputs & (1 << i)))
+        continue;
+      const iom_output_t *m = (const iom_output_t *)(buf + (i - first) * OUTPUT_SIZE);
+      vile_outputstate_t *out = &state->output[i].state;
+      out->type = NXT_COMMAND_REPLY;
+      out->opcode = NXT_OPCODE_GET_OUTPUTSTATE;
+      out->status = NXT_STATUS_OK;
+      out->port = i;
+      out->power = m->speed;
+      out->mode = m->mode;
+      out->regulation = m->reg_mode;
+      out->turn_ratio = m->sync_turn;
+      out->run_state = m->run_state;
+      out->tacho_limit = m->tacho_limit;
+      out->tacho_count = m->tacho_cnt;
+      out->block_tacho_count = m->block_tacho_cnt;
+      out->rotation_count = m->rotation_cnt;
+    }
+  }
+
+  nxt_unlock();
+  return ret < 0 ? -1 : reads;
+}
+
+static int mirror_thread(SceSize args, void *argp)
+{
+  ksceDebugPrintf("screen mirror started\n");
+
+  while (running)
+  {
+    SceInt64 t0 = ksceKernelGetSystemTimeWide();
+    nxt_lock_priority(VILE_PRIORITY_BULK);
+    int ret = read_iomap(SCREEN_MODULE, SCREEN_OFFSET, VILE_SCREEN_BYTES, scratch, 0, VILE_PRIORITY_BULK, ksceKernelGetSystemTimeWide() - t0);
+    nxt_unlock();
+    SceInt64 t1 = ksceKernelGetSystemTimeWide();
+
+    ksceKernelLockMutex(io_mtx, 1, NULL);
+    if (ret == VILE_SCREEN_BYTES)
+    {
+      uint32_t took = (uint32_t)(t1 - t0);
+      stats.reads++;
+      read_sum += took;
+      if (took > stats.read_max)
+        stats.read_max = took;
+
+      if (!stats.frames || memcmp(frame.pixels, scratch, VILE_SCREEN_BYTES))
+      {
+        memcpy(frame.pixels, scratch, VILE_SCREEN_BYTES);
+        frame.sequence++;
+        frame.timestamp = t1;
+        stats.frames++;
+        ksceKernelSignalCondAll(io_cond);
+      }
+      else
+      {
+        stats.unchanged++;
+      }
+    }
+    else
+    {
+      stats.failures++;
+    }
+    SceInt64 next = ret < 0 ? t1 + SCREEN_RETRY : t0 + interval;
+    ksceKernelUnlockMutex(io_mtx, 1);
+
+    SceInt64 now = ksceKernelGetSystemTimeWide();
+    if (now < next)
+    {
+      SceUInt timeout = (SceUInt)(next - now);
+      ksceKernelWaitEventFlag(io_ev, IOMAP_EV_WAKE, SCE_EVENT_WAITCLEAR_PAT | SCE_EVENT_WAITOR, NULL, &timeout);
+    }
+  }
+
+  ksceDebugPrintf("screen mirror stopped\n");
+  return 0;
+}
+
+static void mirror_stop()
+{
+  if (io_thid < 0)
+    return;
+
+  running = 0;
+  ksceKernelSetEventFlag(io_ev, IOMAP_EV_WAKE);
+  ksceKernelWaitThreadEnd(io_thid, NULL, NULL);
+  ksceKernelDeleteThread(io_thid);
+  io_thid = -1;
+
+  // waiters give up
+  ksceKernelLockMutex(io_mtx, 1, NULL);
+  ksceKernelSignalCondAll(io_cond);
+  ksceKernelUnlockMutex(io_mtx, 1);
+}
+
+void iomap_shutdown()
+{
+  mirror_stop();
+}
+
+int iomap_init()
+{
+  io_mtx = ksceKernelCreateMutex("vile_iomap", 0, 0, NULL);
+  if (io_mtx < 0)
+    return -1;
+  io_cond = ksceKernelCreateCond("vile_iomap", 0, io_mtx, NULL);
+  io_ev = ksceKernelCreateEventFlag("vile_iomap", 0, 0, NULL);
+  state_mtx = ksceKernelCreateMutex("vile_iomap_state", 0, 0, NULL);
+  return (io_cond < 0 || io_ev < 0 || state_mtx < 0) ? -1 : 0;
+}
+
+// the Input or Output module ports a write lands on, as a mask
+static uint8_t written_ports(const uint32_t module, const uint16_t offset, const uint16_t size)
+{
+  unsigned int stride;
+  unsigned int ports;
+  if (module == INPUT_MODULE)
+  {
+    stride = INPUT_SIZE;
+    ports = 4;
+  }
+  else if (module == OUTPUT_MODULE)
+  {
+    stride = OUTPUT_SIZE;
+    ports = 3;
+  }
+  else
+  {
+    return 0;
+  }
+
+  uint8_t mask = 0;
+  for (unsigned int i = 0; i < ports; i++)
+    if (offset < (i + 1) * stride && (uint32_t)offset + size > i * stride)
+      mask |= 1 << i;
+  return mask;
+}
+
+/*
+ *  PUBLIC COMMANDS
+ */
+
+// returns bytes read
+int vileReadIOMap(const uint32_t module, const uint16_t offset, const uint16_t size, void *data)
+{
+  uint32_t state;
+  ENTER_SYSCALL(state);
+
+  if (!size || (uint32_t)offset + size > 0xFFFF)
+  {
+    EXIT_SYSCALL(state);
+    return -1;
+  }
+
+  SceInt64 begin = ksceKernelGetSystemTimeWide();
+  nxt_lock_priority(VILE_PRIORITY_BULK);
+  int ret = read_iomap(module, offset, size, data, 1, VILE_PRIORITY_BULK, ksceKernelGetSystemTimeWide() - begin);
+  nxt_unlock();
+
+  EXIT_SYSCALL(state);
+  return ret;
+}
+
+// returns bytes written; a write the brick refused part of is done
+// again with a reply to every packet
+int vileWriteIOMap(const uint32_t module, const uint16_t offset, const uint16_t size, const void *data)
+{
+  uint32_t state;
+  ENTER_SYSCALL(state);
+
+  if (!size || (uint32_t)offset + size > 0xFFFF)
+  {
+    EXIT_SYSCALL(state);
+    return -1;
+  }
+
+  uint8_t ports = written_ports(module, offset, size);
+  uint8_t opcode = module == INPUT_MODULE ? NXT_OPCODE_SET_INPUTMODE : NXT_OPCODE_SET_OUTPUTSTATE;
+
+  for (int i = 0; i < 3 && module == OUTPUT_MODULE; i++)
+  {
+    if ((ports & (1 << i)) && session_check_motor(i) < 0)
+    {
+      EXIT_SYSCALL(state);
+      return -1;
+    }
+  }
+
+  nxt_lock_priority(VILE_PRIORITY_BULK);
+  int ret = write_iomap(module, offset, size, data, IOMAP_WINDOW);
+  if (ret < 0)
+    ret = write_iomap(module, offset, size, data, 1);
+
+  // even a failed write may have got some of the way
+  for (int i = 0; i < 4; i++)
+  {
+    if (!(ports & (1 << i)))
+      continue;
+    const unsigned char probe[3] = {NXT_DIRECT_COMMAND_DOREPLY, opcode, i};
+    combine_command(probe, sizeof(probe));
+    restore_forget(probe, sizeof(probe));
+    if (module == OUTPUT_MODULE)
+      drive_forget(probe, sizeof(probe));
+  }
+  nxt_unlock();
+
+  EXIT_SYSCALL(state);
+  return ret;
+}
+
+int vileGetState(vile_state_t *ustate)
+{
+  uint32_t state;
+  ENTER_SYSCALL(state);
+
+  ksceKernelLockMutex(state_mtx, 1, NULL);
+  ksceKernelMemcpyUserToKernel(&kstate, ustate, sizeof(vile_state_t));
+  int ret = nxt_read_state(&kstate, VILE_PRIORITY_TELEMETRY);
+  if (ret >= 0)
+    ksceKernelMemcpyKernelToUser(ustate, &kstate, sizeof(vile_state_t));
+  ksceKernelUnlockMutex(state_mtx, 1);
+
+  EXIT_SYSCALL(state);
+  return ret;
+}
+
+int vileStartScreenMirror(const uint32_t uinterval)
+{
+  uint32_t state;
+  ENTER_SYSCALL(state);
+
+  // checked and started under the lock, so two starts can't both get a thread
+  ksceKernelLockMutex(io_mtx, 1, NULL);
+  interval = uinterval;
+  memset(&stats, 0, sizeof(stats));
+  read_sum = 0;
+  started = ksceKernelGetSystemTimeWide();
+
+  if (io_thid >= 0)
+  {
+    // new interval applies right away
+    ksceKernelSetEventFlag(io_ev, IOMAP_EV_WAKE);
+    ksceKernelUnlockMutex(io_mtx, 1);
+    EXIT_SYSCALL(state);
+    return 0;
+  }
+
+  io_thid = ksceKernelCreateThread("vile_screen", mirror_thread, 0x3C, 0x1000, 0, 0x10000, NULL);
+  if (io_thid < 0)
+  {
+    ksceKernelUnlockMutex(io_mtx, 1);
+    EXIT_SYSCALL(state);
+    return -1;
+  }
+
+  ksceKernelClearEventFlag(io_ev, ~IOMAP_EV_WAKE);
+  running = 1;
+  ksceKernelStartThread(io_thid, 0, NULL);
+
+  ksceKernelUnlockMutex(io_mtx, 1);
+
+  EXIT_SYSCALL(state);
+  return 0;
+}
+
+int vileStopScreenMirror()
+{
+  uint32_t state;
+  ENTER_SYSCALL(state);
+
+  mirror_stop();
+
+  EXIT_SYSCALL(state);
+  return 0;
+}
+
+// waits for a frame newer than after; returns its sequence
+int vileGetScreenFrame(vile_screen_t *out, const uint32_t after, const uint32_t timeout)
+{
+  uint32_t state;
+  ENTER_SYSCALL(state);
+
+  SceInt64 deadline = ksceKernelGetSystemTimeWide() + timeout;
+  int ret = -1;
+
+  ksceKernelLockMutex(io_mtx, 1, NULL);
+  while (running && frame.sequence <= after)
+  {
+    if (!timeout)
+    {
+      ksceKernelWaitCond(io_cond, NULL);
+      continue;
+    }
+
+    SceInt64 now = ksceKernelGetSystemTimeWide();
+    if (now >= deadline)
+      break;
+    SceUInt left = (SceUInt)(deadline - now);
+    ksceKernelWaitCond(io_cond, &left);
+  }
+  if (frame.sequence > after)
+  {
+    ksceKernelMemcpyKernelToUser(out, &frame, sizeof(vile_screen_t));
+    ret = (int)frame.sequence;
+  }
+  ksceKernelUnlockMutex(io_mtx, 1);
+
+  EXIT_SYSCALL(state);
+  return ret;
+}
+
+int vileGetScreenStats(vile_screen_stats_t *out)
+{
+  uint32_t state;
+  ENTER_SYSCALL(state);
+
+  ksceKernelLockMutex(io_mtx, 1, NULL);
+  vile_screen_stats_t kstats = stats;
+  kstats.running = running;
+  kstats.interval = interval;
+  kstats.read_avg = kstats.reads ? (uint32_t)(read_sum / kstats.reads) : 0;
+  kstats.read_bytes = SCREEN_WIRE_BYTES;
+  SceInt64 elapsed = ksceKernelGetSystemTimeWide() - started;
+  if (started && elapsed > 0)
+  {
+    kstats.reads_per_s = (uint32_t)((uint64_t)kstats.reads * 1000000 / elapsed);
+    kstats.frames_per_s = (uint32_t)((uint64_t)kstats.frames * 1000000 / elapsed);
+  }
+  ksceKernelUnlockMutex(io_mtx, 1);
+
+  ksceKernelMemcpyKernelToUser(out, &kstats, sizeof(kstats));
+
+  EXIT_SYSCALL(state);
+  return 0;
+}
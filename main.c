@@ -19,382 +19,136 @@
 #include <psp2kern/kernel/modulemgr.h>
 #include <psp2kern/kernel/cpu.h>
 #include <psp2kern/kernel/debug.h>
-#include <psp2kern/kernel/suspend.h>
-#include <psp2kern/kernel/threadmgr/event_flags.h>
+#include <psp2kern/kernel/threadmgr.h>
 #include <psp2kern/kernel/sysmem/data_transfers.h>
-#include <psp2kern/usbd.h>
-#include <psp2kern/usbserv.h>
 #include <string.h>
-#include "vile.h"
-
-const int NXT_USB_ID_VENDOR_LEGO = 0x0694;
-const int NXT_USB_ID_PRODUCT_NXT = 0x0002;
-const int NXT_USB_ENDPOINT_OUT = 0x01; //1
-const int NXT_USB_ENDPOINT_IN = 0x82; //130
-const int NXT_USB_TIMEOUT = 1000;
-const int NXT_USB_READSIZE = 64;
-const int NXT_USB_INTERFACE = 0;
-
-enum {
-  NXT_DIRECT_COMMAND_DOREPLY = 0x00,
-  NXT_SYSTEM_COMMAND_DOREPLY = 0x01,
-  NXT_COMMAND_REPLY = 0x02,
-  NXT_DIRECT_COMMAND_NOREPLY = 0x80,
-  NXT_SYSTEM_COMMAND_NOREPLY = 0x81,
-};
-
-enum {
-  NXT_OPCODE_STARTPROGRAM = 0x00,
-  NXT_OPCODE_STOPPROGRAM = 0x01,
-  NXT_OPCODE_PLAYSOUND = 0x02,
-  NXT_OPCODE_PLAYTONE = 0x03,
-  NXT_OPCODE_SET_OUTPUTSTATE = 0x04,
-  NXT_OPCODE_SET_INPUTMODE = 0x05,
-  NXT_OPCODE_GET_OUTPUTSTATE = 0x06,
-  NXT_OPCODE_GET_INPUTVALUES = 0x07,
-  NXT_OPCODE_RESET_INPUT_SCALEDVALUES = 0x08,
-  NXT_OPCODE_MESSAGE_WRITE = 0x09,
-  NXT_OPCODE_MESSAGE_READ = 0x13,
-  NXT_OPCODE_RESET_MOTOR_POSITION = 0x0A,
-  NXT_OPCODE_BATTERYLEVEL = 0x0B,
-  NXT_OPCODE_STOP_SOUND = 0x0C,
-  NXT_OPCODE_KEEPALIVE = 0x0D,
-  NXT_OPCODE_LS_GET_STATUS = 0x0E,
-  NXT_OPCODE_LS_WRITE = 0x0F,
-  NXT_OPCODE_LS_READ = 0x10,
-  NXT_OPCODE_GET_CURRENTPROGRAM_NAME = 0x11,
-  /** \todo system commands */
-  NXT_OPCODE_SYS_OPENREAD = 0x80,
-  NXT_OPCODE_SYS_OPENWRITE = 0x81,
-  NXT_OPCODE_SYS_READ = 0x82,
-  NXT_OPCODE_SYS_WRITE = 0x83,
-  NXT_OPCODE_SYS_CLOSE = 0x84,
-  NXT_OPCODE_SYS_DELETE = 0x85,
-  NXT_OPCODE_SYS_FINDFIRST = 0x86,
-  NXT_OPCODE_SYS_FINDNEXT = 0x87,
-  NXT_OPCODE_SYS_GET_FIRMVAREVERSION = 0x88,
-  NXT_OPCODE_SYS_OPENLINEARWRITE = 0x89,
-  NXT_OPCODE_SYS_OPENLINEARREAD = 0x8A,
-  NXT_OPCODE_SYS_OPENWRITEDATA = 0x8B,
-  NXT_OPCODE_SYS_OPENAPPENDDATA = 0x8C,
-  NXT_OPCODE_SYS_BOOT = 0x97,
-  NXT_OPCODE_SYS_SETBRICKNAME = 0x98,
-  NXT_OPCODE_SYS_GET_DEVICEINFO = 0x9B,
-  NXT_OPCODE_SYS_DELETE_USERFLASH = 0xA0,
-  NXT_OPCODE_SYS_POLLCOMMAND_LENGTH = 0xA1,
-  NXT_OPCODE_SYS_POLLCOMMAND = 0xA2,
-  NXT_OPCODE_SYS_RESET_BLUETOOTH = 0xA4
-};
-
-// packet return types
-#pragma pack(push,1)
-
-typedef struct {
-  uint8_t type;
-  uint8_t opcode;
-  uint8_t status;
-} ret_status_t __attribute__ ((aligned (64)));
-
-typedef struct {
-  uint8_t type;
-  uint8_t opcode;
-  uint8_t status;
-  uint16_t mv;
-} ret_battery_t __attribute__ ((aligned (64)));
-
-typedef struct {
-  uint8_t type;
-  uint8_t opcode;
-  uint8_t status;
-  uint32_t msec;
-} ret_keepalive_t __attribute__ ((aligned (64)));
-
-typedef struct {
-  uint8_t type;
-  uint8_t opcode;
-  uint8_t status;
-  char filename[20];
-} ret_currentprogram_t __attribute__ ((aligned (64)));
-
-typedef struct {
-  uint8_t type;
-  uint8_t opcode;
-  uint8_t status;
-  uint8_t bytes_ready;
-} ret_lsstatus_t __attribute__ ((aligned (64)));
-
-typedef struct {
-  uint8_t type;
-  uint8_t opcode;
-  uint8_t status;
-  uint8_t bytes_read;
-  char data[16];
-} ret_lsread_t __attribute__ ((aligned (64)));
-
-typedef struct {
-  uint8_t type;
-  uint8_t opcode;
-  uint8_t status;
-  uint8_t local_inbox;
-  uint8_t msg_size;
-  char data[58];
-} ret_msgread_t __attribute__ ((aligned (64)));
-
-// command packet types
-
-typedef struct {
-  uint8_t type;
-  uint8_t opcode;
-} cmd_simple_t __attribute__ ((aligned (64)));
-
-typedef struct {
-  uint8_t type;
-  uint8_t opcode;
-  uint8_t port;
-} cmd_port_t __attribute__ ((aligned (64)));
-
-typedef struct {
-  uint8_t type;
-  uint8_t opcode;
-  uint8_t port;
-  uint8_t relative;
-} cmd_resetport_t __attribute__ ((aligned (64)));
-
-typedef struct {
-  uint8_t type;
-  uint8_t opcode;
-  char filename[20];
-} cmd_startprogram_t __attribute__ ((aligned (64)));
-
-typedef struct {
-  uint8_t type;
-  uint8_t opcode;
-  uint8_t loop;
-  char filename[20];
-} cmd_playsound_t __attribute__ ((aligned (64)));
-
-typedef struct {
-  uint8_t type;
-  uint8_t opcode;
-  uint16_t freq;
-  uint16_t duration;
-} cmd_playtone_t __attribute__ ((aligned (64)));
-
-typedef struct {
-  uint8_t type;
-  uint8_t opcode;
-  uint8_t port;
-  int8_t power;
-  uint8_t mode;
-  uint8_t regulation;
-  int8_t turn_ratio;
-  uint8_t run_state;
-  uint32_t tacho_limit;
-} cmd_setoutput_t __attribute__ ((aligned (64)));
-
-typedef struct {
-  uint8_t type;
-  uint8_t opcode;
-  uint8_t port;
-  uint8_t stype;
-  uint8_t smode;
-} cmd_setinput_t __attribute__ ((aligned (64)));
-
-typedef struct {
-  uint8_t type;
-  uint8_t opcode;
-  uint8_t port;
-  uint8_t tx_size;
-  uint8_t rx_size;
-  char data[20];
-} cmd_lswrite_t __attribute__ ((aligned (64)));
-
-typedef struct {
-  uint8_t type;
-  uint8_t opcode;
-  uint8_t remote_inbox;
-  uint8_t local_inbox;
-  uint8_t remove;
-} cmd_msgread_t __attribute__ ((aligned (64)));
-
-typedef struct {
-  uint8_t type;
-  uint8_t opcode;
-  uint8_t inbox;
-  uint8_t message_size;
-  char message[59];
-} cmd_msgwrite_t __attribute__ ((aligned (64)));
-
-#pragma pack(pop)
-
-SceUID transfer_ev;
-SceUID out_pipe_id = 0;
-SceUID in_pipe_id = 0;
+#include "nxt.h"
+#include "capture.h"
 
 static uint8_t started = 0;
-static uint8_t plugged = 0;
+static const nxt_transport_t *transport = &transport_usbd;
+static vile_transport_stats_t transport_stats;
+static SceInt64 wire_time; // usec spent in the transport during the current transfer
 
-int vile_probe(int device_id);
-int vile_attach(int device_id);
-int vile_detach(int device_id);
+// under the bus, the pair and direction of the last vileDrive
+static uint8_t drive_left = 0xFF;
+static uint8_t drive_right = 0xFF;
+static int8_t drive_dir = 0;
 
-static const SceUsbdDriver vileDriver = {
-  .name = "vile",
-  .probe = vile_probe,
-  .attach = vile_attach,
-  .detach = vile_detach,
-};
-
-static int vile_sysevent_handler(int resume, int eventid, void *args, void *opt)
+int nxt_set_transport(const nxt_transport_t *t)
 {
-  if (resume && started)
-  {
-    ksceUsbServMacSelect(2, 0); // re-set host mode
-  }
+  if (started || !t)
+    return -1;
+  transport = t;
   return 0;
 }
 
-static void set_config_done(int32_t result, int32_t count, void *arg)
+int vileStart()
 {
-  ksceDebugPrintf("config cb result: %08x, count: %d\n", result, count);
-  ksceKernelSetEventFlag(transfer_ev, 4);
-}
+  uint32_t state;
+  ENTER_SYSCALL(state);
 
-int vile_probe(int device_id)
-{
-  SceUsbdDeviceDescriptor *device;
-  ksceDebugPrintf("probing device: %x\n", device_id);
-  device = (SceUsbdDeviceDescriptor*)ksceUsbdScanStaticDescriptor(device_id, 0, SCE_USBD_DESCRIPTOR_DEVICE);
-  if (device)
+  // every process gets a session, the first one starts the driver
+  int first = session_open();
+  if (first <= 0)
   {
-    ksceDebugPrintf("vendor: %04x\n", device->idVendor);
-    ksceDebugPrintf("product: %04x\n", device->idProduct);
-    if (device->idVendor == NXT_USB_ID_VENDOR_LEGO && device->idProduct == NXT_USB_ID_PRODUCT_NXT)
-    {
-      ksceDebugPrintf("found NXT brick\n");
-      return 0;
-    }
+    EXIT_SYSCALL(state);
+    return first < 0 ? -1 : 1;
   }
 
-  return -1;
+  ksceDebugPrintf("starting ViLE on %s\n", transport->name);
+  nxt_lock();
+  memset(&transport_stats, 0, sizeof(transport_stats));
+  nxt_unlock();
+  arbiter_reset_stats();
+  pacing_reset();
+  restore_start();
+  poller_start();
+  started = 1;
+  transport->start();
+  EXIT_SYSCALL(state);
+  return 1;
 }
 
-int vile_attach(int device_id)
+// every thread and the transport, whoever still has a session
+static void driver_stop()
 {
-  ksceDebugPrintf("attaching device: %x\n", device_id);
-  SceUsbdDeviceDescriptor *device;
-  device = (SceUsbdDeviceDescriptor*)ksceUsbdScanStaticDescriptor(device_id, 0, SCE_USBD_DESCRIPTOR_DEVICE);
-  if (device && device->idVendor == NXT_USB_ID_VENDOR_LEGO && device->idProduct == NXT_USB_ID_PRODUCT_NXT)
-  {
-
-    SceUsbdConfigurationDescriptor *cdesc;
-    if ((cdesc = (SceUsbdConfigurationDescriptor *)ksceUsbdScanStaticDescriptor(device_id, NULL, SCE_USBD_DESCRIPTOR_CONFIGURATION)) == NULL)
-      return SCE_USBD_ATTACH_FAILED;
-
-    if (cdesc->bNumInterfaces != 1)
-      return SCE_USBD_ATTACH_FAILED;
-
+  trajectory_shutdown();
+  melody_shutdown();
+  iomap_shutdown();
+  stream_shutdown();
+  flash_shutdown();
+  controller_shutdown();
+  odometry_shutdown();
+  rules_shutdown();
+  telemetry_shutdown();
+  capture_shutdown();
+  poller_shutdown();
+  sampling_shutdown();
+  restore_shutdown();
 
-    SceUsbdEndpointDescriptor *endpoint;
-    ksceDebugPrintf("scanning endpoints\n");
-    endpoint = (SceUsbdEndpointDescriptor*)ksceUsbdScanStaticDescriptor(device_id, device, SCE_USBD_DESCRIPTOR_ENDPOINT);
-    while (endpoint)
-    {
-      ksceDebugPrintf("got EP: %02x\n", endpoint->bEndpointAddress);
-      if (endpoint->bEndpointAddress == NXT_USB_ENDPOINT_IN)
-      {
-        ksceDebugPrintf("opening in pipe\n");
-        in_pipe_id = ksceUsbdOpenPipe(device_id, endpoint);
-        ksceDebugPrintf("= 0x%08x\n", in_pipe_id);
-      }
-      else if (endpoint->bEndpointAddress == NXT_USB_ENDPOINT_OUT)
-      {
-        ksceDebugPrintf("opening out pipe\n");
-        out_pipe_id = ksceUsbdOpenPipe(device_id, endpoint);
-        ksceDebugPrintf("= 0x%08x\n", out_pipe_id);
-      }
-      endpoint = (SceUsbdEndpointDescriptor*)ksceUsbdScanStaticDescriptor(device_id, endpoint, SCE_USBD_DESCRIPTOR_ENDPOINT);
-    }
-
-    SceUID control_pipe_id = ksceUsbdOpenPipe(device_id, NULL);
-    ksceUsbdSetConfiguration(control_pipe_id, cdesc->bConfigurationValue, set_config_done, NULL);
-    unsigned int matched;
-    ksceDebugPrintf("waiting ef (cfg)\n");
-    ksceKernelWaitEventFlag(transfer_ev, 4, SCE_EVENT_WAITCLEAR_PAT | SCE_EVENT_WAITAND, &matched, 0);
-
-    if (out_pipe_id > 0 && in_pipe_id > 0)
-    {
-      plugged = 1;
-      return 0;
-    }
-  }
-  return -1;
-}
-
-int vile_detach(int device_id)
-{
-  in_pipe_id = 0;
-  out_pipe_id = 0;
-  plugged = 0;
-  return -1;
+  started = 0;
+  transport->stop();
 }
 
-int vileStart()
+int vileStop()
 {
   uint32_t state;
   ENTER_SYSCALL(state);
 
-  ksceDebugPrintf("starting ViLE\n");
-  started = 1;
-  int ret = ksceUsbServMacSelect(2, 0);
-  ksceDebugPrintf("MAC select = 0x%08x\n", ret);
-  ret = ksceUsbdRegisterDriver(&vileDriver);
-  ksceDebugPrintf("ksceUsbdRegisterDriver = 0x%08x\n", ret);
+  // the driver keeps running for the other sessions
+  if (session_close())
+    driver_stop();
+
   EXIT_SYSCALL(state);
+
   return 1;
 }
 
-int vileStop()
+int vileGetTransportStats(vile_transport_stats_t *stats)
 {
   uint32_t state;
   ENTER_SYSCALL(state);
 
-  started = 0;
-  plugged = 0;
-  if (in_pipe_id) ksceUsbdClosePipe(in_pipe_id);
-  if (out_pipe_id) ksceUsbdClosePipe(out_pipe_id);
-  ksceUsbdUnregisterDriver(&vileDriver);
-  ksceUsbServMacSelect(2, 1);
+  nxt_lock();
+  vile_transport_stats_t kstats = transport_stats;
+  nxt_unlock();
+
+  ksceKernelMemcpyKernelToUser(stats, &kstats, sizeof(kstats));
 
   EXIT_SYSCALL(state);
+  return 0;
+}
 
-  return 1;
-  // TODO: restore udcd?
+int nxt_connected()
+{
+  return (started && transport->connected());
 }
 
-int vileHasNxt()
+int nxt_bootloader()
 {
-//  ksceDebugPrintf("started: %d, plugged: %d\n", started, plugged);
-  return (started && plugged);
+  return started && transport->bootloader && transport->bootloader();
 }
 
-void nxt_callback_send(int32_t result, int32_t count, void* arg)
+// SAM-BA speaks text and raw bytes, not packets: no capture, no pacing
+int nxt_boot_send(const unsigned char *data, unsigned int length)
 {
-  ksceDebugPrintf("send cb result: %08x, count: %d\n", result, count);
-  *(int*)arg = count;
-  ksceKernelSetEventFlag(transfer_ev, 1);
+  return transport->send(data, length);
 }
 
-void nxt_callback_recv(int32_t result, int32_t count, void* arg)
+int nxt_boot_recv(unsigned char *data, unsigned int length)
 {
-//  ksceDebugPrintf("recv cb result: %08x, count: %d\n", result, count);
-  *(int*)arg = count;
-  ksceKernelSetEventFlag(transfer_ev, 2);
+  return transport->recv(data, length);
+}
+
+int vileHasNxt()
+{
+//  ksceDebugPrintf("started: %d, plugged: %d\n", started, plugged);
+  return nxt_connected();
 }
 
 int nxt_send(unsigned char *request, unsigned int length)
 {
-  int transferred = 0;
   // transfer
   ksceDebugPrintf("sending 0x%08x\n", request);
   for (int i = 0; i < length; i++)
@@ -402,52 +156,199 @@ int nxt_send(unsigned char *request, unsigned int length)
     ksceDebugPrintf("%02x ", request[i]);
   }
   ksceDebugPrintf("\n");
-  int ret = ksceUsbdBulkTransfer(out_pipe_id, request, length,  nxt_callback_send, &transferred);
+  SceInt64 begin = capture_begin();
+  SceInt64 t0 = ksceKernelGetSystemTimeWide();
+  int ret = transport->send(request, length);
+  wire_time += ksceKernelGetSystemTimeWide() - t0;
   ksceDebugPrintf("send 0x%08x\n", ret);
-  // wait for eventflag
-  unsigned int matched;
-  ksceDebugPrintf("waiting ef\n");
-  ksceKernelWaitEventFlag(transfer_ev, 1, SCE_EVENT_WAITCLEAR_PAT | SCE_EVENT_WAITAND, &matched, 0);
-  return transferred;
+  capture_packet(CAP_SEND, request, length, ret, begin);
+  return ret;
 }
 
 int nxt_recv(unsigned char *result)
 {
-  int transferred = 0;
-  // transfer
-//  ksceDebugPrintf("sending (recv) 0x%08x, len 64\n", result);
-  int ret = ksceUsbdBulkTransfer(in_pipe_id, result, 64,  nxt_callback_recv, &transferred);
-//  ksceDebugPrintf("send 0x%08x\n", ret);
-  // wait for eventflag
-  unsigned int matched;
-  ksceDebugPrintf("waiting ef (recv)\n");
-  ksceKernelWaitEventFlag(transfer_ev, 2, SCE_EVENT_WAITCLEAR_PAT | SCE_EVENT_WAITAND, &matched, 0);
-  return transferred;
+  SceInt64 begin = capture_begin();
+  SceInt64 t0 = ksceKernelGetSystemTimeWide();
+  int ret = transport->recv(result, 64);
+  wire_time += ksceKernelGetSystemTimeWide() - t0;
+  capture_packet(CAP_RECV, result, 64, ret, begin);
+  return ret;
+}
+
+// bus held; anything else moving a motor of the last vileDrive leaves its
+// block tacho counts to the next one to reset
+void drive_forget(const unsigned char *request, unsigned int length)
+{
+  if (length < 3 || request[1] != NXT_OPCODE_SET_OUTPUTSTATE)
+    return;
+  if (request[2] != NXT_OUT_ALL && request[2] != drive_left && request[2] != drive_right)
+    return;
+
+  drive_left = 0xFF;
+  drive_right = 0xFF;
+  drive_dir = 0;
+}
+
+// one exchange with the bus already held, begin is when the caller started
+// on it and wait how long it queued for the bus
+int nxt_exchange(unsigned char *request, unsigned int length, unsigned char *result, vile_priority_t priority, SceInt64 begin, SceInt64 wait)
+{
+  // time held back by pacing counts as waiting
+  wait += pacing_wait(priority);
+  wire_time = 0;
+
+  int ret = nxt_send(request, length);
+
+  if (ret != length)
+    ret = -1;
+  else if (result)
+    ret = nxt_recv(result);
+
+  // only replies say anything about how busy the brick is
+  if (result || ret < 0)
+    pacing_update(ret, result, wire_time);
+
+  if (ret >= 0 && (!result || (ret >= 3 && result[2] == NXT_STATUS_OK)))
+    restore_command(request, length);
+
+  // even a command the brick refused may have been half done
+  if (ret >= 0)
+  {
+    combine_command(request, length);
+    drive_forget(request, length);
+  }
+
+  // split the time into waiting for the bus, the transport, and everything else
+  SceInt64 handling = (ksceKernelGetSystemTimeWide() - begin) - wait - wire_time;
+
+  transport_stats.transfers++;
+  if (ret < 0)
+    transport_stats.errors++;
+  transport_stats.wait_us += wait;
+  transport_stats.transport_us += wire_time;
+  transport_stats.protocol_us += handling;
+  if (wire_time > transport_stats.transport_max_us)
+    transport_stats.transport_max_us = (uint32_t)wire_time;
+  if (handling > transport_stats.protocol_max_us)
+    transport_stats.protocol_max_us = (uint32_t)handling;
+
+  return ret;
+}
+
+// one request/reply exchange; pipes are shared by syscalls and kernel threads,
+// so the pair must not interleave with anybody else's
+int nxt_transfer_priority(unsigned char *request, unsigned int length, unsigned char *result, vile_priority_t priority)
+{
+  SceInt64 begin = ksceKernelGetSystemTimeWide();
+
+  if (session_check(request, length) < 0)
+    return -1;
+
+  // only what was let through goes in the log
+  telemetry_command(request, length);
+
+  if (priority == VILE_PRIORITY_DEFAULT)
+    priority = nxt_command_priority(request, length);
+
+  SceInt64 queued = ksceKernelGetSystemTimeWide();
+  nxt_lock_priority(priority);
+  SceInt64 acquired = ksceKernelGetSystemTimeWide();
+
+  int ret = nxt_exchange(request, length, result, priority, begin, acquired - queued);
+
+  nxt_unlock();
+  return ret;
+}
+
+int nxt_transfer(unsigned char *request, unsigned int length, unsigned char *result)
+{
+  return nxt_transfer_priority(request, length, result, VILE_PRIORITY_DEFAULT);
 }
 
 /*
  *  PUBLIC COMMANDS
  */
 
-int vileStartProgram(const char *filename)
+// raw packets back to back under one bus acquisition, see vile.hpp;
+// the batch runs at its first packet's priority and steps aside between
+// packets when a more urgent class is waiting
+int vileBatch(vile_packet_t *packets, const unsigned int count)
 {
-
   uint32_t state;
   ENTER_SYSCALL(state);
 
-  cmd_startprogram_t cmd = {NXT_DIRECT_COMMAND_DOREPLY, NXT_OPCODE_STARTPROGRAM, ""};
-  strncat(cmd.filename, filename, 19);
-
-  int sent = nxt_send((unsigned char*) &cmd, sizeof (cmd));
-
-  if (sent != sizeof (cmd))
+  if (count > VILE_BATCH_MAX)
   {
     EXIT_SYSCALL(state);
     return -1;
   }
 
+  int done = 0;
+  uint8_t locked = 0;
+  SceInt64 wait = 0;
+
+  for (unsigned int i = 0; i < count; i++)
+  {
+    // one at a time, syscall stacks are small
+    vile_packet_t kpacket;
+    ksceKernelMemcpyUserToKernel(&kpacket, &packets[i], sizeof(kpacket));
+
+    int ret = -1;
+    if (kpacket.length >= 2 && kpacket.length <= sizeof(kpacket.data) && session_check(kpacket.data, kpacket.length) == 0)
+    {
+      SceInt64 begin = ksceKernelGetSystemTimeWide();
+      telemetry_command(kpacket.data, kpacket.length);
+
+      vile_priority_t priority = kpacket.priority;
+      if (priority == VILE_PRIORITY_DEFAULT)
+        priority = nxt_command_priority(kpacket.data, kpacket.length);
+
+      if (!locked)
+      {
+        nxt_lock_priority(priority);
+        wait = ksceKernelGetSystemTimeWide() - begin;
+        locked = 1;
+      }
+      else if (nxt_yield())
+      {
+        wait = ksceKernelGetSystemTimeWide() - begin;
+      }
+
+      // bit 7 of the packet type means no reply
+      uint8_t reply = !(kpacket.data[0] & 0x80);
+      ret = nxt_exchange(kpacket.data, kpacket.length, reply ? kpacket.data : NULL, priority, begin, wait);
+      wait = 0;
+
+      if (!reply && ret >= 0)
+        ret = 0;
+    }
+
+    kpacket.result = ret;
+    ksceKernelMemcpyKernelToUser(&packets[i], &kpacket, sizeof(kpacket));
+
+    if (ret < 0)
+      break;
+    done++;
+  }
+
+  if (locked)
+    nxt_unlock();
+
+  EXIT_SYSCALL(state);
+  return done;
+}
+
+int vileStartProgram(const char *filename)
+{
+
+  uint32_t state;
+  ENTER_SYSCALL(state);
+
+  cmd_startprogram_t cmd = {NXT_DIRECT_COMMAND_DOREPLY, NXT_OPCODE_STARTPROGRAM, ""};
+  strncat(cmd.filename, filename, 19);
+
   ret_status_t st;
-  int ret = nxt_recv((unsigned char*) &st);
+  int ret = nxt_transfer((unsigned char*) &cmd, sizeof (cmd), (unsigned char*) &st);
   if (ret != sizeof (ret_status_t))
   {
     EXIT_SYSCALL(state);
@@ -477,16 +378,8 @@ int vileStopProgram()
 
   cmd_simple_t cmd = {NXT_DIRECT_COMMAND_DOREPLY, NXT_OPCODE_STOPPROGRAM};
 
-  int sent = nxt_send((unsigned char*) &cmd, sizeof (cmd));
-
-  if (sent != sizeof (cmd))
-  {
-    EXIT_SYSCALL(state);
-    return -1;
-  }
-
   ret_status_t st;
-  int ret = nxt_recv((unsigned char*) &st);
+  int ret = nxt_transfer((unsigned char*) &cmd, sizeof (cmd), (unsigned char*) &st);
 
   if (ret != sizeof (ret_status_t))
   {
@@ -517,15 +410,8 @@ int vileGetCurrentProgramName(char* filename)
 
   cmd_simple_t cmd = {NXT_DIRECT_COMMAND_DOREPLY, NXT_OPCODE_GET_CURRENTPROGRAM_NAME};
 
-  int sent = nxt_send((unsigned char*) &cmd, sizeof (cmd));
-
-  if (sent != sizeof (cmd))
-  {
-    return -1;
-  }
-
   ret_currentprogram_t st;
-  int ret = nxt_recv((unsigned char*) &st);
+  int ret = nxt_transfer((unsigned char*) &cmd, sizeof (cmd), (unsigned char*) &st);
 
   if (ret != sizeof (ret_currentprogram_t))
   {
@@ -558,16 +444,8 @@ int vilePlaySoundfile(const char *filename, const unsigned short loop)
   cmd_playsound_t cmd = {NXT_DIRECT_COMMAND_DOREPLY, NXT_OPCODE_PLAYSOUND, loop, ""};
   strncat(cmd.filename, filename, 19);
 
-  int sent = nxt_send((unsigned char*) &cmd, sizeof (cmd));
-
-  if (sent != sizeof (cmd))
-  {
-    EXIT_SYSCALL(state);
-    return -1;
-  }
-
   ret_status_t st;
-  int ret = nxt_recv((unsigned char*) &st);
+  int ret = nxt_transfer((unsigned char*) &cmd, sizeof (cmd), (unsigned char*) &st);
 
   if (ret != sizeof (ret_status_t))
   {
@@ -599,16 +477,8 @@ int vilePlayTone(const unsigned int freq, const unsigned int duration)
 
   cmd_playtone_t cmd = {NXT_DIRECT_COMMAND_DOREPLY, NXT_OPCODE_PLAYTONE, freq, duration};
 
-  int sent = nxt_send((unsigned char*) &cmd, sizeof (cmd));
-
-  if (sent != sizeof (cmd))
-  {
-    EXIT_SYSCALL(state);
-    return -1;
-  }
-
   ret_status_t st;
-  int ret = nxt_recv((unsigned char*) &st);
+  int ret = nxt_transfer((unsigned char*) &cmd, sizeof (cmd), (unsigned char*) &st);
 
   if (ret != sizeof (ret_status_t))
   {
@@ -637,18 +507,12 @@ int vileStopSound()
   uint32_t state;
   ENTER_SYSCALL(state);
 
-  cmd_simple_t cmd = {NXT_DIRECT_COMMAND_DOREPLY, NXT_OPCODE_STOP_SOUND};
-
-  int sent = nxt_send((unsigned char*) &cmd, sizeof (cmd));
+  melody_cancel();
 
-  if (sent != sizeof (cmd))
-  {
-    EXIT_SYSCALL(state);
-    return -1;
-  }
+  cmd_simple_t cmd = {NXT_DIRECT_COMMAND_DOREPLY, NXT_OPCODE_STOP_SOUND};
 
   ret_status_t st;
-  int ret = nxt_recv((unsigned char*) &st);
+  int ret = nxt_transfer((unsigned char*) &cmd, sizeof (cmd), (unsigned char*) &st);
 
   if (ret != sizeof (ret_status_t))
   {
@@ -672,6 +536,34 @@ int vileStopSound()
   return 0;
 }
 
+int nxt_set_output_state(const vile_setoutputstate_t *outstate, const uint8_t reply)
+{
+  cmd_setoutput_t cmd = {
+    reply ? NXT_DIRECT_COMMAND_DOREPLY : NXT_DIRECT_COMMAND_NOREPLY, NXT_OPCODE_SET_OUTPUTSTATE,
+    (uint8_t)outstate->port, (int8_t)outstate->power, (uint8_t)outstate->mode, (uint8_t)outstate->regulation,
+    (int8_t)outstate->turn_ratio, (uint8_t)outstate->run_state, (uint32_t)outstate->tacho_limit
+  };
+
+  if (!reply)
+  {
+    return (nxt_transfer((unsigned char*) &cmd, sizeof (cmd), NULL) == sizeof (cmd)) ? 0 : -1;
+  }
+
+  ret_status_t st;
+  int ret = nxt_transfer((unsigned char*) &cmd, sizeof (cmd), (unsigned char*) &st);
+
+  if (ret != sizeof (ret_status_t))
+    return -1;
+
+  if (st.type != NXT_COMMAND_REPLY || st.opcode != NXT_OPCODE_SET_OUTPUTSTATE)
+    return -1;
+
+  if (st.status != NXT_STATUS_OK)
+    return -1;
+
+  return 0;
+}
+
 int vileSetOutputState(
   const vile_setoutputstate_t* outstate
 )
@@ -679,47 +571,104 @@ int vileSetOutputState(
   uint32_t state;
   ENTER_SYSCALL(state);
 
-
   vile_setoutputstate_t koutstate;
   ksceKernelMemcpyUserToKernel(&koutstate, outstate, sizeof(vile_setoutputstate_t));
 
-  cmd_setoutput_t cmd = {
-    NXT_DIRECT_COMMAND_DOREPLY, NXT_OPCODE_SET_OUTPUTSTATE, (uint8_t)koutstate.port, (int8_t)koutstate.power,
-    (uint8_t)koutstate.mode, (uint8_t)koutstate.regulation, (int8_t)koutstate.turn_ratio, (uint8_t)koutstate.run_state, (uint32_t)koutstate.tacho_limit
-  };
+  int ret = nxt_set_output_state(&koutstate, 1);
 
-  int sent = nxt_send((unsigned char*) &cmd, sizeof (cmd));
+  EXIT_SYSCALL(state);
 
-  if (sent != sizeof (cmd))
-  {
-    EXIT_SYSCALL(state);
-    return -1;
-  }
+  return ret;
+}
 
+// bus held; no reply unless asked for, 0 or -1
+static int drive_packet(unsigned char *request, unsigned int length, uint8_t reply, SceInt64 begin, SceInt64 wait)
+{
   ret_status_t st;
-  int ret = nxt_recv((unsigned char*) &st);
+  telemetry_command(request, length);
+  int ret = nxt_exchange(request, length, reply ? (unsigned char*) &st : NULL, VILE_PRIORITY_CONTROL, begin, wait);
 
-  if (ret != sizeof (ret_status_t))
+  if (!reply)
+    return ret == (int)length ? 0 : -1;
+  if (ret != sizeof (ret_status_t) || st.type != NXT_COMMAND_REPLY || st.opcode != NXT_OPCODE_SET_OUTPUTSTATE || st.status != NXT_STATUS_OK)
+    return -1;
+  return 0;
+}
+
+// zero speed brakes; otherwise regulated as a synced pair
+static void drive_command(cmd_setoutput_t *cmd, uint8_t port, int8_t speed, int8_t ratio, uint8_t reply)
+{
+  cmd_setoutput_t c = {
+    reply ? NXT_DIRECT_COMMAND_DOREPLY : NXT_DIRECT_COMMAND_NOREPLY, NXT_OPCODE_SET_OUTPUTSTATE, port, speed,
+    NXT_MOTOR_MODE_ON | NXT_MOTOR_MODE_BRAKE | (speed ? NXT_MOTOR_MODE_REGULATED : 0),
+    speed ? NXT_MOTOR_REGULATION_SYNC : NXT_MOTOR_REGULATION_IDLE,
+    speed ? ratio : 0, NXT_MOTOR_RUNSTATE_RUNNING, 0
+  };
+  *cmd = c;
+}
+
+// speed -100..100, turn -100..100 toward the right wheel (100 spins in place);
+// the brick keeps both motors in step with sync regulation. The NXT has no
+// command for two motors, so both SET_OUTPUT_STATEs go back to back under
+// one bus acquisition and only the second waits for a reply
+int vileDrive(const vile_out_t left, const vile_out_t right, const int8_t speed, const int8_t turn)
+{
+  uint32_t state;
+  ENTER_SYSCALL(state);
+
+  if (left > NXT_OUT_C || right > NXT_OUT_C || left == right || speed < -100 || speed > 100 || turn < -100 || turn > 100)
   {
     EXIT_SYSCALL(state);
     return -1;
   }
 
-  if (st.type != NXT_COMMAND_REPLY || st.opcode != NXT_OPCODE_SET_OUTPUTSTATE)
+  // the firmware slows the higher numbered motor for a positive turn ratio
+  int8_t ratio = left < right ? turn : -turn;
+  int8_t dir = speed > 0 ? 1 : speed < 0 ? -1 : 0;
+
+  cmd_setoutput_t first;
+  cmd_setoutput_t second;
+  drive_command(&first, left, speed, ratio, 0);
+  drive_command(&second, right, speed, ratio, 1);
+
+  if (session_check((unsigned char*) &first, sizeof(first)) < 0 || session_check((unsigned char*) &second, sizeof(second)) < 0)
   {
     EXIT_SYSCALL(state);
     return -1;
   }
 
-  if (st.status != NXT_STATUS_OK)
+  SceInt64 begin = ksceKernelGetSystemTimeWide();
+  nxt_lock_priority(VILE_PRIORITY_CONTROL);
+  SceInt64 wait = ksceKernelGetSystemTimeWide() - begin;
+
+  int ret = 0;
+  // sync regulation steers by the block tacho counts; whatever they hold
+  // from a move in another direction (or on another pair) would jerk the
+  // base back toward where they agree
+  if (dir && (dir != drive_dir || left != drive_left || right != drive_right))
   {
-    EXIT_SYSCALL(state);
-    return -1;
+    cmd_resetport_t reset = { NXT_DIRECT_COMMAND_NOREPLY, NXT_OPCODE_RESET_MOTOR_POSITION, left, 1 };
+    ret |= drive_packet((unsigned char*) &reset, sizeof(reset), 0, begin, wait);
+    reset.port = right;
+    ret |= drive_packet((unsigned char*) &reset, sizeof(reset), 0, begin, 0);
+    wait = 0;
   }
 
-  EXIT_SYSCALL(state);
+  if (ret == 0)
+    ret = drive_packet((unsigned char*) &first, sizeof(first), 0, begin, wait);
+  if (ret == 0)
+    ret = drive_packet((unsigned char*) &second, sizeof(second), 1, begin, 0);
 
-  return 0;
+  // its own packets made drive_forget drop the last pair; after a failure
+  // nobody knows what the block tacho counts hold
+  drive_left = ret == 0 ? left : 0xFF;
+  drive_right = ret == 0 ? right : 0xFF;
+  drive_dir = ret == 0 ? dir : 0;
+
+  nxt_unlock();
+
+  EXIT_SYSCALL(state);
+  return ret;
 }
 
 int vileSetInputMode(
@@ -735,16 +684,8 @@ int vileSetInputMode(
     NXT_DIRECT_COMMAND_DOREPLY, NXT_OPCODE_SET_INPUTMODE, port, stype, smode
   };
 
-  int sent = nxt_send((unsigned char*) &cmd, sizeof (cmd));
-
-  if (sent != sizeof (cmd))
-  {
-    EXIT_SYSCALL(state);
-    return -1;
-  }
-
   ret_status_t st;
-  int ret = nxt_recv((unsigned char*) &st);
+  int ret = nxt_transfer((unsigned char*) &cmd, sizeof (cmd), (unsigned char*) &st);
 
   if (ret != sizeof (ret_status_t))
   {
@@ -769,40 +710,36 @@ int vileSetInputMode(
 }
 
 
-int vileGetOutputState(const vile_out_t port, vile_outputstate_t *out)
+int nxt_get_output_state(const vile_out_t port, vile_outputstate_t *out, const vile_priority_t priority)
 {
-  uint32_t state;
-  ENTER_SYSCALL(state);
-
   cmd_port_t cmd = {
     NXT_DIRECT_COMMAND_DOREPLY, NXT_OPCODE_GET_OUTPUTSTATE, port
   };
 
-  vile_outputstate_t kout;
-
-  int sent = nxt_send((unsigned char*) &cmd, sizeof (cmd));
-
-  if (sent != sizeof (cmd))
-  {
-    EXIT_SYSCALL(state);
-    return -1;
-  }
-
-  int ret = nxt_recv((unsigned char*) &kout);
+  int ret = nxt_read_combined((unsigned char*) &cmd, sizeof (cmd), (unsigned char*) out, sizeof (vile_outputstate_t), priority);
 
   if (ret != sizeof (vile_outputstate_t))
-  {
-    EXIT_SYSCALL(state);
     return -1;
-  }
 
   if (out->type != NXT_COMMAND_REPLY || out->opcode != NXT_OPCODE_GET_OUTPUTSTATE)
-  {
-    EXIT_SYSCALL(state);
     return -1;
-  }
 
   if (out->status != NXT_STATUS_OK)
+    return -1;
+
+  return 0;
+}
+
+int vileGetOutputState(const vile_out_t port, vile_outputstate_t *out)
+{
+  uint32_t state;
+  ENTER_SYSCALL(state);
+
+  vile_outputstate_t kout;
+
+  int ret = nxt_get_output_state(port, &kout, VILE_PRIORITY_DEFAULT);
+
+  if (ret < 0)
   {
     EXIT_SYSCALL(state);
     return -1;
@@ -815,40 +752,36 @@ int vileGetOutputState(const vile_out_t port, vile_outputstate_t *out)
 }
 
 
-int vileGetInputValues(const vile_in_t port, vile_inputstate_t *out)
+int nxt_get_input_values(const vile_in_t port, vile_inputstate_t *out, const vile_priority_t priority)
 {
-  uint32_t state;
-  ENTER_SYSCALL(state);
-
   cmd_port_t cmd = {
     NXT_DIRECT_COMMAND_DOREPLY, NXT_OPCODE_GET_INPUTVALUES, port
   };
 
-  int sent = nxt_send((unsigned char*) &cmd, sizeof (cmd));
+  int ret = nxt_read_combined((unsigned char*) &cmd, sizeof (cmd), (unsigned char*) out, sizeof (vile_inputstate_t), priority);
 
-  if (sent != sizeof (cmd))
-  {
-    EXIT_SYSCALL(state);
+  if (ret != sizeof (vile_inputstate_t))
     return -1;
-  }
 
-  vile_inputstate_t kout;
-
-  int ret = nxt_recv((unsigned char*)&kout);
-
-  if (ret != sizeof (vile_inputstate_t))
-  {
-    EXIT_SYSCALL(state);
+  if (out->type != NXT_COMMAND_REPLY || out->opcode != NXT_OPCODE_GET_INPUTVALUES)
     return -1;
-  }
 
-  if (kout.type != NXT_COMMAND_REPLY || kout.opcode != NXT_OPCODE_GET_INPUTVALUES)
-  {
-    EXIT_SYSCALL(state);
+  if (out->status != NXT_STATUS_OK)
     return -1;
-  }
 
-  if (kout.status != NXT_STATUS_OK)
+  return 0;
+}
+
+int vileGetInputValues(const vile_in_t port, vile_inputstate_t *out)
+{
+  uint32_t state;
+  ENTER_SYSCALL(state);
+
+  vile_inputstate_t kout;
+
+  int ret = nxt_get_input_values(port, &kout, VILE_PRIORITY_DEFAULT);
+
+  if (ret < 0)
   {
     EXIT_SYSCALL(state);
     return -1;
@@ -870,16 +803,8 @@ int vileResetInputScaledValue(const vile_in_t port)
     NXT_DIRECT_COMMAND_DOREPLY, NXT_OPCODE_RESET_INPUT_SCALEDVALUES, port
   };
 
-  int sent = nxt_send((unsigned char*) &cmd, sizeof (cmd));
-
-  if (sent != sizeof (cmd))
-  {
-    EXIT_SYSCALL(state);
-    return -1;
-  }
-
   ret_status_t st;
-  int ret = nxt_recv((unsigned char*) &st);
+  int ret = nxt_transfer((unsigned char*) &cmd, sizeof (cmd), (unsigned char*) &st);
 
   if (ret != sizeof (ret_status_t))
   {
@@ -912,16 +837,8 @@ int vileResetMotorPosition(const vile_out_t port, const uint8_t relative)
     NXT_DIRECT_COMMAND_DOREPLY, NXT_OPCODE_RESET_MOTOR_POSITION, port, (relative > 0) ? 1 : 0
   };
 
-  int sent = nxt_send((unsigned char*) &cmd, sizeof (cmd));
-
-  if (sent != sizeof (cmd))
-  {
-    EXIT_SYSCALL(state);
-    return -1;
-  }
-
   ret_status_t st;
-  int ret = nxt_recv((unsigned char*) &st);
+  int ret = nxt_transfer((unsigned char*) &cmd, sizeof (cmd), (unsigned char*) &st);
 
   if (ret != sizeof (ret_status_t))
   {
@@ -953,16 +870,8 @@ int vileGetBatteryLevel()
 
   cmd_simple_t cmd = {NXT_DIRECT_COMMAND_DOREPLY, NXT_OPCODE_BATTERYLEVEL};
 
-  int sent = nxt_send((unsigned char*) &cmd, sizeof (cmd));
-
-  if (sent != sizeof(cmd))
-  {
-    EXIT_SYSCALL(state);
-    return -1;
-  }
-
   ret_battery_t bt;
-  int ret = nxt_recv((unsigned char*) &bt);
+  int ret = nxt_transfer((unsigned char*) &cmd, sizeof (cmd), (unsigned char*) &bt);
 
   if (ret != sizeof (ret_battery_t))
   {
@@ -1161,15 +1070,31 @@ void _start() __attribute__ ((weak, alias("module_start")));
 int module_start(SceSize args, void *argp)
 {
   ksceDebugPrintf("libViLE starting\n");
-  ksceKernelRegisterSysEventHandler("zvile_sysevent", vile_sysevent_handler, NULL);
-  transfer_ev = ksceKernelCreateEventFlag("vile_transfer", 0, 0, NULL);
-  ksceDebugPrintf("ef: 0x%08x\n", transfer_ev);
+  transport_usbd_init();
+  arbiter_init();
+  combine_init();
+  trajectory_init();
+  controller_init();
+  odometry_init();
+  rules_init();
+  telemetry_init();
+  capture_init();
+  restore_init();
+  poller_init();
+  sampling_init();
+  melody_init();
+  files_init();
+  iomap_init();
+  stream_init();
+  flash_init();
   return SCE_KERNEL_START_SUCCESS;
 }
 
 int module_stop(SceSize args, void *argp)
 {
-  vileStop();
+  // not vileStop, the module goes away with or without sessions open
+  session_reset();
+  driver_stop();
   return SCE_KERNEL_STOP_SUCCESS;
 }
 
@@ -0,0 +1,285 @@
+/**
+        libvile
+        Copyright (C) 2022 Cat (Ivan Epifanov)
+
+        This program is free software: you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        This program is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <psp2kern/kernel/cpu.h>
+#include <psp2kern/kernel/debug.h>
+#include <psp2kern/kernel/threadmgr.h>
+#include <psp2kern/kernel/sysmem/data_transfers.h>
+#include <string.h>
+#include "nxt.h"
+
+// notes starting later than this are counted as late
+#define MELODY_LATE 1000
+// usec a note takes at least, so zero-length ones don't flood the bus
+#define MELODY_MIN_STEP 1000
+
+#define MELODY_EV_WAKE 1
+
+static vile_note_t notes[VILE_MELODY_MAX];
+static unsigned int count = 0;
+static unsigned int next = 0; // note to start next
+static uint8_t loop = 0;
+static uint8_t playing = 0;
+static uint32_t generation = 0; // bumped whenever the melody is replaced or cancelled
+
+static SceInt64 epoch = 0; // start of the current pass
+static SceInt64 offset = 0; // usec from epoch to the next note
+
+static SceUID mel_mtx;
+static SceUID mel_ev;
+static SceUID mel_thid = -1;
+
+static volatile uint8_t running = 0;
+
+static vile_melody_stats_t stats;
+static uint64_t jitter_sum = 0;
+
+static void stats_reset()
+{
+  memset(&stats, 0, sizeof(stats));
+  stats.jitter_min = 0xFFFFFFFF;
+  jitter_sum = 0;
+}
+
+static int melody_thread(SceSize args, void *argp)
+{
+  ksceDebugPrintf("melody thread started\n");
+
+  while (running)
+  {
+    ksceKernelLockMutex(mel_mtx, 1, NULL);
+
+    if (!playing)
+    {
+      ksceKernelUnlockMutex(mel_mtx, 1);
+      ksceKernelWaitEventFlag(mel_ev, MELODY_EV_WAKE, SCE_EVENT_WAITCLEAR_PAT | SCE_EVENT_WAITOR, NULL, NULL);
+      continue;
+    }
+
+    vile_note_t note = notes[next];
+    SceInt64 due = epoch + offset;
+    uint32_t gen = generation;
+    ksceKernelUnlockMutex(mel_mtx, 1);
+
+    SceInt64 now = ksceKernelGetSystemTimeWide();
+
+    if (now < due)
+    {
+      SceUInt timeout = (SceUInt)(due - now);
+      ksceKernelWaitEventFlag(mel_ev, MELODY_EV_WAKE, SCE_EVENT_WAITCLEAR_PAT | SCE_EVENT_WAITOR, NULL, &timeout);
+      // woken up early (replaced, cancelled or stopped) or timed out, re-check either way
+      continue;
+    }
+
+    // rests only take time
+    int ret = 0;
+    if (note.frequency)
+    {
+      cmd_playtone_t cmd = {NXT_DIRECT_COMMAND_NOREPLY, NXT_OPCODE_PLAYTONE, note.frequency, note.duration};
+      ret = nxt_transfer((unsigned char*) &cmd, sizeof (cmd), NULL) == sizeof (cmd) ? 0 : -1;
+    }
+    now = ksceKernelGetSystemTimeWide();
+
+    uint32_t jitter = (uint32_t)(now - due);
+
+    ksceKernelLockMutex(mel_mtx, 1, NULL);
+    if (gen == generation)
+    {
+      SceInt64 step = ((SceInt64)note.duration + note.gap) * 1000;
+      offset += step > MELODY_MIN_STEP ? step : MELODY_MIN_STEP;
+      if (++next == count)
+      {
+        next = 0;
+        stats.passes++;
+        if (loop)
+        {
+          epoch += offset;
+          offset = 0;
+        }
+        else
+        {
+          playing = 0;
+        }
+      }
+
+      if (ret < 0)
+      {
+        stats.failed++;
+      }
+      else if (note.frequency)
+      {
+        stats.played++;
+        if (jitter > MELODY_LATE)
+          stats.late++;
+        if (jitter < stats.jitter_min)
+          stats.jitter_min = jitter;
+        if (jitter > stats.jitter_max)
+          stats.jitter_max = jitter;
+        stats.jitter_last = jitter;
+        jitter_sum += jitter;
+      }
+    }
+    ksceKernelUnlockMutex(mel_mtx, 1);
+  }
+
+  ksceDebugPrintf("melody thread stopped\n");
+  return 0;
+}
+
+// forget the melody, the tone already sent keeps sounding
+void melody_cancel()
+{
+  ksceKernelLockMutex(mel_mtx, 1, NULL);
+  playing = 0;
+  generation++;
+  ksceKernelUnlockMutex(mel_mtx, 1);
+
+  ksceKernelSetEventFlag(mel_ev, MELODY_EV_WAKE);
+}
+
+void melody_shutdown()
+{
+  if (mel_thid < 0)
+    return;
+
+  running = 0;
+  ksceKernelSetEventFlag(mel_ev, MELODY_EV_WAKE);
+  ksceKernelWaitThreadEnd(mel_thid, NULL, NULL);
+  ksceKernelDeleteThread(mel_thid);
+  mel_thid = -1;
+
+  ksceKernelLockMutex(mel_mtx, 1, NULL);
+  playing = 0;
+  count = 0;
+  generation++;
+  ksceKernelUnlockMutex(mel_mtx, 1);
+}
+
+int melody_init()
+{
+  mel_mtx = ksceKernelCreateMutex("vile_melody", 0, 0, NULL);
+  mel_ev = ksceKernelCreateEventFlag("vile_melody", 0, 0, NULL);
+  stats_reset();
+  return (mel_mtx < 0 || mel_ev < 0) ? -1 : 0;
+}
+
+/*
+ *  PUBLIC COMMANDS
+ */
+
+// replaces whatever is playing, the first note starts right away
+int vilePlayMelody(const vile_note_t *unotes, const unsigned int ucount, const uint8_t uloop)
+{
+  uint32_t state;
+  ENTER_SYSCALL(state);
+
+  if (!ucount || ucount > VILE_MELODY_MAX)
+  {
+    EXIT_SYSCALL(state);
+    return -1;
+  }
+
+  // a loop with no time in it would have the sequencer spin
+  if (uloop)
+  {
+    vile_note_t chunk[16];
+    uint32_t total = 0;
+    for (unsigned int i = 0; i < ucount; i += 16)
+    {
+      unsigned int n = ucount - i > 16 ? 16 : ucount - i;
+      ksceKernelMemcpyUserToKernel(chunk, &unotes[i], n * sizeof(vile_note_t));
+      for (unsigned int j = 0; j < n; j++)
+        total += chunk[j].duration + chunk[j].gap;
+    }
+    if (!total)
+    {
+      EXIT_SYSCALL(state);
+      return -1;
+    }
+  }
+
+  // under the lock, so two first calls don't start two sequencers
+  ksceKernelLockMutex(mel_mtx, 1, NULL);
+  if (mel_thid < 0)
+  {
+    mel_thid = ksceKernelCreateThread("vile_melody", melody_thread, 0x3C, 0x1000, 0, 0x10000, NULL);
+    if (mel_thid < 0)
+    {
+      ksceKernelUnlockMutex(mel_mtx, 1);
+      EXIT_SYSCALL(state);
+      return -1;
+    }
+    ksceKernelClearEventFlag(mel_ev, ~MELODY_EV_WAKE);
+    running = 1;
+    ksceKernelStartThread(mel_thid, 0, NULL);
+  }
+
+  ksceKernelMemcpyUserToKernel(notes, unotes, ucount * sizeof(vile_note_t));
+  count = ucount;
+  next = 0;
+  loop = uloop;
+  generation++;
+  stats_reset();
+  epoch = ksceKernelGetSystemTimeWide();
+  offset = 0;
+  playing = 1;
+  ksceKernelUnlockMutex(mel_mtx, 1);
+
+  ksceKernelSetEventFlag(mel_ev, MELODY_EV_WAKE);
+
+  EXIT_SYSCALL(state);
+  return 0;
+}
+
+int vileStopMelody()
+{
+  uint32_t state;
+  ENTER_SYSCALL(state);
+
+  melody_cancel();
+
+  // and silence the note in progress
+  cmd_simple_t cmd = {NXT_DIRECT_COMMAND_NOREPLY, NXT_OPCODE_STOP_SOUND};
+  int ret = nxt_transfer((unsigned char*) &cmd, sizeof (cmd), NULL) == sizeof (cmd) ? 0 : -1;
+
+  EXIT_SYSCALL(state);
+  return ret;
+}
+
+int vileGetMelodyStats(vile_melody_stats_t *ustats)
+{
+  uint32_t state;
+  ENTER_SYSCALL(state);
+
+  vile_melody_stats_t kstats;
+
+  ksceKernelLockMutex(mel_mtx, 1, NULL);
+  kstats = stats;
+  kstats.playing = playing;
+  kstats.position = next;
+  if (!kstats.played)
+    kstats.jitter_min = 0;
+  else
+    kstats.jitter_avg = (uint32_t)(jitter_sum / kstats.played);
+  ksceKernelUnlockMutex(mel_mtx, 1);
+
+  ksceKernelMemcpyKernelToUser(ustats, &kstats, sizeof(vile_melody_stats_t));
+
+  EXIT_SYSCALL(state);
+  return 0;
+}
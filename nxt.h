@@ -0,0 +1,461 @@
+/**
+        libvile
+        Copyright (C) 2022 Cat (Ivan Epifanov)
+
+        This program is free software: you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        This program is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef __NXT_H__
+#define __NXT_H__
+
+#include <stdint.h>
+#include "vile.h"
+#include "transport.h"
+
+enum {
+  NXT_DIRECT_COMMAND_DOREPLY = 0x00,
+  NXT_SYSTEM_COMMAND_DOREPLY = 0x01,
+  NXT_COMMAND_REPLY = 0x02,
+  NXT_DIRECT_COMMAND_NOREPLY = 0x80,
+  NXT_SYSTEM_COMMAND_NOREPLY = 0x81,
+};
+
+enum {
+  NXT_OPCODE_STARTPROGRAM = 0x00,
+  NXT_OPCODE_STOPPROGRAM = 0x01,
+  NXT_OPCODE_PLAYSOUND = 0x02,
+  NXT_OPCODE_PLAYTONE = 0x03,
+  NXT_OPCODE_SET_OUTPUTSTATE = 0x04,
+  NXT_OPCODE_SET_INPUTMODE = 0x05,
+  NXT_OPCODE_GET_OUTPUTSTATE = 0x06,
+  NXT_OPCODE_GET_INPUTVALUES = 0x07,
+  NXT_OPCODE_RESET_INPUT_SCALEDVALUES = 0x08,
+  NXT_OPCODE_MESSAGE_WRITE = 0x09,
+  NXT_OPCODE_MESSAGE_READ = 0x13,
+  NXT_OPCODE_RESET_MOTOR_POSITION = 0x0A,
+  NXT_OPCODE_BATTERYLEVEL = 0x0B,
+  NXT_OPCODE_STOP_SOUND = 0x0C,
+  NXT_OPCODE_KEEPALIVE = 0x0D,
+  NXT_OPCODE_LS_GET_STATUS = 0x0E,
+  NXT_OPCODE_LS_WRITE = 0x0F,
+  NXT_OPCODE_LS_READ = 0x10,
+  NXT_OPCODE_GET_CURRENTPROGRAM_NAME = 0x11,
+  /** \todo system commands */
+  NXT_OPCODE_SYS_OPENREAD = 0x80,
+  NXT_OPCODE_SYS_OPENWRITE = 0x81,
+  NXT_OPCODE_SYS_READ = 0x82,
+  NXT_OPCODE_SYS_WRITE = 0x83,
+  NXT_OPCODE_SYS_CLOSE = 0x84,
+  NXT_OPCODE_SYS_DELETE = 0x85,
+  NXT_OPCODE_SYS_FINDFIRST = 0x86,
+  NXT_OPCODE_SYS_FINDNEXT = 0x87,
+  NXT_OPCODE_SYS_GET_FIRMVAREVERSION = 0x88,
+  NXT_OPCODE_SYS_OPENLINEARWRITE = 0x89,
+  NXT_OPCODE_SYS_OPENLINEARREAD = 0x8A,
+  NXT_OPCODE_SYS_OPENWRITEDATA = 0x8B,
+  NXT_OPCODE_SYS_OPENAPPENDDATA = 0x8C,
+  NXT_OPCODE_SYS_READ_IOMAP = 0x94,
+  NXT_OPCODE_SYS_WRITE_IOMAP = 0x95,
+  NXT_OPCODE_SYS_BOOT = 0x97,
+  NXT_OPCODE_SYS_SETBRICKNAME = 0x98,
+  NXT_OPCODE_SYS_GET_DEVICEINFO = 0x9B,
+  NXT_OPCODE_SYS_DELETE_USERFLASH = 0xA0,
+  NXT_OPCODE_SYS_POLLCOMMAND_LENGTH = 0xA1,
+  NXT_OPCODE_SYS_POLLCOMMAND = 0xA2,
+  NXT_OPCODE_SYS_RESET_BLUETOOTH = 0xA4
+};
+
+// packet return types
+#pragma pack(push,1)
+
+typedef struct {
+  uint8_t type;
+  uint8_t opcode;
+  uint8_t status;
+} ret_status_t __attribute__ ((aligned (64)));
+
+typedef struct {
+  uint8_t type;
+  uint8_t opcode;
+  uint8_t status;
+  uint16_t mv;
+} ret_battery_t __attribute__ ((aligned (64)));
+
+typedef struct {
+  uint8_t type;
+  uint8_t opcode;
+  uint8_t status;
+  uint32_t msec;
+} ret_keepalive_t __attribute__ ((aligned (64)));
+
+typedef struct {
+  uint8_t type;
+  uint8_t opcode;
+  uint8_t status;
+  char filename[20];
+} ret_currentprogram_t __attribute__ ((aligned (64)));
+
+typedef struct {
+  uint8_t type;
+  uint8_t opcode;
+  uint8_t status;
+  uint8_t bytes_ready;
+} ret_lsstatus_t __attribute__ ((aligned (64)));
+
+typedef struct {
+  uint8_t type;
+  uint8_t opcode;
+  uint8_t status;
+  uint8_t bytes_read;
+  char data[16];
+} ret_lsread_t __attribute__ ((aligned (64)));
+
+typedef struct {
+  uint8_t type;
+  uint8_t opcode;
+  uint8_t status;
+  uint8_t local_inbox;
+  uint8_t msg_size;
+  char data[58];
+} ret_msgread_t __attribute__ ((aligned (64)));
+
+typedef struct {
+  uint8_t type;
+  uint8_t opcode;
+  uint8_t status;
+  uint8_t handle;
+} ret_handle_t __attribute__ ((aligned (64)));
+
+typedef struct {
+  uint8_t type;
+  uint8_t opcode;
+  uint8_t status;
+  uint8_t handle;
+  uint16_t size;
+} ret_write_t __attribute__ ((aligned (64)));
+
+// FINDFIRST and FINDNEXT
+typedef struct {
+  uint8_t type;
+  uint8_t opcode;
+  uint8_t status;
+  uint8_t handle;
+  char filename[20];
+  uint32_t size;
+} ret_find_t __attribute__ ((aligned (64)));
+
+typedef struct {
+  uint8_t type;
+  uint8_t opcode;
+  uint8_t status;
+  char name[15];
+  uint8_t address[7]; // bluetooth, the last byte is always 0
+  uint32_t signal;
+  uint32_t free_flash;
+} ret_deviceinfo_t __attribute__ ((aligned (64)));
+
+// what is left of a usb packet after the header
+#define NXT_IOMAP_READ_CHUNK 55
+
+typedef struct {
+  uint8_t type;
+  uint8_t opcode;
+  uint8_t status;
+  uint32_t module;
+  uint16_t size;
+  uint8_t data[NXT_IOMAP_READ_CHUNK];
+} ret_iomap_t __attribute__ ((aligned (64)));
+
+#define NXT_POLL_CHUNK 59
+
+typedef struct {
+  uint8_t type;
+  uint8_t opcode;
+  uint8_t status;
+  uint8_t buffer;
+  uint8_t length;
+  uint8_t data[NXT_POLL_CHUNK];
+} ret_poll_t __attribute__ ((aligned (64)));
+
+// command packet types
+
+typedef struct {
+  uint8_t type;
+  uint8_t opcode;
+} cmd_simple_t __attribute__ ((aligned (64)));
+
+typedef struct {
+  uint8_t type;
+  uint8_t opcode;
+  uint8_t port;
+} cmd_port_t __attribute__ ((aligned (64)));
+
+typedef struct {
+  uint8_t type;
+  uint8_t opcode;
+  uint8_t port;
+  uint8_t relative;
+} cmd_resetport_t __attribute__ ((aligned (64)));
+
+typedef struct {
+  uint8_t type;
+  uint8_t opcode;
+  char filename[20];
+} cmd_startprogram_t __attribute__ ((aligned (64)));
+
+typedef struct {
+  uint8_t type;
+  uint8_t opcode;
+  uint8_t loop;
+  char filename[20];
+} cmd_playsound_t __attribute__ ((aligned (64)));
+
+typedef struct {
+  uint8_t type;
+  uint8_t opcode;
+  uint16_t freq;
+  uint16_t duration;
+} cmd_playtone_t __attribute__ ((aligned (64)));
+
+typedef struct {
+  uint8_t type;
+  uint8_t opcode;
+  uint8_t port;
+  int8_t power;
+  uint8_t mode;
+  uint8_t regulation;
+  int8_t turn_ratio;
+  uint8_t run_state;
+  uint32_t tacho_limit;
+} cmd_setoutput_t __attribute__ ((aligned (64)));
+
+typedef struct {
+  uint8_t type;
+  uint8_t opcode;
+  uint8_t port;
+  uint8_t stype;
+  uint8_t smode;
+} cmd_setinput_t __attribute__ ((aligned (64)));
+
+typedef struct {
+  uint8_t type;
+  uint8_t opcode;
+  uint8_t port;
+  uint8_t tx_size;
+  uint8_t rx_size;
+  char data[20];
+} cmd_lswrite_t __attribute__ ((aligned (64)));
+
+typedef struct {
+  uint8_t type;
+  uint8_t opcode;
+  uint8_t remote_inbox;
+  uint8_t local_inbox;
+  uint8_t remove;
+} cmd_msgread_t __attribute__ ((aligned (64)));
+
+typedef struct {
+  uint8_t type;
+  uint8_t opcode;
+  uint8_t inbox;
+  uint8_t message_size;
+  char message[59];
+} cmd_msgwrite_t __attribute__ ((aligned (64)));
+
+typedef struct {
+  uint8_t type;
+  uint8_t opcode;
+  char filename[20];
+} cmd_file_t __attribute__ ((aligned (64)));
+
+typedef struct {
+  uint8_t type;
+  uint8_t opcode;
+  char filename[20];
+  uint32_t size;
+} cmd_openwrite_t __attribute__ ((aligned (64)));
+
+typedef struct {
+  uint8_t type;
+  uint8_t opcode;
+  uint8_t handle;
+} cmd_handle_t __attribute__ ((aligned (64)));
+
+// fills a whole usb packet
+#define NXT_WRITE_CHUNK 61
+
+// SYS_BOOT's argument, in a cmd_file_t; only honoured over usb
+#define NXT_BOOT_MAGIC "Let's dance: SAMBA"
+
+typedef struct {
+  uint8_t type;
+  uint8_t opcode;
+  uint8_t handle;
+  uint8_t data[NXT_WRITE_CHUNK];
+} cmd_write_t __attribute__ ((aligned (64)));
+
+#define NXT_IOMAP_WRITE_CHUNK 54
+
+typedef struct {
+  uint8_t type;
+  uint8_t opcode;
+  uint32_t module;
+  uint16_t offset;
+  uint16_t size;
+  uint8_t data[NXT_IOMAP_WRITE_CHUNK];
+} cmd_iomap_t __attribute__ ((aligned (64)));
+
+// POLLCOMMAND_LENGTH stops after buffer
+typedef struct {
+  uint8_t type;
+  uint8_t opcode;
+  uint8_t buffer;
+  uint8_t length;
+} cmd_poll_t __attribute__ ((aligned (64)));
+
+#pragma pack(pop)
+
+// bus (main.c)
+
+int nxt_connected();
+// a SAM-BA bootloader in place of the brick; bus held for send/recv
+int nxt_bootloader();
+int nxt_boot_send(const unsigned char *data, unsigned int length);
+int nxt_boot_recv(unsigned char *data, unsigned int length);
+int nxt_send(unsigned char *request, unsigned int length);
+int nxt_recv(unsigned char *result);
+// priority VILE_PRIORITY_DEFAULT picks a class from the opcode
+int nxt_transfer_priority(unsigned char *request, unsigned int length, unsigned char *result, vile_priority_t priority);
+int nxt_transfer(unsigned char *request, unsigned int length, unsigned char *result);
+// bus held; begin is when the caller started on the command, wait how long it queued
+int nxt_exchange(unsigned char *request, unsigned int length, unsigned char *result, vile_priority_t priority, SceInt64 begin, SceInt64 wait);
+// bus held, every command that went out
+void drive_forget(const unsigned char *request, unsigned int length);
+
+int nxt_set_output_state(const vile_setoutputstate_t *outstate, const uint8_t reply);
+int nxt_get_input_values(const vile_in_t port, vile_inputstate_t *out, const vile_priority_t priority);
+int nxt_get_output_state(const vile_out_t port, vile_outputstate_t *out, const vile_priority_t priority);
+
+// arbiter.c
+
+int arbiter_init();
+void arbiter_reset_stats();
+vile_priority_t nxt_command_priority(const unsigned char *request, unsigned int length);
+void nxt_lock_priority(vile_priority_t priority);
+void nxt_lock(); // control class
+void nxt_unlock();
+int nxt_yield();
+int session_open();
+int session_close();
+void session_reset(); // module unload
+int session_check(const unsigned char *request, unsigned int length);
+int session_check_for(SceUID pid, const unsigned char *request, unsigned int length);
+int session_check_motor(uint8_t port);
+
+// combine.c
+
+int combine_init();
+// a GET_INPUTVALUES or GET_OUTPUTSTATE shared with the same read in flight;
+// size is result's, returns what the transfer did
+int nxt_read_combined(unsigned char *request, unsigned int length, unsigned char *result, unsigned int size, vile_priority_t priority);
+// bus held
+void combine_command(const unsigned char *request, unsigned int length);
+
+// pacing.c
+
+void pacing_reset();
+// bus held; returns usec spent waiting for the issue budget
+SceInt64 pacing_wait(vile_priority_t priority);
+void pacing_update(int ret, const unsigned char *reply, SceInt64 latency);
+
+// poller.c
+
+int poller_init();
+void poller_start();
+void poller_shutdown();
+
+// sampling.c
+
+int sampling_init();
+void sampling_shutdown();
+
+// restore.c
+
+int restore_init();
+void restore_start();
+void restore_shutdown();
+void restore_command(const unsigned char *request, unsigned int length);
+void restore_forget(const unsigned char *request, unsigned int length);
+
+// files.c
+
+int files_init();
+
+// iomap.c
+
+int iomap_init();
+void iomap_shutdown();
+// ports selected in state; returns reads it took or -1
+int nxt_read_state(vile_state_t *state, vile_priority_t priority);
+
+// stream.c
+
+int stream_init();
+void stream_shutdown();
+
+// flash.c
+
+int flash_init();
+void flash_shutdown();
+
+// melody.c
+
+int melody_init();
+void melody_shutdown();
+void melody_cancel();
+
+// trajectory.c
+
+int trajectory_init();
+void trajectory_shutdown();
+
+// controller.c
+
+int controller_init();
+void controller_shutdown();
+
+// odometry.c
+
+int odometry_init();
+void odometry_shutdown();
+
+// rules.c
+
+int rules_init();
+void rules_shutdown();
+
+// telemetry.c
+
+int telemetry_init();
+void telemetry_shutdown();
+void telemetry_command(const unsigned char *request, unsigned int length);
+
+// capture.c
+
+int capture_init();
+void capture_shutdown();
+SceInt64 capture_begin();
+void capture_packet(const uint8_t dir, const unsigned char *data, const unsigned int length, const int result, const SceInt64 begin);
+
+#endif // __NXT_H__
@@ -0,0 +1,422 @@
+/**
+        libvile
+        Copyright (C) 2022 Cat (Ivan Epifanov)
+
+        This program is free software: you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        This program is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <psp2kern/kernel/cpu.h>
+#include <psp2kern/kernel/debug.h>
+#include <psp2kern/kernel/threadmgr.h>
+#include <psp2kern/kernel/sysmem/data_transfers.h>
+#include <string.h>
+#include "nxt.h"
+
+/*
+ * Dead reckoning for a differential drive. Heading comes straight from the
+ * difference of the two wheels' total counts, so it never drifts from
+ * rounding. Position adds up each update's travel along the heading
+ * halfway through the update, rotated with CORDIC in 1/65536 um.
+ *
+ * Angles are binary: a full turn is 2^32 and wraps by itself.
+ */
+
+#define ODOMETRY_MIN_PERIOD 2000
+#define ODOMETRY_CORDIC 24
+
+#define ODOMETRY_EV_WAKE 1
+
+#define PI_Q30 3373259426LL
+#define CORDIC_K_Q30 652032874LL // 1 / the gain of ODOMETRY_CORDIC iterations
+
+// atan(2^-i) in binary angle
+static const int32_t cordic_atan[ODOMETRY_CORDIC] = {
+  536870912, 316933406, 167458907, 85004756, 42667331, 21354465, 10679838, 5340245,
+  2670163, 1335087, 667544, 333772, 166886, 83443, 41722, 20861,
+  10430, 5215, 2608, 1304, 652, 326, 163, 81
+};
+
+static vile_odometry_t config;
+
+static SceUID odo_mtx;
+static SceUID odo_ev;
+static SceUID odo_thid = -1;
+
+static volatile uint8_t running = 0;
+
+// under odo_mtx
+static vile_pose_t pose;
+static int64_t x_q16; // 1/65536 um
+static int64_t y_q16;
+static uint32_t heading_origin; // added to the heading from the counts
+static int64_t total_left; // degrees since start
+static int64_t total_right;
+
+static int64_t travel_q16; // 1/65536 um per degree
+static int64_t turn_q8; // 1/256 binary angle per degree of difference
+
+static vile_odometry_stats_t stats;
+static uint64_t read_sum = 0;
+static uint64_t skew_sum = 0;
+
+// (length, 0) turned by angle
+static void rotate(int64_t length, uint32_t angle, int64_t *dx, int64_t *dy)
+{
+  int64_t x = length * CORDIC_K_Q30 >> 30;
+  int64_t y = 0;
+  int32_t z = (int32_t)angle;
+
+  // CORDIC converges within a quarter turn either way, flip the rest over
+  if (z > 0x40000000 || z < -0x40000000)
+  {
+    x = -x;
+    z = (int32_t)(angle + 0x80000000u);
+  }
+
+  for (int i = 0; i < ODOMETRY_CORDIC; i++)
+  {
+    int64_t nx;
+    if (z >= 0)
+    {
+      nx = x - (y >> i);
+      y += x >> i;
+      z -= cordic_atan[i];
+    }
+    else
+    {
+      nx = x + (y >> i);
+      y -= x >> i;
+      z += cordic_atan[i];
+    }
+    x = nx;
+  }
+
+  *dx = x;
+  *dy = y;
+}
+
+static uint32_t heading_of(int64_t left, int64_t right)
+{
+  return heading_origin + (uint32_t)((right - left) * turn_q8 >> 8);
+}
+
+// bus held
+static int read_count(vile_out_t port, int32_t *count, SceInt64 wait)
+{
+  cmd_port_t cmd = {NXT_DIRECT_COMMAND_DOREPLY, NXT_OPCODE_GET_OUTPUTSTATE, port};
+  vile_outputstate_t r;
+
+  SceInt64 begin = ksceKernelGetSystemTimeWide();
+  int ret = nxt_exchange((unsigned char*) &cmd, 3, (unsigned char*) &r, VILE_PRIORITY_CONTROL, begin, wait);
+  if (ret != sizeof(vile_outputstate_t) || r.type != NXT_COMMAND_REPLY ||
+      r.opcode != NXT_OPCODE_GET_OUTPUTSTATE || r.status != NXT_STATUS_OK)
+    return -1;
+
+  *count = r.rotation_count;
+  return 0;
+}
+
+// both counts back to back in one hold of the bus; time is halfway between
+static int read_counts(int32_t *left, int32_t *right, SceInt64 *time, SceInt64 *skew)
+{
+  SceInt64 begin = ksceKernelGetSystemTimeWide();
+  nxt_lock_priority(VILE_PRIORITY_CONTROL);
+  SceInt64 first = ksceKernelGetSystemTimeWide();
+
+  int ret = read_count(config.left, left, first - begin);
+  SceInt64 second = ksceKernelGetSystemTimeWide();
+  if (ret == 0)
+    ret = read_count(config.right, right, 0);
+  SceInt64 end = ksceKernelGetSystemTimeWide();
+
+  nxt_unlock();
+
+  if (ret < 0)
+    return -1;
+
+  if (config.reversed & 1)
+    *left = -*left;
+  if (config.reversed & 2)
+    *right = -*right;
+
+  // each count is taken about halfway through its own round trip
+  *time = (first + second) / 4 + (second + end) / 4;
+  *skew = (end - first) / 2;
+  return 0;
+}
+
+static void integrate(int32_t left, int32_t right, SceInt64 time)
+{
+  // the counts are 32 bit and may wrap, the deltas don't
+  int32_t dl = (int32_t)((uint32_t)left - (uint32_t)pose.left_count);
+  int32_t dr = (int32_t)((uint32_t)right - (uint32_t)pose.right_count);
+
+  uint32_t before = pose.heading;
+  total_left += dl;
+  total_right += dr;
+  uint32_t after = heading_of(total_left, total_right);
+
+  // travel of the middle of the axle, along the heading halfway through
+  int32_t turn = (int32_t)(after - before);
+  int64_t travel = ((int64_t)dl + dr) * travel_q16 / 2;
+  int64_t dx, dy;
+  rotate(travel, before + turn / 2, &dx, &dy);
+  x_q16 += dx;
+  y_q16 += dy;
+
+  SceInt64 dt = time - (SceInt64)pose.timestamp;
+  if (dt > 0)
+  {
+    pose.speed = (int32_t)((travel * 1000000 / dt) >> 16);
+    // microdegrees first, a small turn would round away in millidegrees
+    pose.turn_rate = (int32_t)(((int64_t)turn * 360000000 >> 32) * 1000 / dt);
+  }
+
+  pose.timestamp = time;
+  pose.sequence++;
+  pose.x = (int32_t)(x_q16 >> 16);
+  pose.y = (int32_t)(y_q16 >> 16);
+  pose.heading = after;
+  pose.left_count = left;
+  pose.right_count = right;
+}
+
+static int odometry_thread(SceSize args, void *argp)
+{
+  ksceDebugPrintf("odometry thread started\n");
+
+  SceInt64 next = ksceKernelGetSystemTimeWide();
+  SceInt64 window = next;
+  uint32_t window_count = 0;
+  uint8_t primed = 0;
+
+  while (running)
+  {
+    SceInt64 now = ksceKernelGetSystemTimeWide();
+
+    if (now < next)
+    {
+      SceUInt timeout = (SceUInt)(next - now);
+      ksceKernelWaitEventFlag(odo_ev, ODOMETRY_EV_WAKE, SCE_EVENT_WAITCLEAR_PAT | SCE_EVENT_WAITOR, NULL, &timeout);
+      continue;
+    }
+
+    uint32_t skipped = 0;
+    next += config.period;
+    if (next <= now)
+    {
+      // fell behind, keep the original phase instead of bursting to catch up
+      skipped = (uint32_t)((now - next) / config.period) + 1;
+      next += (SceInt64)skipped * config.period;
+    }
+
+    if (now - window >= 1000000)
+    {
+      ksceKernelLockMutex(odo_mtx, 1, NULL);
+      stats.rate = window_count;
+      ksceKernelUnlockMutex(odo_mtx, 1);
+      window = now;
+      window_count = 0;
+    }
+
+    int32_t left, right;
+    SceInt64 time, skew;
+    int ret = read_counts(&left, &right, &time, &skew);
+    uint32_t took = (uint32_t)(ksceKernelGetSystemTimeWide() - now);
+
+    ksceKernelLockMutex(odo_mtx, 1, NULL);
+    stats.overruns += skipped;
+    if (ret < 0)
+      stats.failed++;
+    else
+    {
+      if (!primed)
+      {
+        // the pose starts where the wheels are now
+        pose.left_count = left;
+        pose.right_count = right;
+        pose.timestamp = time;
+        primed = 1;
+      }
+      else
+        integrate(left, right, time);
+
+      stats.updates++;
+      window_count++;
+      read_sum += took;
+      skew_sum += skew;
+      if (took > stats.read_max)
+        stats.read_max = took;
+    }
+    ksceKernelUnlockMutex(odo_mtx, 1);
+  }
+
+  ksceDebugPrintf("odometry thread stopped\n");
+  return 0;
+}
+
+static void odometry_stop()
+{
+  if (odo_thid < 0)
+    return;
+
+  running = 0;
+  ksceKernelSetEventFlag(odo_ev, ODOMETRY_EV_WAKE);
+  ksceKernelWaitThreadEnd(odo_thid, NULL, NULL);
+  ksceKernelDeleteThread(odo_thid);
+  odo_thid = -1;
+}
+
+int odometry_init()
+{
+  odo_mtx = ksceKernelCreateMutex("vile_odometry", 0, 0, NULL);
+  odo_ev = ksceKernelCreateEventFlag("vile_odometry", 0, 0, NULL);
+  return (odo_mtx < 0 || odo_ev < 0) ? -1 : 0;
+}
+
+void odometry_shutdown()
+{
+  odometry_stop();
+}
+
+/*
+ *  PUBLIC COMMANDS
+ */
+
+int vileStartOdometry(const vile_odometry_t *odometry)
+{
+  uint32_t state;
+  ENTER_SYSCALL(state);
+
+  vile_odometry_t kodometry;
+  ksceKernelMemcpyUserToKernel(&kodometry, odometry, sizeof(vile_odometry_t));
+
+  // up to 8 m wheels keep the fixed point in range
+  if (kodometry.left > NXT_OUT_C || kodometry.right > NXT_OUT_C || kodometry.left == kodometry.right ||
+      !kodometry.wheel_diameter || kodometry.wheel_diameter > 8000000 || !kodometry.track_width ||
+      kodometry.period < ODOMETRY_MIN_PERIOD)
+  {
+    EXIT_SYSCALL(state);
+    return -1;
+  }
+
+  // checked and started under the lock, so two starts can't both get a thread
+  ksceKernelLockMutex(odo_mtx, 1, NULL);
+
+  if (odo_thid >= 0)
+  {
+    ksceKernelUnlockMutex(odo_mtx, 1);
+    EXIT_SYSCALL(state);
+    return -1;
+  }
+
+  config = kodometry;
+  memset(&pose, 0, sizeof(pose));
+  memset(&stats, 0, sizeof(stats));
+  read_sum = 0;
+  skew_sum = 0;
+  x_q16 = 0;
+  y_q16 = 0;
+  heading_origin = 0;
+  total_left = 0;
+  total_right = 0;
+  travel_q16 = (int64_t)config.wheel_diameter * PI_Q30 / 360 >> 14;
+  // turns = degrees * pi * diameter / 360 / (2 * pi * track)
+  turn_q8 = ((int64_t)config.wheel_diameter << 40) / (720LL * config.track_width);
+
+  odo_thid = ksceKernelCreateThread("vile_odometry", odometry_thread, 0x3C, 0x1000, 0, 0x10000, NULL);
+  if (odo_thid < 0)
+  {
+    ksceKernelUnlockMutex(odo_mtx, 1);
+    EXIT_SYSCALL(state);
+    return -1;
+  }
+
+  ksceKernelClearEventFlag(odo_ev, ~ODOMETRY_EV_WAKE);
+  running = 1;
+  ksceKernelStartThread(odo_thid, 0, NULL);
+
+  ksceKernelUnlockMutex(odo_mtx, 1);
+
+  EXIT_SYSCALL(state);
+  return 0;
+}
+
+int vileStopOdometry()
+{
+  uint32_t state;
+  ENTER_SYSCALL(state);
+
+  odometry_stop();
+
+  EXIT_SYSCALL(state);
+  return 0;
+}
+
+int vileGetPose(vile_pose_t *upose)
+{
+  uint32_t state;
+  ENTER_SYSCALL(state);
+
+  ksceKernelLockMutex(odo_mtx, 1, NULL);
+  vile_pose_t kpose = pose;
+  ksceKernelUnlockMutex(odo_mtx, 1);
+
+  ksceKernelMemcpyKernelToUser(upose, &kpose, sizeof(vile_pose_t));
+
+  EXIT_SYSCALL(state);
+  return 0;
+}
+
+int vileSetPose(const int32_t x, const int32_t y, const uint32_t heading)
+{
+  uint32_t state;
+  ENTER_SYSCALL(state);
+
+  ksceKernelLockMutex(odo_mtx, 1, NULL);
+  x_q16 = (int64_t)x << 16;
+  y_q16 = (int64_t)y << 16;
+  heading_origin = 0;
+  heading_origin = heading - heading_of(total_left, total_right);
+  pose.x = x;
+  pose.y = y;
+  pose.heading = heading;
+  ksceKernelUnlockMutex(odo_mtx, 1);
+
+  EXIT_SYSCALL(state);
+  return 0;
+}
+
+int vileGetOdometryStats(vile_odometry_stats_t *ustats)
+{
+  uint32_t state;
+  ENTER_SYSCALL(state);
+
+  vile_odometry_stats_t kstats;
+
+  ksceKernelLockMutex(odo_mtx, 1, NULL);
+  kstats = stats;
+  kstats.running = running;
+  if (kstats.updates)
+  {
+    kstats.read_avg = (uint32_t)(read_sum / kstats.updates);
+    kstats.skew_avg = (uint32_t)(skew_sum / kstats.updates);
+  }
+  ksceKernelUnlockMutex(odo_mtx, 1);
+
+  ksceKernelMemcpyKernelToUser(ustats, &kstats, sizeof(vile_odometry_stats_t));
+
+  EXIT_SYSCALL(state);
+  return 0;
+}
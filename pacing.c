@@ -0,0 +1,193 @@
+/**
+        libvile
+        Copyright (C) 2022 Cat (Ivan Epifanov)
+
+        This program is free software: you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        This program is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <psp2kern/kernel/cpu.h>
+#include <psp2kern/kernel/debug.h>
+#include <psp2kern/kernel/threadmgr.h>
+#include <psp2kern/kernel/sysmem/data_transfers.h>
+#include <string.h>
+#include "nxt.h"
+
+/*
+ * Spacing between commands, AIMD style. Each reply is compared with the
+ * lowest latency seen recently; a reply much slower than that, a
+ * brick-side buffer error or a failed transfer doubles the gap. Every
+ * command sent shrinks it by 1/PACING_DECAY, so the rate creeps back up
+ * even when most traffic asks for no reply. Runs with the bus held.
+ */
+
+// reply slower than baseline * 2 + slack counts as congestion
+#define PACING_SLACK 500
+#define PACING_DECAY 256
+#define PACING_MIN_GAP 250 // first gap after congestion
+#define PACING_MAX_GAP 20000 // the bus is held while pacing, keep stops quick
+// baseline is the minimum over this many replies
+#define PACING_WINDOW 256
+
+static uint8_t enabled = 1;
+static uint32_t gap = 0;
+static SceInt64 last_issue = 0;
+// slow replies before this are the backlog that caused the last increase
+static SceInt64 holdoff = 0;
+
+static uint32_t baseline = 0;
+static uint32_t window_min = 0xFFFFFFFF;
+static uint32_t window_count = 0;
+
+static vile_pacing_stats_t stats;
+static uint64_t latency_sum = 0;
+
+static void pacing_reset_locked()
+{
+  gap = 0;
+  holdoff = 0;
+  baseline = 0;
+  window_min = 0xFFFFFFFF;
+  window_count = 0;
+  memset(&stats, 0, sizeof(stats));
+  latency_sum = 0;
+}
+
+void pacing_reset()
+{
+  nxt_lock();
+  pacing_reset_locked();
+  nxt_unlock();
+}
+
+SceInt64 pacing_wait(vile_priority_t priority)
+{
+  SceInt64 now = ksceKernelGetSystemTimeWide();
+  SceInt64 delay = 0;
+
+  // a stop never waits for the budget
+  if (enabled && gap && priority != VILE_PRIORITY_SAFETY)
+  {
+    SceInt64 next = last_issue + gap;
+    if (now < next)
+    {
+      delay = next - now;
+      ksceKernelDelayThread((SceUInt)delay);
+      stats.paced++;
+      stats.delay_us += delay;
+      now = next;
+    }
+  }
+
+  last_issue = now;
+  gap -= gap / PACING_DECAY + (gap ? 1 : 0);
+  return delay;
+}
+
+static int brick_busy(int ret, const unsigned char *reply)
+{
+  return ret >= 3 && reply[0] == NXT_COMMAND_REPLY &&
+         (reply[2] == NXT_STATUS_COMMUNICATION_ERROR || reply[2] == NXT_STATUS_NO_BUFFER);
+}
+
+void pacing_update(int ret, const unsigned char *reply, SceInt64 latency)
+{
+  uint32_t l = (uint32_t)latency;
+  int congested;
+
+  if (ret < 0)
+  {
+    congested = 1;
+  }
+  else if (brick_busy(ret, reply))
+  {
+    // refused straight away, says nothing about latency
+    stats.brick_errors++;
+    congested = 1;
+  }
+  else
+  {
+    stats.replies++;
+    latency_sum += l;
+
+    int bucket = 0;
+    while (bucket < VILE_PACING_BUCKETS - 1 && l >= (256u << bucket))
+      bucket++;
+    stats.latency_hist[bucket]++;
+
+    congested = baseline && l > baseline * 2 + PACING_SLACK;
+
+    if (l < window_min)
+      window_min = l;
+    if (!baseline || l < baseline)
+      baseline = l;
+    // let the baseline rise again if the link got slower for good
+    if (++window_count == PACING_WINDOW)
+    {
+      baseline = window_min;
+      window_min = 0xFFFFFFFF;
+      window_count = 0;
+    }
+  }
+
+  SceInt64 now = ksceKernelGetSystemTimeWide();
+  if (!congested || now < holdoff)
+    return;
+
+  gap *= 2;
+  if (gap < PACING_MIN_GAP)
+    gap = PACING_MIN_GAP;
+  if (gap > PACING_MAX_GAP)
+    gap = PACING_MAX_GAP;
+  // what was queued when this reply left has drained after about as long again
+  holdoff = now + latency;
+  stats.congestion++;
+}
+
+/*
+ *  PUBLIC COMMANDS
+ */
+
+int vileSetPacing(const uint8_t enable)
+{
+  uint32_t state;
+  ENTER_SYSCALL(state);
+
+  nxt_lock();
+  enabled = enable ? 1 : 0;
+  pacing_reset_locked();
+  nxt_unlock();
+
+  EXIT_SYSCALL(state);
+  return 0;
+}
+
+int vileGetPacingStats(vile_pacing_stats_t *out)
+{
+  uint32_t state;
+  ENTER_SYSCALL(state);
+
+  nxt_lock();
+  vile_pacing_stats_t kstats = stats;
+  kstats.enabled = enabled;
+  kstats.gap = enabled ? gap : 0;
+  kstats.rate = (enabled && gap) ? 1000000 / gap : 0;
+  kstats.baseline = baseline;
+  kstats.latency_avg = kstats.replies ? (uint32_t)(latency_sum / kstats.replies) : 0;
+  nxt_unlock();
+
+  ksceKernelMemcpyKernelToUser(out, &kstats, sizeof(kstats));
+
+  EXIT_SYSCALL(state);
+  return 0;
+}
@@ -0,0 +1,483 @@
+/**
+        libvile
+        Copyright (C) 2022 Cat (Ivan Epifanov)
+
+        This program is free software: you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        This program is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <psp2kern/kernel/cpu.h>
+#include <psp2kern/kernel/debug.h>
+#include <psp2kern/kernel/threadmgr.h>
+#include <psp2kern/kernel/sysmem/data_transfers.h>
+#include <string.h>
+#include "nxt.h"
+
+/*
+ * Blocking waits on sensor conditions and motors finishing a move. One
+ * thread polls every port that somebody is waiting on, once per period
+ * however many waiters it has, and wakes the waiters whose condition the
+ * sample meets. Motors are polled less often while far from their tacho
+ * limit and more often as they close in on it.
+ */
+
+#define POLLER_WAITERS 16
+#define POLLER_INPUTS 4
+#define POLLER_OUTPUTS 3
+#define POLLER_PERIOD 5000 // usec between polls of a port
+#define POLLER_MOTOR_MAX 50000 // motors without a limit, or far from it
+
+#define POLLER_EV_WAKE 1
+
+typedef struct {
+  uint8_t used;
+  uint8_t done;
+  uint8_t primed; // first sample seen
+  vile_in_t port;
+  vile_input_condition_t condition;
+  int16_t threshold;
+  int16_t last; // previous value for crossings, the first one for deltas
+  vile_inputstate_t state; // the sample that met the condition
+} input_waiter_t;
+
+static input_waiter_t waiters[POLLER_WAITERS];
+
+typedef struct {
+  uint8_t used;
+  uint8_t done;
+  uint8_t ports; // motors to wait for
+  uint8_t idle; // motors seen idle
+  vile_motor_counts_t counts[POLLER_OUTPUTS];
+} motor_waiter_t;
+
+static motor_waiter_t motor_waiters[POLLER_WAITERS];
+
+// last poll of each motor, for the speed
+static struct {
+  SceInt64 due; // next poll, 0 is right away
+  SceInt64 time;
+  int32_t tacho;
+  uint8_t seen;
+} motors[POLLER_OUTPUTS];
+
+static SceUID poll_mtx;
+static SceUID poll_cond; // some waiter is done
+static SceUID poll_ev;
+static SceUID poll_thid = -1;
+
+static volatile uint8_t running = 0;
+
+static int input_met(input_waiter_t *w, const vile_inputstate_t *in)
+{
+  int16_t v = in->scaled_value;
+  int16_t th = w->threshold;
+  int met = 0;
+
+  if (!w->primed)
+  {
+    w->primed = 1;
+    w->last = v;
+    // crossings and deltas need something to compare with
+    return w->condition == VILE_INPUT_EQUALS && v == th;
+  }
+
+  switch (w->condition)
+  {
+    case VILE_INPUT_EQUALS:
+      met = (v == th);
+      break;
+    case VILE_INPUT_ABOVE:
+      met = (w->last <= th && v > th);
+      w->last = v;
+      break;
+    case VILE_INPUT_BELOW:
+      met = (w->last >= th && v < th);
+      w->last = v;
+      break;
+    case VILE_INPUT_CHANGED:
+      met = ((v > w->last) ? v - w->last : w->last - v) >= th;
+      break;
+  }
+  return met;
+}
+
+// half the time left until the tacho limit at the speed seen so far
+static SceUInt motor_interval(int port, const vile_outputstate_t *out, SceInt64 now)
+{
+  SceUInt interval = POLLER_MOTOR_MAX;
+  int32_t tacho = out->tacho_count;
+
+  if (out->tacho_limit && motors[port].seen && now > motors[port].time)
+  {
+    int32_t moved = tacho - motors[port].tacho;
+    if (moved < 0)
+      moved = -moved;
+    int32_t done = (tacho < 0) ? -tacho : tacho;
+    int32_t left = (int32_t)out->tacho_limit - done;
+
+    if (left <= 0 || !moved)
+      interval = POLLER_PERIOD;
+    else
+    {
+      // usec to go = left / (moved / dt)
+      SceInt64 eta = (SceInt64)left * (now - motors[port].time) / moved;
+      if (eta / 2 < interval)
+        interval = (SceUInt)(eta / 2);
+    }
+  }
+  else if (out->tacho_limit)
+  {
+    // no speed yet
+    interval = POLLER_PERIOD;
+  }
+
+  if (interval < POLLER_PERIOD)
+    interval = POLLER_PERIOD;
+
+  motors[port].time = now;
+  motors[port].tacho = tacho;
+  motors[port].seen = 1;
+  return interval;
+}
+
+static int poll_inputs(uint8_t ports)
+{
+  int woke = 0;
+
+  for (int port = 0; port < POLLER_INPUTS; port++)
+  {
+    if (!(ports & (1 << port)))
+      continue;
+
+    vile_inputstate_t in;
+    if (nxt_get_input_values(port, &in, VILE_PRIORITY_TELEMETRY) < 0)
+      continue;
+
+    ksceKernelLockMutex(poll_mtx, 1, NULL);
+    for (int i = 0; i < POLLER_WAITERS; i++)
+    {
+      input_waiter_t *w = &waiters[i];
+      if (!w->used || w->done || w->port != port)
+        continue;
+      if (input_met(w, &in))
+      {
+        w->state = in;
+        w->done = 1;
+        woke = 1;
+      }
+    }
+    ksceKernelUnlockMutex(poll_mtx, 1);
+  }
+
+  return woke;
+}
+
+static int poll_motor(int port)
+{
+  int woke = 0;
+  vile_outputstate_t out;
+  int ret = nxt_get_output_state(port, &out, VILE_PRIORITY_TELEMETRY);
+  SceInt64 now = ksceKernelGetSystemTimeWide();
+
+  ksceKernelLockMutex(poll_mtx, 1, NULL);
+  if (ret < 0)
+  {
+    motors[port].due = now + POLLER_PERIOD;
+    ksceKernelUnlockMutex(poll_mtx, 1);
+    return 0;
+  }
+
+  motors[port].due = now + motor_interval(port, &out, now);
+
+  if (out.run_state == NXT_MOTOR_RUNSTATE_IDLE)
+  {
+    for (int i = 0; i < POLLER_WAITERS; i++)
+    {
+      motor_waiter_t *w = &motor_waiters[i];
+      if (!w->used || w->done || !(w->ports & (1 << port)) || (w->idle & (1 << port)))
+        continue;
+
+      w->idle |= 1 << port;
+      w->counts[port].tacho_count = out.tacho_count;
+      w->counts[port].block_tacho_count = out.block_tacho_count;
+      w->counts[port].rotation_count = out.rotation_count;
+      if (w->idle == w->ports)
+      {
+        w->done = 1;
+        woke = 1;
+      }
+    }
+  }
+  ksceKernelUnlockMutex(poll_mtx, 1);
+
+  return woke;
+}
+
+static int poller_thread(SceSize args, void *argp)
+{
+  ksceDebugPrintf("poller thread started\n");
+
+  SceInt64 inputs_due = 0;
+
+  while (running)
+  {
+    uint8_t ports = 0;
+    uint8_t motor_ports = 0;
+
+    ksceKernelLockMutex(poll_mtx, 1, NULL);
+    for (int i = 0; i < POLLER_WAITERS; i++)
+    {
+      if (waiters[i].used && !waiters[i].done)
+        ports |= 1 << waiters[i].port;
+      if (motor_waiters[i].used && !motor_waiters[i].done)
+        motor_ports |= motor_waiters[i].ports & ~motor_waiters[i].idle;
+    }
+    ksceKernelUnlockMutex(poll_mtx, 1);
+
+    if (!ports && !motor_ports)
+    {
+      ksceKernelWaitEventFlag(poll_ev, POLLER_EV_WAKE, SCE_EVENT_WAITCLEAR_PAT | SCE_EVENT_WAITOR, NULL, NULL);
+      continue;
+    }
+
+    SceInt64 now = ksceKernelGetSystemTimeWide();
+    int woke = 0;
+
+    if (ports && now >= inputs_due)
+    {
+      inputs_due = now + POLLER_PERIOD;
+      woke |= poll_inputs(ports);
+    }
+
+    for (int port = 0; port < POLLER_OUTPUTS; port++)
+    {
+      if ((motor_ports & (1 << port)) && now >= motors[port].due)
+        woke |= poll_motor(port);
+    }
+
+    ksceKernelLockMutex(poll_mtx, 1, NULL);
+    if (woke)
+      ksceKernelSignalCondAll(poll_cond);
+
+    // sleep until whatever is due first, a new waiter cuts that short
+    SceInt64 next = now + POLLER_MOTOR_MAX;
+    if (ports && inputs_due < next)
+      next = inputs_due;
+    for (int port = 0; port < POLLER_OUTPUTS; port++)
+      if ((motor_ports & (1 << port)) && motors[port].due < next)
+        next = motors[port].due;
+    ksceKernelUnlockMutex(poll_mtx, 1);
+
+    now = ksceKernelGetSystemTimeWide();
+    if (now < next)
+    {
+      SceUInt timeout = (SceUInt)(next - now);
+      ksceKernelWaitEventFlag(poll_ev, POLLER_EV_WAKE, SCE_EVENT_WAITCLEAR_PAT | SCE_EVENT_WAITOR, NULL, &timeout);
+    }
+  }
+
+  ksceDebugPrintf("poller thread stopped\n");
+  return 0;
+}
+
+void poller_start()
+{
+  if (poll_thid >= 0)
+    return;
+
+  poll_thid = ksceKernelCreateThread("vile_poller", poller_thread, 0x3C, 0x1000, 0, 0x10000, NULL);
+  if (poll_thid < 0)
+    return;
+
+  ksceKernelClearEventFlag(poll_ev, ~POLLER_EV_WAKE);
+  running = 1;
+  ksceKernelStartThread(poll_thid, 0, NULL);
+}
+
+void poller_shutdown()
+{
+  if (poll_thid < 0)
+    return;
+
+  ksceKernelLockMutex(poll_mtx, 1, NULL);
+  running = 0;
+  // waiters give up
+  ksceKernelSignalCondAll(poll_cond);
+  ksceKernelUnlockMutex(poll_mtx, 1);
+
+  ksceKernelSetEventFlag(poll_ev, POLLER_EV_WAKE);
+  ksceKernelWaitThreadEnd(poll_thid, NULL, NULL);
+  ksceKernelDeleteThread(poll_thid);
+  poll_thid = -1;
+}
+
+int poller_init()
+{
+  poll_mtx = ksceKernelCreateMutex("vile_poller", 0, 0, NULL);
+  if (poll_mtx < 0)
+    return -1;
+  poll_cond = ksceKernelCreateCond("vile_poller", 0, poll_mtx, NULL);
+  poll_ev = ksceKernelCreateEventFlag("vile_poller", 0, 0, NULL);
+  return (poll_cond < 0 || poll_ev < 0) ? -1 : 0;
+}
+
+/*
+ *  PUBLIC COMMANDS
+ */
+
+int vileWaitInput(
+  const vile_in_t port,
+  const vile_input_condition_t condition,
+  const int16_t threshold,
+  const uint32_t timeout,
+  vile_inputstate_t *out
+)
+{
+  uint32_t state;
+  ENTER_SYSCALL(state);
+
+  if (port >= POLLER_INPUTS || condition > VILE_INPUT_CHANGED)
+  {
+    EXIT_SYSCALL(state);
+    return -1;
+  }
+
+  SceInt64 deadline = ksceKernelGetSystemTimeWide() + timeout;
+
+  ksceKernelLockMutex(poll_mtx, 1, NULL);
+
+  input_waiter_t *w = NULL;
+  for (int i = 0; i < POLLER_WAITERS; i++)
+  {
+    if (!waiters[i].used)
+    {
+      w = &waiters[i];
+      break;
+    }
+  }
+
+  if (!w || !running)
+  {
+    ksceKernelUnlockMutex(poll_mtx, 1);
+    EXIT_SYSCALL(state);
+    return -1;
+  }
+
+  memset(w, 0, sizeof(*w));
+  w->used = 1;
+  w->port = port;
+  w->condition = condition;
+  w->threshold = threshold;
+  ksceKernelSetEventFlag(poll_ev, POLLER_EV_WAKE);
+
+  while (!w->done && running)
+  {
+    if (!timeout)
+    {
+      ksceKernelWaitCond(poll_cond, NULL);
+      continue;
+    }
+
+    SceInt64 now = ksceKernelGetSystemTimeWide();
+    if (now >= deadline)
+      break;
+    SceUInt left = (SceUInt)(deadline - now);
+    ksceKernelWaitCond(poll_cond, &left);
+  }
+
+  int ret = w->done ? 0 : -1;
+  vile_inputstate_t kstate = w->state;
+  w->used = 0;
+  ksceKernelUnlockMutex(poll_mtx, 1);
+
+  if (ret == 0 && out)
+    ksceKernelMemcpyKernelToUser(out, &kstate, sizeof(kstate));
+
+  EXIT_SYSCALL(state);
+  return ret;
+}
+
+int vileWaitMotorIdle(const uint8_t ports, const uint32_t timeout, vile_motor_counts_t *counts)
+{
+  uint32_t state;
+  ENTER_SYSCALL(state);
+
+  if (!ports || ports >= (1 << POLLER_OUTPUTS))
+  {
+    EXIT_SYSCALL(state);
+    return -1;
+  }
+
+  SceInt64 deadline = ksceKernelGetSystemTimeWide() + timeout;
+
+  ksceKernelLockMutex(poll_mtx, 1, NULL);
+
+  motor_waiter_t *w = NULL;
+  for (int i = 0; i < POLLER_WAITERS; i++)
+  {
+    if (!motor_waiters[i].used)
+    {
+      w = &motor_waiters[i];
+      break;
+    }
+  }
+
+  if (!w || !running)
+  {
+    ksceKernelUnlockMutex(poll_mtx, 1);
+    EXIT_SYSCALL(state);
+    return -1;
+  }
+
+  memset(w, 0, sizeof(*w));
+  w->used = 1;
+  w->ports = ports;
+
+  // first look right away, the speed is measured from there
+  for (int port = 0; port < POLLER_OUTPUTS; port++)
+  {
+    if (ports & (1 << port))
+    {
+      motors[port].due = 0;
+      motors[port].seen = 0;
+    }
+  }
+  ksceKernelSetEventFlag(poll_ev, POLLER_EV_WAKE);
+
+  while (!w->done && running)
+  {
+    if (!timeout)
+    {
+      ksceKernelWaitCond(poll_cond, NULL);
+      continue;
+    }
+
+    SceInt64 now = ksceKernelGetSystemTimeWide();
+    if (now >= deadline)
+      break;
+    SceUInt left = (SceUInt)(deadline - now);
+    ksceKernelWaitCond(poll_cond, &left);
+  }
+
+  int ret = w->done ? 0 : -1;
+  vile_motor_counts_t kcounts[POLLER_OUTPUTS];
+  memcpy(kcounts, w->counts, sizeof(kcounts));
+  w->used = 0;
+  ksceKernelUnlockMutex(poll_mtx, 1);
+
+  if (ret == 0 && counts)
+    ksceKernelMemcpyKernelToUser(counts, kcounts, sizeof(kcounts));
+
+  EXIT_SYSCALL(state);
+  return ret;
+}
@@ -0,0 +1,360 @@
+/**
+        libvile
+        Copyright (C) 2022 Cat (Ivan Epifanov)
+
+        This program is free software: you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        This program is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <psp2kern/kernel/cpu.h>
+#include <psp2kern/kernel/debug.h>
+#include <psp2kern/kernel/threadmgr.h>
+#include <psp2kern/kernel/sysmem/data_transfers.h>
+#include <string.h>
+#include "nxt.h"
+
+/*
+ * Brick state across resume and reattach. The last input mode of every
+ * port and the last output state of every motor are kept as they go out;
+ * when the transport reports the brick back they are sent again in one
+ * burst, followed by a keepalive so we know the brick has taken them.
+ * Moves with a tacho limit are not repeated, the motor already went
+ * (part of) the way.
+ */
+
+#define RESTORE_INPUTS 4
+#define RESTORE_OUTPUTS 3
+// how long the brick gets to show up after a resume
+#define RESTORE_CONNECT_WAIT 2000000
+#define RESTORE_POLL 10000
+// a failed burst is tried again this often, the wait doubling each time
+#define RESTORE_RETRIES 4
+#define RESTORE_BACKOFF 20000
+
+#define RESTORE_EV_WAKE 1
+
+// last state, only touched with the bus held
+static struct {
+  cmd_setinput_t cmd;
+  uint8_t valid;
+} inputs[RESTORE_INPUTS];
+
+static struct {
+  cmd_setoutput_t cmd;
+  uint8_t valid;
+} outputs[RESTORE_OUTPUTS];
+
+static SceUID rst_mtx;
+static SceUID rst_cond; // ready changed
+static SceUID rst_ev;
+static SceUID rst_thid = -1;
+
+static volatile uint8_t running = 0;
+static uint8_t ready = 0;
+static uint8_t failed = 0; // gave up on the brick attached now
+static uint8_t pending = 0;
+static SceInt64 since = 0; // first trigger not yet answered
+
+static vile_restore_stats_t stats;
+
+static void remember_output(const cmd_setoutput_t *cmd, int port)
+{
+  if (cmd->tacho_limit)
+  {
+    outputs[port].valid = 0;
+    return;
+  }
+  outputs[port].cmd = *cmd;
+  outputs[port].cmd.type = NXT_DIRECT_COMMAND_NOREPLY;
+  outputs[port].cmd.port = port;
+  outputs[port].valid = 1;
+}
+
+// bus held, called for every command the brick accepted
+void restore_command(const unsigned char *request, unsigned int length)
+{
+  if ((request[0] & 0x7F) != NXT_DIRECT_COMMAND_DOREPLY)
+    return;
+
+  if (request[1] == NXT_OPCODE_SET_INPUTMODE && length >= sizeof(cmd_setinput_t))
+  {
+    const cmd_setinput_t *cmd = (const cmd_setinput_t *)request;
+    if (cmd->port >= RESTORE_INPUTS)
+      return;
+    inputs[cmd->port].cmd = *cmd;
+    inputs[cmd->port].cmd.type = NXT_DIRECT_COMMAND_NOREPLY;
+    inputs[cmd->port].valid = 1;
+  }
+  else if (request[1] == NXT_OPCODE_SET_OUTPUTSTATE && length >= sizeof(cmd_setoutput_t))
+  {
+    const cmd_setoutput_t *cmd = (const cmd_setoutput_t *)request;
+    if (cmd->port == NXT_OUT_ALL)
+    {
+      for (int i = 0; i < RESTORE_OUTPUTS; i++)
+        remember_output(cmd, i);
+    }
+    else if (cmd->port < RESTORE_OUTPUTS)
+    {
+      remember_output(cmd, cmd->port);
+    }
+  }
+}
+
+// bus held, the port request would change was changed some other way
+// (an IOMap write); what was kept for it may no longer be what it has
+void restore_forget(const unsigned char *request, unsigned int length)
+{
+  if (length < 3)
+    return;
+
+  if (request[1] == NXT_OPCODE_SET_INPUTMODE && request[2] < RESTORE_INPUTS)
+    inputs[request[2]].valid = 0;
+  else if (request[1] == NXT_OPCODE_SET_OUTPUTSTATE && request[2] < RESTORE_OUTPUTS)
+    outputs[request[2]].valid = 0;
+}
+
+// bus held; returns packets sent, < 0 on failure
+static int restore_burst()
+{
+  int sent = 0;
+
+  for (int i = 0; i < RESTORE_INPUTS; i++)
+  {
+    if (!inputs[i].valid)
+      continue;
+    if (nxt_send((unsigned char *)&inputs[i].cmd, sizeof(cmd_setinput_t)) != sizeof(cmd_setinput_t))
+      return -1;
+    sent++;
+  }
+
+  for (int i = 0; i < RESTORE_OUTPUTS; i++)
+  {
+    if (!outputs[i].valid)
+      continue;
+    if (nxt_send((unsigned char *)&outputs[i].cmd, sizeof(cmd_setoutput_t)) != sizeof(cmd_setoutput_t))
+      return -1;
+    sent++;
+  }
+
+  if (!sent)
+    return 0;
+
+  // replies come in order, so this one means everything above is done
+  cmd_simple_t cmd = {NXT_DIRECT_COMMAND_DOREPLY, NXT_OPCODE_KEEPALIVE};
+  ret_keepalive_t kt;
+  if (nxt_send((unsigned char *)&cmd, sizeof(cmd)) != sizeof(cmd))
+    return -1;
+  if (nxt_recv((unsigned char *)&kt) != sizeof(kt) || kt.type != NXT_COMMAND_REPLY || kt.opcode != NXT_OPCODE_KEEPALIVE)
+    return -1;
+
+  return sent;
+}
+
+static int restore_thread(SceSize args, void *argp)
+{
+  ksceDebugPrintf("restore thread started\n");
+
+  while (running)
+  {
+    ksceKernelWaitEventFlag(rst_ev, RESTORE_EV_WAKE, SCE_EVENT_WAITCLEAR_PAT | SCE_EVENT_WAITOR, NULL, NULL);
+
+    ksceKernelLockMutex(rst_mtx, 1, NULL);
+    uint8_t triggered = pending;
+    SceInt64 begin = since;
+    pending = 0;
+    ksceKernelUnlockMutex(rst_mtx, 1);
+
+    if (!running || !triggered)
+      continue;
+
+    // after a resume the brick takes a while to enumerate again
+    while (running && !nxt_connected() && ksceKernelGetSystemTimeWide() - begin < RESTORE_CONNECT_WAIT)
+      ksceKernelDelayThread(RESTORE_POLL);
+
+    int ret = -1;
+    uint32_t failures = 0;
+    SceUInt backoff = RESTORE_BACKOFF;
+    for (int attempt = 0; attempt <= RESTORE_RETRIES && running && nxt_connected(); attempt++)
+    {
+      if (attempt)
+      {
+        ksceKernelDelayThread(backoff);
+        backoff *= 2;
+      }
+
+      nxt_lock_priority(VILE_PRIORITY_SAFETY);
+      ret = restore_burst();
+      nxt_unlock();
+
+      if (ret >= 0)
+        break;
+      failures++;
+    }
+
+    uint32_t took = (uint32_t)(ksceKernelGetSystemTimeWide() - begin);
+
+    ksceKernelLockMutex(rst_mtx, 1, NULL);
+    stats.failures += failures;
+    if (ret < 0)
+    {
+      // vileWaitReady stops waiting until the brick attaches again
+      if (!pending)
+      {
+        failed = 1;
+        ksceKernelSignalCondAll(rst_cond);
+      }
+    }
+    else if (!pending)
+    {
+      // not retriggered while we were at it
+      ready = 1;
+      stats.generation++;
+      stats.restored += ret;
+      stats.last_us = took;
+      if (took > stats.max_us)
+        stats.max_us = took;
+      ksceKernelSignalCondAll(rst_cond);
+    }
+    ksceKernelUnlockMutex(rst_mtx, 1);
+  }
+
+  ksceDebugPrintf("restore thread stopped\n");
+  return 0;
+}
+
+// transports call these when the brick appears (or the system resumes) and goes away
+void restore_attached()
+{
+  ksceKernelLockMutex(rst_mtx, 1, NULL);
+  if (!pending)
+    since = ksceKernelGetSystemTimeWide();
+  pending = 1;
+  ready = 0;
+  failed = 0;
+  ksceKernelUnlockMutex(rst_mtx, 1);
+
+  ksceKernelSetEventFlag(rst_ev, RESTORE_EV_WAKE);
+}
+
+void restore_detached()
+{
+  ksceKernelLockMutex(rst_mtx, 1, NULL);
+  ready = 0;
+  failed = 0;
+  ksceKernelUnlockMutex(rst_mtx, 1);
+}
+
+void restore_start()
+{
+  // a new session starts from whatever the brick has
+  nxt_lock();
+  for (int i = 0; i < RESTORE_INPUTS; i++)
+    inputs[i].valid = 0;
+  for (int i = 0; i < RESTORE_OUTPUTS; i++)
+    outputs[i].valid = 0;
+  nxt_unlock();
+
+  ksceKernelLockMutex(rst_mtx, 1, NULL);
+  memset(&stats, 0, sizeof(stats));
+  ready = 0;
+  failed = 0;
+  pending = 0;
+  ksceKernelUnlockMutex(rst_mtx, 1);
+
+  if (rst_thid >= 0)
+    return;
+
+  rst_thid = ksceKernelCreateThread("vile_restore", restore_thread, 0x3C, 0x1000, 0, 0x10000, NULL);
+  if (rst_thid < 0)
+    return;
+
+  ksceKernelClearEventFlag(rst_ev, ~RESTORE_EV_WAKE);
+  running = 1;
+  ksceKernelStartThread(rst_thid, 0, NULL);
+}
+
+void restore_shutdown()
+{
+  if (rst_thid < 0)
+    return;
+
+  running = 0;
+  ksceKernelSetEventFlag(rst_ev, RESTORE_EV_WAKE);
+  ksceKernelWaitThreadEnd(rst_thid, NULL, NULL);
+  ksceKernelDeleteThread(rst_thid);
+  rst_thid = -1;
+
+  ksceKernelLockMutex(rst_mtx, 1, NULL);
+  ready = 0;
+  ksceKernelSignalCondAll(rst_cond);
+  ksceKernelUnlockMutex(rst_mtx, 1);
+}
+
+int restore_init()
+{
+  rst_mtx = ksceKernelCreateMutex("vile_restore", 0, 0, NULL);
+  if (rst_mtx < 0)
+    return -1;
+  rst_cond = ksceKernelCreateCond("vile_restore", 0, rst_mtx, NULL);
+  rst_ev = ksceKernelCreateEventFlag("vile_restore", 0, 0, NULL);
+  return (rst_cond < 0 || rst_ev < 0) ? -1 : 0;
+}
+
+/*
+ *  PUBLIC COMMANDS
+ */
+
+int vileWaitReady(const uint32_t timeout)
+{
+  uint32_t state;
+  ENTER_SYSCALL(state);
+
+  SceInt64 deadline = ksceKernelGetSystemTimeWide() + timeout;
+
+  ksceKernelLockMutex(rst_mtx, 1, NULL);
+  while (!ready && !failed && running)
+  {
+    if (!timeout)
+    {
+      ksceKernelWaitCond(rst_cond, NULL);
+      continue;
+    }
+
+    SceInt64 now = ksceKernelGetSystemTimeWide();
+    if (now >= deadline)
+      break;
+    SceUInt left = (SceUInt)(deadline - now);
+    ksceKernelWaitCond(rst_cond, &left);
+  }
+  int ret = ready ? (int)stats.generation : -1;
+  ksceKernelUnlockMutex(rst_mtx, 1);
+
+  EXIT_SYSCALL(state);
+  return ret;
+}
+
+int vileGetRestoreStats(vile_restore_stats_t *out)
+{
+  uint32_t state;
+  ENTER_SYSCALL(state);
+
+  ksceKernelLockMutex(rst_mtx, 1, NULL);
+  vile_restore_stats_t kstats = stats;
+  kstats.ready = ready;
+  ksceKernelUnlockMutex(rst_mtx, 1);
+
+  ksceKernelMemcpyKernelToUser(out, &kstats, sizeof(kstats));
+
+  EXIT_SYSCALL(state);
+  return 0;
+}
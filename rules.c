@@ -0,0 +1,427 @@
+/**
+        libvile
+        Copyright (C) 2022 Cat (Ivan Epifanov)
+
+        This program is free software: you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        This program is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <psp2kern/kernel/cpu.h>
+#include <psp2kern/kernel/debug.h>
+#include <psp2kern/kernel/processmgr.h>
+#include <psp2kern/kernel/threadmgr.h>
+#include <psp2kern/kernel/sysmem/data_transfers.h>
+#include <string.h>
+#include "nxt.h"
+
+/*
+ * Reactive rules. Every period one thread takes the bus and reads each
+ * watched port once, however many rules watch it. A read that meets a
+ * rule's condition sends that rule's commands right behind it, no reply
+ * asked for and the bus still held, so a reaction costs one read's round
+ * trip and never goes through user space.
+ *
+ * Conditions are edge triggered: a rule fires when its condition becomes
+ * true and again only once it has been false in between. CHANGED measures
+ * from where the rule last fired.
+ */
+
+#define RULES_MIN_PERIOD 2000
+#define RULES_WATCHED 7 // 4 inputs and 3 outputs
+
+#define RULES_EV_WAKE 1
+
+typedef struct {
+  vile_signal_kind_t kind;
+  uint8_t port;
+  SceInt64 last; // start of the last good read, 0 is none
+} watched_t;
+
+typedef struct {
+  uint8_t watched; // index into watched
+  uint8_t primed;
+  uint8_t met; // condition held at the last read
+  uint8_t armed;
+  int32_t last; // previous value for crossings, the base for changes
+} rule_state_t;
+
+static vile_rules_t config; // also the staging copy in vileStartRules
+static rule_state_t rules[VILE_RULES_MAX];
+static watched_t watched[RULES_WATCHED];
+static unsigned int watched_count = 0;
+
+static SceUID rul_mtx;
+static SceUID rul_ev;
+static SceUID rul_thid = -1;
+static SceUID rul_pid; // who started the rules, its claims apply when they fire
+
+static volatile uint8_t running = 0;
+
+// under rul_mtx
+static vile_rules_stats_t stats;
+static uint64_t react_sum = 0;
+
+// bus held
+static int read_value(const watched_t *w, int32_t *value, SceInt64 begin, SceInt64 wait)
+{
+  cmd_port_t cmd = {NXT_DIRECT_COMMAND_DOREPLY, 0, w->port};
+
+  if (w->kind == VILE_SIGNAL_INPUT)
+  {
+    vile_inputstate_t r;
+    cmd.opcode = NXT_OPCODE_GET_INPUTVALUES;
+    int ret = nxt_exchange((unsigned char*) &cmd, sizeof(cmd), (unsigned char*) &r, VILE_PRIORITY_CONTROL, begin, wait);
+    if (ret != sizeof(vile_inputstate_t) || r.type != NXT_COMMAND_REPLY ||
+        r.opcode != NXT_OPCODE_GET_INPUTVALUES || r.status != NXT_STATUS_OK)
+      return -1;
+    *value = r.scaled_value;
+    return 0;
+  }
+
+  vile_outputstate_t r;
+  cmd.opcode = NXT_OPCODE_GET_OUTPUTSTATE;
+  int ret = nxt_exchange((unsigned char*) &cmd, sizeof(cmd), (unsigned char*) &r, VILE_PRIORITY_CONTROL, begin, wait);
+  if (ret != sizeof(vile_outputstate_t) || r.type != NXT_COMMAND_REPLY ||
+      r.opcode != NXT_OPCODE_GET_OUTPUTSTATE || r.status != NXT_STATUS_OK)
+    return -1;
+  *value = r.tacho_count;
+  return 0;
+}
+
+// whether the rule fires on this value
+static int rule_met(const vile_rule_t *c, rule_state_t *r, int32_t v)
+{
+  int32_t th = c->threshold;
+  int met = 0;
+
+  if (!r->primed)
+  {
+    r->primed = 1;
+    r->last = v;
+    // crossings and changes need something to compare with
+    met = c->condition == VILE_INPUT_EQUALS && v == th;
+    r->met = met;
+    return met;
+  }
+
+  switch (c->condition)
+  {
+    case VILE_INPUT_EQUALS:
+      met = (v == th);
+      break;
+    case VILE_INPUT_ABOVE:
+      met = (r->last <= th && v > th);
+      r->last = v;
+      break;
+    case VILE_INPUT_BELOW:
+      met = (r->last >= th && v < th);
+      r->last = v;
+      break;
+    case VILE_INPUT_CHANGED:
+      met = ((int64_t)v > r->last ? (int64_t)v - r->last : (int64_t)r->last - v) >= th;
+      if (met)
+        r->last = v;
+      // every change past the threshold is a new one
+      r->met = 0;
+      return met;
+  }
+
+  // crossings are edges already, equality has to be left first
+  int fire = met && (c->condition != VILE_INPUT_EQUALS || !r->met);
+  r->met = met;
+  return fire;
+}
+
+// bus held; returns commands that failed
+static int fire(const vile_rule_t *c, SceInt64 begin)
+{
+  int failed = 0;
+
+  for (int i = 0; i < VILE_RULE_COMMANDS && c->command[i].length; i++)
+  {
+    uint8_t packet[sizeof(c->command[i].data)];
+    memcpy(packet, c->command[i].data, c->command[i].length);
+    packet[0] |= NXT_DIRECT_COMMAND_NOREPLY;
+
+    // another process may have claimed the motor since the rules started
+    if (session_check_for(rul_pid, packet, c->command[i].length) < 0)
+    {
+      failed++;
+      continue;
+    }
+
+    telemetry_command(packet, c->command[i].length);
+    if (nxt_exchange(packet, c->command[i].length, NULL, VILE_PRIORITY_CONTROL, begin, 0) != c->command[i].length)
+      failed++;
+  }
+
+  return failed;
+}
+
+static void cycle(SceInt64 queued)
+{
+  nxt_lock_priority(VILE_PRIORITY_CONTROL);
+  SceInt64 wait = ksceKernelGetSystemTimeWide() - queued;
+
+  for (unsigned int w = 0; w < watched_count; w++)
+  {
+    watched_t *wt = &watched[w];
+    SceInt64 begin = ksceKernelGetSystemTimeWide();
+    int32_t value;
+    int ret = read_value(wt, &value, begin, wait);
+    wait = 0;
+
+    if (ret < 0)
+    {
+      ksceKernelLockMutex(rul_mtx, 1, NULL);
+      stats.failed++;
+      ksceKernelUnlockMutex(rul_mtx, 1);
+      continue;
+    }
+
+    for (unsigned int i = 0; i < config.count; i++)
+    {
+      rule_state_t *r = &rules[i];
+      const vile_rule_t *c = &config.rule[i];
+      if (r->watched != w || !rule_met(c, r, value) || !r->armed)
+        continue;
+
+      int failed = fire(c, begin);
+      SceInt64 sent = ksceKernelGetSystemTimeWide();
+      uint32_t react = (uint32_t)(sent - begin);
+
+      if (c->once)
+        r->armed = 0;
+
+      ksceKernelLockMutex(rul_mtx, 1, NULL);
+      stats.failed += failed;
+      stats.fired++;
+      stats.rule[i].fired++;
+      stats.rule[i].armed = r->armed;
+      stats.rule[i].value = value;
+      stats.rule[i].react_us = react;
+      react_sum += react;
+      if (react > stats.react_max)
+        stats.react_max = react;
+      if (wt->last && (uint32_t)(sent - wt->last) > stats.window_max)
+        stats.window_max = (uint32_t)(sent - wt->last);
+      ksceKernelUnlockMutex(rul_mtx, 1);
+    }
+
+    wt->last = begin;
+  }
+
+  nxt_unlock();
+}
+
+static int rules_thread(SceSize args, void *argp)
+{
+  ksceDebugPrintf("rules thread started\n");
+
+  SceInt64 next = ksceKernelGetSystemTimeWide();
+  SceInt64 window = next;
+  uint32_t window_count = 0;
+
+  while (running)
+  {
+    SceInt64 now = ksceKernelGetSystemTimeWide();
+
+    if (now < next)
+    {
+      SceUInt timeout = (SceUInt)(next - now);
+      ksceKernelWaitEventFlag(rul_ev, RULES_EV_WAKE, SCE_EVENT_WAITCLEAR_PAT | SCE_EVENT_WAITOR, NULL, &timeout);
+      continue;
+    }
+
+    uint32_t skipped = 0;
+    next += config.period;
+    if (next <= now)
+    {
+      // fell behind, keep the original phase instead of bursting to catch up
+      skipped = (uint32_t)((now - next) / config.period) + 1;
+      next += (SceInt64)skipped * config.period;
+    }
+
+    if (now - window >= 1000000)
+    {
+      ksceKernelLockMutex(rul_mtx, 1, NULL);
+      stats.rate = window_count;
+      ksceKernelUnlockMutex(rul_mtx, 1);
+      window = now;
+      window_count = 0;
+    }
+
+    cycle(now);
+    window_count++;
+
+    ksceKernelLockMutex(rul_mtx, 1, NULL);
+    stats.overruns += skipped;
+    stats.cycles++;
+    ksceKernelUnlockMutex(rul_mtx, 1);
+  }
+
+  ksceDebugPrintf("rules thread stopped\n");
+  return 0;
+}
+
+static void rules_stop()
+{
+  if (rul_thid < 0)
+    return;
+
+  running = 0;
+  ksceKernelSetEventFlag(rul_ev, RULES_EV_WAKE);
+  ksceKernelWaitThreadEnd(rul_thid, NULL, NULL);
+  ksceKernelDeleteThread(rul_thid);
+  rul_thid = -1;
+}
+
+// config staged; 0 or -1
+static int rules_check()
+{
+  if (config.period < RULES_MIN_PERIOD || !config.count || config.count > VILE_RULES_MAX)
+    return -1;
+
+  for (unsigned int i = 0; i < config.count; i++)
+  {
+    const vile_rule_t *c = &config.rule[i];
+    int ports = c->kind == VILE_SIGNAL_INPUT ? 4 : 3;
+    if (c->kind > VILE_SIGNAL_OUTPUT || c->port >= ports || c->condition > VILE_INPUT_CHANGED || !c->command[0].length)
+      return -1;
+
+    for (int j = 0; j < VILE_RULE_COMMANDS && c->command[j].length; j++)
+    {
+      const vile_rule_command_t *cmd = &c->command[j];
+      // direct commands only, the file and flash ones are no reactions
+      if (cmd->length < 2 || cmd->length > sizeof(cmd->data) || (cmd->data[0] & 0x7F) != NXT_DIRECT_COMMAND_DOREPLY)
+        return -1;
+      if (session_check(cmd->data, cmd->length) < 0)
+        return -1;
+    }
+  }
+
+  return 0;
+}
+
+int rules_init()
+{
+  rul_mtx = ksceKernelCreateMutex("vile_rules", 0, 0, NULL);
+  rul_ev = ksceKernelCreateEventFlag("vile_rules", 0, 0, NULL);
+  return (rul_mtx < 0 || rul_ev < 0) ? -1 : 0;
+}
+
+void rules_shutdown()
+{
+  rules_stop();
+}
+
+/*
+ *  PUBLIC COMMANDS
+ */
+
+int vileStartRules(const vile_rules_t *urules)
+{
+  uint32_t state;
+  ENTER_SYSCALL(state);
+
+  ksceKernelLockMutex(rul_mtx, 1, NULL);
+
+  if (rul_thid >= 0)
+  {
+    ksceKernelUnlockMutex(rul_mtx, 1);
+    EXIT_SYSCALL(state);
+    return -1;
+  }
+
+  // too big for the stack, staged where the thread will read it
+  ksceKernelMemcpyUserToKernel(&config, urules, sizeof(vile_rules_t));
+  if (rules_check() < 0)
+  {
+    memset(&config, 0, sizeof(config));
+    ksceKernelUnlockMutex(rul_mtx, 1);
+    EXIT_SYSCALL(state);
+    return -1;
+  }
+
+  rul_pid = ksceKernelGetProcessId();
+  memset(rules, 0, sizeof(rules));
+  memset(&stats, 0, sizeof(stats));
+  react_sum = 0;
+  watched_count = 0;
+  for (unsigned int i = 0; i < config.count; i++)
+  {
+    const vile_rule_t *c = &config.rule[i];
+    unsigned int w = 0;
+    while (w < watched_count && (watched[w].kind != c->kind || watched[w].port != c->port))
+      w++;
+    if (w == watched_count)
+    {
+      watched[w].kind = c->kind;
+      watched[w].port = c->port;
+      watched[w].last = 0;
+      watched_count++;
+    }
+    rules[i].watched = w;
+    rules[i].armed = 1;
+    stats.rule[i].armed = 1;
+  }
+  stats.count = config.count;
+
+  rul_thid = ksceKernelCreateThread("vile_rules", rules_thread, 0x3C, 0x1000, 0, 0x10000, NULL);
+  if (rul_thid < 0)
+  {
+    ksceKernelUnlockMutex(rul_mtx, 1);
+    EXIT_SYSCALL(state);
+    return -1;
+  }
+
+  ksceKernelClearEventFlag(rul_ev, ~RULES_EV_WAKE);
+  running = 1;
+  ksceKernelStartThread(rul_thid, 0, NULL);
+
+  ksceKernelUnlockMutex(rul_mtx, 1);
+
+  EXIT_SYSCALL(state);
+  return 0;
+}
+
+int vileStopRules()
+{
+  uint32_t state;
+  ENTER_SYSCALL(state);
+
+  rules_stop();
+
+  EXIT_SYSCALL(state);
+  return 0;
+}
+
+int vileGetRulesStats(vile_rules_stats_t *ustats)
+{
+  uint32_t state;
+  ENTER_SYSCALL(state);
+
+  vile_rules_stats_t kstats;
+
+  ksceKernelLockMutex(rul_mtx, 1, NULL);
+  kstats = stats;
+  kstats.running = running;
+  if (kstats.fired)
+    kstats.react_avg = (uint32_t)(react_sum / kstats.fired);
+  ksceKernelUnlockMutex(rul_mtx, 1);
+
+  ksceKernelMemcpyKernelToUser(ustats, &kstats, sizeof(vile_rules_stats_t));
+
+  EXIT_SYSCALL(state);
+  return 0;
+}
@@ -22,9 +22,25 @@
 #include <stdlib.h>
 #include <string.h>
 #include <vile.h>
+#include <vilerso.h>
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_mixer.h>
 
+static Uint32 touch_event;
+
+// the kernel polls the sensor, we only hear about presses
+static int touch_thread(void *data)
+{
+    while (vileWaitInput(NXT_IN_2, VILE_INPUT_ABOVE, 0, 0, NULL) == 0)
+    {
+        SDL_Event event;
+        SDL_zero(event);
+        event.type = touch_event;
+        SDL_PushEvent(&event);
+    }
+    return 0;
+}
+
 int main(int argc, char *argv[])
 {
     vileStart();
@@ -41,7 +57,8 @@ int main(int argc, char *argv[])
         fprintf(stderr, "Unable to open audio: %s\n", SDL_GetError());
         exit(-1);
     }
-    Mix_Music *ymt = Mix_LoadMUS("app0:/data/ymt.mp3");
+    // decoded to the format opened above, 44.1 kHz 16-bit stereo
+    Mix_Chunk *ymt = Mix_LoadWAV("app0:/data/ymt.mp3");
     if (!ymt)
     {
         fprintf(stderr, "Unable to open audio: %s\n", SDL_GetError());
@@ -68,6 +85,19 @@ int main(int argc, char *argv[])
 
     vileSetInputMode(NXT_IN_2, NXT_SENSOR_SWITCH, NXT_SENSOR_MODE_BOOLEAN);
 
+    // the brick plays it, the first 8 seconds fit in an 8 kHz .rso
+    uint32_t frames = ymt->alen / 4;
+    uint32_t size = vileRsoSize(frames, 44100, 8000);
+    uint8_t *rso = malloc(size);
+    int len = vileRsoConvert((const int16_t *)ymt->abuf, frames, 2, 44100, 8000, rso, size);
+    if (len < 0 || vileUploadFile("ymt.rso", rso, len) < 0)
+        fprintf(stderr, "Unable to upload ymt.rso\n");
+    free(rso);
+    Mix_FreeChunk(ymt);
+
+    touch_event = SDL_RegisterEvents(1);
+    SDL_Thread *touch = SDL_CreateThread(touch_thread, "touch", NULL);
+
     SDL_SetRenderDrawColor( renderer, 0x00, 0xFF, 0x00, 0xFF );
     SDL_RenderClear( renderer );
     SDL_RenderPresent( renderer );
@@ -145,13 +175,8 @@ int main(int argc, char *argv[])
         } else if (event.type == SDL_JOYBUTTONDOWN) {
             if (event.jbutton.button == 0) break;
             vilePlayTone( 200*event.jbutton.button, 100);
-        }
-
-        vile_inputstate_t st;
-        vileGetInputValues(NXT_IN_2, &st);
-        if (st.scaled_value == 1)
-        {
-            Mix_PlayMusic(ymt, 0);
+        } else if (event.type == touch_event) {
+            vilePlaySoundfile("ymt.rso", 0);
 //            break;
         }
 
@@ -176,7 +201,9 @@ int main(int argc, char *argv[])
     vileSetOutputState(&t);
 
 
+    // wakes the touch thread with an error
     vileStop();
+    SDL_WaitThread(touch, NULL);
 
     SDL_JoystickClose(joystick);
     SDL_DestroyRenderer(renderer);
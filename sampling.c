@@ -0,0 +1,410 @@
+/**
+        libvile
+        Copyright (C) 2022 Cat (Ivan Epifanov)
+
+        This program is free software: you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        This program is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <psp2kern/kernel/cpu.h>
+#include <psp2kern/kernel/debug.h>
+#include <psp2kern/kernel/threadmgr.h>
+#include <psp2kern/kernel/sysmem/data_transfers.h>
+#include <string.h>
+#include "nxt.h"
+
+/*
+ * Adaptive sampling. Every signal gets its min rate, what is left of the
+ * budget goes to the signals that have been changing, in proportion to
+ * how fast (in deadbands per second), up to their max rate. Signals that
+ * sit still stay at their min rate and the rest of the bus is left alone.
+ * One thread reads whichever signal is due first and never bursts to
+ * catch up, so the reads add up to the budget at most.
+ *
+ * Activity rises at once and decays over a few reads, a signal that starts
+ * moving gets its share at the next allocation.
+ */
+
+#define SAMPLING_REALLOC 100000 // usec between allocations
+#define SAMPLING_DECAY 8 // activity loses 1/8 of the difference per read
+
+#define SAMPLING_EV_WAKE 1
+
+typedef struct {
+  vile_signal_t config;
+  uint32_t allocated; // millihertz
+  SceInt64 interval;
+  SceInt64 due;
+  SceInt64 last; // last good read, 0 is none
+  int32_t value;
+  uint32_t activity;
+  uint32_t window_count;
+  vile_sample_t sample;
+  vile_signal_stats_t stats;
+} signal_t;
+
+static signal_t signals[VILE_SAMPLING_SIGNALS];
+static unsigned int count = 0;
+static uint32_t budget = 0;
+
+static SceUID smp_mtx;
+static SceUID smp_ev;
+static SceUID smp_thid = -1;
+
+static volatile uint8_t running = 0;
+
+static vile_sampling_stats_t stats;
+static SceInt64 read_avg = 0; // usec, smoothed
+
+// all under smp_mtx
+static void allocate()
+{
+  uint32_t usable = budget;
+  if (read_avg > 0 && 1000000 / read_avg < usable)
+    usable = (uint32_t)(1000000 / read_avg);
+  if (!usable)
+    usable = 1;
+
+  int64_t left = (int64_t)usable * 1000;
+  uint64_t weight[VILE_SAMPLING_SIGNALS];
+
+  for (unsigned int i = 0; i < count; i++)
+  {
+    signal_t *s = &signals[i];
+    s->allocated = s->config.min_rate * 1000;
+    weight[i] = (uint64_t)s->activity * 1000 / s->config.deadband;
+    left -= s->allocated;
+  }
+
+  if (left < 0)
+  {
+    // the mins alone are too much, everybody gets slowed down alike
+    int64_t mins = (int64_t)usable * 1000 - left;
+    for (unsigned int i = 0; i < count; i++)
+      signals[i].allocated = (uint32_t)(signals[i].allocated * (int64_t)usable * 1000 / mins);
+    left = 0;
+  }
+
+  // every pass either hands out all that's left or fills someone up to max
+  for (unsigned int pass = 0; pass <= count && left > 0; pass++)
+  {
+    uint64_t total = 0;
+    for (unsigned int i = 0; i < count; i++)
+      if (signals[i].allocated < signals[i].config.max_rate * 1000u)
+        total += weight[i];
+    if (!total)
+      break;
+
+    int64_t given = 0;
+    for (unsigned int i = 0; i < count; i++)
+    {
+      signal_t *s = &signals[i];
+      uint32_t max = s->config.max_rate * 1000u;
+      if (s->allocated >= max || !weight[i])
+        continue;
+
+      int64_t add = (int64_t)((uint64_t)left * weight[i] / total);
+      if (add > max - s->allocated)
+        add = max - s->allocated;
+      s->allocated += (uint32_t)add;
+      given += add;
+    }
+    if (!given)
+      break;
+    left -= given;
+  }
+
+  for (unsigned int i = 0; i < count; i++)
+  {
+    signal_t *s = &signals[i];
+    if (!s->allocated)
+      s->allocated = 1;
+    s->interval = 1000000000LL / s->allocated;
+    // a signal that sped up shouldn't wait out its old interval
+    if (s->last && s->due > s->last + s->interval)
+      s->due = s->last + s->interval;
+    s->stats.allocated = (s->allocated + 500) / 1000;
+  }
+
+  stats.usable = usable;
+  stats.allocations++;
+}
+
+static void sample_update(signal_t *s, SceInt64 now)
+{
+  int32_t value = s->config.kind == VILE_SIGNAL_INPUT ? s->sample.input.scaled_value : s->sample.output.tacho_count;
+
+  if (s->last && now > s->last)
+  {
+    uint32_t change = (uint32_t)(value > s->value ? value - s->value : s->value - value);
+    if (change < s->config.deadband)
+      change = 0;
+
+    uint32_t speed = (uint32_t)((uint64_t)change * 1000000 / (now - s->last));
+    if (speed > s->activity)
+      s->activity = speed;
+    else
+      s->activity -= (s->activity - speed) / SAMPLING_DECAY;
+  }
+
+  s->value = value;
+  s->last = now;
+  s->stats.activity = s->activity;
+}
+
+static int sampling_thread(SceSize args, void *argp)
+{
+  ksceDebugPrintf("sampling thread started\n");
+
+  SceInt64 realloc_due = 0;
+  SceInt64 window = ksceKernelGetSystemTimeWide();
+  uint32_t window_count = 0;
+
+  while (running)
+  {
+    SceInt64 now = ksceKernelGetSystemTimeWide();
+
+    ksceKernelLockMutex(smp_mtx, 1, NULL);
+
+    if (now >= realloc_due)
+    {
+      allocate();
+      realloc_due = now + SAMPLING_REALLOC;
+    }
+
+    if (now - window >= 1000000)
+    {
+      for (unsigned int i = 0; i < count; i++)
+      {
+        signals[i].stats.rate = signals[i].window_count;
+        signals[i].window_count = 0;
+      }
+      stats.rate = window_count;
+      window = now;
+      window_count = 0;
+    }
+
+    signal_t *s = &signals[0];
+    for (unsigned int i = 1; i < count; i++)
+      if (signals[i].due < s->due)
+        s = &signals[i];
+
+    SceInt64 next = s->due < realloc_due ? s->due : realloc_due;
+    ksceKernelUnlockMutex(smp_mtx, 1);
+
+    if (now < next)
+    {
+      SceUInt timeout = (SceUInt)(next - now);
+      ksceKernelWaitEventFlag(smp_ev, SAMPLING_EV_WAKE, SCE_EVENT_WAITCLEAR_PAT | SCE_EVENT_WAITOR, NULL, &timeout);
+      continue;
+    }
+
+    vile_inputstate_t in;
+    vile_outputstate_t out;
+    int ret;
+    if (s->config.kind == VILE_SIGNAL_INPUT)
+      ret = nxt_get_input_values(s->config.port, &in, VILE_PRIORITY_TELEMETRY);
+    else
+      ret = nxt_get_output_state(s->config.port, &out, VILE_PRIORITY_TELEMETRY);
+
+    SceInt64 done = ksceKernelGetSystemTimeWide();
+
+    ksceKernelLockMutex(smp_mtx, 1, NULL);
+
+    read_avg = read_avg ? read_avg + (done - now - read_avg) / 8 : done - now;
+    if (!read_avg)
+      read_avg = 1;
+
+    // keep the phase, a read that ran late doesn't make the next one early
+    s->due += s->interval;
+    if (s->due <= done)
+      s->due = done + s->interval;
+
+    s->stats.reads++;
+    s->window_count++;
+    window_count++;
+
+    if (ret < 0)
+      s->stats.failed++;
+    else
+    {
+      if (s->config.kind == VILE_SIGNAL_INPUT)
+        s->sample.input = in;
+      else
+        s->sample.output = out;
+      s->sample.timestamp = done;
+      s->sample.sequence++;
+      sample_update(s, done);
+    }
+
+    ksceKernelUnlockMutex(smp_mtx, 1);
+  }
+
+  ksceDebugPrintf("sampling thread stopped\n");
+  return 0;
+}
+
+static void sampling_stop()
+{
+  if (smp_thid < 0)
+    return;
+
+  running = 0;
+  ksceKernelSetEventFlag(smp_ev, SAMPLING_EV_WAKE);
+  ksceKernelWaitThreadEnd(smp_thid, NULL, NULL);
+  ksceKernelDeleteThread(smp_thid);
+  smp_thid = -1;
+}
+
+int sampling_init()
+{
+  smp_mtx = ksceKernelCreateMutex("vile_sampling", 0, 0, NULL);
+  smp_ev = ksceKernelCreateEventFlag("vile_sampling", 0, 0, NULL);
+  return (smp_mtx < 0 || smp_ev < 0) ? -1 : 0;
+}
+
+void sampling_shutdown()
+{
+  sampling_stop();
+}
+
+/*
+ *  PUBLIC COMMANDS
+ */
+
+int vileStartSampling(const vile_sampling_t *sampling)
+{
+  uint32_t state;
+  ENTER_SYSCALL(state);
+
+  vile_sampling_t ksampling;
+  ksceKernelMemcpyUserToKernel(&ksampling, sampling, sizeof(vile_sampling_t));
+
+  if (!ksampling.budget || !ksampling.count || ksampling.count > VILE_SAMPLING_SIGNALS)
+  {
+    EXIT_SYSCALL(state);
+    return -1;
+  }
+
+  for (unsigned int i = 0; i < ksampling.count; i++)
+  {
+    vile_signal_t *c = &ksampling.signal[i];
+    int ports = c->kind == VILE_SIGNAL_INPUT ? 4 : 3;
+    int bad = c->kind > VILE_SIGNAL_OUTPUT || c->port >= ports || !c->min_rate || c->max_rate < c->min_rate;
+
+    // each port once, otherwise it would simply be read twice as often
+    for (unsigned int j = 0; j < i && !bad; j++)
+      bad = ksampling.signal[j].kind == c->kind && ksampling.signal[j].port == c->port;
+
+    if (bad)
+    {
+      EXIT_SYSCALL(state);
+      return -1;
+    }
+    if (!c->deadband)
+      c->deadband = 1;
+  }
+
+  // checked and started under the lock, so two starts can't both get a thread
+  ksceKernelLockMutex(smp_mtx, 1, NULL);
+
+  if (smp_thid >= 0)
+  {
+    ksceKernelUnlockMutex(smp_mtx, 1);
+    EXIT_SYSCALL(state);
+    return -1;
+  }
+
+  memset(signals, 0, sizeof(signals));
+  memset(&stats, 0, sizeof(stats));
+  for (unsigned int i = 0; i < ksampling.count; i++)
+    signals[i].config = ksampling.signal[i];
+  count = ksampling.count;
+  budget = ksampling.budget;
+  read_avg = 0;
+
+  smp_thid = ksceKernelCreateThread("vile_sampling", sampling_thread, 0x3C, 0x1000, 0, 0x10000, NULL);
+  if (smp_thid < 0)
+  {
+    ksceKernelUnlockMutex(smp_mtx, 1);
+    EXIT_SYSCALL(state);
+    return -1;
+  }
+
+  ksceKernelClearEventFlag(smp_ev, ~SAMPLING_EV_WAKE);
+  running = 1;
+  ksceKernelStartThread(smp_thid, 0, NULL);
+
+  ksceKernelUnlockMutex(smp_mtx, 1);
+
+  EXIT_SYSCALL(state);
+  return 0;
+}
+
+int vileStopSampling()
+{
+  uint32_t state;
+  ENTER_SYSCALL(state);
+
+  sampling_stop();
+
+  EXIT_SYSCALL(state);
+  return 0;
+}
+
+int vileGetSample(const unsigned int index, vile_sample_t *sample)
+{
+  uint32_t state;
+  ENTER_SYSCALL(state);
+
+  vile_sample_t ksample;
+
+  ksceKernelLockMutex(smp_mtx, 1, NULL);
+  int ret = index < count ? 0 : -1;
+  if (ret == 0)
+    ksample = signals[index].sample;
+  ksceKernelUnlockMutex(smp_mtx, 1);
+
+  if (ret == 0)
+    ksceKernelMemcpyKernelToUser(sample, &ksample, sizeof(vile_sample_t));
+
+  EXIT_SYSCALL(state);
+  return ret;
+}
+
+int vileGetSamplingStats(vile_sampling_stats_t *ustats)
+{
+  uint32_t state;
+  ENTER_SYSCALL(state);
+
+  vile_sampling_stats_t kstats;
+  SceInt64 now = ksceKernelGetSystemTimeWide();
+
+  ksceKernelLockMutex(smp_mtx, 1, NULL);
+  kstats = stats;
+  kstats.running = running;
+  kstats.budget = budget;
+  kstats.count = count;
+  kstats.read_avg = (uint32_t)read_avg;
+  for (unsigned int i = 0; i < count; i++)
+  {
+    kstats.signal[i] = signals[i].stats;
+    kstats.signal[i].age = signals[i].last ? (uint32_t)(now - signals[i].last) : 0;
+  }
+  ksceKernelUnlockMutex(smp_mtx, 1);
+
+  ksceKernelMemcpyKernelToUser(ustats, &kstats, sizeof(vile_sampling_stats_t));
+
+  EXIT_SYSCALL(state);
+  return 0;
+}
@@ -0,0 +1,477 @@
+/**
+        libvile
+        Copyright (C) 2022 Cat (Ivan Epifanov)
+
+        This program is free software: you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        This program is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <psp2kern/kernel/cpu.h>
+#include <psp2kern/kernel/debug.h>
+#include <psp2kern/kernel/threadmgr.h>
+#include <psp2kern/kernel/sysmem.h>
+#include <psp2kern/kernel/sysmem/data_transfers.h>
+#include <string.h>
+#include "nxt.h"
+
+/*
+ * Poll buffers and the sensor stream. A program on the brick writes into
+ * the Comm module's usb poll buffer, a 64 byte ring, and POLLCOMMAND
+ * takes out as much as is there up to what was asked for. The helper
+ * (nxc/vilestrm.nxc) packs every port into one STREAM_FRAME byte frame
+ * per period, so one poll brings back two full samples where direct
+ * commands need seven exchanges for one. The reader asks for whole
+ * frames only; when it gets all it asked for there is likely more and it
+ * polls again straight away, otherwise it waits an interval.
+ */
+
+// frame on the wire, little endian: magic, sequence, tick (msec, low 16
+// bits), 4 scaled sensor values, 3 rotation counts
+#define STREAM_MAGIC 0x56
+#define STREAM_FRAME 24
+#define STREAM_POLL (NXT_POLL_CHUNK / STREAM_FRAME * STREAM_FRAME)
+#define STREAM_RETRY 100000 // no brick, or no poll buffer
+#define STREAM_RING_BYTES ((VILE_STREAM_RING * sizeof(vile_stream_frame_t) + 0xFFF) & ~0xFFF)
+
+#define STREAM_EV_WAKE 1
+
+static SceUID st_mtx;
+static SceUID st_cond; // new frames
+static SceUID st_ev;
+static SceUID st_thid = -1;
+static SceUID ring_uid = -1;
+
+static volatile uint8_t running = 0;
+static uint8_t started_program = 0;
+static uint32_t interval = 0;
+static SceInt64 started = 0;
+
+static vile_stream_frame_t *ring = NULL;
+static uint32_t total = 0; // frames ever received, ring index is total % VILE_STREAM_RING
+
+// reader thread only
+static uint8_t carry[STREAM_FRAME + STREAM_POLL];
+static unsigned int carried = 0;
+static uint8_t synced = 0;
+static uint8_t last_raw = 0;
+static uint32_t last_sequence = 0;
+static uint32_t last_tick = 0;
+
+static vile_stream_stats_t stats;
+static uint64_t poll_sum = 0;
+
+// bus held; length without the data, or -1
+static int poll_length(uint8_t buffer, vile_priority_t priority, SceInt64 wait)
+{
+  cmd_poll_t cmd = {NXT_SYSTEM_COMMAND_DOREPLY, NXT_OPCODE_SYS_POLLCOMMAND_LENGTH, buffer};
+  ret_poll_t r;
+
+  SceInt64 begin = ksceKernelGetSystemTimeWide();
+  int ret = nxt_exchange((unsigned char*) &cmd, 3, (unsigned char*) &r, priority, begin, wait);
+  if (ret < 5 || r.type != NXT_COMMAND_REPLY || r.opcode != NXT_OPCODE_SYS_POLLCOMMAND_LENGTH ||
+      r.status != NXT_STATUS_OK || r.buffer != buffer)
+    return -1;
+  return r.length;
+}
+
+// bus held; bytes read into out, or -1
+static int poll_read(uint8_t buffer, uint8_t size, uint8_t *out, vile_priority_t priority, SceInt64 wait)
+{
+  cmd_poll_t cmd = {NXT_SYSTEM_COMMAND_DOREPLY, NXT_OPCODE_SYS_POLLCOMMAND, buffer, size};
+  ret_poll_t r;
+
+  SceInt64 begin = ksceKernelGetSystemTimeWide();
+  int ret = nxt_exchange((unsigned char*) &cmd, 4, (unsigned char*) &r, priority, begin, wait);
+  if (ret < 5 || r.type != NXT_COMMAND_REPLY || r.opcode != NXT_OPCODE_SYS_POLLCOMMAND ||
+      r.status != NXT_STATUS_OK || r.buffer != buffer || r.length > size || ret < 5 + r.length)
+    return -1;
+
+  memcpy(out, r.data, r.length);
+  return r.length;
+}
+
+static int16_t get16(const uint8_t *p)
+{
+  return (int16_t)(p[0] | (p[1] << 8));
+}
+
+static int32_t get32(const uint8_t *p)
+{
+  return (int32_t)(p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24));
+}
+
+// st_mtx held; the helper's 8 and 16 bit counters widened
+static void publish(const uint8_t *p, SceInt64 now)
+{
+  vile_stream_frame_t *f = &ring[total % VILE_STREAM_RING];
+
+  if (synced)
+  {
+    // a repeated number can only be a whole lap
+    unsigned int gap = (uint8_t)(p[1] - last_raw);
+    if (!gap)
+      gap = 256;
+    last_sequence += gap;
+    stats.lost += gap - 1;
+    last_tick += (uint16_t)((p[2] | (p[3] << 8)) - (uint16_t)last_tick);
+  }
+  else
+  {
+    last_sequence = 1;
+    last_tick = p[2] | (p[3] << 8);
+    synced = 1;
+  }
+  last_raw = p[1];
+
+  f->sequence = last_sequence;
+  f->tick = last_tick;
+  f->timestamp = now;
+  for (int i = 0; i < 4; i++)
+    f->value[i] = get16(p + 4 + 2 * i);
+  for (int i = 0; i < 3; i++)
+    f->rotation[i] = get32(p + 12 + 4 * i);
+  f->reserved = 0;
+
+  total++;
+  stats.frames++;
+}
+
+// st_mtx held; cuts carry into frames, returns how many
+static int unpack(SceInt64 now)
+{
+  unsigned int at = 0;
+  int frames = 0;
+
+  while (carried - at >= STREAM_FRAME)
+  {
+    if (carry[at] != STREAM_MAGIC)
+    {
+      // not from the helper, or a frame lost its start
+      at++;
+      stats.resyncs++;
+      continue;
+    }
+    publish(carry + at, now);
+    at += STREAM_FRAME;
+    frames++;
+  }
+
+  memmove(carry, carry + at, carried - at);
+  carried -= at;
+  return frames;
+}
+
+static int stream_thread(SceSize args, void *argp)
+{
+  ksceDebugPrintf("stream reader started\n");
+
+  while (running)
+  {
+    SceInt64 t0 = ksceKernelGetSystemTimeWide();
+    nxt_lock_priority(VILE_PRIORITY_TELEMETRY);
+    int ret = poll_read(NXT_POLL_USB, STREAM_POLL, carry + carried, VILE_PRIORITY_TELEMETRY, ksceKernelGetSystemTimeWide() - t0);
+    nxt_unlock();
+    SceInt64 t1 = ksceKernelGetSystemTimeWide();
+
+    ksceKernelLockMutex(st_mtx, 1, NULL);
+    if (ret >= 0)
+    {
+      uint32_t took = (uint32_t)(t1 - t0);
+      stats.polls++;
+      poll_sum += took;
+      if (took > stats.poll_max)
+        stats.poll_max = took;
+      stats.bytes += ret;
+      if (!ret)
+        stats.empty++;
+
+      carried += ret;
+      if (unpack(t1))
+        ksceKernelSignalCondAll(st_cond);
+    }
+    else
+    {
+      stats.failures++;
+    }
+    SceInt64 next = ret < 0 ? t1 + STREAM_RETRY : ret == STREAM_POLL ? t1 : t1 + interval;
+    ksceKernelUnlockMutex(st_mtx, 1);
+
+    SceInt64 now = ksceKernelGetSystemTimeWide();
+    if (now < next)
+    {
+      SceUInt timeout = (SceUInt)(next - now);
+      ksceKernelWaitEventFlag(st_ev, STREAM_EV_WAKE, SCE_EVENT_WAITCLEAR_PAT | SCE_EVENT_WAITOR, NULL, &timeout);
+    }
+  }
+
+  ksceDebugPrintf("stream reader stopped\n");
+  return 0;
+}
+
+// filename is a terminated 20 byte kernel buffer, or NULL
+static int program_command(uint8_t opcode, const char *filename)
+{
+  cmd_startprogram_t cmd = {NXT_DIRECT_COMMAND_DOREPLY, opcode, ""};
+  if (filename)
+    memcpy(cmd.filename, filename, sizeof(cmd.filename) - 1);
+
+  ret_status_t st;
+  int ret = nxt_transfer((unsigned char*) &cmd, filename ? sizeof(cmd) : 2, (unsigned char*) &st);
+  if (ret != sizeof(ret_status_t) || st.type != NXT_COMMAND_REPLY || st.opcode != opcode || st.status != NXT_STATUS_OK)
+    return -1;
+  return 0;
+}
+
+static void reader_stop()
+{
+  if (st_thid < 0)
+    return;
+
+  running = 0;
+  ksceKernelSetEventFlag(st_ev, STREAM_EV_WAKE);
+  ksceKernelWaitThreadEnd(st_thid, NULL, NULL);
+  ksceKernelDeleteThread(st_thid);
+  st_thid = -1;
+
+  if (started_program)
+  {
+    program_command(NXT_OPCODE_STOPPROGRAM, NULL);
+    started_program = 0;
+  }
+
+  // waiters give up
+  ksceKernelLockMutex(st_mtx, 1, NULL);
+  ksceKernelSignalCondAll(st_cond);
+  ksceKernelUnlockMutex(st_mtx, 1);
+}
+
+void stream_shutdown()
+{
+  reader_stop();
+}
+
+int stream_init()
+{
+  st_mtx = ksceKernelCreateMutex("vile_stream", 0, 0, NULL);
+  if (st_mtx < 0)
+    return -1;
+  st_cond = ksceKernelCreateCond("vile_stream", 0, st_mtx, NULL);
+  st_ev = ksceKernelCreateEventFlag("vile_stream", 0, 0, NULL);
+
+  ring_uid = ksceKernelAllocMemBlock("vile_stream", SCE_KERNEL_MEMBLOCK_TYPE_KERNEL_RW, STREAM_RING_BYTES, NULL);
+  if (ring_uid < 0)
+    return -1;
+  ksceKernelGetMemBlockBase(ring_uid, (void **)&ring);
+
+  return (st_cond < 0 || st_ev < 0) ? -1 : 0;
+}
+
+/*
+ *  PUBLIC COMMANDS
+ */
+
+int vilePollLength(const vile_pollbuf_t buffer)
+{
+  uint32_t state;
+  ENTER_SYSCALL(state);
+
+  SceInt64 begin = ksceKernelGetSystemTimeWide();
+  nxt_lock_priority(VILE_PRIORITY_TELEMETRY);
+  int ret = poll_length(buffer, VILE_PRIORITY_TELEMETRY, ksceKernelGetSystemTimeWide() - begin);
+  nxt_unlock();
+
+  EXIT_SYSCALL(state);
+  return ret;
+}
+
+int vilePollRead(const vile_pollbuf_t buffer, void *data, const uint8_t size)
+{
+  uint32_t state;
+  ENTER_SYSCALL(state);
+
+  if (!size || size > VILE_POLL_MAX)
+  {
+    EXIT_SYSCALL(state);
+    return -1;
+  }
+
+  uint8_t kdata[VILE_POLL_MAX];
+  SceInt64 begin = ksceKernelGetSystemTimeWide();
+  nxt_lock_priority(VILE_PRIORITY_TELEMETRY);
+  int ret = poll_read(buffer, size, kdata, VILE_PRIORITY_TELEMETRY, ksceKernelGetSystemTimeWide() - begin);
+  nxt_unlock();
+
+  if (ret > 0)
+    ksceKernelMemcpyKernelToUser(data, kdata, ret);
+
+  EXIT_SYSCALL(state);
+  return ret;
+}
+
+int vileStartStream(const char *program, const uint32_t uinterval)
+{
+  uint32_t state;
+  ENTER_SYSCALL(state);
+
+  // checked and started under the lock, so two starts can't both get a
+  // reader or start the helper twice; the reader only takes the lock
+  // with the bus released
+  ksceKernelLockMutex(st_mtx, 1, NULL);
+  interval = uinterval;
+
+  if (st_thid >= 0)
+  {
+    // new interval applies right away
+    ksceKernelSetEventFlag(st_ev, STREAM_EV_WAKE);
+    ksceKernelUnlockMutex(st_mtx, 1);
+    EXIT_SYSCALL(state);
+    return 0;
+  }
+
+  if (!ring)
+  {
+    ksceKernelUnlockMutex(st_mtx, 1);
+    EXIT_SYSCALL(state);
+    return -1;
+  }
+
+  if (program)
+  {
+    char kprogram[20] = "";
+    ksceKernelStrncpyUserToKernel(kprogram, program, sizeof(kprogram) - 1);
+    if (program_command(NXT_OPCODE_STARTPROGRAM, kprogram) < 0)
+    {
+      ksceKernelUnlockMutex(st_mtx, 1);
+      EXIT_SYSCALL(state);
+      return -1;
+    }
+    started_program = 1;
+  }
+
+  memset(&stats, 0, sizeof(stats));
+  poll_sum = 0;
+  total = 0;
+  carried = 0;
+  synced = 0;
+  started = ksceKernelGetSystemTimeWide();
+
+  st_thid = ksceKernelCreateThread("vile_stream", stream_thread, 0x3C, 0x1000, 0, 0x10000, NULL);
+  if (st_thid < 0)
+  {
+    if (started_program)
+      program_command(NXT_OPCODE_STOPPROGRAM, NULL);
+    started_program = 0;
+    ksceKernelUnlockMutex(st_mtx, 1);
+    EXIT_SYSCALL(state);
+    return -1;
+  }
+
+  ksceKernelClearEventFlag(st_ev, ~STREAM_EV_WAKE);
+  running = 1;
+  ksceKernelStartThread(st_thid, 0, NULL);
+
+  ksceKernelUnlockMutex(st_mtx, 1);
+
+  EXIT_SYSCALL(state);
+  return 0;
+}
+
+int vileStopStream()
+{
+  uint32_t state;
+  ENTER_SYSCALL(state);
+
+  reader_stop();
+
+  EXIT_SYSCALL(state);
+  return 0;
+}
+
+int vileReadStream(vile_stream_frame_t *out, const unsigned int count, const uint32_t after, const uint32_t timeout)
+{
+  uint32_t state;
+  ENTER_SYSCALL(state);
+
+  if (!count)
+  {
+    EXIT_SYSCALL(state);
+    return -1;
+  }
+
+  SceInt64 deadline = ksceKernelGetSystemTimeWide() + timeout;
+  int ret = -1;
+
+  ksceKernelLockMutex(st_mtx, 1, NULL);
+  while (running && (!total || ring[(total - 1) % VILE_STREAM_RING].sequence <= after))
+  {
+    if (!timeout)
+    {
+      ksceKernelWaitCond(st_cond, NULL);
+      continue;
+    }
+
+    SceInt64 now = ksceKernelGetSystemTimeWide();
+    if (now >= deadline)
+      break;
+    SceUInt left = (SceUInt)(deadline - now);
+    ksceKernelWaitCond(st_cond, &left);
+  }
+
+  // newer frames, back from the latest
+  uint32_t oldest = total > VILE_STREAM_RING ? total - VILE_STREAM_RING : 0;
+  uint32_t first = total;
+  while (first > oldest && ring[(first - 1) % VILE_STREAM_RING].sequence > after)
+    first--;
+
+  if (first < total)
+  {
+    uint32_t n = total - first;
+    if (n > count)
+      n = count;
+    // in at most two runs around the end of the ring
+    uint32_t idx = first % VILE_STREAM_RING;
+    uint32_t run = VILE_STREAM_RING - idx < n ? VILE_STREAM_RING - idx : n;
+    ksceKernelMemcpyKernelToUser(out, &ring[idx], run * sizeof(vile_stream_frame_t));
+    if (run < n)
+      ksceKernelMemcpyKernelToUser(out + run, &ring[0], (n - run) * sizeof(vile_stream_frame_t));
+    ret = (int)n;
+  }
+  ksceKernelUnlockMutex(st_mtx, 1);
+
+  EXIT_SYSCALL(state);
+  return ret;
+}
+
+int vileGetStreamStats(vile_stream_stats_t *out)
+{
+  uint32_t state;
+  ENTER_SYSCALL(state);
+
+  ksceKernelLockMutex(st_mtx, 1, NULL);
+  vile_stream_stats_t kstats = stats;
+  kstats.running = running;
+  kstats.interval = interval;
+  kstats.poll_avg = kstats.polls ? (uint32_t)(poll_sum / kstats.polls) : 0;
+  SceInt64 elapsed = ksceKernelGetSystemTimeWide() - started;
+  if (started && elapsed > 0)
+  {
+    kstats.polls_per_s = (uint32_t)((uint64_t)kstats.polls * 1000000 / elapsed);
+    kstats.frames_per_s = (uint32_t)((uint64_t)kstats.frames * 1000000 / elapsed);
+  }
+  ksceKernelUnlockMutex(st_mtx, 1);
+
+  ksceKernelMemcpyKernelToUser(out, &kstats, sizeof(kstats));
+
+  EXIT_SYSCALL(state);
+  return 0;
+}
@@ -0,0 +1,556 @@
+/**
+        libvile
+        Copyright (C) 2022 Cat (Ivan Epifanov)
+
+        This program is free software: you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        This program is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <psp2kern/kernel/cpu.h>
+#include <psp2kern/kernel/debug.h>
+#include <psp2kern/kernel/threadmgr.h>
+#include <psp2kern/kernel/sysmem.h>
+#include <psp2kern/kernel/iofilemgr.h>
+#include <string.h>
+#include "nxt.h"
+#include "telemetry.h"
+
+// blocks in flight between the encoder and storage
+#define TELEMETRY_BLOCKS 4
+#define TELEMETRY_MIN_PERIOD 1000
+#define TELEMETRY_DEFAULT_KEYFRAME 100
+
+#define TELEMETRY_EV_WAKE 1
+#define TELEMETRY_EV_BLOCK 2
+
+enum {
+  BLOCK_FREE = 0,
+  BLOCK_FILLING,
+  BLOCK_FULL
+};
+
+static SceUID tlm_mtx;
+static SceUID tlm_ev;
+static SceUID sampler_thid = -1;
+static SceUID writer_thid = -1;
+static SceUID blocks_uid = -1;
+static SceUID fd = -1;
+
+static uint8_t *blocks = NULL;
+static uint8_t block_state[TELEMETRY_BLOCKS];
+static unsigned int full_queue[TELEMETRY_BLOCKS];
+static unsigned int full_head = 0;
+static unsigned int full_tail = 0;
+
+static volatile uint8_t running = 0;
+static volatile uint8_t writing = 0;
+static volatile uint8_t recording_commands = 0;
+
+static vile_telemetry_t config;
+static SceInt64 epoch;
+
+// encoder state, guarded by tlm_mtx
+static int cur = -1;
+static uint8_t *wp;
+static uint32_t block_seq;
+static uint8_t block_keyed;
+static int32_t prev[TLM_MAX_FIELDS];
+static int nfields;
+static uint64_t last_time;
+static uint32_t since_key;
+
+static vile_telemetry_stats_t stats;
+
+static inline tlm_block_t *block_header(int idx)
+{
+  return (tlm_block_t *)(blocks + idx * TLM_BLOCK_SIZE);
+}
+
+static void block_seal()
+{
+  tlm_block_t *hdr = block_header(cur);
+  uint8_t *end = blocks + (cur + 1) * TLM_BLOCK_SIZE;
+
+  hdr->used = wp - (uint8_t *)(hdr + 1);
+  memset(wp, 0, end - wp);
+
+  block_state[cur] = BLOCK_FULL;
+  full_queue[full_tail % TELEMETRY_BLOCKS] = cur;
+  full_tail++;
+  cur = -1;
+
+  ksceKernelSetEventFlag(tlm_ev, TELEMETRY_EV_BLOCK);
+}
+
+static int block_open()
+{
+  for (int i = 0; i < TELEMETRY_BLOCKS; i++)
+  {
+    if (block_state[i] != BLOCK_FREE)
+      continue;
+
+    tlm_block_t *hdr = block_header(i);
+    hdr->magic = TLM_BLOCK_MAGIC;
+    hdr->seq = block_seq++;
+    hdr->time = last_time;
+    hdr->used = 0;
+    hdr->records = 0;
+
+    block_state[i] = BLOCK_FILLING;
+    cur = i;
+    wp = (uint8_t *)(hdr + 1);
+    block_keyed = 0;
+    return 0;
+  }
+  return -1;
+}
+
+// room for one more record, NULL if storage can't keep up
+static uint8_t *record_reserve()
+{
+  if (cur >= 0 && (blocks + (cur + 1) * TLM_BLOCK_SIZE) - wp < TLM_RECORD_MAX)
+    block_seal();
+
+  if (cur < 0 && block_open() < 0)
+  {
+    stats.dropped++;
+    return NULL;
+  }
+
+  return wp;
+}
+
+static void record_commit(uint8_t *p)
+{
+  stats.bytes += p - wp;
+  block_header(cur)->records++;
+  wp = p;
+}
+
+static void encode_sample(uint64_t time, const int32_t *fields)
+{
+  uint8_t *p = record_reserve();
+  if (!p)
+    return;
+
+  if (!block_keyed || since_key >= config.keyframe)
+  {
+    *p++ = TLM_REC_KEYFRAME;
+    p = tlm_put_varint(p, time);
+    for (int i = 0; i < nfields; i++)
+      p = tlm_put_varint(p, tlm_zigzag(fields[i]));
+
+    block_keyed = 1;
+    since_key = 0;
+    stats.keyframes++;
+  }
+  else
+  {
+    uint64_t mask = 0;
+    for (int i = 0; i < nfields; i++)
+      if (fields[i] != prev[i])
+        mask |= 1ULL << i;
+
+    *p++ = TLM_REC_SAMPLE;
+    p = tlm_put_varint(p, tlm_zigzag((int32_t)(time - last_time) - (int32_t)config.period));
+    p = tlm_put_varint(p, mask);
+    for (int i = 0; i < nfields; i++)
+      if (mask & (1ULL << i))
+        p = tlm_put_varint(p, tlm_zigzag((int32_t)((uint32_t)fields[i] - (uint32_t)prev[i])));
+  }
+
+  memcpy(prev, fields, nfields * sizeof(int32_t));
+  last_time = time;
+  since_key++;
+  stats.samples++;
+  record_commit(p);
+}
+
+// bytes after type/opcode worth keeping, -1 for commands we don't log
+static int command_payload(uint8_t opcode)
+{
+  switch (opcode)
+  {
+    case NXT_OPCODE_STARTPROGRAM:
+      return 20;
+    case NXT_OPCODE_STOPPROGRAM:
+    case NXT_OPCODE_STOP_SOUND:
+      return 0;
+    case NXT_OPCODE_PLAYSOUND:
+      return 21;
+    case NXT_OPCODE_PLAYTONE:
+      return 4;
+    case NXT_OPCODE_SET_OUTPUTSTATE:
+      return 10;
+    case NXT_OPCODE_SET_INPUTMODE:
+      return 3;
+    case NXT_OPCODE_RESET_INPUT_SCALEDVALUES:
+      return 1;
+    case NXT_OPCODE_RESET_MOTOR_POSITION:
+      return 2;
+    default:
+      return -1;
+  }
+}
+
+void telemetry_command(const unsigned char *request, unsigned int length)
+{
+  if (!recording_commands || length < 2)
+    return;
+
+  if (request[0] != NXT_DIRECT_COMMAND_DOREPLY && request[0] != NXT_DIRECT_COMMAND_NOREPLY)
+    return;
+
+  int size = command_payload(request[1]);
+  if (size < 0)
+    return;
+  if (size > length - 2)
+    size = length - 2;
+
+  uint64_t time = ksceKernelGetSystemTimeWide() - epoch;
+
+  ksceKernelLockMutex(tlm_mtx, 1, NULL);
+
+  uint8_t *p = running ? record_reserve() : NULL;
+  if (p)
+  {
+    *p++ = TLM_REC_COMMAND;
+    p = tlm_put_varint(p, tlm_zigzag((int32_t)(time - last_time)));
+    *p++ = request[1];
+    *p++ = size;
+    memcpy(p, &request[2], size);
+    p += size;
+
+    stats.commands++;
+    record_commit(p);
+  }
+
+  ksceKernelUnlockMutex(tlm_mtx, 1);
+}
+
+// sampler thread only, too big for its stack
+static vile_state_t sample_state;
+
+// returns number of failed reads
+static int sample_fields(int32_t *fields)
+{
+  int n = 0;
+  int failed = 0;
+
+  // all selected ports in a few IOMap reads
+  sample_state.inputs = config.inputs;
+  sample_state.outputs = config.outputs;
+  int ok = nxt_read_state(&sample_state, VILE_PRIORITY_TELEMETRY) >= 0;
+
+  for (int i = 0; i < TLM_INPUTS; i++)
+  {
+    if (!(config.inputs & (1 << i)))
+      continue;
+
+    const vile_inputstate_t *in = &sample_state.input[i].state;
+    if (!ok)
+    {
+      // keep last known values, they encode as "unchanged"
+      memcpy(&fields[n], &prev[n], TLM_IN_FIELDS * sizeof(int32_t));
+      failed++;
+    }
+    else
+    {
+      fields[n + TLM_IN_RAW] = in->raw_value;
+      fields[n + TLM_IN_NORMALIZED] = in->normalized_value;
+      fields[n + TLM_IN_SCALED] = in->scaled_value;
+      fields[n + TLM_IN_STATE] = (in->valid ? 1 : 0) | (in->calibrated ? 2 : 0) | (in->sensor_type << 8) | (in->sensor_mode << 16);
+    }
+    n += TLM_IN_FIELDS;
+  }
+
+  for (int i = 0; i < TLM_OUTPUTS; i++)
+  {
+    if (!(config.outputs & (1 << i)))
+      continue;
+
+    const vile_outputstate_t *out = &sample_state.output[i].state;
+    if (!ok)
+    {
+      memcpy(&fields[n], &prev[n], TLM_OUT_FIELDS * sizeof(int32_t));
+      failed++;
+    }
+    else
+    {
+      fields[n + TLM_OUT_POWER] = out->power;
+      fields[n + TLM_OUT_STATE] = out->mode | (out->regulation << 8) | (out->run_state << 16);
+      fields[n + TLM_OUT_TURN_RATIO] = out->turn_ratio;
+      fields[n + TLM_OUT_TACHO_LIMIT] = (int32_t)out->tacho_limit;
+      fields[n + TLM_OUT_TACHO_COUNT] = out->tacho_count;
+      fields[n + TLM_OUT_BLOCK_TACHO_COUNT] = out->block_tacho_count;
+      fields[n + TLM_OUT_ROTATION_COUNT] = out->rotation_count;
+    }
+    n += TLM_OUT_FIELDS;
+  }
+
+  return failed;
+}
+
+static int sampler_thread(SceSize args, void *argp)
+{
+  ksceDebugPrintf("telemetry sampler started\n");
+
+  SceInt64 next = ksceKernelGetSystemTimeWide();
+  int32_t fields[TLM_MAX_FIELDS];
+
+  while (running)
+  {
+    SceInt64 now = ksceKernelGetSystemTimeWide();
+
+    if (now < next)
+    {
+      SceUInt timeout = (SceUInt)(next - now);
+      ksceKernelWaitEventFlag(tlm_ev, TELEMETRY_EV_WAKE, SCE_EVENT_WAITCLEAR_PAT | SCE_EVENT_WAITOR, NULL, &timeout);
+      continue;
+    }
+
+    next += config.period;
+    if (next <= now)
+      next = now + config.period;
+
+    if (nfields)
+    {
+      int failed = sample_fields(fields);
+
+      ksceKernelLockMutex(tlm_mtx, 1, NULL);
+      stats.failed += failed;
+      encode_sample(now - epoch, fields);
+      ksceKernelUnlockMutex(tlm_mtx, 1);
+    }
+  }
+
+  ksceDebugPrintf("telemetry sampler stopped\n");
+  return 0;
+}
+
+static int writer_thread(SceSize args, void *argp)
+{
+  ksceDebugPrintf("telemetry writer started\n");
+
+  while (1)
+  {
+    ksceKernelLockMutex(tlm_mtx, 1, NULL);
+
+    if (full_head == full_tail)
+    {
+      uint8_t done = !writing;
+      ksceKernelUnlockMutex(tlm_mtx, 1);
+      if (done)
+        break;
+      ksceKernelWaitEventFlag(tlm_ev, TELEMETRY_EV_BLOCK, SCE_EVENT_WAITCLEAR_PAT | SCE_EVENT_WAITOR, NULL, NULL);
+      continue;
+    }
+
+    unsigned int idx = full_queue[full_head % TELEMETRY_BLOCKS];
+    ksceKernelUnlockMutex(tlm_mtx, 1);
+
+    // full blocks belong to the writer, no lock needed for the write itself
+    int ret = ksceIoWrite(fd, blocks + idx * TLM_BLOCK_SIZE, TLM_BLOCK_SIZE);
+    if (ret != TLM_BLOCK_SIZE)
+      ksceDebugPrintf("telemetry write: 0x%08x\n", ret);
+
+    ksceKernelLockMutex(tlm_mtx, 1, NULL);
+    full_head++;
+    block_state[idx] = BLOCK_FREE;
+    stats.blocks++;
+    ksceKernelUnlockMutex(tlm_mtx, 1);
+  }
+
+  ksceDebugPrintf("telemetry writer stopped\n");
+  return 0;
+}
+
+static void telemetry_stop()
+{
+  if (sampler_thid < 0)
+    return;
+
+  recording_commands = 0;
+  running = 0;
+  ksceKernelSetEventFlag(tlm_ev, TELEMETRY_EV_WAKE);
+  ksceKernelWaitThreadEnd(sampler_thid, NULL, NULL);
+  ksceKernelDeleteThread(sampler_thid);
+  sampler_thid = -1;
+
+  ksceKernelLockMutex(tlm_mtx, 1, NULL);
+  if (cur >= 0)
+    block_seal();
+  writing = 0;
+  ksceKernelUnlockMutex(tlm_mtx, 1);
+
+  ksceKernelSetEventFlag(tlm_ev, TELEMETRY_EV_BLOCK);
+  ksceKernelWaitThreadEnd(writer_thid, NULL, NULL);
+  ksceKernelDeleteThread(writer_thid);
+  writer_thid = -1;
+
+  ksceIoClose(fd);
+  fd = -1;
+
+  ksceKernelFreeMemBlock(blocks_uid);
+  blocks_uid = -1;
+  blocks = NULL;
+}
+
+int telemetry_init()
+{
+  tlm_mtx = ksceKernelCreateMutex("vile_telemetry", 0, 0, NULL);
+  tlm_ev = ksceKernelCreateEventFlag("vile_telemetry", 0, 0, NULL);
+  return (tlm_mtx < 0 || tlm_ev < 0) ? -1 : 0;
+}
+
+void telemetry_shutdown()
+{
+  telemetry_stop();
+}
+
+/*
+ *  PUBLIC COMMANDS
+ */
+
+int vileStartTelemetry(const char *path, const vile_telemetry_t *telemetry)
+{
+  uint32_t state;
+  ENTER_SYSCALL(state);
+
+  if (sampler_thid >= 0)
+  {
+    EXIT_SYSCALL(state);
+    return -1;
+  }
+
+  char kpath[256];
+  vile_telemetry_t kconfig;
+
+  ksceKernelStrncpyUserToKernel(kpath, path, sizeof(kpath));
+  kpath[sizeof(kpath) - 1] = 0;
+  ksceKernelMemcpyUserToKernel(&kconfig, telemetry, sizeof(vile_telemetry_t));
+
+  if (kconfig.period < TELEMETRY_MIN_PERIOD)
+  {
+    EXIT_SYSCALL(state);
+    return -1;
+  }
+
+  kconfig.inputs &= (1 << TLM_INPUTS) - 1;
+  kconfig.outputs &= (1 << TLM_OUTPUTS) - 1;
+  if (!kconfig.keyframe)
+    kconfig.keyframe = TELEMETRY_DEFAULT_KEYFRAME;
+
+  blocks_uid = ksceKernelAllocMemBlock("vile_telemetry", SCE_KERNEL_MEMBLOCK_TYPE_KERNEL_RW, TELEMETRY_BLOCKS * TLM_BLOCK_SIZE, NULL);
+  if (blocks_uid < 0)
+  {
+    EXIT_SYSCALL(state);
+    return -1;
+  }
+  ksceKernelGetMemBlockBase(blocks_uid, (void **)&blocks);
+
+  fd = ksceIoOpen(kpath, SCE_O_WRONLY | SCE_O_CREAT | SCE_O_TRUNC, 0666);
+  if (fd < 0)
+  {
+    ksceDebugPrintf("telemetry open %s: 0x%08x\n", kpath, fd);
+    ksceKernelFreeMemBlock(blocks_uid);
+    blocks_uid = -1;
+    EXIT_SYSCALL(state);
+    return -1;
+  }
+
+  epoch = ksceKernelGetSystemTimeWide();
+
+  tlm_header_t hdr = {
+    .magic = TLM_MAGIC,
+    .version = TLM_VERSION,
+    .header_size = sizeof(tlm_header_t),
+    .block_size = TLM_BLOCK_SIZE,
+    .period = kconfig.period,
+    .keyframe = kconfig.keyframe,
+    .inputs = kconfig.inputs,
+    .outputs = kconfig.outputs,
+    .start = epoch,
+    .reserved = 0
+  };
+  ksceIoWrite(fd, &hdr, sizeof(hdr));
+
+  ksceKernelLockMutex(tlm_mtx, 1, NULL);
+  config = kconfig;
+  nfields = tlm_field_count(config.inputs, config.outputs);
+  memset(prev, 0, sizeof(prev));
+  memset(block_state, BLOCK_FREE, sizeof(block_state));
+  memset(&stats, 0, sizeof(stats));
+  full_head = full_tail = 0;
+  cur = -1;
+  block_seq = 0;
+  last_time = 0;
+  since_key = 0;
+  ksceKernelUnlockMutex(tlm_mtx, 1);
+
+  sampler_thid = ksceKernelCreateThread("vile_telemetry", sampler_thread, 0x40, 0x2000, 0, 0x10000, NULL);
+  writer_thid = ksceKernelCreateThread("vile_telemetry_io", writer_thread, 0x60, 0x1000, 0, 0x10000, NULL);
+  if (sampler_thid < 0 || writer_thid < 0)
+  {
+    if (sampler_thid >= 0)
+      ksceKernelDeleteThread(sampler_thid);
+    if (writer_thid >= 0)
+      ksceKernelDeleteThread(writer_thid);
+    sampler_thid = writer_thid = -1;
+    ksceIoClose(fd);
+    fd = -1;
+    ksceKernelFreeMemBlock(blocks_uid);
+    blocks_uid = -1;
+    EXIT_SYSCALL(state);
+    return -1;
+  }
+
+  ksceKernelClearEventFlag(tlm_ev, ~(TELEMETRY_EV_WAKE | TELEMETRY_EV_BLOCK));
+  running = 1;
+  writing = 1;
+  recording_commands = kconfig.commands ? 1 : 0;
+  ksceKernelStartThread(writer_thid, 0, NULL);
+  ksceKernelStartThread(sampler_thid, 0, NULL);
+
+  EXIT_SYSCALL(state);
+  return 0;
+}
+
+int vileStopTelemetry()
+{
+  uint32_t state;
+  ENTER_SYSCALL(state);
+
+  telemetry_stop();
+
+  EXIT_SYSCALL(state);
+  return 0;
+}
+
+int vileGetTelemetryStats(vile_telemetry_stats_t *ustats)
+{
+  uint32_t state;
+  ENTER_SYSCALL(state);
+
+  vile_telemetry_stats_t kstats;
+
+  ksceKernelLockMutex(tlm_mtx, 1, NULL);
+  kstats = stats;
+  kstats.running = running;
+  ksceKernelUnlockMutex(tlm_mtx, 1);
+
+  ksceKernelMemcpyKernelToUser(ustats, &kstats, sizeof(vile_telemetry_stats_t));
+
+  EXIT_SYSCALL(state);
+  return 0;
+}
@@ -0,0 +1,157 @@
+/**
+        libvile
+        Copyright (C) 2022 Cat (Ivan Epifanov)
+
+        This program is free software: you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        This program is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Telemetry log format, shared by the kernel recorder and host decoder.
+ *
+ * File is a tlm_header_t followed by fixed size blocks, each starting
+ * with tlm_block_t. Every block begins with a keyframe before its first
+ * sample, so decoding can start at any block and seeking is a binary
+ * search over block headers.
+ *
+ * Records:
+ *   KEYFRAME  tag, varint time, zigzag varint per field (absolute)
+ *   SAMPLE    tag, zigzag varint (dt - period), varint changed-field mask,
+ *             zigzag varint delta per changed field
+ *   COMMAND   tag, zigzag varint (time - last sample time), opcode,
+ *             payload length, payload
+ *
+ * Times are usec since recording start. Sample dt is relative to the
+ * previous sample, so commands don't disturb the period baseline.
+ * Fields are listed per enabled input port (TLM_IN_*), then per enabled
+ * output port (TLM_OUT_*), in port order.
+ */
+
+#ifndef __TELEMETRY_H__
+#define __TELEMETRY_H__
+
+#include <stdint.h>
+
+#define TLM_MAGIC 0x4D4C5456 // "VTLM"
+#define TLM_BLOCK_MAGIC 0x4B4C4256 // "VBLK"
+#define TLM_VERSION 1
+#define TLM_BLOCK_SIZE 32768
+
+// worst case record is a full sample delta
+#define TLM_RECORD_MAX 256
+
+enum {
+  TLM_REC_KEYFRAME = 0x01,
+  TLM_REC_SAMPLE = 0x02,
+  TLM_REC_COMMAND = 0x03
+};
+
+enum {
+  TLM_IN_RAW = 0,
+  TLM_IN_NORMALIZED,
+  TLM_IN_SCALED,
+  TLM_IN_STATE, // valid | calibrated << 1 | type << 8 | mode << 16
+  TLM_IN_FIELDS
+};
+
+enum {
+  TLM_OUT_POWER = 0,
+  TLM_OUT_STATE, // mode | regulation << 8 | run_state << 16
+  TLM_OUT_TURN_RATIO,
+  TLM_OUT_TACHO_LIMIT,
+  TLM_OUT_TACHO_COUNT,
+  TLM_OUT_BLOCK_TACHO_COUNT,
+  TLM_OUT_ROTATION_COUNT,
+  TLM_OUT_FIELDS
+};
+
+#define TLM_INPUTS 4
+#define TLM_OUTPUTS 3
+#define TLM_MAX_FIELDS (TLM_INPUTS * TLM_IN_FIELDS + TLM_OUTPUTS * TLM_OUT_FIELDS)
+
+#pragma pack(push,1)
+
+typedef struct {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t header_size;
+  uint32_t block_size;
+  uint32_t period; // usec
+  uint16_t keyframe; // samples between keyframes
+  uint8_t inputs; // port bitmasks
+  uint8_t outputs;
+  uint64_t start; // system time at recording start, usec
+  uint32_t reserved;
+} tlm_header_t;
+
+typedef struct {
+  uint32_t magic;
+  uint32_t seq;
+  uint64_t time; // last sample time when the block was opened
+  uint32_t used; // payload bytes following this header
+  uint32_t records;
+} tlm_block_t;
+
+#pragma pack(pop)
+
+static inline uint32_t tlm_zigzag(int32_t v)
+{
+  return ((uint32_t)v << 1) ^ (uint32_t)(v >> 31);
+}
+
+static inline int32_t tlm_unzigzag(uint32_t v)
+{
+  return (int32_t)(v >> 1) ^ -(int32_t)(v & 1);
+}
+
+static inline uint8_t *tlm_put_varint(uint8_t *p, uint64_t v)
+{
+  while (v >= 0x80)
+  {
+    *p++ = (uint8_t)(v | 0x80);
+    v >>= 7;
+  }
+  *p++ = (uint8_t)v;
+  return p;
+}
+
+// returns NULL on truncated or overlong input
+static inline const uint8_t *tlm_get_varint(const uint8_t *p, const uint8_t *end, uint64_t *v)
+{
+  uint64_t r = 0;
+  for (int shift = 0; shift < 64 && p < end; shift += 7)
+  {
+    uint8_t b = *p++;
+    r |= (uint64_t)(b & 0x7F) << shift;
+    if (!(b & 0x80))
+    {
+      *v = r;
+      return p;
+    }
+  }
+  return NULL;
+}
+
+static inline int tlm_field_count(uint8_t inputs, uint8_t outputs)
+{
+  int n = 0;
+  for (int i = 0; i < TLM_INPUTS; i++)
+    if (inputs & (1 << i))
+      n += TLM_IN_FIELDS;
+  for (int i = 0; i < TLM_OUTPUTS; i++)
+    if (outputs & (1 << i))
+      n += TLM_OUT_FIELDS;
+  return n;
+}
+
+#endif // __TELEMETRY_H__
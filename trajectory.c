@@ -0,0 +1,264 @@
+/**
+        libvile
+        Copyright (C) 2022 Cat (Ivan Epifanov)
+
+        This program is free software: you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        This program is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <psp2kern/kernel/cpu.h>
+#include <psp2kern/kernel/debug.h>
+#include <psp2kern/kernel/threadmgr.h>
+#include <psp2kern/kernel/sysmem/data_transfers.h>
+#include <string.h>
+#include "nxt.h"
+
+// ring of pending setpoints, must be power of two
+#define TRAJECTORY_SIZE 512
+#define TRAJECTORY_MASK (TRAJECTORY_SIZE - 1)
+// setpoints emitted later than this are counted as late
+#define TRAJECTORY_LATE 1000
+
+#define TRAJECTORY_EV_WAKE 1
+
+static vile_setpoint_t points[TRAJECTORY_SIZE];
+static unsigned int head = 0; // next to emit
+static unsigned int tail = 0; // next free slot
+static uint32_t last_time = 0;
+
+static SceUID traj_mtx;
+static SceUID traj_ev;
+static SceUID traj_thid = -1;
+
+static volatile uint8_t running = 0;
+static SceInt64 epoch = 0;
+
+static vile_trajectory_stats_t stats;
+static uint64_t jitter_sum = 0;
+
+static void stats_reset()
+{
+  memset(&stats, 0, sizeof(stats));
+  stats.jitter_min = 0xFFFFFFFF;
+  jitter_sum = 0;
+}
+
+static int trajectory_thread(SceSize args, void *argp)
+{
+  ksceDebugPrintf("trajectory thread started\n");
+
+  while (running)
+  {
+    ksceKernelLockMutex(traj_mtx, 1, NULL);
+
+    if (head == tail)
+    {
+      ksceKernelUnlockMutex(traj_mtx, 1);
+      // underrun, sleep until something is appended or we're stopped
+      ksceKernelWaitEventFlag(traj_ev, TRAJECTORY_EV_WAKE, SCE_EVENT_WAITCLEAR_PAT | SCE_EVENT_WAITOR, NULL, NULL);
+      continue;
+    }
+
+    vile_setpoint_t point = points[head & TRAJECTORY_MASK];
+    ksceKernelUnlockMutex(traj_mtx, 1);
+
+    SceInt64 due = epoch + point.time;
+    SceInt64 now = ksceKernelGetSystemTimeWide();
+
+    if (now < due)
+    {
+      SceUInt timeout = (SceUInt)(due - now);
+      ksceKernelWaitEventFlag(traj_ev, TRAJECTORY_EV_WAKE, SCE_EVENT_WAITCLEAR_PAT | SCE_EVENT_WAITOR, NULL, &timeout);
+      // woken up early (stop or append) or timed out, re-check either way
+      continue;
+    }
+
+    // noreply: we only care about the packet leaving on time
+    int ret = nxt_set_output_state(&point.state, 0);
+    now = ksceKernelGetSystemTimeWide();
+
+    uint32_t jitter = (uint32_t)(now - due);
+
+    ksceKernelLockMutex(traj_mtx, 1, NULL);
+    head++;
+    if (ret < 0)
+    {
+      stats.failed++;
+    }
+    else
+    {
+      stats.emitted++;
+      if (jitter > TRAJECTORY_LATE)
+        stats.late++;
+      if (jitter < stats.jitter_min)
+        stats.jitter_min = jitter;
+      if (jitter > stats.jitter_max)
+        stats.jitter_max = jitter;
+      stats.jitter_last = jitter;
+      jitter_sum += jitter;
+    }
+    ksceKernelUnlockMutex(traj_mtx, 1);
+  }
+
+  ksceDebugPrintf("trajectory thread stopped\n");
+  return 0;
+}
+
+static void trajectory_stop()
+{
+  if (traj_thid < 0)
+    return;
+
+  running = 0;
+  ksceKernelSetEventFlag(traj_ev, TRAJECTORY_EV_WAKE);
+  ksceKernelWaitThreadEnd(traj_thid, NULL, NULL);
+  ksceKernelDeleteThread(traj_thid);
+  traj_thid = -1;
+
+  ksceKernelLockMutex(traj_mtx, 1, NULL);
+  head = tail = 0;
+  last_time = 0;
+  ksceKernelUnlockMutex(traj_mtx, 1);
+}
+
+int trajectory_init()
+{
+  traj_mtx = ksceKernelCreateMutex("vile_trajectory", 0, 0, NULL);
+  traj_ev = ksceKernelCreateEventFlag("vile_trajectory", 0, 0, NULL);
+  stats_reset();
+  return (traj_mtx < 0 || traj_ev < 0) ? -1 : 0;
+}
+
+void trajectory_shutdown()
+{
+  trajectory_stop();
+}
+
+/*
+ *  PUBLIC COMMANDS
+ */
+
+int vileAppendTrajectory(const vile_setpoint_t *upoints, const unsigned int count)
+{
+  uint32_t state;
+  ENTER_SYSCALL(state);
+
+  vile_setpoint_t chunk[16];
+  unsigned int appended = 0;
+  int valid = 1;
+
+  ksceKernelLockMutex(traj_mtx, 1, NULL);
+
+  while (valid && appended < count && (tail - head) < TRAJECTORY_SIZE)
+  {
+    unsigned int n = count - appended;
+    if (n > 16)
+      n = 16;
+    if (n > TRAJECTORY_SIZE - (tail - head))
+      n = TRAJECTORY_SIZE - (tail - head);
+
+    ksceKernelMemcpyUserToKernel(chunk, &upoints[appended], n * sizeof(vile_setpoint_t));
+
+    for (unsigned int i = 0; i < n; i++)
+    {
+      // setpoints must come in time order, the executor only looks at the head
+      // and only drive motors nobody else claimed
+      if (chunk[i].time < last_time || session_check_motor(chunk[i].state.port) < 0)
+      {
+        valid = 0;
+        break;
+      }
+      last_time = chunk[i].time;
+      points[tail & TRAJECTORY_MASK] = chunk[i];
+      tail++;
+      appended++;
+    }
+  }
+
+  ksceKernelUnlockMutex(traj_mtx, 1);
+
+  if (appended)
+    ksceKernelSetEventFlag(traj_ev, TRAJECTORY_EV_WAKE);
+
+  EXIT_SYSCALL(state);
+
+  if (!appended && !valid)
+    return -1;
+
+  return appended;
+}
+
+int vileStartTrajectory()
+{
+  uint32_t state;
+  ENTER_SYSCALL(state);
+
+  if (traj_thid >= 0)
+  {
+    EXIT_SYSCALL(state);
+    return -1;
+  }
+
+  ksceKernelLockMutex(traj_mtx, 1, NULL);
+  stats_reset();
+  ksceKernelUnlockMutex(traj_mtx, 1);
+
+  traj_thid = ksceKernelCreateThread("vile_trajectory", trajectory_thread, 0x3C, 0x1000, 0, 0x10000, NULL);
+  if (traj_thid < 0)
+  {
+    EXIT_SYSCALL(state);
+    return -1;
+  }
+
+  ksceKernelClearEventFlag(traj_ev, ~TRAJECTORY_EV_WAKE);
+  epoch = ksceKernelGetSystemTimeWide();
+  running = 1;
+  ksceKernelStartThread(traj_thid, 0, NULL);
+
+  EXIT_SYSCALL(state);
+  return 0;
+}
+
+int vileStopTrajectory()
+{
+  uint32_t state;
+  ENTER_SYSCALL(state);
+
+  trajectory_stop();
+
+  EXIT_SYSCALL(state);
+  return 0;
+}
+
+int vileGetTrajectoryStats(vile_trajectory_stats_t *ustats)
+{
+  uint32_t state;
+  ENTER_SYSCALL(state);
+
+  vile_trajectory_stats_t kstats;
+
+  ksceKernelLockMutex(traj_mtx, 1, NULL);
+  kstats = stats;
+  kstats.running = running;
+  kstats.queued = tail - head;
+  if (!kstats.emitted)
+    kstats.jitter_min = 0;
+  else
+    kstats.jitter_avg = (uint32_t)(jitter_sum / kstats.emitted);
+  ksceKernelUnlockMutex(traj_mtx, 1);
+
+  ksceKernelMemcpyKernelToUser(ustats, &kstats, sizeof(vile_trajectory_stats_t));
+
+  EXIT_SYSCALL(state);
+  return 0;
+}
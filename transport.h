@@ -0,0 +1,68 @@
+/**
+        libvile
+        Copyright (C) 2022 Cat (Ivan Epifanov)
+
+        This program is free software: you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        This program is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+ * The link to the brick. main.c only talks to the current transport:
+ * usbd on the Vita, libusb or a simulator socket on a Linux host.
+ * All calls except start/stop happen with the bus locked, see nxt_lock().
+ */
+
+#ifndef __TRANSPORT_H__
+#define __TRANSPORT_H__
+
+#include <stdint.h>
+
+enum {
+  NXT_TRANSPORT_OUT = 0x01,
+  NXT_TRANSPORT_IN = 0x02
+};
+
+// same shape as ksceUsbdDoneCallback, count is bytes transferred
+typedef void (*nxt_transport_done_t)(int32_t result, int32_t count, void *arg);
+
+typedef struct {
+  const char *name;
+  int (*start)(); // begin looking for a brick
+  void (*stop)();
+  int (*connected)();
+  // blocking, return bytes transferred or < 0
+  int (*send)(const unsigned char *data, unsigned int length);
+  int (*recv)(unsigned char *data, unsigned int length);
+  // queue one transfer, done may run before submit returns; < 0 if not queued
+  int (*submit)(uint8_t dir, unsigned char *data, unsigned int length, nxt_transport_done_t done, void *arg);
+  // fail whatever send/recv is waiting, used when the brick goes away
+  void (*cancel)();
+  // a SAM-BA bootloader is attached in place of a brick, send/recv talk
+  // to it and connected() is 0; may be NULL
+  int (*bootloader)();
+} nxt_transport_t;
+
+// transport_usbd.c
+
+extern const nxt_transport_t transport_usbd;
+int transport_usbd_init();
+
+// restore.c, transports report the brick appearing (or the system
+// resuming) and going away
+void restore_attached();
+void restore_detached();
+
+// main.c, only while stopped
+int nxt_set_transport(const nxt_transport_t *transport);
+
+#endif // __TRANSPORT_H__
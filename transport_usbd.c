@@ -0,0 +1,313 @@
+/**
+        libvile
+        Copyright (C) 2022 Cat (Ivan Epifanov)
+
+        This program is free software: you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        This program is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <psp2kern/kernel/debug.h>
+#include <psp2kern/kernel/suspend.h>
+#include <psp2kern/kernel/threadmgr.h>
+#include <psp2kern/usbd.h>
+#include <psp2kern/usbserv.h>
+#include "transport.h"
+
+const int NXT_USB_ID_VENDOR_LEGO = 0x0694;
+const int NXT_USB_ID_PRODUCT_NXT = 0x0002;
+// the brick after SYS_BOOT, or with no firmware
+const int NXT_USB_ID_VENDOR_ATMEL = 0x03EB;
+const int NXT_USB_ID_PRODUCT_SAMBA = 0x6124;
+const int NXT_USB_ENDPOINT_OUT = 0x01; //1
+const int NXT_USB_ENDPOINT_IN = 0x82; //130
+const int NXT_USB_TIMEOUT = 1000;
+const int NXT_USB_READSIZE = 64;
+const int NXT_USB_INTERFACE = 0;
+
+#define EV_SEND 1
+#define EV_RECV 2
+#define EV_CONFIG 4
+
+SceUID transfer_ev;
+SceUID out_pipe_id = 0;
+SceUID in_pipe_id = 0;
+
+static uint8_t started = 0;
+static uint8_t plugged = 0;
+static uint8_t samba = 0;
+static volatile uint8_t cancelled = 0;
+
+// per direction, the transfer usbd_wait is waiting for; a completion
+// carries its generation in the callback arg, an older one is ignored
+typedef struct {
+  volatile uint32_t generation;
+  volatile int count;
+} usbd_wait_t;
+
+static usbd_wait_t wait_out;
+static usbd_wait_t wait_in;
+
+int vile_probe(int device_id);
+int vile_attach(int device_id);
+int vile_detach(int device_id);
+
+static const SceUsbdDriver vileDriver = {
+  .name = "vile",
+  .probe = vile_probe,
+  .attach = vile_attach,
+  .detach = vile_detach,
+};
+
+static int vile_sysevent_handler(int resume, int eventid, void *args, void *opt)
+{
+  if (resume && started)
+  {
+    ksceUsbServMacSelect(2, 0); // re-set host mode
+    restore_attached(); // the brick may have lost its input modes
+  }
+  return 0;
+}
+
+static int is_nxt(const SceUsbdDeviceDescriptor *device)
+{
+  return device->idVendor == NXT_USB_ID_VENDOR_LEGO && device->idProduct == NXT_USB_ID_PRODUCT_NXT;
+}
+
+static int is_samba(const SceUsbdDeviceDescriptor *device)
+{
+  return device->idVendor == NXT_USB_ID_VENDOR_ATMEL && device->idProduct == NXT_USB_ID_PRODUCT_SAMBA;
+}
+
+static void set_config_done(int32_t result, int32_t count, void *arg)
+{
+  ksceDebugPrintf("config cb result: %08x, count: %d\n", result, count);
+  ksceKernelSetEventFlag(transfer_ev, EV_CONFIG);
+}
+
+int vile_probe(int device_id)
+{
+  SceUsbdDeviceDescriptor *device;
+  ksceDebugPrintf("probing device: %x\n", device_id);
+  device = (SceUsbdDeviceDescriptor*)ksceUsbdScanStaticDescriptor(device_id, 0, SCE_USBD_DESCRIPTOR_DEVICE);
+  if (device)
+  {
+    ksceDebugPrintf("vendor: %04x\n", device->idVendor);
+    ksceDebugPrintf("product: %04x\n", device->idProduct);
+    if (is_nxt(device))
+    {
+      ksceDebugPrintf("found NXT brick\n");
+      return 0;
+    }
+    if (is_samba(device))
+    {
+      ksceDebugPrintf("found NXT in SAM-BA\n");
+      return 0;
+    }
+  }
+
+  return -1;
+}
+
+int vile_attach(int device_id)
+{
+  ksceDebugPrintf("attaching device: %x\n", device_id);
+  SceUsbdDeviceDescriptor *device;
+  device = (SceUsbdDeviceDescriptor*)ksceUsbdScanStaticDescriptor(device_id, 0, SCE_USBD_DESCRIPTOR_DEVICE);
+  if (device && (is_nxt(device) || is_samba(device)))
+  {
+    uint8_t boot = is_samba(device);
+
+    SceUsbdConfigurationDescriptor *cdesc;
+    if ((cdesc = (SceUsbdConfigurationDescriptor *)ksceUsbdScanStaticDescriptor(device_id, NULL, SCE_USBD_DESCRIPTOR_CONFIGURATION)) == NULL)
+      return SCE_USBD_ATTACH_FAILED;
+
+    // SAM-BA is a CDC device, its bulk endpoints are the brick's
+    if (cdesc->bNumInterfaces != (boot ? 2 : 1))
+      return SCE_USBD_ATTACH_FAILED;
+
+
+    SceUsbdEndpointDescriptor *endpoint;
+    ksceDebugPrintf("scanning endpoints\n");
+    endpoint = (SceUsbdEndpointDescriptor*)ksceUsbdScanStaticDescriptor(device_id, device, SCE_USBD_DESCRIPTOR_ENDPOINT);
+    while (endpoint)
+    {
+      ksceDebugPrintf("got EP: %02x\n", endpoint->bEndpointAddress);
+      if (endpoint->bEndpointAddress == NXT_USB_ENDPOINT_IN)
+      {
+        ksceDebugPrintf("opening in pipe\n");
+        in_pipe_id = ksceUsbdOpenPipe(device_id, endpoint);
+        ksceDebugPrintf("= 0x%08x\n", in_pipe_id);
+      }
+      else if (endpoint->bEndpointAddress == NXT_USB_ENDPOINT_OUT)
+      {
+        ksceDebugPrintf("opening out pipe\n");
+        out_pipe_id = ksceUsbdOpenPipe(device_id, endpoint);
+        ksceDebugPrintf("= 0x%08x\n", out_pipe_id);
+      }
+      endpoint = (SceUsbdEndpointDescriptor*)ksceUsbdScanStaticDescriptor(device_id, endpoint, SCE_USBD_DESCRIPTOR_ENDPOINT);
+    }
+
+    SceUID control_pipe_id = ksceUsbdOpenPipe(device_id, NULL);
+    ksceUsbdSetConfiguration(control_pipe_id, cdesc->bConfigurationValue, set_config_done, NULL);
+    unsigned int matched;
+    ksceDebugPrintf("waiting ef (cfg)\n");
+    ksceKernelWaitEventFlag(transfer_ev, EV_CONFIG, SCE_EVENT_WAITCLEAR_PAT | SCE_EVENT_WAITAND, &matched, 0);
+
+    if (out_pipe_id > 0 && in_pipe_id > 0)
+    {
+      cancelled = 0;
+      if (boot)
+      {
+        samba = 1;
+        return 0;
+      }
+      plugged = 1;
+      restore_attached();
+      return 0;
+    }
+  }
+  return -1;
+}
+
+int vile_detach(int device_id)
+{
+  in_pipe_id = 0;
+  out_pipe_id = 0;
+  if (plugged)
+    restore_detached();
+  plugged = 0;
+  samba = 0;
+  transport_usbd.cancel();
+  return -1;
+}
+
+static void usbd_callback_send(int32_t result, int32_t count, void* arg)
+{
+  ksceDebugPrintf("send cb result: %08x, count: %d\n", result, count);
+  if ((uint32_t)(uintptr_t)arg != wait_out.generation)
+    return;
+  wait_out.count = count;
+  ksceKernelSetEventFlag(transfer_ev, EV_SEND);
+}
+
+static void usbd_callback_recv(int32_t result, int32_t count, void* arg)
+{
+//  ksceDebugPrintf("recv cb result: %08x, count: %d\n", result, count);
+  if ((uint32_t)(uintptr_t)arg != wait_in.generation)
+    return;
+  wait_in.count = count;
+  ksceKernelSetEventFlag(transfer_ev, EV_RECV);
+}
+
+static int usbd_start()
+{
+  started = 1;
+  int ret = ksceUsbServMacSelect(2, 0);
+  ksceDebugPrintf("MAC select = 0x%08x\n", ret);
+  ret = ksceUsbdRegisterDriver(&vileDriver);
+  ksceDebugPrintf("ksceUsbdRegisterDriver = 0x%08x\n", ret);
+  return ret;
+}
+
+static void usbd_stop()
+{
+  started = 0;
+  plugged = 0;
+  samba = 0;
+  if (in_pipe_id) ksceUsbdClosePipe(in_pipe_id);
+  if (out_pipe_id) ksceUsbdClosePipe(out_pipe_id);
+  ksceUsbdUnregisterDriver(&vileDriver);
+  ksceUsbServMacSelect(2, 1);
+  // TODO: restore udcd?
+}
+
+static int usbd_connected()
+{
+  return plugged;
+}
+
+static int usbd_bootloader()
+{
+  return samba;
+}
+
+static int usbd_submit(uint8_t dir, unsigned char *data, unsigned int length, nxt_transport_done_t done, void *arg)
+{
+  SceUID pipe = (dir == NXT_TRANSPORT_IN) ? in_pipe_id : out_pipe_id;
+  if (!pipe)
+    return -1;
+  return ksceUsbdBulkTransfer(pipe, data, length, done, arg);
+}
+
+// submit and sleep until the callback fires or the transfer is cancelled
+static int usbd_wait(uint8_t dir, unsigned char *data, unsigned int length)
+{
+  usbd_wait_t *w = (dir == NXT_TRANSPORT_IN) ? &wait_in : &wait_out;
+  unsigned int bit = (dir == NXT_TRANSPORT_IN) ? EV_RECV : EV_SEND;
+
+  if (cancelled)
+    return -1;
+
+  // from here on a cancelled transfer's completion doesn't match, so it
+  // can't set the bit after it is cleared
+  uint32_t generation = ++w->generation;
+  w->count = 0;
+  ksceKernelClearEventFlag(transfer_ev, ~bit);
+
+  int ret = usbd_submit(dir, data, length, (dir == NXT_TRANSPORT_IN) ? usbd_callback_recv : usbd_callback_send, (void *)(uintptr_t)generation);
+  if (ret < 0)
+    return ret;
+
+  unsigned int matched;
+  ksceKernelWaitEventFlag(transfer_ev, bit, SCE_EVENT_WAITCLEAR_PAT | SCE_EVENT_WAITAND, &matched, 0);
+
+  return cancelled ? -1 : w->count;
+}
+
+static int usbd_send(const unsigned char *data, unsigned int length)
+{
+  return usbd_wait(NXT_TRANSPORT_OUT, (unsigned char *)data, length);
+}
+
+static int usbd_recv(unsigned char *data, unsigned int length)
+{
+  return usbd_wait(NXT_TRANSPORT_IN, data, length);
+}
+
+// usbd has no way to abort a bulk transfer, so waiters are released and
+// the late completion finds its generation gone and is dropped
+static void usbd_cancel()
+{
+  cancelled = 1;
+  ksceKernelSetEventFlag(transfer_ev, EV_SEND | EV_RECV);
+}
+
+const nxt_transport_t transport_usbd = {
+  .name = "usbd",
+  .start = usbd_start,
+  .stop = usbd_stop,
+  .connected = usbd_connected,
+  .send = usbd_send,
+  .recv = usbd_recv,
+  .submit = usbd_submit,
+  .cancel = usbd_cancel,
+  .bootloader = usbd_bootloader
+};
+
+int transport_usbd_init()
+{
+  ksceKernelRegisterSysEventHandler("zvile_sysevent", vile_sysevent_handler, NULL);
+  transfer_ev = ksceKernelCreateEventFlag("vile_transfer", 0, 0, NULL);
+  ksceDebugPrintf("ef: 0x%08x\n", transfer_ev);
+  return (transfer_ev < 0) ? -1 : 0;
+}
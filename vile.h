@@ -168,6 +168,19 @@ int vileStop();
 
 int vileHasNxt();
 
+// where transfer time goes, usec totals since vileStart
+typedef struct {
+  uint32_t transfers;
+  uint32_t errors;
+  uint64_t wait_us; // waiting for the bus
+  uint64_t transport_us; // inside the transport, device turnaround included
+  uint64_t protocol_us; // driver side handling around it
+  uint32_t transport_max_us;
+  uint32_t protocol_max_us;
+} vile_transport_stats_t;
+
+int vileGetTransportStats(vile_transport_stats_t *stats);
+
 int vileStartProgram(const char *filename);
 int vileStopProgram();
 int vileGetCurrentProgramName(char* filename);
@@ -186,6 +199,10 @@ typedef struct {
 } vile_setoutputstate_t;
 
 int vileSetOutputState(const vile_setoutputstate_t* outstate);
+// two-motor base: speed -100..100, turn -100..100 toward the right wheel
+// (50 stops it, 100 spins in place), 0 speed brakes; both motors are
+// regulated as a pair by the brick
+int vileDrive(const vile_out_t left, const vile_out_t right, const int8_t speed, const int8_t turn);
 int vileGetOutputState(const vile_out_t port, vile_outputstate_t *out);
 
 int vileSetInputMode(
@@ -205,6 +222,647 @@ int vileResetMotorPosition(const vile_out_t port, const uint8_t relative);
 
 int vileGetBatteryLevel();
 
+// read combining: vileGetInputValues and vileGetOutputState for a port
+// that already has the same read in flight share its reply; with a
+// freshness window a reply that came back at most that long ago is
+// handed out again without a round trip
+
+typedef struct {
+  uint32_t reads;
+  uint32_t issued; // round trips
+  uint32_t joined; // reads that shared one in flight
+  uint32_t fresh; // reads answered inside the freshness window
+  uint32_t freshness; // usec
+} vile_combine_stats_t;
+
+int vileSetReadFreshness(const uint32_t usec); // 0, the default, only shares reads in flight
+int vileGetCombineStats(vile_combine_stats_t *stats);
+
+// bus priority classes, the most urgent waiting class gets the bus next
+
+typedef enum __attribute__ ((__packed__)) {
+  VILE_PRIORITY_DEFAULT = 0x00, // by opcode: stops are safety, reads telemetry, system commands bulk
+  VILE_PRIORITY_SAFETY = 0x01,
+  VILE_PRIORITY_CONTROL = 0x02,
+  VILE_PRIORITY_TELEMETRY = 0x03,
+  VILE_PRIORITY_BULK = 0x04
+} vile_priority_t;
+
+#define VILE_PRIORITY_CLASSES 4
+
+typedef struct {
+  // indexed by priority - 1
+  uint32_t acquired[VILE_PRIORITY_CLASSES];
+  uint32_t wait_max[VILE_PRIORITY_CLASSES]; // usec queued for the bus
+  uint32_t wait_avg[VILE_PRIORITY_CLASSES];
+  uint32_t yields; // batches that stepped aside for a more urgent class
+} vile_priority_stats_t;
+
+int vileGetPriorityStats(vile_priority_stats_t *stats);
+
+// sessions: every process calling vileStart gets one, and within a
+// priority class the bus is shared between them by weight
+
+#define VILE_SESSIONS_MAX 8
+
+typedef struct {
+  uint32_t pid; // 0 is the driver's own threads
+  uint32_t weight;
+  uint32_t claims; // VILE_MOTOR() mask
+  uint32_t acquired;
+  uint64_t bus_us; // time holding the bus
+  uint32_t share; // permille of all bus time
+  uint32_t wait_avg; // usec queued for the bus
+  uint32_t wait_max;
+} vile_session_stats_t;
+
+int vileSetSessionWeight(const uint32_t weight); // 1..100, default 10
+// motors only the claiming process may drive, fails if another one has any of them
+int vileClaimMotors(const uint8_t ports);
+int vileReleaseMotors(const uint8_t ports);
+// fills up to max entries, returns how many
+int vileGetSessionStats(vile_session_stats_t *stats, const unsigned int max);
+
+// raw packets sent back to back while holding the bus, see vile.hpp for a typed interface
+
+#define VILE_BATCH_MAX 16
+
+typedef struct {
+  int16_t result; // out: reply bytes, 0 when the packet asks for no reply, < 0 on error
+  uint8_t length; // in: request bytes
+  vile_priority_t priority; // in: used from the first packet of a batch
+  uint8_t data[64]; // in: request, out: reply
+} vile_packet_t;
+
+// returns packets completed, stops at the first failure
+int vileBatch(vile_packet_t *packets, const unsigned int count);
+
+// adaptive pacing: the gap between commands doubles when replies slow down
+// or the brick runs out of buffers, and shrinks again while they are quick
+
+#define VILE_PACING_BUCKETS 16
+
+typedef struct {
+  uint32_t enabled;
+  uint32_t gap; // usec kept between commands, 0 is unpaced
+  uint32_t rate; // commands per second allowed by gap, 0 is unlimited
+  uint32_t baseline; // usec, fastest recent reply
+  uint32_t latency_avg; // usec, transport time of replied commands
+  uint32_t replies;
+  uint32_t congestion; // times the gap was increased
+  uint32_t brick_errors; // COMMUNICATION_ERROR and NO_BUFFER replies
+  uint32_t paced; // commands held back
+  uint64_t delay_us; // total time held back
+  // reply latency, bucket 0 is < 256usec, bucket n < 256 << n, last open-ended
+  uint32_t latency_hist[VILE_PACING_BUCKETS];
+} vile_pacing_stats_t;
+
+int vileSetPacing(const uint8_t enable); // also resets pacing state and stats
+int vileGetPacingStats(vile_pacing_stats_t *stats);
+
+// blocking waits on a sensor's scaled value, polled in the kernel and
+// shared by everybody waiting on the same port
+
+typedef enum __attribute__ ((__packed__)) {
+  VILE_INPUT_EQUALS = 0x00, // value == threshold, may be met right away
+  VILE_INPUT_ABOVE = 0x01, // goes from <= threshold to > threshold
+  VILE_INPUT_BELOW = 0x02, // goes from >= threshold to < threshold
+  VILE_INPUT_CHANGED = 0x03 // moved by threshold or more since the wait began
+} vile_input_condition_t;
+
+// timeout in usec, 0 waits forever; out gets the sample that met the
+// condition and may be NULL; returns 0, or -1 on timeout
+int vileWaitInput(
+  const vile_in_t port,
+  const vile_input_condition_t condition,
+  const int16_t threshold,
+  const uint32_t timeout,
+  vile_inputstate_t *out
+);
+
+// blocking wait for motors to go idle, e.g. at the end of a tacho_limit move
+
+#define VILE_MOTOR(port) (1 << (port)) // for the ports mask
+
+typedef struct {
+  int32_t tacho_count;
+  int32_t block_tacho_count;
+  int32_t rotation_count;
+} vile_motor_counts_t;
+
+// timeout in usec, 0 waits forever; counts, if not NULL, is indexed by
+// port and gets the counters each motor stopped at; returns 0, or -1 on timeout
+int vileWaitMotorIdle(const uint8_t ports, const uint32_t timeout, vile_motor_counts_t *counts);
+
+// adaptive sampling: a budget of GET_INPUTVALUES/GET_OUTPUTSTATE reads per
+// second shared between the subscribed signals by how fast each changed
+// lately, every signal kept between its own min and max rate
+
+#define VILE_SAMPLING_SIGNALS 7
+
+typedef enum __attribute__ ((__packed__)) {
+  VILE_SIGNAL_INPUT = 0x00, // a sensor's scaled value
+  VILE_SIGNAL_OUTPUT = 0x01 // a motor's tacho count
+} vile_signal_kind_t;
+
+typedef struct {
+  vile_signal_kind_t kind;
+  uint8_t port; // vile_in_t or vile_out_t
+  uint16_t min_rate; // reads per second, at least 1
+  uint16_t max_rate;
+  uint16_t deadband; // smaller changes don't count, also the unit of change; 0 is 1
+} vile_signal_t;
+
+typedef struct {
+  uint32_t budget; // reads per second for all signals together
+  uint32_t count;
+  vile_signal_t signal[VILE_SAMPLING_SIGNALS];
+} vile_sampling_t;
+
+typedef struct {
+  uint64_t timestamp; // usec, system time of the read
+  uint32_t sequence; // reads of the signal so far, 0 is none yet
+  vile_inputstate_t input; // whichever the signal's kind is
+  vile_outputstate_t output;
+} vile_sample_t;
+
+typedef struct {
+  uint32_t allocated; // reads per second from the last allocation
+  uint32_t rate; // reads during the last full second
+  uint32_t activity; // change per second, smoothed
+  uint32_t reads;
+  uint32_t failed;
+  uint32_t age; // usec since the last good read
+} vile_signal_stats_t;
+
+typedef struct {
+  uint32_t running;
+  uint32_t budget;
+  uint32_t usable; // the budget, or fewer reads when the bus can't keep up
+  uint32_t rate; // all reads during the last full second
+  uint32_t read_avg; // usec per read, queueing for the bus included
+  uint32_t allocations;
+  uint32_t count;
+  vile_signal_stats_t signal[VILE_SAMPLING_SIGNALS];
+} vile_sampling_stats_t;
+
+int vileStartSampling(const vile_sampling_t *sampling);
+int vileStopSampling();
+// latest read of signal index, in the order given to vileStartSampling
+int vileGetSample(const unsigned int index, vile_sample_t *sample);
+int vileGetSamplingStats(vile_sampling_stats_t *stats);
+
+// state restore after resume or reattach: input modes and motor states are
+// sent again, vileWaitReady returns once the brick has them
+
+typedef struct {
+  uint32_t ready;
+  uint32_t generation; // bumped every time the brick becomes ready
+  uint32_t restored; // packets sent again
+  uint32_t failures;
+  uint32_t last_us; // attach or resume to ready
+  uint32_t max_us;
+} vile_restore_stats_t;
+
+// timeout in usec, 0 waits forever; returns the generation or -1, also
+// right away once restoring the attached brick failed for good
+int vileWaitReady(const uint32_t timeout);
+int vileGetRestoreStats(vile_restore_stats_t *stats);
+
+// melodies played by the driver, each tone sent on time as a no-reply
+// PLAYTONE; vileStopSound stops the melody too
+
+#define VILE_MELODY_MAX 256
+
+typedef struct {
+  uint16_t frequency; // Hz, 0 is a rest
+  uint16_t duration; // ms
+  uint16_t gap; // ms of silence after the note
+} vile_note_t;
+
+typedef struct {
+  uint32_t playing;
+  uint32_t position; // next note
+  uint32_t passes; // times the end was reached
+  uint32_t played;
+  uint32_t failed;
+  uint32_t late; // started more than 1ms after its time
+  uint32_t jitter_min; // usec
+  uint32_t jitter_max;
+  uint32_t jitter_avg;
+  uint32_t jitter_last;
+} vile_melody_stats_t;
+
+// replaces the melody playing, if any; loop repeats it until stopped and
+// needs some duration or gap. Every note takes at least 1 ms
+int vilePlayMelody(const vile_note_t *notes, const unsigned int count, const uint8_t loop);
+int vileStopMelody();
+int vileGetMelodyStats(vile_melody_stats_t *stats);
+
+// files on the brick
+
+typedef struct {
+  uint32_t uploads;
+  uint32_t failures;
+  uint64_t bytes;
+  uint32_t writes; // WRITE packets
+  uint32_t windows; // writes that waited for a reply
+  uint32_t yields; // times the bus went to a more urgent command mid-upload
+  uint32_t retries; // uploads redone with a reply to every write
+  uint32_t last_us;
+  uint32_t last_rate; // bytes/s
+} vile_upload_stats_t;
+
+// replaces the file if it exists; returns bytes written or -1,
+// see vilerso.h for sounds
+int vileUploadFile(const char *filename, const void *data, const uint32_t size);
+int vileGetUploadStats(vile_upload_stats_t *stats);
+
+// deploy: only what changed is uploaded. The driver remembers name, size
+// and content hash of every file it deployed, per brick (by bluetooth
+// address), for as long as it is loaded; a file is sent again unless that
+// matches and the brick still lists it with the same size
+
+#define VILE_DEPLOY_MAX 32 // files in one deploy
+
+typedef struct {
+  char name[20];
+  const void *data;
+  uint32_t size;
+} vile_deploy_file_t;
+
+typedef struct {
+  uint32_t deploys;
+  uint32_t failures;
+  uint32_t uploaded; // files
+  uint32_t skipped;
+  uint64_t bytes_uploaded;
+  uint64_t bytes_skipped;
+  uint32_t bricks; // bricks with a manifest
+  uint32_t last_listed; // files the brick listed
+  uint32_t last_list_us; // device info and listing
+  uint32_t last_hash_us;
+  uint32_t last_us; // the whole deploy
+} vile_deploy_stats_t;
+
+// program, if not NULL, is started afterwards; returns files uploaded or -1
+int vileDeploy(const vile_deploy_file_t *files, const unsigned int count, const char *program);
+int vileGetDeployStats(vile_deploy_stats_t *stats);
+// manifests across reboots, saving overwrites path
+int vileSaveDeployManifests(const char *path);
+int vileLoadDeployManifests(const char *path);
+
+// firmware module IOMaps, any size, split into packets by the driver;
+// writes to Output module ports another process claimed are refused
+
+int vileReadIOMap(const uint32_t module, const uint16_t offset, const uint16_t size, void *data);
+int vileWriteIOMap(const uint32_t module, const uint16_t offset, const uint16_t size, const void *data);
+
+// sensors and motors from the Input and Output module IOMaps, a few large
+// reads in place of one GET_INPUTVALUES/GET_OUTPUTSTATE per port; fields
+// are filled as those commands would (calibrated is always 0)
+
+typedef struct {
+  uint8_t inputs; // ports to read, bit n is port NXT_IN_1 + n
+  uint8_t outputs; // bit n is NXT_OUT_A + n
+  struct {
+    vile_inputstate_t state;
+  } input[4];
+  struct {
+    vile_outputstate_t state;
+  } output[3];
+} vile_state_t;
+
+// reads the ports selected in state, returns reads it took or -1
+int vileGetState(vile_state_t *state);
+
+// screen mirror: the display frame buffer, 8 rows of 100 bytes, bit n of
+// a byte in row r is pixel line 8 * r + n
+
+#define VILE_SCREEN_WIDTH 100
+#define VILE_SCREEN_HEIGHT 64
+#define VILE_SCREEN_BYTES 800
+
+typedef struct {
+  uint32_t sequence; // only frames that changed get one
+  uint32_t reserved;
+  uint64_t timestamp; // usec, when it was read
+  uint8_t pixels[VILE_SCREEN_BYTES];
+} vile_screen_t;
+
+typedef struct {
+  uint32_t running;
+  uint32_t interval;
+  uint32_t reads;
+  uint32_t frames; // reads that differed from the last frame
+  uint32_t unchanged;
+  uint32_t failures;
+  uint32_t reads_per_s;
+  uint32_t frames_per_s;
+  uint32_t read_bytes; // on the wire per read, both directions
+  uint32_t read_avg; // usec per read
+  uint32_t read_max;
+} vile_screen_stats_t;
+
+// interval is usec between reads, 0 reads as fast as the bus allows;
+// called again it only changes the interval
+int vileStartScreenMirror(const uint32_t interval);
+int vileStopScreenMirror();
+// waits for a frame newer than sequence after, timeout 0 waits for good;
+// returns the frame's sequence or -1
+int vileGetScreenFrame(vile_screen_t *frame, const uint32_t after, const uint32_t timeout);
+int vileGetScreenStats(vile_screen_stats_t *stats);
+
+// poll buffers: bytes a program on the brick left for the host
+
+typedef enum __attribute__ ((__packed__)) {
+  NXT_POLL_USB = 0x00,
+  NXT_POLL_HIGHSPEED = 0x01
+} vile_pollbuf_t;
+
+#define VILE_POLL_MAX 59 // bytes per read
+
+// bytes waiting, or -1
+int vilePollLength(const vile_pollbuf_t buffer);
+// takes up to size bytes out of the buffer, returns how many or -1
+int vilePollRead(const vile_pollbuf_t buffer, void *data, const uint8_t size);
+
+// sensor stream: the helper program (nxc/vilestrm.nxc) samples every port
+// at a fixed rate into the usb poll buffer, the driver drains it into a
+// ring of timestamped frames
+
+#define VILE_STREAM_PROGRAM "vilestrm.rxe"
+#define VILE_STREAM_RING 1024
+
+typedef struct {
+  uint32_t sequence; // as the helper counted, gaps are frames it dropped
+  uint32_t tick; // brick msec when sampled
+  uint64_t timestamp; // usec, when the driver got it
+  int16_t value[4]; // scaled, indexed by input port
+  int32_t rotation[3]; // rotation counts, indexed by output port
+  uint32_t reserved;
+} vile_stream_frame_t;
+
+typedef struct {
+  uint32_t running;
+  uint32_t interval;
+  uint32_t polls;
+  uint32_t empty; // polls that found nothing
+  uint32_t failures;
+  uint32_t frames;
+  uint32_t lost; // dropped by the helper with the buffer full
+  uint32_t resyncs; // bytes skipped looking for a frame
+  uint64_t bytes;
+  uint32_t polls_per_s;
+  uint32_t frames_per_s;
+  uint32_t poll_avg; // usec per poll
+  uint32_t poll_max;
+} vile_stream_stats_t;
+
+// starts program first unless it is NULL, usually VILE_STREAM_PROGRAM;
+// interval is usec to wait once the buffer is drained, about the
+// helper's period
+int vileStartStream(const char *program, const uint32_t interval);
+// also stops the program vileStartStream started
+int vileStopStream();
+// up to count frames newer than sequence after, oldest first; waits for
+// one, timeout 0 waits for good; returns frames copied or -1
+int vileReadStream(vile_stream_frame_t *frames, const unsigned int count, const uint32_t after, const uint32_t timeout);
+int vileGetStreamStats(vile_stream_stats_t *stats);
+
+// firmware update: the brick reboots into its SAM-BA bootloader (or is
+// found there already), the image is written a page at a time, read back
+// and booted. The image stays loaded, one call per brick does a fleet.
+
+#define VILE_FLASH_PAGE 256
+#define VILE_FLASH_SIZE 0x40000
+
+typedef enum __attribute__ ((__packed__)) {
+  VILE_FLASH_IDLE = 0,
+  VILE_FLASH_REBOOTING, // waiting for SAM-BA to show up
+  VILE_FLASH_PREPARING, // unlocking, loading the page writer
+  VILE_FLASH_WRITING,
+  VILE_FLASH_VERIFYING,
+  VILE_FLASH_BOOTING, // waiting for the new firmware to answer
+  VILE_FLASH_DONE,
+  VILE_FLASH_FAILED
+} vile_flash_state_t;
+
+typedef struct {
+  uint32_t state; // vile_flash_state_t
+  uint32_t pages; // in the image
+  uint32_t written; // page writes, rewrites included
+  uint32_t verified; // pages read back
+  uint32_t rewritten; // pages that read back wrong and were written again
+  uint32_t round_trips; // commands that waited for an answer
+  uint32_t flashed; // bricks done with this image
+  uint32_t write_us;
+  uint32_t verify_us;
+  uint32_t total_us; // from the call until the new firmware answered
+  uint32_t write_rate; // bytes/s
+} vile_flash_stats_t;
+
+// image NULL flashes the next brick with the image already loaded;
+// returns 0 once started, follow it with vileGetFlashStats
+int vileFlashFirmware(const void *image, const uint32_t size);
+int vileGetFlashStats(vile_flash_stats_t *stats);
+
+// trajectory executor
+
+typedef struct {
+  uint32_t time; // usec since vileStartTrajectory
+  vile_setoutputstate_t state;
+} vile_setpoint_t;
+
+typedef struct {
+  uint32_t running;
+  uint32_t queued;
+  uint32_t emitted;
+  uint32_t failed;
+  uint32_t late; // emitted more than 1ms after its time
+  uint32_t jitter_min; // usec
+  uint32_t jitter_max;
+  uint32_t jitter_avg;
+  uint32_t jitter_last;
+} vile_trajectory_stats_t;
+
+int vileAppendTrajectory(const vile_setpoint_t *points, const unsigned int count);
+int vileStartTrajectory();
+int vileStopTrajectory();
+int vileGetTrajectoryStats(vile_trajectory_stats_t *stats);
+
+// closed-loop controller
+
+typedef enum __attribute__ ((__packed__)) {
+  VILE_SOURCE_SCALED = 0x00,
+  VILE_SOURCE_RAW = 0x01,
+  VILE_SOURCE_NORMALIZED = 0x02
+} vile_source_t;
+
+typedef struct {
+  vile_in_t in_port;
+  vile_source_t source;
+  vile_out_t out_port;
+  vile_motor_mode_t mode;
+  vile_motor_regulation_t regulation;
+  int8_t turn_ratio;
+  int8_t bias; // added to controller output, i.e. base power
+  int8_t min_power; // output clamp, both 0 means -100..100
+  int8_t max_power;
+  uint32_t period; // usec
+  int32_t setpoint;
+  int32_t kp; // gains are 16.16 fixed point, per iteration
+  int32_t ki;
+  int32_t kd;
+} vile_controller_t;
+
+typedef struct {
+  uint32_t running;
+  uint32_t iterations;
+  uint32_t failed;
+  uint32_t overruns; // iterations skipped because the previous one ran long
+  uint32_t rate; // iterations during the last full second
+  uint32_t jitter_max; // usec, iteration start vs schedule
+  uint32_t jitter_avg;
+  int32_t last_input;
+  int32_t last_error;
+  int32_t last_output;
+} vile_controller_stats_t;
+
+int vileStartController(const vile_controller_t *controller);
+int vileStopController();
+int vileSetControllerGains(const int32_t kp, const int32_t ki, const int32_t kd);
+int vileSetControllerSetpoint(const int32_t setpoint);
+int vileGetControllerStats(vile_controller_stats_t *stats);
+
+// odometry: both drive motors' rotation counts read back to back at a
+// steady rate and integrated into a pose in the kernel. Don't reset the
+// motors' rotation counts while it runs.
+
+typedef struct {
+  vile_out_t left;
+  vile_out_t right;
+  uint8_t reversed; // bit 0 left, bit 1 right: forward counts down
+  uint32_t wheel_diameter; // um
+  uint32_t track_width; // um, between the wheels
+  uint32_t period; // usec between updates
+} vile_odometry_t;
+
+typedef struct {
+  uint64_t timestamp; // usec, system time between the two reads
+  uint32_t sequence; // updates so far
+  int32_t x; // um
+  int32_t y;
+  uint32_t heading; // full turn is 2^32, counterclockwise from the x axis
+  int32_t speed; // um/s forward, over the last update
+  int32_t turn_rate; // millidegrees/s counterclockwise
+  int32_t left_count; // rotation counts the pose is from
+  int32_t right_count;
+} vile_pose_t;
+
+typedef struct {
+  uint32_t running;
+  uint32_t updates;
+  uint32_t failed;
+  uint32_t overruns; // updates skipped because the previous one ran long
+  uint32_t rate; // updates during the last full second
+  uint32_t read_max; // usec for both reads, queueing for the bus included
+  uint32_t read_avg;
+  uint32_t skew_avg; // usec between the two reads
+} vile_odometry_stats_t;
+
+int vileStartOdometry(const vile_odometry_t *odometry);
+int vileStopOdometry();
+int vileGetPose(vile_pose_t *pose);
+// moves the pose, sequence and counts carry on
+int vileSetPose(const int32_t x, const int32_t y, const uint32_t heading);
+int vileGetOdometryStats(vile_odometry_stats_t *stats);
+
+// reactive rules: a kernel thread reads the ports the rules watch every
+// period, back to back, and sends a rule's commands the moment a read meets
+// its condition, before it lets go of the bus. Conditions are the ones
+// vileWaitInput takes, on a sensor's scaled value or a motor's tacho count;
+// a rule fires each time its condition is met again
+
+#define VILE_RULES_MAX 16
+#define VILE_RULE_COMMANDS 4
+
+typedef struct {
+  uint8_t length; // 0 ends the list
+  uint8_t data[31]; // a direct command, always sent without a reply
+} vile_rule_command_t;
+
+typedef struct {
+  vile_signal_kind_t kind;
+  uint8_t port; // vile_in_t or vile_out_t
+  vile_input_condition_t condition;
+  uint8_t once; // disarm after firing
+  int32_t threshold;
+  vile_rule_command_t command[VILE_RULE_COMMANDS];
+} vile_rule_t;
+
+typedef struct {
+  uint32_t period; // usec between reads of the watched ports
+  uint32_t count;
+  vile_rule_t rule[VILE_RULES_MAX];
+} vile_rules_t;
+
+typedef struct {
+  uint32_t armed;
+  uint32_t fired;
+  int32_t value; // that fired it last
+  uint32_t react_us; // last firing, see below
+} vile_rule_stats_t;
+
+typedef struct {
+  uint32_t running;
+  uint32_t cycles; // reads of every watched port
+  uint32_t overruns; // cycles skipped because the previous one ran long
+  uint32_t failed; // reads and commands
+  uint32_t fired;
+  uint32_t rate; // cycles during the last full second
+  uint32_t react_avg; // usec from the read that met a condition starting to the last command sent
+  uint32_t react_max;
+  uint32_t window_max; // usec from the read before it, the change happened in between
+  uint32_t count;
+  vile_rule_stats_t rule[VILE_RULES_MAX];
+} vile_rules_stats_t;
+
+int vileStartRules(const vile_rules_t *rules);
+int vileStopRules();
+int vileGetRulesStats(vile_rules_stats_t *stats);
+
+// telemetry recorder, see telemetry.h for the file format
+
+typedef struct {
+  uint32_t period; // usec between samples
+  uint8_t inputs; // bitmask of vile_in_t ports to sample
+  uint8_t outputs; // bitmask of vile_out_t ports to sample
+  uint8_t commands; // also record issued commands
+  uint16_t keyframe; // samples between keyframes, 0 for default
+} vile_telemetry_t;
+
+typedef struct {
+  uint32_t running;
+  uint32_t samples;
+  uint32_t keyframes;
+  uint32_t commands;
+  uint32_t failed; // sample reads that failed
+  uint32_t dropped; // records lost because all blocks were waiting for storage
+  uint32_t blocks; // blocks written
+  uint32_t bytes; // encoded payload bytes
+} vile_telemetry_stats_t;
+
+int vileStartTelemetry(const char *path, const vile_telemetry_t *telemetry);
+int vileStopTelemetry();
+int vileGetTelemetryStats(vile_telemetry_stats_t *stats);
+
+// usb capture, see capture.h for the file format
+
+int vileStartCapture(const unsigned int count); // ring size in packets, 0 for default
+int vileStopCapture();
+int vileSaveCapture(const char *path);
+
 #ifdef __cplusplus
 }
 #endif
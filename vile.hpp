@@ -0,0 +1,447 @@
+/**
+        libvile
+        Copyright (C) 2022 Cat (Ivan Epifanov)
+
+        This program is free software: you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        This program is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Typed commands on top of vileBatch. Each command type carries its opcode,
+ * request layout and reply layout; sizes are checked at compile time, and
+ * a batch of commands lives in a fixed array on the caller's stack.
+ *
+ *   vile::batch<vile::set_output_state, vile::get_input_values> b(
+ *     vile::set_output_state(NXT_OUT_A, 75), vile::get_input_values(NXT_IN_1));
+ *   if (b.submit())
+ *     int v = b.reply<1>().scaled_value;
+ *
+ * Needs C++14.
+ */
+
+#ifndef __VILE_HPP__
+#define __VILE_HPP__
+
+#include <stddef.h>
+#include <string.h>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include "vile.h"
+
+namespace vile {
+
+enum : uint8_t {
+  direct_reply = 0x00,
+  system_reply = 0x01,
+  reply_type = 0x02,
+  direct_noreply = 0x80,
+  system_noreply = 0x81
+};
+
+// wire layouts, mirrors of nxt.h
+#pragma pack(push,1)
+
+struct header_t {
+  uint8_t type;
+  uint8_t opcode;
+};
+
+struct status_t {
+  uint8_t type;
+  uint8_t opcode;
+  uint8_t status;
+};
+
+struct battery_t {
+  uint8_t type;
+  uint8_t opcode;
+  uint8_t status;
+  uint16_t mv;
+};
+
+struct keepalive_t {
+  uint8_t type;
+  uint8_t opcode;
+  uint8_t status;
+  uint32_t msec;
+};
+
+struct program_name_t {
+  uint8_t type;
+  uint8_t opcode;
+  uint8_t status;
+  char filename[20];
+};
+
+#pragma pack(pop)
+
+static_assert(sizeof(header_t) == 2, "command header is 2 bytes");
+static_assert(sizeof(status_t) == 3, "status reply is 3 bytes");
+static_assert(sizeof(battery_t) == 5, "battery reply is 5 bytes");
+static_assert(sizeof(keepalive_t) == 7, "keep alive reply is 7 bytes");
+static_assert(sizeof(program_name_t) == 23, "program name reply is 23 bytes");
+static_assert(sizeof(vile_outputstate_t) == 25, "output state reply is 25 bytes");
+static_assert(sizeof(vile_inputstate_t) == 16, "input values reply is 16 bytes");
+static_assert(offsetof(vile_outputstate_t, tacho_count) == 13, "vile_outputstate_t layout");
+static_assert(offsetof(vile_inputstate_t, scaled_value) == 12, "vile_inputstate_t layout");
+static_assert(sizeof(vile_packet_t) == 68, "vile_packet_t layout");
+
+/*
+ * A command is a packed request whose first two bytes are the header,
+ * plus the reply layout it expects (void for none). Opcode, request size
+ * and reply size are all constants of the type.
+ */
+template <uint8_t Opcode, typename Request, typename Reply, uint8_t Type = direct_reply>
+struct command {
+  static constexpr uint8_t opcode = Opcode;
+  static constexpr uint8_t type = Type;
+  typedef Request request_type;
+  typedef Reply reply_t;
+  static constexpr bool has_reply = !std::is_void<Reply>::value;
+  static constexpr size_t request_size = sizeof(Request);
+
+  static_assert(std::is_trivially_copyable<Request>::value, "requests are copied as bytes");
+  static_assert(request_size >= 2 && request_size <= 64, "request must fit one packet");
+  static_assert(offsetof(Request, type) == 0 && offsetof(Request, opcode) == 1, "request must start with the header");
+
+  Request request;
+
+  command()
+  {
+    memset(&request, 0, sizeof(request));
+    request.type = Type;
+    request.opcode = Opcode;
+  }
+};
+
+template <typename Reply>
+struct reply_size {
+  static constexpr size_t value = sizeof(Reply);
+  static_assert(sizeof(Reply) <= 64, "reply must fit one packet");
+};
+
+template <>
+struct reply_size<void> {
+  static constexpr size_t value = 0;
+};
+
+#pragma pack(push,1)
+
+struct port_request_t {
+  uint8_t type;
+  uint8_t opcode;
+  uint8_t port;
+};
+
+struct output_request_t {
+  uint8_t type;
+  uint8_t opcode;
+  uint8_t port;
+  int8_t power;
+  uint8_t mode;
+  uint8_t regulation;
+  int8_t turn_ratio;
+  uint8_t run_state;
+  uint32_t tacho_limit;
+};
+
+struct input_request_t {
+  uint8_t type;
+  uint8_t opcode;
+  uint8_t port;
+  uint8_t stype;
+  uint8_t smode;
+};
+
+struct tone_request_t {
+  uint8_t type;
+  uint8_t opcode;
+  uint16_t freq;
+  uint16_t duration;
+};
+
+struct reset_request_t {
+  uint8_t type;
+  uint8_t opcode;
+  uint8_t port;
+  uint8_t relative;
+};
+
+struct program_request_t {
+  uint8_t type;
+  uint8_t opcode;
+  char filename[20];
+};
+
+struct sound_request_t {
+  uint8_t type;
+  uint8_t opcode;
+  uint8_t loop;
+  char filename[20];
+};
+
+#pragma pack(pop)
+
+static_assert(sizeof(output_request_t) == 12, "SetOutputState is 12 bytes");
+static_assert(sizeof(input_request_t) == 5, "SetInputMode is 5 bytes");
+static_assert(sizeof(tone_request_t) == 6, "PlayTone is 6 bytes");
+static_assert(sizeof(program_request_t) == 22, "StartProgram is 22 bytes");
+static_assert(sizeof(sound_request_t) == 23, "PlaySoundFile is 23 bytes");
+
+// commands
+
+struct start_program : command<0x00, program_request_t, status_t> {
+  explicit start_program(const char *filename)
+  {
+    strncpy(request.filename, filename, sizeof(request.filename) - 1);
+  }
+};
+
+struct stop_program : command<0x01, header_t, status_t> {};
+
+struct play_sound_file : command<0x02, sound_request_t, status_t> {
+  play_sound_file(const char *filename, bool loop)
+  {
+    request.loop = loop;
+    strncpy(request.filename, filename, sizeof(request.filename) - 1);
+  }
+};
+
+struct play_tone : command<0x03, tone_request_t, status_t> {
+  play_tone(uint16_t freq, uint16_t duration)
+  {
+    request.freq = freq;
+    request.duration = duration;
+  }
+};
+
+struct set_output_state : command<0x04, output_request_t, status_t> {
+  set_output_state(vile_out_t port, int8_t power,
+                   vile_motor_mode_t mode = NXT_MOTOR_MODE_ON,
+                   vile_motor_regulation_t regulation = NXT_MOTOR_REGULATION_IDLE,
+                   int8_t turn_ratio = 0,
+                   vile_motor_runstate_t run_state = NXT_MOTOR_RUNSTATE_RUNNING,
+                   uint32_t tacho_limit = 0)
+  {
+    request.port = port;
+    request.power = power;
+    request.mode = mode;
+    request.regulation = regulation;
+    request.turn_ratio = turn_ratio;
+    request.run_state = run_state;
+    request.tacho_limit = tacho_limit;
+  }
+
+  explicit set_output_state(const vile_setoutputstate_t &s)
+    : set_output_state(s.port, s.power, s.mode, s.regulation, s.turn_ratio, s.run_state, s.tacho_limit)
+  {
+  }
+};
+
+struct set_input_mode : command<0x05, input_request_t, status_t> {
+  set_input_mode(vile_in_t port, vile_sensor_type_t stype, vile_sensor_mode_t smode)
+  {
+    request.port = port;
+    request.stype = stype;
+    request.smode = smode;
+  }
+};
+
+struct get_output_state : command<0x06, port_request_t, vile_outputstate_t> {
+  explicit get_output_state(vile_out_t port)
+  {
+    request.port = port;
+  }
+};
+
+struct get_input_values : command<0x07, port_request_t, vile_inputstate_t> {
+  explicit get_input_values(vile_in_t port)
+  {
+    request.port = port;
+  }
+};
+
+struct reset_input_scaled_value : command<0x08, port_request_t, status_t> {
+  explicit reset_input_scaled_value(vile_in_t port)
+  {
+    request.port = port;
+  }
+};
+
+struct reset_motor_position : command<0x0A, reset_request_t, status_t> {
+  reset_motor_position(vile_out_t port, bool relative)
+  {
+    request.port = port;
+    request.relative = relative;
+  }
+};
+
+struct battery_level : command<0x0B, header_t, battery_t> {};
+
+struct stop_sound : command<0x0C, header_t, status_t> {};
+
+struct keep_alive : command<0x0D, header_t, keepalive_t> {};
+
+struct current_program_name : command<0x11, header_t, program_name_t> {};
+
+/*
+ * Fire and forget form of a command whose reply is only a status,
+ * e.g. noreply<set_output_state>(NXT_OUT_A, 50). Saves the reply
+ * round trip; errors on the brick side go unnoticed.
+ */
+template <typename Cmd>
+struct noreply : Cmd {
+  static_assert(std::is_same<typename Cmd::reply_t, status_t>::value, "only status-only commands can skip the reply");
+  typedef void reply_t;
+  static constexpr bool has_reply = false;
+
+  template <typename... Args>
+  explicit noreply(Args&&... args) : Cmd(std::forward<Args>(args)...)
+  {
+    this->request.type |= 0x80;
+  }
+};
+
+/*
+ * A fixed sequence of commands sent with one vileBatch call. Results are
+ * read back per index: ok<I>() is true when the reply arrived, matched the
+ * opcode and size, and reported success.
+ */
+template <typename... Cmds>
+class batch {
+public:
+  static constexpr size_t size = sizeof...(Cmds);
+  static_assert(size > 0, "empty batch");
+  static_assert(size <= VILE_BATCH_MAX, "batch larger than VILE_BATCH_MAX");
+
+  explicit batch(const Cmds&... cmds)
+  {
+    encode(std::index_sequence_for<Cmds...>(), cmds...);
+  }
+
+  // true when every command completed and succeeded
+  bool submit()
+  {
+    completed_ = vileBatch(packets_, size);
+    return completed_ == (int)size && all_ok(std::index_sequence_for<Cmds...>());
+  }
+
+  // bus class for the whole batch instead of one picked from the first opcode
+  batch &priority(vile_priority_t priority)
+  {
+    packets_[0].priority = priority;
+    return *this;
+  }
+
+  int completed() const
+  {
+    return completed_;
+  }
+
+  template <size_t I>
+  using command_at = typename std::tuple_element<I, std::tuple<Cmds...>>::type;
+
+  template <size_t I>
+  bool ok() const
+  {
+    typedef command_at<I> Cmd;
+    const vile_packet_t &p = packets_[I];
+    if ((int)I >= completed_ || p.result < 0)
+      return false;
+    if (!Cmd::has_reply)
+      return true;
+    // a short or long reply means the layout above is wrong for this firmware
+    if ((size_t)p.result != reply_size<typename Cmd::reply_t>::value)
+      return false;
+    return p.data[0] == reply_type && p.data[1] == Cmd::opcode && p.data[2] == NXT_STATUS_OK;
+  }
+
+  // brick status byte, or -1 when there is none
+  template <size_t I>
+  int status() const
+  {
+    const vile_packet_t &p = packets_[I];
+    if ((int)I >= completed_ || p.result < 3)
+      return -1;
+    return p.data[2];
+  }
+
+  template <size_t I>
+  typename command_at<I>::reply_t reply() const
+  {
+    typedef typename command_at<I>::reply_t Reply;
+    static_assert(!std::is_void<Reply>::value, "command has no reply");
+    Reply r;
+    memcpy(&r, packets_[I].data, sizeof(r));
+    return r;
+  }
+
+private:
+  vile_packet_t packets_[size];
+  int completed_ = 0;
+
+  template <typename Cmd>
+  static void encode_one(vile_packet_t &p, const Cmd &cmd)
+  {
+    p.result = 0;
+    p.length = Cmd::request_size;
+    p.priority = VILE_PRIORITY_DEFAULT;
+    memcpy(p.data, &cmd.request, Cmd::request_size);
+  }
+
+  template <size_t... I>
+  void encode(std::index_sequence<I...>, const Cmds&... cmds)
+  {
+    int unused[] = { (encode_one(packets_[I], cmds), 0)... };
+    (void)unused;
+  }
+
+  template <size_t... I>
+  bool all_ok(std::index_sequence<I...>) const
+  {
+    bool results[] = { ok<I>()... };
+    for (bool r : results)
+      if (!r)
+        return false;
+    return true;
+  }
+};
+
+template <typename... Cmds>
+batch<Cmds...> make_batch(const Cmds&... cmds)
+{
+  return batch<Cmds...>(cmds...);
+}
+
+// single command, returns the reply (or nothing) and sets ok
+template <typename Cmd>
+typename std::enable_if<Cmd::has_reply, typename Cmd::reply_t>::type execute(const Cmd &cmd, bool *ok = nullptr)
+{
+  batch<Cmd> b(cmd);
+  bool r = b.submit();
+  if (ok)
+    *ok = r;
+  return b.template reply<0>();
+}
+
+template <typename Cmd>
+typename std::enable_if<!Cmd::has_reply, bool>::type execute(const Cmd &cmd)
+{
+  batch<Cmd> b(cmd);
+  return b.submit();
+}
+
+} // namespace vile
+
+#endif // __VILE_HPP__
@@ -0,0 +1,215 @@
+/**
+        libvile
+        Copyright (C) 2022 Cat (Ivan Epifanov)
+
+        This program is free software: you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        This program is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "vile.h"
+#include "vilerso.h"
+
+/*
+ * Resampling is a polyphase windowed-sinc FIR in fixed point: every
+ * output sample is one dot product of int16 input against an int16
+ * coefficient row picked by the fractional position. Rows are a multiple
+ * of 8 taps with no branches inside, which the compiler turns into
+ * NEON (or SSE2) multiply-accumulates at -O3.
+ */
+
+#define RSO_PHASE_BITS 6
+#define RSO_PHASES (1 << RSO_PHASE_BITS)
+#define RSO_ZEROS 8 // sinc zero crossings each side, at the output rate
+#define RSO_MAX_TAPS 128
+#define RSO_COEF_BITS 14 // rows sum to 1 << 14, the dot product stays in 32 bits
+#define RSO_CUTOFF 0.45 // of the lower rate
+
+static uint32_t out_samples(uint32_t frames, uint32_t in_rate, uint32_t out_rate)
+{
+  uint64_t n = (uint64_t)frames * out_rate / in_rate;
+  return n > VILE_RSO_MAX_SAMPLES ? VILE_RSO_MAX_SAMPLES : (uint32_t)n;
+}
+
+uint32_t vileRsoSize(const uint32_t frames, const uint32_t in_rate, const uint32_t out_rate)
+{
+  if (!in_rate || out_rate < VILE_RSO_MIN_RATE || out_rate > VILE_RSO_MAX_RATE)
+    return 0;
+  return VILE_RSO_HEADER + out_samples(frames, in_rate, out_rate);
+}
+
+// taps per row, a multiple of 8
+static int filter_taps(uint32_t in_rate, uint32_t out_rate)
+{
+  uint32_t ratio = (in_rate + out_rate - 1) / out_rate;
+  if (!ratio)
+    ratio = 1;
+  int taps = 2 * RSO_ZEROS * ratio;
+  taps = (taps + 7) & ~7;
+  return taps > RSO_MAX_TAPS ? RSO_MAX_TAPS : taps;
+}
+
+static void make_filter(int16_t *coef, int taps, uint32_t in_rate, uint32_t out_rate)
+{
+  // cycles per input sample
+  double fc = RSO_CUTOFF * (in_rate < out_rate ? in_rate : out_rate) / in_rate;
+  int half = taps / 2;
+
+  for (int p = 0; p < RSO_PHASES; p++)
+  {
+    double row[RSO_MAX_TAPS];
+    double sum = 0;
+    double frac = (double)p / RSO_PHASES;
+
+    for (int k = 0; k < taps; k++)
+    {
+      // distance from the output instant, which sits frac past tap half - 1
+      double t = k - (half - 1) - frac;
+      double x = 2 * M_PI * fc * t;
+      double sinc = t == 0 ? 1 : sin(x) / x;
+      // Blackman over the taps, centred on the output instant
+      double w = (t + half) / taps;
+      double window = (w <= 0 || w >= 1) ? 0 : 0.42 - 0.5 * cos(2 * M_PI * w) + 0.08 * cos(4 * M_PI * w);
+      row[k] = sinc * window;
+      sum += row[k];
+    }
+
+    // unity gain at DC for every phase, rounding error goes to the centre tap
+    int total = 0;
+    for (int k = 0; k < taps; k++)
+    {
+      coef[p * taps + k] = (int16_t)lrint(row[k] / sum * (1 << RSO_COEF_BITS));
+      total += coef[p * taps + k];
+    }
+    coef[p * taps + half - 1] += (1 << RSO_COEF_BITS) - total;
+  }
+}
+
+static int32_t dot(const int16_t *x, const int16_t *c, int taps)
+{
+  int32_t acc = 0;
+  for (int k = 0; k < taps; k++)
+    acc += (int32_t)x[k] * c[k];
+  return acc;
+}
+
+int vileRsoConvert(
+  const int16_t *pcm,
+  const uint32_t frames,
+  const uint32_t channels,
+  const uint32_t in_rate,
+  const uint32_t out_rate,
+  uint8_t *out,
+  const uint32_t size
+)
+{
+  uint32_t total = vileRsoSize(frames, in_rate, out_rate);
+  if (!pcm || !out || !channels || !total || size < total)
+    return -1;
+
+  uint32_t n = total - VILE_RSO_HEADER;
+  int taps = filter_taps(in_rate, out_rate);
+  int half = taps / 2;
+
+  // mono with silence around it, so the filter never reads outside
+  int16_t *x = malloc((frames + taps + 1) * sizeof(int16_t));
+  int16_t *coef = malloc(RSO_PHASES * taps * sizeof(int16_t));
+  if (!x || !coef)
+  {
+    free(x);
+    free(coef);
+    return -1;
+  }
+
+  memset(x, 0, (half - 1) * sizeof(int16_t));
+  memset(x + half - 1 + frames, 0, (half + 2) * sizeof(int16_t));
+  if (channels == 1)
+  {
+    memcpy(x + half - 1, pcm, frames * sizeof(int16_t));
+  }
+  else
+  {
+    for (uint32_t i = 0; i < frames; i++)
+    {
+      int32_t s = 0;
+      for (uint32_t c = 0; c < channels; c++)
+        s += pcm[i * channels + c];
+      x[half - 1 + i] = (int16_t)(s / (int32_t)channels);
+    }
+  }
+
+  make_filter(coef, taps, in_rate, out_rate);
+
+  // big endian: sound file, data length, rate, play mode
+  out[0] = 0x01;
+  out[1] = 0x00;
+  out[2] = n >> 8;
+  out[3] = n & 0xFF;
+  out[4] = out_rate >> 8;
+  out[5] = out_rate & 0xFF;
+  out[6] = 0;
+  out[7] = 0;
+
+  // input position in 32.32 fixed point
+  uint64_t step = ((uint64_t)in_rate << 32) / out_rate;
+  uint64_t pos = 0;
+  uint8_t *o = out + VILE_RSO_HEADER;
+
+  for (uint32_t i = 0; i < n; i++, pos += step)
+  {
+    uint32_t idx = (uint32_t)(pos >> 32);
+    uint32_t phase = (uint32_t)(pos >> (32 - RSO_PHASE_BITS)) & (RSO_PHASES - 1);
+    int32_t acc = dot(x + idx, coef + phase * taps, taps);
+    // down to 8 bits, rounded
+    int32_t v = (acc + (1 << (RSO_COEF_BITS + 7))) >> (RSO_COEF_BITS + 8);
+    if (v < -128)
+      v = -128;
+    if (v > 127)
+      v = 127;
+    o[i] = (uint8_t)(v + 128);
+  }
+
+  free(x);
+  free(coef);
+  return (int)total;
+}
+
+int vilePlayPcm(
+  const char *filename,
+  const int16_t *pcm,
+  const uint32_t frames,
+  const uint32_t channels,
+  const uint32_t in_rate,
+  const uint32_t out_rate,
+  const uint8_t loop
+)
+{
+  uint32_t size = vileRsoSize(frames, in_rate, out_rate);
+  if (!size)
+    return -1;
+
+  uint8_t *rso = malloc(size);
+  if (!rso)
+    return -1;
+
+  int ret = vileRsoConvert(pcm, frames, channels, in_rate, out_rate, rso, size);
+  if (ret > 0)
+    ret = vileUploadFile(filename, rso, ret);
+  free(rso);
+
+  if (ret < 0 || vilePlaySoundfile(filename, loop) < 0)
+    return -1;
+  return 0;
+}
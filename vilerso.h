@@ -0,0 +1,71 @@
+/**
+        libvile
+        Copyright (C) 2022 Cat (Ivan Epifanov)
+
+        This program is free software: you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        This program is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+ * 16-bit PCM to NXT sound files (.rso: 8-bit unsigned mono after an
+ * 8 byte header), user side. Link libvilerso next to libvile_stub.
+ *
+ *   vilePlayPcm("ymt.rso", chunk->abuf, chunk->alen / 4, 2, 44100, 8000, 0);
+ */
+
+#ifndef __VILERSO_H__
+#define __VILERSO_H__
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define VILE_RSO_HEADER 8
+#define VILE_RSO_MIN_RATE 2000
+#define VILE_RSO_MAX_RATE 16000
+// the length field is 16 bits, longer sounds are cut
+#define VILE_RSO_MAX_SAMPLES 65535
+
+// bytes the .rso of frames input frames takes, header included; 0 on bad rates
+uint32_t vileRsoSize(const uint32_t frames, const uint32_t in_rate, const uint32_t out_rate);
+
+// pcm holds frames frames of channels interleaved samples; writes the
+// whole file to out, returns its size or -1
+int vileRsoConvert(
+  const int16_t *pcm,
+  const uint32_t frames,
+  const uint32_t channels,
+  const uint32_t in_rate,
+  const uint32_t out_rate,
+  uint8_t *out,
+  const uint32_t size
+);
+
+// converts, uploads as filename (replacing it) and starts playback
+int vilePlayPcm(
+  const char *filename,
+  const int16_t *pcm,
+  const uint32_t frames,
+  const uint32_t channels,
+  const uint32_t in_rate,
+  const uint32_t out_rate,
+  const uint8_t loop
+);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __VILERSO_H__
@@ -0,0 +1,421 @@
+/**
+        libvile
+        Copyright (C) 2022 Cat (Ivan Epifanov)
+
+        This program is free software: you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        This program is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "vile.h"
+#include "vilesig.h"
+
+/*
+ * Every kernel has a scalar version that also does the ends of a column,
+ * and a vector version for the middle: 8 int16 lanes for the median and
+ * the crossings, 4 int32/float lanes for the rest. NEON on the Vita (and
+ * ARM hosts), SSE2 on x86, VILE_SIG_SCALAR builds without either for
+ * comparison.
+ *
+ * The moving average is a running sum done as a prefix sum of
+ * in[i] - in[i - window] inside each vector, exact in int32. The median is
+ * an odd-even transposition sort of window shifted loads, min/max only.
+ */
+
+#if !defined(VILE_SIG_SCALAR) && (defined(__ARM_NEON) || defined(__ARM_NEON__))
+#define SIG_NEON
+#include <arm_neon.h>
+#elif !defined(VILE_SIG_SCALAR) && defined(__SSE2__)
+#define SIG_SSE2
+#include <emmintrin.h>
+#endif
+
+const char *vileSigBackend()
+{
+#if defined(SIG_NEON)
+  return "neon";
+#elif defined(SIG_SSE2)
+  return "sse2";
+#else
+  return "scalar";
+#endif
+}
+
+int vileSigBatchInit(vile_sig_batch_t *batch, const uint32_t capacity)
+{
+  memset(batch, 0, sizeof(*batch));
+  if (!capacity)
+    return -1;
+
+  // all three columns in one block
+  int16_t *p = malloc((size_t)capacity * 3 * sizeof(int16_t));
+  if (!p)
+    return -1;
+
+  batch->capacity = capacity;
+  batch->raw = p;
+  batch->normalized = p + capacity;
+  batch->scaled = p + 2 * capacity;
+  return 0;
+}
+
+void vileSigBatchFree(vile_sig_batch_t *batch)
+{
+  free(batch->raw);
+  memset(batch, 0, sizeof(*batch));
+}
+
+uint32_t vileSigGather(vile_sig_batch_t *batch, const vile_inputstate_t *first, const uint32_t stride, const uint32_t count)
+{
+  uint32_t n = count < batch->capacity ? count : batch->capacity;
+  const uint8_t *p = (const uint8_t *)first;
+
+  // the records are far apart, this is all loads and no arithmetic
+  for (uint32_t i = 0; i < n; i++, p += stride)
+  {
+    const vile_inputstate_t *in = (const vile_inputstate_t *)p;
+    batch->raw[i] = (int16_t)in->raw_value;
+    batch->normalized[i] = (int16_t)in->normalized_value;
+    batch->scaled[i] = in->scaled_value;
+  }
+
+  batch->count = n;
+  return n;
+}
+
+/*
+ *  SCALE
+ */
+
+void vileSigScale(const int16_t *in, const uint32_t n, const float gain, const float offset, float *out)
+{
+  uint32_t i = 0;
+
+#if defined(SIG_NEON)
+  float32x4_t g = vdupq_n_f32(gain);
+  float32x4_t o = vdupq_n_f32(offset);
+  for (; i + 8 <= n; i += 8)
+  {
+    int16x8_t x = vld1q_s16(in + i);
+    float32x4_t lo = vcvtq_f32_s32(vmovl_s16(vget_low_s16(x)));
+    float32x4_t hi = vcvtq_f32_s32(vmovl_s16(vget_high_s16(x)));
+    vst1q_f32(out + i, vmlaq_f32(o, lo, g));
+    vst1q_f32(out + i + 4, vmlaq_f32(o, hi, g));
+  }
+#elif defined(SIG_SSE2)
+  __m128 g = _mm_set1_ps(gain);
+  __m128 o = _mm_set1_ps(offset);
+  for (; i + 8 <= n; i += 8)
+  {
+    __m128i x = _mm_loadu_si128((const __m128i *)(in + i));
+    // sign extended by landing in the top half and shifting back
+    __m128 lo = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16));
+    __m128 hi = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16));
+    _mm_storeu_ps(out + i, _mm_add_ps(_mm_mul_ps(lo, g), o));
+    _mm_storeu_ps(out + i + 4, _mm_add_ps(_mm_mul_ps(hi, g), o));
+  }
+#endif
+
+  for (; i < n; i++)
+    out[i] = in[i] * gain + offset;
+}
+
+/*
+ *  MOVING AVERAGE
+ */
+
+void vileSigMovingAverage(const int16_t *in, const uint32_t n, const uint32_t window, float *out)
+{
+  if (!n || !window)
+    return;
+
+  float scale = 1.0f / window;
+  int32_t sum = (int32_t)window * in[0];
+  uint32_t i = 0;
+
+  // until the window is all real samples the one leaving is in[0]
+  for (; i < n && i < window; i++)
+  {
+    sum += in[i] - in[0];
+    out[i] = sum * scale;
+  }
+
+#if defined(SIG_NEON)
+  int32x4_t zero = vdupq_n_s32(0);
+  int32x4_t carry = vdupq_n_s32(sum);
+  float32x4_t s = vdupq_n_f32(scale);
+  for (; i + 4 <= n; i += 4)
+  {
+    int32x4_t d = vsubl_s16(vld1_s16(in + i), vld1_s16(in + i - window));
+    d = vaddq_s32(d, vextq_s32(zero, d, 3));
+    d = vaddq_s32(d, vextq_s32(zero, d, 2));
+    d = vaddq_s32(d, carry);
+    carry = vdupq_lane_s32(vget_high_s32(d), 1);
+    vst1q_f32(out + i, vmulq_f32(vcvtq_f32_s32(d), s));
+  }
+  sum = vgetq_lane_s32(carry, 0);
+#elif defined(SIG_SSE2)
+  __m128i carry = _mm_set1_epi32(sum);
+  __m128 s = _mm_set1_ps(scale);
+  for (; i + 4 <= n; i += 4)
+  {
+    __m128i a = _mm_loadl_epi64((const __m128i *)(in + i));
+    __m128i b = _mm_loadl_epi64((const __m128i *)(in + i - window));
+    __m128i d = _mm_sub_epi32(_mm_srai_epi32(_mm_unpacklo_epi16(a, a), 16), _mm_srai_epi32(_mm_unpacklo_epi16(b, b), 16));
+    d = _mm_add_epi32(d, _mm_slli_si128(d, 4));
+    d = _mm_add_epi32(d, _mm_slli_si128(d, 8));
+    d = _mm_add_epi32(d, carry);
+    carry = _mm_shuffle_epi32(d, _MM_SHUFFLE(3, 3, 3, 3));
+    _mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(d), s));
+  }
+  sum = _mm_cvtsi128_si32(carry);
+#endif
+
+  for (; i < n; i++)
+  {
+    sum += in[i] - in[i - window];
+    out[i] = sum * scale;
+  }
+}
+
+/*
+ *  MEDIAN
+ */
+
+static int16_t median_at(const int16_t *in, uint32_t n, uint32_t i, uint32_t half)
+{
+  int16_t v[VILE_SIG_MEDIAN_MAX];
+  uint32_t w = 2 * half + 1;
+
+  for (uint32_t k = 0; k < w; k++)
+  {
+    int64_t j = (int64_t)i - half + k;
+    v[k] = in[j < 0 ? 0 : j >= n ? n - 1 : j];
+  }
+
+  for (uint32_t k = 1; k < w; k++)
+  {
+    int16_t x = v[k];
+    uint32_t j = k;
+    for (; j > 0 && v[j - 1] > x; j--)
+      v[j] = v[j - 1];
+    v[j] = x;
+  }
+
+  return v[half];
+}
+
+#if defined(SIG_NEON)
+typedef int16x8_t v16_t;
+#define v16_load(p) vld1q_s16(p)
+#define v16_store(p, v) vst1q_s16(p, v)
+#define v16_min(a, b) vminq_s16(a, b)
+#define v16_max(a, b) vmaxq_s16(a, b)
+#elif defined(SIG_SSE2)
+typedef __m128i v16_t;
+#define v16_load(p) _mm_loadu_si128((const __m128i *)(p))
+#define v16_store(p, v) _mm_storeu_si128((__m128i *)(p), v)
+#define v16_min(a, b) _mm_min_epi16(a, b)
+#define v16_max(a, b) _mm_max_epi16(a, b)
+#endif
+
+#ifdef v16_load
+// 8 medians from in - half on; inlined per window so v[] stays in registers
+static inline __attribute__((always_inline)) void median_block(const int16_t *in, int16_t *out, const uint32_t w)
+{
+  v16_t v[VILE_SIG_MEDIAN_MAX];
+
+  for (uint32_t k = 0; k < w; k++)
+    v[k] = v16_load(in + k);
+
+  // w passes sort w values, which is plenty for the middle one
+  for (uint32_t pass = 0; pass < w; pass++)
+  {
+    for (uint32_t k = pass & 1; k + 1 < w; k += 2)
+    {
+      v16_t lo = v16_min(v[k], v[k + 1]);
+      v[k + 1] = v16_max(v[k], v[k + 1]);
+      v[k] = lo;
+    }
+  }
+
+  v16_store(out, v[w / 2]);
+}
+
+static void median_run(const int16_t *in, int16_t *out, uint32_t from, uint32_t to, uint32_t w)
+{
+  uint32_t half = w / 2;
+  uint32_t i = from;
+
+  switch (w)
+  {
+#define MEDIAN_CASE(W) case W: for (; i + 8 <= to; i += 8) median_block(in + i - half, out + i, W); break;
+    MEDIAN_CASE(3)
+    MEDIAN_CASE(5)
+    MEDIAN_CASE(7)
+    MEDIAN_CASE(9)
+#undef MEDIAN_CASE
+  }
+
+  for (; i < to; i++)
+    out[i] = median_at(in, to + half, i, half);
+}
+#endif
+
+int vileSigMedian(const int16_t *in, const uint32_t n, const uint32_t window, int16_t *out)
+{
+  if (!(window & 1) || window > VILE_SIG_MEDIAN_MAX)
+    return -1;
+
+  uint32_t half = window / 2;
+  uint32_t i = 0;
+
+  // where the window hangs over the start, and past it
+  for (; i < n && i < half; i++)
+    out[i] = median_at(in, n, i, half);
+
+#ifdef v16_load
+  if (n > 2 * half)
+  {
+    median_run(in, out, i, n - half, window);
+    i = n - half;
+  }
+#endif
+
+  for (; i < n; i++)
+    out[i] = median_at(in, n, i, half);
+
+  return 0;
+}
+
+/*
+ *  DERIVATIVE
+ */
+
+static float derivative_at(const int16_t *in, uint32_t n, uint32_t i, uint32_t span, float rate)
+{
+  uint32_t a = i < span ? 0 : i - span;
+  uint32_t b = i + span >= n ? n - 1 : i + span;
+  return b > a ? (in[b] - in[a]) * rate / (b - a) : 0.0f;
+}
+
+void vileSigDerivative(const int16_t *in, const uint32_t n, const uint32_t span, const float rate, float *out)
+{
+  if (!span)
+    return;
+
+  float scale = rate / (2 * span);
+  uint32_t i = 0;
+
+  for (; i < n && i < span; i++)
+    out[i] = derivative_at(in, n, i, span, rate);
+
+  uint32_t end = n > span ? n - span : i;
+
+#if defined(SIG_NEON)
+  float32x4_t s = vdupq_n_f32(scale);
+  for (; i + 8 <= end; i += 8)
+  {
+    int16x8_t a = vld1q_s16(in + i + span);
+    int16x8_t b = vld1q_s16(in + i - span);
+    int32x4_t lo = vsubl_s16(vget_low_s16(a), vget_low_s16(b));
+    int32x4_t hi = vsubl_s16(vget_high_s16(a), vget_high_s16(b));
+    vst1q_f32(out + i, vmulq_f32(vcvtq_f32_s32(lo), s));
+    vst1q_f32(out + i + 4, vmulq_f32(vcvtq_f32_s32(hi), s));
+  }
+#elif defined(SIG_SSE2)
+  __m128 s = _mm_set1_ps(scale);
+  for (; i + 8 <= end; i += 8)
+  {
+    __m128i a = _mm_loadu_si128((const __m128i *)(in + i + span));
+    __m128i b = _mm_loadu_si128((const __m128i *)(in + i - span));
+    __m128i lo = _mm_sub_epi32(_mm_srai_epi32(_mm_unpacklo_epi16(a, a), 16), _mm_srai_epi32(_mm_unpacklo_epi16(b, b), 16));
+    __m128i hi = _mm_sub_epi32(_mm_srai_epi32(_mm_unpackhi_epi16(a, a), 16), _mm_srai_epi32(_mm_unpackhi_epi16(b, b), 16));
+    _mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(lo), s));
+    _mm_storeu_ps(out + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), s));
+  }
+#endif
+
+  for (; i < end; i++)
+    out[i] = (in[i + span] - in[i - span]) * scale;
+
+  for (; i < n; i++)
+    out[i] = derivative_at(in, n, i, span, rate);
+}
+
+/*
+ *  CROSSINGS
+ */
+
+uint32_t vileSigCrossings(const int16_t *in, const uint32_t n, const int16_t threshold, vile_sig_crossing_t *out, const uint32_t max)
+{
+  uint32_t found = 0;
+  uint32_t i = 1;
+
+  // most of a column crosses nothing, whole vectors of that are skipped
+#if defined(SIG_NEON)
+  int16x8_t th = vdupq_n_s16(threshold);
+  for (; i + 8 <= n && found < max; i += 8)
+  {
+    uint16x8_t now = vcgtq_s16(vld1q_s16(in + i), th);
+    uint16x8_t before = vcgtq_s16(vld1q_s16(in + i - 1), th);
+    uint8x8_t changed = vmovn_u16(veorq_u16(now, before));
+    if (!vget_lane_u64(vreinterpret_u64_u8(changed), 0))
+      continue;
+
+    for (uint32_t k = i; k < i + 8 && found < max; k++)
+    {
+      int above = in[k] > threshold;
+      if (above != (in[k - 1] > threshold))
+      {
+        out[found].index = k;
+        out[found].rising = above;
+        found++;
+      }
+    }
+  }
+#elif defined(SIG_SSE2)
+  __m128i th = _mm_set1_epi16(threshold);
+  for (; i + 8 <= n && found < max; i += 8)
+  {
+    __m128i now = _mm_cmpgt_epi16(_mm_loadu_si128((const __m128i *)(in + i)), th);
+    __m128i before = _mm_cmpgt_epi16(_mm_loadu_si128((const __m128i *)(in + i - 1)), th);
+    // two mask bits per lane
+    int changed = _mm_movemask_epi8(_mm_xor_si128(now, before));
+    int above = _mm_movemask_epi8(now);
+
+    while (changed && found < max)
+    {
+      int bit = __builtin_ctz(changed);
+      out[found].index = i + bit / 2;
+      out[found].rising = (above >> bit) & 1;
+      found++;
+      changed &= ~(3 << bit);
+    }
+  }
+#endif
+
+  for (; i < n && found < max; i++)
+  {
+    int above = in[i] > threshold;
+    if (above != (in[i - 1] > threshold))
+    {
+      out[found].index = i;
+      out[found].rising = above;
+      found++;
+    }
+  }
+
+  return found;
+}
@@ -0,0 +1,91 @@
+/**
+        libvile
+        Copyright (C) 2022 Cat (Ivan Epifanov)
+
+        This program is free software: you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        This program is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Post-processing of recorded sensor samples, user side. Samples are
+ * gathered out of whatever records hold them (vile_sample_t, vile_state_t,
+ * ...) into one array per field, then filtered a column at a time. Link
+ * libvilesig next to libvile_stub.
+ *
+ *   vile_sig_batch_t b;
+ *   vileSigBatchInit(&b, n);
+ *   vileSigGather(&b, &samples[0].input, sizeof(vile_sample_t), n);
+ *   vileSigMedian(b.scaled, b.count, 5, smooth);
+ */
+
+#ifndef __VILESIG_H__
+#define __VILESIG_H__
+
+#include <stdint.h>
+#include "vile.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define VILE_SIG_MEDIAN_MAX 9
+
+typedef struct {
+  uint32_t count;
+  uint32_t capacity;
+  int16_t *raw; // raw_value
+  int16_t *normalized; // normalized_value
+  int16_t *scaled; // scaled_value
+} vile_sig_batch_t;
+
+typedef struct {
+  uint32_t index; // first sample past the threshold
+  int32_t rising; // 1 going above, 0 going back to or under
+} vile_sig_crossing_t;
+
+// "neon", "sse2" or "scalar", whichever the library was built with
+const char *vileSigBackend();
+
+// returns 0 or -1
+int vileSigBatchInit(vile_sig_batch_t *batch, const uint32_t capacity);
+void vileSigBatchFree(vile_sig_batch_t *batch);
+
+// count records stride bytes apart, first is the first record's input
+// state; replaces the batch's contents, returns samples taken
+uint32_t vileSigGather(vile_sig_batch_t *batch, const vile_inputstate_t *first, const uint32_t stride, const uint32_t count);
+
+// out = in * gain + offset, e.g. to calibrated units
+void vileSigScale(const int16_t *in, const uint32_t n, const float gain, const float offset, float *out);
+
+// mean of the window samples up to and including each one, before the
+// first sample counts as the first sample
+void vileSigMovingAverage(const int16_t *in, const uint32_t n, const uint32_t window, float *out);
+
+// median of the window samples centered on each one, window odd and up
+// to VILE_SIG_MEDIAN_MAX, past the ends count as the end samples;
+// out must not be in; returns 0 or -1
+int vileSigMedian(const int16_t *in, const uint32_t n, const uint32_t window, int16_t *out);
+
+// change per second from the samples span either side, rate in Hz;
+// near the ends whatever is there on the short side
+void vileSigDerivative(const int16_t *in, const uint32_t n, const uint32_t span, const float rate, float *out);
+
+// where the signal goes above the threshold or back; returns how many
+// were written, at most max
+uint32_t vileSigCrossings(const int16_t *in, const uint32_t n, const int16_t threshold, vile_sig_crossing_t *out, const uint32_t max);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __VILESIG_H__